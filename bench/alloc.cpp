@@ -0,0 +1,254 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Allocation gate
+//
+// Runs the real FtpServer in-process with allocation tracking, drives a steady-state command
+// and transfer mix, and checks heap allocations per operation of each tagged server path against
+// a budget. Exits with failure when a path exceeds its budget, so allocation regressions are
+// caught like any other benchmark regression.
+
+#include "allocTrack.h"
+#include "harness.h"
+
+#if !FTPD_ALLOC_TRACKING
+#error "ftpd-bench-alloc requires FTPD_ALLOC_TRACKING"
+#endif
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+/// \brief Allocation budget of a tagged path
+struct Budget
+{
+	/// \brief Tag name
+	char const *tag;
+
+	/// \brief Maximum allocations per operation
+	double allocations;
+};
+
+/// \brief Budgets for the steady-state paths exercised by the mix
+/// Half an allocation of headroom absorbs occasional buffer growth; lower these as paths
+/// are trimmed, raising one needs a reason
+constexpr Budget budgets[] = {
+    // clang-format off
+    {"FtpServer::loop",   0.0},
+    {"FtpSession::poll",  0.5},
+    {"readCommand",       0.0},
+    {"NOOP",              0.0},
+    {"PWD",               2.5},
+    {"CWD",              11.5},
+    {"CDUP",              1.5},
+    {"SIZE",             11.5},
+    {"MLST",              9.5},
+    {"TYPE",              0.0},
+    {"PASV",              1.5},
+    {"RETR",              9.5},
+    {"STOR",              9.5},
+    {"LIST",              8.5},
+    {"retrieveTransfer",  0.0},
+    {"storeTransfer",     0.0},
+    {"listTransfer",      2.0},
+    // clang-format on
+};
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options]\n"
+	    "  -r, --rounds N       measured rounds of the command mix (default 200)\n"
+	    "  -w, --warmup N       unmeasured rounds first (default 20)\n"
+	    "  -o, --output FILE    write JSON report to FILE\n",
+	    prog_);
+}
+
+/// \brief Run one round of the command mix
+/// \param client_ Client
+/// \param data_ Upload data
+bool round (bench::Client &client_, std::vector<char> const &data_)
+{
+	std::uint64_t bytes;
+
+	return client_.command ("NOOP") == 200 && client_.command ("PWD") == 257 &&
+	       client_.command ("CWD dir") == 200 && client_.command ("CDUP") == 200 &&
+	       client_.command ("SIZE data.bin") == 213 && client_.command ("MLST data.bin") == 250 &&
+	       client_.command ("TYPE I") == 200 && client_.retrieve ("data.bin", bytes) &&
+	       client_.list ("LIST", "dir", bytes) &&
+	       client_.store ("upload.bin", data_.data (), data_.size ());
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	unsigned rounds     = 200;
+	unsigned warmup     = 20;
+	char const *output = nullptr;
+
+	static option const longOptions[] = {
+	    {"rounds", required_argument, nullptr, 'r'},
+	    {"warmup", required_argument, nullptr, 'w'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "r:w:o:h", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'r':
+			rounds = std::max (1ul, std::strtoul (optarg, nullptr, 0));
+			break;
+
+		case 'w':
+			warmup = std::strtoul (optarg, nullptr, 0);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// the UI thread isn't a gated path
+	bench::Server server;
+	if (!server.start (false))
+		return EXIT_FAILURE;
+
+	auto const &root = server.root ();
+
+	std::vector<char> data (65536);
+	bench::fillCompressible (data, 0x12345678);
+
+	if (!bench::writeFile (root + "/data.bin", data.data (), data.size ()) ||
+	    ::mkdir ((root + "/dir").c_str (), 0755) != 0)
+	{
+		std::fprintf (stderr, "Failed to create synthetic content: %s\n", std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0; i < 16; ++i)
+	{
+		auto const path = root + "/dir/entry-" + std::to_string (i) + ".txt";
+		if (!bench::writeFile (path, data.data (), i * 100))
+		{
+			std::fprintf (
+			    stderr, "Failed to create %s: %s\n", path.c_str (), std::strerror (errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	bench::Client client;
+	if (!client.connect (server.port ()) || client.command ("USER bench") < 0 ||
+	    client.command ("PASS bench") < 0 || client.command ("CWD " + root) != 200)
+	{
+		std::fprintf (stderr, "Failed to log in: %s\n", client.reply ().c_str ());
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0; i < warmup + rounds; ++i)
+	{
+		// first-use allocations (buffers, caches, histograms) happen during warmup
+		if (i == warmup)
+			alloc::reset ();
+
+		if (!round (client, data))
+		{
+			std::fprintf (stderr, "Command mix failed: %s\n", client.reply ().c_str ());
+			return EXIT_FAILURE;
+		}
+	}
+
+	client.close ();
+
+	std::string json = "{\"rounds\":" + std::to_string (rounds) + ",\"paths\":[";
+
+	bool pass = true;
+	std::printf ("%-20s %10s %12s %12s %8s\n", "path", "ops", "allocs/op", "bytes/op", "budget");
+	for (auto const &budget : budgets)
+	{
+		auto const counts     = alloc::counts (budget.tag);
+		auto const operations = std::max<std::uint64_t> (counts.operations, 1);
+		auto const perOp      = static_cast<double> (counts.allocations) / operations;
+		auto const bytesPerOp = static_cast<double> (counts.bytes) / operations;
+		auto const ok         = perOp <= budget.allocations;
+
+		std::printf ("%-20s %10" PRIu64 " %12.2f %12.1f %8.2f%s\n",
+		    budget.tag,
+		    counts.operations,
+		    perOp,
+		    bytesPerOp,
+		    budget.allocations,
+		    ok ? "" : "  OVER BUDGET");
+
+		char entry[256];
+		std::snprintf (entry,
+		    sizeof (entry),
+		    "%s{\"tag\":\"%s\",\"operations\":%" PRIu64 ",\"allocations_per_operation\":%.2f,"
+		    "\"bytes_per_operation\":%.1f,\"budget\":%.2f,\"pass\":%s}",
+		    &budget == budgets ? "" : ",",
+		    budget.tag,
+		    counts.operations,
+		    perOp,
+		    bytesPerOp,
+		    budget.allocations,
+		    ok ? "true" : "false");
+		json += entry;
+
+		pass = pass && ok;
+	}
+
+	json += "],\"pass\":";
+	json += pass ? "true}\n" : "false}\n";
+
+	server.stop ();
+
+	if (output)
+	{
+		auto const fp = std::fopen (output, "w");
+		if (!fp || std::fputs (json.c_str (), fp) < 0 || std::fclose (fp) != 0)
+		{
+			std::fprintf (stderr, "Failed to write %s: %s\n", output, std::strerror (errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
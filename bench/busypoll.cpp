@@ -0,0 +1,277 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Control-channel latency benchmark for busy polling
+//
+// Runs the in-process server once per poll mode (blocking, then each busy-poll time, optionally
+// with the server thread pinned) and times NOOP round trips on one control connection. Reports
+// round-trip percentiles next to the CPU the server burned, so the latency gain can be weighed
+// against the cost of spinning.
+
+#include "harness.h"
+
+#include "ftpConfig.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/// \brief Benchmark options
+struct Options
+{
+	/// \brief Seconds per mode
+	double duration = 3.0;
+
+	/// \brief Busy-poll times to compare against blocking
+	std::vector<std::chrono::microseconds> spins = {
+	    std::chrono::microseconds (50), std::chrono::microseconds (1000)};
+
+	/// \brief Client think time between commands
+	std::chrono::microseconds gap{0};
+
+	/// \brief CPU to pin the server thread to in busy-poll modes; -1 to leave it alone
+	int cpu = -1;
+};
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options]\n"
+	    "  -d, --duration SEC   seconds per mode (default 3)\n"
+	    "  -s, --spin US[,US]   busy-poll times to compare (default 50,1000)\n"
+	    "  -g, --gap US         client think time between commands (default 0)\n"
+	    "  -p, --pin CPU        pin the server thread in busy-poll modes\n"
+	    "  -o, --output FILE    write JSON report to FILE (default stdout)\n",
+	    prog_);
+}
+
+/// \brief Parse comma-separated busy-poll times
+/// \param[out] spins_ Parsed times
+/// \param arg_ Argument
+bool parseSpins (std::vector<std::chrono::microseconds> &spins_, char const *arg_)
+{
+	spins_.clear ();
+	while (*arg_)
+	{
+		char *end;
+		auto const value = std::strtoul (arg_, &end, 0);
+		if (end == arg_ || (*end && *end != ','))
+			return false;
+
+		spins_.emplace_back (value);
+		arg_ = *end ? end + 1 : end;
+	}
+
+	return !spins_.empty ();
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Options options;
+	char const *output = nullptr;
+
+	static option const longOptions[] = {
+	    {"duration", required_argument, nullptr, 'd'},
+	    {"spin", required_argument, nullptr, 's'},
+	    {"gap", required_argument, nullptr, 'g'},
+	    {"pin", required_argument, nullptr, 'p'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "d:s:g:p:o:h", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'd':
+			options.duration = std::strtod (optarg, nullptr);
+			break;
+
+		case 's':
+			if (!parseSpins (options.spins, optarg))
+			{
+				usage (argv_[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		case 'g':
+			options.gap = std::chrono::microseconds (std::strtoul (optarg, nullptr, 0));
+			break;
+
+		case 'p':
+			options.cpu = std::atoi (optarg);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// no UI thread, so the process CPU is the server's plus the client's
+	bench::Server server;
+	if (!server.start (false))
+		return EXIT_FAILURE;
+
+	auto const fp = output ? std::fopen (output, "w") : stdout;
+	if (!fp)
+	{
+		std::fprintf (stderr, "Failed to open %s: %s\n", output, std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::fprintf (fp,
+	    "{\n"
+	    "  \"server\": \"%s\",\n"
+	    "  \"cpus\": %u,\n"
+	    "  \"duration\": %.3f,\n"
+	    "  \"gap_us\": %lld,\n"
+	    "  \"modes\": [",
+	    STATUS_STRING,
+	    std::thread::hardware_concurrency (),
+	    options.duration,
+	    static_cast<long long> (options.gap.count ()));
+
+	// blocking first, as the baseline
+	auto modes = options.spins;
+	modes.insert (std::begin (modes), std::chrono::microseconds (0));
+
+	std::uint64_t totalErrors = 0;
+	for (auto const &spin : modes)
+	{
+		auto const cpu = spin.count () > 0 ? options.cpu : -1;
+		if (!server.server ().updateConfig ([&] (FtpConfig &config_) {
+			    return config_.setBusyPoll (spin) && config_.setPinCpu (cpu);
+		    }))
+		{
+			std::fprintf (stderr,
+			    "Invalid busy-poll time %lld\n",
+			    static_cast<long long> (spin.count ()));
+			return EXIT_FAILURE;
+		}
+
+		// connect after the update, so the control socket picks up the setting
+		bench::Client client;
+		if (!client.connect (server.port ()))
+			return EXIT_FAILURE;
+
+		// let the server thread apply the pinning and settle
+		for (unsigned i = 0; i < 100; ++i)
+			client.command ("NOOP");
+
+		std::vector<double> latency;
+		std::uint64_t errors = 0;
+
+		auto const cpuStart    = bench::processCpu ();
+		auto const clientStart = bench::threadCpu ();
+		auto const start       = bench::now ();
+		auto const deadline    = start + options.duration;
+
+		while (bench::now () < deadline)
+		{
+			if (options.gap.count () > 0)
+				std::this_thread::sleep_for (options.gap);
+
+			auto const t0 = bench::now ();
+			if (client.command ("NOOP") != 200)
+			{
+				++errors;
+				continue;
+			}
+
+			latency.emplace_back (bench::now () - t0);
+		}
+
+		auto const elapsed   = bench::now () - start;
+		auto const clientCpu = bench::threadCpu () - clientStart;
+		auto const serverCpu = bench::processCpu () - cpuStart - clientCpu;
+
+		client.command ("QUIT");
+		totalErrors += errors;
+
+		double sum = 0.0;
+		for (auto const &sample : latency)
+			sum += sample;
+
+		auto const ops = latency.size ();
+
+		std::fprintf (fp,
+		    "%s\n"
+		    "    {\n"
+		    "      \"spin_us\": %lld,\n"
+		    "      \"cpu\": %d,\n"
+		    "      \"ops\": %zu,\n"
+		    "      \"errors\": %" PRIu64 ",\n"
+		    "      \"ops_per_s\": %.2f,\n"
+		    "      \"mean_us\": %.2f,\n"
+		    "      \"p50_us\": %.2f,\n"
+		    "      \"p99_us\": %.2f,\n"
+		    "      \"max_us\": %.2f,\n"
+		    "      \"server_cpu_s\": %.3f,\n"
+		    "      \"server_cpu_pct\": %.1f,\n"
+		    "      \"server_cpu_us_per_op\": %.2f\n"
+		    "    }",
+		    spin == modes.front () ? "" : ",",
+		    static_cast<long long> (spin.count ()),
+		    cpu,
+		    ops,
+		    errors,
+		    ops / elapsed,
+		    ops ? sum / ops * 1e6 : 0.0,
+		    bench::percentile (latency, 50.0) * 1e6,
+		    bench::percentile (latency, 99.0) * 1e6,
+		    bench::percentile (latency, 100.0) * 1e6,
+		    serverCpu,
+		    serverCpu / elapsed * 100.0,
+		    ops ? serverCpu / ops * 1e6 : 0.0);
+		std::fflush (fp);
+	}
+
+	std::fprintf (fp, "\n  ]\n}\n");
+
+	if (output)
+		std::fclose (fp);
+
+	server.stop ();
+
+	return totalErrors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,722 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "harness.h"
+
+#include "ftpConfig.h"
+
+#ifndef CLASSIC
+#include <imgui.h>
+#endif
+
+#include <zlib.h>
+
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <utility>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+/// \brief Data buffer size
+constexpr auto BUFFERSIZE = 256 * 1024;
+
+/// \brief Connect to loopback port
+/// \param port_ Port to connect to
+/// \returns Connected socket, -1 on error
+int connectLoopback (std::uint16_t const port_)
+{
+	auto const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	sockaddr_in addr{};
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons (port_);
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	if (::connect (fd, reinterpret_cast<sockaddr const *> (&addr), sizeof (addr)) != 0)
+	{
+		::close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/// \brief Send all data
+/// \param fd_ Socket to send on
+/// \param data_ Data to send
+/// \param size_ Data size
+bool sendAll (int const fd_, void const *const data_, std::size_t const size_)
+{
+	auto p        = static_cast<char const *> (data_);
+	auto const end = p + size_;
+	while (p < end)
+	{
+		auto const rc = ::send (fd_, p, end - p, MSG_NOSIGNAL);
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		p += rc;
+	}
+
+	return true;
+}
+
+/// \brief Find an unused loopback port
+std::uint16_t freePort ()
+{
+	auto const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+
+	sockaddr_in addr{};
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+	socklen_t len = sizeof (addr);
+	if (::bind (fd, reinterpret_cast<sockaddr const *> (&addr), sizeof (addr)) != 0 ||
+	    ::getsockname (fd, reinterpret_cast<sockaddr *> (&addr), &len) != 0)
+	{
+		::close (fd);
+		return 0;
+	}
+
+	::close (fd);
+	return ntohs (addr.sin_port);
+}
+
+/// \brief Convert timespec to seconds
+/// \param ts_ Timespec to convert
+double seconds (timespec const &ts_)
+{
+	return ts_.tv_sec + ts_.tv_nsec / 1e9;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+bench::Client::~Client ()
+{
+	close ();
+}
+
+bench::Client::Client () = default;
+
+bench::Client::Client (Client &&that_)
+{
+	*this = std::move (that_);
+}
+
+bench::Client &bench::Client::operator= (Client &&that_)
+{
+	if (this != &that_)
+	{
+		close ();
+
+		m_fd      = std::exchange (that_.m_fd, -1);
+		m_port    = that_.m_port;
+		m_input   = std::move (that_.m_input);
+		m_reply   = std::move (that_.m_reply);
+		m_buffer  = std::move (that_.m_buffer);
+		m_deflate = that_.m_deflate;
+	}
+
+	return *this;
+}
+
+bool bench::Client::connect (std::uint16_t const port_)
+{
+	close ();
+
+	m_fd = connectLoopback (port_);
+	if (m_fd < 0)
+		return false;
+
+	m_port = port_;
+
+	if (readReply () != 220)
+	{
+		close ();
+		return false;
+	}
+
+	return true;
+}
+
+void bench::Client::close ()
+{
+	if (m_fd >= 0)
+		::close (m_fd);
+
+	m_fd      = -1;
+	m_deflate = false;
+	m_input.clear ();
+}
+
+int bench::Client::release ()
+{
+	m_input.clear ();
+	m_deflate = false;
+	return std::exchange (m_fd, -1);
+}
+
+int bench::Client::command (std::string_view const command_)
+{
+	std::string line;
+	line.reserve (command_.size () + 2);
+	line += command_;
+	line += "\r\n";
+
+	if (!sendAll (m_fd, line.data (), line.size ()))
+		return -1;
+
+	return readReply ();
+}
+
+int bench::Client::readReply ()
+{
+	m_reply.clear ();
+
+	std::string line;
+	if (!readLine (line) || line.size () < 3)
+		return -1;
+
+	m_reply = line;
+
+	auto const code = std::atoi (line.substr (0, 3).c_str ());
+	if (line.size () > 3 && line[3] == '-')
+	{
+		// multi-line reply ends with "<code> "
+		auto const last = line.substr (0, 3) + ' ';
+		do
+		{
+			if (!readLine (line))
+				return -1;
+
+			m_reply += '\n';
+			m_reply += line;
+		} while (line.compare (0, 4, last) != 0);
+	}
+
+	return code;
+}
+
+std::string const &bench::Client::reply () const
+{
+	return m_reply;
+}
+
+bool bench::Client::mode (bool const deflate_)
+{
+	if (command (deflate_ ? "MODE Z" : "MODE S") != 200)
+		return false;
+
+	m_deflate = deflate_;
+	return true;
+}
+
+bool bench::Client::retrieve (std::string_view const path_, std::uint64_t &bytes_)
+{
+	auto const fd = openData ();
+	if (fd < 0)
+		return false;
+
+	auto const code = command ("RETR " + std::string (path_));
+	if (code != 150 && code != 125)
+	{
+		::close (fd);
+		return false;
+	}
+
+	if (!recvData (fd, bytes_))
+		return false;
+
+	return readReply () == 226;
+}
+
+bool bench::Client::store (std::string_view const path_,
+    void const *const data_,
+    std::size_t const size_)
+{
+	auto const fd = openData ();
+	if (fd < 0)
+		return false;
+
+	auto const code = command ("STOR " + std::string (path_));
+	if (code != 150 && code != 125)
+	{
+		::close (fd);
+		return false;
+	}
+
+	if (!sendData (fd, data_, size_))
+		return false;
+
+	return readReply () == 226;
+}
+
+bool bench::Client::list (std::string_view const command_,
+    std::string_view const path_,
+    std::uint64_t &bytes_)
+{
+	auto const fd = openData ();
+	if (fd < 0)
+		return false;
+
+	auto line = std::string (command_);
+	if (!path_.empty ())
+	{
+		line += ' ';
+		line += path_;
+	}
+
+	auto const code = command (line);
+	if (code != 150 && code != 125)
+	{
+		::close (fd);
+		return false;
+	}
+
+	if (!recvData (fd, bytes_))
+		return false;
+
+	return readReply () == 226;
+}
+
+int bench::Client::fd () const
+{
+	return m_fd;
+}
+
+int bench::Client::openData ()
+{
+	if (command ("PASV") != 227)
+		return -1;
+
+	// 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+	auto const pos = m_reply.find ('(');
+	if (pos == std::string::npos)
+		return -1;
+
+	unsigned h[4];
+	unsigned p[2];
+	if (std::sscanf (m_reply.c_str () + pos,
+	        "(%u,%u,%u,%u,%u,%u)",
+	        &h[0],
+	        &h[1],
+	        &h[2],
+	        &h[3],
+	        &p[0],
+	        &p[1]) != 6)
+		return -1;
+
+	return connectLoopback ((p[0] << 8) | p[1]);
+}
+
+bool bench::Client::recvData (int const fd_, std::uint64_t &bytes_)
+{
+	if (m_buffer.size () < BUFFERSIZE)
+		m_buffer.resize (BUFFERSIZE);
+
+	z_stream zs{};
+	std::vector<char> out;
+	if (m_deflate)
+	{
+		if (inflateInit (&zs) != Z_OK)
+		{
+			::close (fd_);
+			return false;
+		}
+
+		out.resize (BUFFERSIZE);
+	}
+
+	bool ok = true;
+	while (true)
+	{
+		auto const rc = ::recv (fd_, m_buffer.data (), m_buffer.size (), 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc <= 0)
+		{
+			ok = rc == 0;
+			break;
+		}
+
+		if (!m_deflate)
+		{
+			bytes_ += rc;
+			continue;
+		}
+
+		zs.next_in  = reinterpret_cast<Bytef *> (m_buffer.data ());
+		zs.avail_in = rc;
+		while (zs.avail_in > 0)
+		{
+			zs.next_out  = reinterpret_cast<Bytef *> (out.data ());
+			zs.avail_out = out.size ();
+
+			auto const zrc = inflate (&zs, Z_NO_FLUSH);
+			if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR)
+			{
+				ok = false;
+				break;
+			}
+
+			bytes_ += out.size () - zs.avail_out;
+			if (zrc == Z_STREAM_END || (zrc == Z_BUF_ERROR && zs.avail_out != 0))
+				break;
+		}
+
+		if (!ok)
+			break;
+	}
+
+	if (m_deflate)
+		inflateEnd (&zs);
+
+	::close (fd_);
+	return ok;
+}
+
+bool bench::Client::sendData (int const fd_, void const *const data_, std::size_t const size_)
+{
+	bool ok = true;
+
+	if (!m_deflate)
+		ok = sendAll (fd_, data_, size_);
+	else
+	{
+		if (m_buffer.size () < BUFFERSIZE)
+			m_buffer.resize (BUFFERSIZE);
+
+		// compress quickly so the client doesn't dominate the measurement
+		z_stream zs{};
+		if (deflateInit (&zs, Z_BEST_SPEED) != Z_OK)
+		{
+			::close (fd_);
+			return false;
+		}
+
+		zs.next_in  = static_cast<Bytef *> (const_cast<void *> (data_));
+		zs.avail_in = size_;
+
+		int zrc;
+		do
+		{
+			zs.next_out  = reinterpret_cast<Bytef *> (m_buffer.data ());
+			zs.avail_out = m_buffer.size ();
+
+			zrc = deflate (&zs, Z_FINISH);
+			if (zrc != Z_OK && zrc != Z_STREAM_END && zrc != Z_BUF_ERROR)
+			{
+				ok = false;
+				break;
+			}
+
+			if (!sendAll (fd_, m_buffer.data (), m_buffer.size () - zs.avail_out))
+			{
+				ok = false;
+				break;
+			}
+		} while (zrc != Z_STREAM_END);
+
+		deflateEnd (&zs);
+	}
+
+	::shutdown (fd_, SHUT_WR);
+	::close (fd_);
+	return ok;
+}
+
+bool bench::Client::readLine (std::string &line_)
+{
+	while (true)
+	{
+		auto const pos = m_input.find ("\r\n");
+		if (pos != std::string::npos)
+		{
+			line_.assign (m_input, 0, pos);
+			m_input.erase (0, pos + 2);
+			return true;
+		}
+
+		char buffer[4096];
+		auto const rc = ::recv (m_fd, buffer, sizeof (buffer), 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc <= 0)
+			return false;
+
+		m_input.append (buffer, rc);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////
+bench::Server::~Server ()
+{
+	stop ();
+}
+
+bench::Server::Server () = default;
+
+bool bench::Server::start (bool const draw_, std::string user_, std::string pass_)
+{
+	auto const tmp = std::getenv ("TMPDIR");
+
+	auto path = std::string (tmp && *tmp ? tmp : "/tmp") + "/ftpd-bench.XXXXXX";
+	if (!::mkdtemp (path.data ()))
+	{
+		std::fprintf (stderr, "mkdtemp: %s\n", std::strerror (errno));
+		return false;
+	}
+
+	m_root = std::move (path);
+
+	// keep anything the server writes relative to its cwd inside the scratch directory
+	if (::chdir (m_root.c_str ()) != 0)
+	{
+		std::fprintf (stderr, "chdir %s: %s\n", m_root.c_str (), std::strerror (errno));
+		return false;
+	}
+
+	m_port = freePort ();
+	if (m_port == 0)
+	{
+		std::fprintf (stderr, "Failed to find free port\n");
+		return false;
+	}
+
+	auto config = FtpConfig::create ();
+	config->setPort (m_port);
+	config->setUser (std::move (user_));
+	config->setPass (std::move (pass_));
+
+#ifndef CLASSIC
+	if (draw_)
+	{
+		ImGui::CreateContext ();
+
+		auto &io       = ImGui::GetIO ();
+		io.DisplaySize = ImVec2 (1280.0f, 720.0f);
+		io.DeltaTime   = 1.0f / 60.0f;
+		io.IniFilename = nullptr;
+
+		unsigned char *pixels;
+		int width;
+		int height;
+		io.Fonts->GetTexDataAsRGBA32 (&pixels, &width, &height);
+	}
+#endif
+
+	m_server = FtpServer::create (std::move (config));
+
+#ifndef CLASSIC
+	if (draw_)
+		m_drawThread = std::thread (&Server::drawFunc, this);
+#else
+	(void)draw_;
+#endif
+
+	// wait for the listener to come up
+	for (unsigned i = 0; i < 500; ++i)
+	{
+		Client client;
+		if (client.connect (m_port))
+			return true;
+
+		std::this_thread::sleep_for (10ms);
+	}
+
+	std::fprintf (stderr, "Server did not start listening on port %u\n", m_port);
+	return false;
+}
+
+void bench::Server::stop ()
+{
+	if (m_drawThread.joinable ())
+	{
+		m_quit = true;
+		m_drawThread.join ();
+
+#ifndef CLASSIC
+		ImGui::DestroyContext ();
+#endif
+	}
+
+	m_server.reset ();
+
+	if (m_root.empty ())
+		return;
+
+	(void)::chdir ("/");
+
+	auto const remove = [] (char const *const path_, struct stat const *, int, FTW *) {
+		return ::remove (path_);
+	};
+
+	if (::nftw (m_root.c_str (), remove, 64, FTW_DEPTH | FTW_PHYS) != 0)
+		std::fprintf (stderr, "Failed to remove %s\n", m_root.c_str ());
+
+	m_root.clear ();
+}
+
+std::uint16_t bench::Server::port () const
+{
+	return m_port;
+}
+
+std::string const &bench::Server::root () const
+{
+	return m_root;
+}
+
+FtpServer &bench::Server::server ()
+{
+	return *m_server;
+}
+
+void bench::Server::drawFunc ()
+{
+#ifndef CLASSIC
+	while (!m_quit)
+	{
+		ImGui::NewFrame ();
+		m_server->draw ();
+		ImGui::Render ();
+
+		std::this_thread::sleep_for (16ms);
+	}
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+double bench::now ()
+{
+	timespec ts;
+	::clock_gettime (CLOCK_MONOTONIC, &ts);
+	return seconds (ts);
+}
+
+double bench::processCpu ()
+{
+	timespec ts;
+	::clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return seconds (ts);
+}
+
+double bench::threadCpu ()
+{
+	timespec ts;
+	::clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+	return seconds (ts);
+}
+
+double bench::percentile (std::vector<double> &samples_, double const p_)
+{
+	if (samples_.empty ())
+		return 0.0;
+
+	std::sort (std::begin (samples_), std::end (samples_));
+
+	auto const rank = p_ / 100.0 * (samples_.size () - 1);
+	auto const lo   = static_cast<std::size_t> (std::floor (rank));
+	auto const hi   = std::min (lo + 1, samples_.size () - 1);
+
+	return samples_[lo] + (samples_[hi] - samples_[lo]) * (rank - lo);
+}
+
+std::uint64_t bench::rss ()
+{
+	auto const fp = std::fopen ("/proc/self/statm", "r");
+	if (!fp)
+		return 0;
+
+	unsigned long size     = 0;
+	unsigned long resident = 0;
+	if (std::fscanf (fp, "%lu %lu", &size, &resident) != 2)
+		resident = 0;
+
+	std::fclose (fp);
+
+	return static_cast<std::uint64_t> (resident) * ::sysconf (_SC_PAGESIZE);
+}
+
+void bench::fillCompressible (std::vector<char> &data_, std::uint32_t seed_)
+{
+	static char const *const words[] = {
+	    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ", "ftpd ", "server ",
+	    "session ", "transfer ", "buffer ", "socket ", "deflate ", "stream ",
+	};
+
+	std::size_t i = 0;
+	while (i < data_.size ())
+	{
+		// xorshift32
+		seed_ ^= seed_ << 13;
+		seed_ ^= seed_ >> 17;
+		seed_ ^= seed_ << 5;
+
+		if ((seed_ & 0x3) == 0)
+		{
+			// random bytes keep the ratio realistic
+			data_[i++] = static_cast<char> (seed_ >> 24);
+			continue;
+		}
+
+		auto const word = words[(seed_ >> 8) % std::size (words)];
+		for (auto p = word; *p && i < data_.size (); ++p)
+			data_[i++] = *p;
+	}
+}
+
+bool bench::writeFile (std::string const &path_, void const *const data_, std::size_t const size_)
+{
+	auto const fp = std::fopen (path_.c_str (), "wb");
+	if (!fp)
+		return false;
+
+	auto const ok = std::fwrite (data_, 1, size_, fp) == size_;
+	return std::fclose (fp) == 0 && ok;
+}
@@ -0,0 +1,216 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ftpServer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/// \brief Benchmark support shared by the bench targets
+namespace bench
+{
+/// \brief Blocking FTP client
+/// \note Only implements what the benchmarks need (PASV, MODE Z, RETR/STOR/LIST/MLSD)
+class Client
+{
+public:
+	~Client ();
+
+	Client ();
+
+	Client (Client const &that_) = delete;
+
+	Client (Client &&that_);
+
+	Client &operator= (Client const &that_) = delete;
+
+	Client &operator= (Client &&that_);
+
+	/// \brief Connect to loopback server and read greeting
+	/// \param port_ Server port
+	bool connect (std::uint16_t port_);
+
+	/// \brief Close connection
+	void close ();
+
+	/// \brief Release control socket to the caller
+	/// \note Any pending input is discarded
+	int release ();
+
+	/// \brief Send command and read reply
+	/// \param command_ Command line (without CRLF)
+	/// \returns Reply code, -1 on error
+	int command (std::string_view command_);
+
+	/// \brief Read reply
+	/// \returns Reply code, -1 on error
+	int readReply ();
+
+	/// \brief Last reply
+	std::string const &reply () const;
+
+	/// \brief Set transfer mode
+	/// \param deflate_ Whether to use MODE Z
+	bool mode (bool deflate_);
+
+	/// \brief Retrieve file
+	/// \param path_ Path to retrieve
+	/// \param[out] bytes_ Decompressed bytes received
+	bool retrieve (std::string_view path_, std::uint64_t &bytes_);
+
+	/// \brief Store file
+	/// \param path_ Path to store
+	/// \param data_ Data to store
+	/// \param size_ Data size
+	bool store (std::string_view path_, void const *data_, std::size_t size_);
+
+	/// \brief List directory
+	/// \param command_ Listing command (LIST/MLSD/NLST)
+	/// \param path_ Path to list
+	/// \param[out] bytes_ Bytes received
+	bool list (std::string_view command_, std::string_view path_, std::uint64_t &bytes_);
+
+	/// \brief Control socket
+	int fd () const;
+
+private:
+	/// \brief Open passive data connection
+	/// \returns Data socket, -1 on error
+	int openData ();
+
+	/// \brief Receive data connection until EOF
+	/// \param fd_ Data socket
+	/// \param[out] bytes_ Decompressed bytes received
+	bool recvData (int fd_, std::uint64_t &bytes_);
+
+	/// \brief Send data connection and close
+	/// \param fd_ Data socket
+	/// \param data_ Data to send
+	/// \param size_ Data size
+	bool sendData (int fd_, void const *data_, std::size_t size_);
+
+	/// \brief Read a reply line
+	/// \param[out] line_ Line read (without CRLF)
+	bool readLine (std::string &line_);
+
+	/// \brief Control socket
+	int m_fd = -1;
+
+	/// \brief Server port
+	std::uint16_t m_port = 0;
+
+	/// \brief Pending control input
+	std::string m_input;
+
+	/// \brief Last reply
+	std::string m_reply;
+
+	/// \brief Data buffer
+	std::vector<char> m_buffer;
+
+	/// \brief Whether MODE Z is active
+	bool m_deflate = false;
+};
+
+/// \brief In-process server on a loopback listener
+/// \note Runs the real FtpServer/FtpSession; a UI thread renders headless frames so the log is
+/// drained and the draw path reads the server's shared state just like the application
+class Server
+{
+public:
+	~Server ();
+
+	Server ();
+
+	/// \brief Start server in a fresh scratch directory
+	/// \param draw_ Whether to render headless frames
+	/// \param user_ Required username
+	/// \param pass_ Required password
+	bool start (bool draw_ = true, std::string user_ = {}, std::string pass_ = {});
+
+	/// \brief Stop server and remove scratch directory
+	void stop ();
+
+	/// \brief Listen port
+	std::uint16_t port () const;
+
+	/// \brief Scratch directory
+	std::string const &root () const;
+
+	/// \brief Server
+	FtpServer &server ();
+
+private:
+	/// \brief UI thread entry point
+	void drawFunc ();
+
+	/// \brief Server
+	UniqueFtpServer m_server;
+
+	/// \brief UI thread
+	std::thread m_drawThread;
+
+	/// \brief Whether UI thread should quit
+	std::atomic_bool m_quit = false;
+
+	/// \brief Scratch directory
+	std::string m_root;
+
+	/// \brief Listen port
+	std::uint16_t m_port = 0;
+};
+
+/// \brief Monotonic time in seconds
+double now ();
+
+/// \brief Process CPU time in seconds
+double processCpu ();
+
+/// \brief Calling thread CPU time in seconds
+double threadCpu ();
+
+/// \brief Get percentile from samples
+/// \param samples_ Samples (sorted in place)
+/// \param p_ Percentile [0, 100]
+double percentile (std::vector<double> &samples_, double p_);
+
+/// \brief Resident set size in bytes
+std::uint64_t rss ();
+
+/// \brief Fill buffer with text-like data that deflates roughly 3:1
+/// \param data_ Buffer to fill
+/// \param seed_ PRNG seed
+void fillCompressible (std::vector<char> &data_, std::uint32_t seed_);
+
+/// \brief Write file
+/// \param path_ Path to write
+/// \param data_ Data to write
+/// \param size_ Data size
+bool writeFile (std::string const &path_, void const *data_, std::size_t size_);
+}
@@ -0,0 +1,434 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Loopback throughput benchmark
+//
+// Runs the real FtpServer in-process and drives it with concurrent blocking clients over
+// loopback, then prints a JSON report suitable for comparing releases.
+
+#include "harness.h"
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/// \brief Per-client results
+struct Stats
+{
+	/// \brief Operation latencies in seconds
+	std::vector<double> latency;
+
+	/// \brief Payload bytes transferred
+	std::uint64_t bytes = 0;
+
+	/// \brief Failed operations
+	std::uint64_t errors = 0;
+
+	/// \brief Client thread CPU time in seconds
+	double cpu = 0.0;
+
+	/// \brief Time an operation
+	/// \param op_ Operation returning success
+	/// \param bytes_ Payload bytes transferred by the operation
+	template <typename F>
+	bool time (F &&op_, std::uint64_t const bytes_ = 0)
+	{
+		auto const start = bench::now ();
+		if (!op_ ())
+		{
+			++errors;
+			return false;
+		}
+
+		latency.emplace_back (bench::now () - start);
+		bytes += bytes_;
+		return true;
+	}
+};
+
+/// \brief Benchmark options
+struct Options
+{
+	/// \brief Concurrent clients
+	unsigned clients = 4;
+
+	/// \brief Seconds per scenario
+	double duration = 3.0;
+
+	/// \brief Large file size
+	std::size_t size = 16 * 1024 * 1024;
+
+	/// \brief Small file size
+	std::size_t smallSize = 4096;
+
+	/// \brief Synthetic directory entries
+	unsigned entries = 1000;
+
+	/// \brief Whether to render headless UI frames
+	bool draw = true;
+};
+
+/// \brief Scenario
+struct Scenario
+{
+	/// \brief Scenario name
+	char const *name;
+
+	/// \brief Whether to use MODE Z
+	bool deflate;
+
+	/// \brief Run one iteration
+	std::function<bool (bench::Client &, unsigned, std::uint64_t, Stats &)> run;
+};
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options] [scenario...]\n"
+	    "  -c, --clients N      concurrent clients (default 4)\n"
+	    "  -d, --duration SEC   seconds per scenario (default 3)\n"
+	    "  -s, --size BYTES     large file size (default 16777216)\n"
+	    "  -S, --small BYTES    small file size (default 4096)\n"
+	    "  -e, --entries N      synthetic directory entries (default 1000)\n"
+	    "  -o, --output FILE    write JSON report to FILE (default stdout)\n"
+	    "  -n, --no-draw        don't render headless UI frames\n"
+	    "Scenarios: retr stor retr_z stor_z retr_dev stor_dev retr_dev_z stor_dev_z list mlsd\n"
+	    "           small (default all)\n",
+	    prog_);
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Options options;
+	char const *output = nullptr;
+
+	static option const longOptions[] = {
+	    {"clients", required_argument, nullptr, 'c'},
+	    {"duration", required_argument, nullptr, 'd'},
+	    {"size", required_argument, nullptr, 's'},
+	    {"small", required_argument, nullptr, 'S'},
+	    {"entries", required_argument, nullptr, 'e'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"no-draw", no_argument, nullptr, 'n'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "c:d:s:S:e:o:nh", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'c':
+			options.clients = std::max (1ul, std::strtoul (optarg, nullptr, 0));
+			break;
+
+		case 'd':
+			options.duration = std::strtod (optarg, nullptr);
+			break;
+
+		case 's':
+			options.size = std::strtoull (optarg, nullptr, 0);
+			break;
+
+		case 'S':
+			options.smallSize = std::strtoull (optarg, nullptr, 0);
+			break;
+
+		case 'e':
+			options.entries = std::strtoul (optarg, nullptr, 0);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'n':
+			options.draw = false;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	bench::Server server;
+	if (!server.start (options.draw))
+		return EXIT_FAILURE;
+
+	auto const &root = server.root ();
+
+	// synthetic content
+	std::vector<char> data (options.size);
+	bench::fillCompressible (data, 0x12345678);
+
+	std::vector<char> small (options.smallSize);
+	bench::fillCompressible (small, 0x87654321);
+
+	if (!bench::writeFile (root + "/data.bin", data.data (), data.size ()) ||
+	    ::mkdir ((root + "/dir").c_str (), 0755) != 0 ||
+	    ::mkdir ((root + "/small").c_str (), 0755) != 0)
+	{
+		std::fprintf (stderr, "Failed to create synthetic content: %s\n", std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0; i < options.entries; ++i)
+	{
+		char name[64];
+		std::snprintf (name, sizeof (name), "/dir/entry-%06u-with-a-longish-name.txt", i);
+		if (!bench::writeFile (root + name, small.data (), i % small.size ()))
+		{
+			std::fprintf (stderr, "Failed to create %s: %s\n", name, std::strerror (errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	auto const retr = [&] (bench::Client &client_, unsigned, std::uint64_t, Stats &stats_) {
+		std::uint64_t bytes = 0;
+		return stats_.time (
+		    [&] { return client_.retrieve (root + "/data.bin", bytes); }, data.size ());
+	};
+
+	auto const stor = [&] (bench::Client &client_, unsigned id_, std::uint64_t, Stats &stats_) {
+		auto const path = root + "/stor" + std::to_string (id_) + ".bin";
+		return stats_.time (
+		    [&] { return client_.store (path, data.data (), data.size ()); }, data.size ());
+	};
+
+	// virtual devices take the disk off the critical path
+	auto const devPath = "/dev/compressible/" + std::to_string (data.size ());
+
+	auto const retrDev = [&] (bench::Client &client_, unsigned, std::uint64_t, Stats &stats_) {
+		std::uint64_t bytes = 0;
+		return stats_.time ([&] { return client_.retrieve (devPath, bytes); }, data.size ());
+	};
+
+	auto const storDev = [&] (bench::Client &client_, unsigned, std::uint64_t, Stats &stats_) {
+		return stats_.time (
+		    [&] { return client_.store ("/dev/null", data.data (), data.size ()); }, data.size ());
+	};
+
+	auto const list = [&] (char const *const command_) {
+		return [&, command_] (bench::Client &client_, unsigned, std::uint64_t, Stats &stats_) {
+			std::uint64_t bytes = 0;
+			auto const ok =
+			    stats_.time ([&] { return client_.list (command_, root + "/dir", bytes); });
+			stats_.bytes += bytes;
+			return ok;
+		};
+	};
+
+	auto const smallFiles = [&] (bench::Client &client_,
+	                            unsigned const id_,
+	                            std::uint64_t const seq_,
+	                            Stats &stats_) {
+		auto const path =
+		    root + "/small/" + std::to_string (id_) + "-" + std::to_string (seq_) + ".txt";
+
+		std::uint64_t bytes = 0;
+		return stats_.time (
+		           [&] { return client_.store (path, small.data (), small.size ()); },
+		           small.size ()) &&
+		       stats_.time ([&] { return client_.retrieve (path, bytes); }, small.size ()) &&
+		       stats_.time ([&] { return client_.command ("DELE " + path) == 250; });
+	};
+
+	std::vector<Scenario> const allScenarios = {
+	    {"retr", false, retr},
+	    {"stor", false, stor},
+	    {"retr_z", true, retr},
+	    {"stor_z", true, stor},
+	    {"retr_dev", false, retrDev},
+	    {"stor_dev", false, storDev},
+	    {"retr_dev_z", true, retrDev},
+	    {"stor_dev_z", true, storDev},
+	    {"list", false, list ("LIST")},
+	    {"mlsd", false, list ("MLSD")},
+	    {"small", false, smallFiles},
+	};
+
+	std::vector<Scenario const *> scenarios;
+	for (int i = optind; i < argc_; ++i)
+	{
+		auto const it = std::find_if (std::begin (allScenarios),
+		    std::end (allScenarios),
+		    [&] (auto const &scenario_) { return std::strcmp (scenario_.name, argv_[i]) == 0; });
+		if (it == std::end (allScenarios))
+		{
+			usage (argv_[0]);
+			return EXIT_FAILURE;
+		}
+
+		scenarios.emplace_back (&*it);
+	}
+
+	if (scenarios.empty ())
+	{
+		for (auto const &scenario : allScenarios)
+			scenarios.emplace_back (&scenario);
+	}
+
+	auto const fp = output ? std::fopen (output, "w") : stdout;
+	if (!fp)
+	{
+		std::fprintf (stderr, "Failed to open %s: %s\n", output, std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::fprintf (fp,
+	    "{\n"
+	    "  \"server\": \"%s\",\n"
+	    "  \"clients\": %u,\n"
+	    "  \"duration\": %.3f,\n"
+	    "  \"size\": %zu,\n"
+	    "  \"small_size\": %zu,\n"
+	    "  \"entries\": %u,\n"
+	    "  \"scenarios\": {",
+	    STATUS_STRING,
+	    options.clients,
+	    options.duration,
+	    options.size,
+	    options.smallSize,
+	    options.entries);
+
+	std::uint64_t totalErrors = 0;
+	for (auto const scenario : scenarios)
+	{
+		std::vector<Stats> results (options.clients);
+		std::vector<std::thread> threads;
+
+		auto const cpuStart = bench::processCpu ();
+		auto const start    = bench::now ();
+		auto const deadline = start + options.duration;
+
+		for (unsigned i = 0; i < options.clients; ++i)
+		{
+			threads.emplace_back ([&, i] {
+				auto &stats     = results[i];
+				auto const cpu0 = bench::threadCpu ();
+
+				bench::Client client;
+				std::uint64_t seq = 0;
+				while (bench::now () < deadline)
+				{
+					if (client.fd () < 0 &&
+					    (!client.connect (server.port ()) ||
+					        (scenario->deflate && !client.mode (true))))
+					{
+						++stats.errors;
+						break;
+					}
+
+					// reconnect after a failure so one bad reply doesn't poison the run
+					if (!scenario->run (client, i, seq++, stats))
+						client.close ();
+				}
+
+				client.command ("QUIT");
+				stats.cpu = bench::threadCpu () - cpu0;
+			});
+		}
+
+		for (auto &thread : threads)
+			thread.join ();
+
+		auto const elapsed = bench::now () - start;
+		auto const cpu     = bench::processCpu () - cpuStart;
+
+		std::vector<double> latency;
+		std::uint64_t bytes  = 0;
+		std::uint64_t errors = 0;
+		double clientCpu     = 0.0;
+		for (auto &s : results)
+		{
+			latency.insert (std::end (latency), std::begin (s.latency), std::end (s.latency));
+			bytes += s.bytes;
+			errors += s.errors;
+			clientCpu += s.cpu;
+		}
+
+		totalErrors += errors;
+
+		auto const ops = latency.size ();
+		auto const gb  = bytes / 1e9;
+
+		std::fprintf (fp,
+		    "%s\n"
+		    "    \"%s\": {\n"
+		    "      \"ops\": %zu,\n"
+		    "      \"errors\": %" PRIu64 ",\n"
+		    "      \"bytes\": %" PRIu64 ",\n"
+		    "      \"seconds\": %.3f,\n"
+		    "      \"mb_per_s\": %.2f,\n"
+		    "      \"ops_per_s\": %.2f,\n"
+		    "      \"p50_ms\": %.3f,\n"
+		    "      \"p99_ms\": %.3f,\n"
+		    "      \"max_ms\": %.3f,\n"
+		    "      \"cpu_s\": %.3f,\n"
+		    "      \"server_cpu_s\": %.3f,\n"
+		    "      \"cpu_s_per_gb\": %.3f,\n"
+		    "      \"server_cpu_s_per_gb\": %.3f\n"
+		    "    }",
+		    scenario == scenarios.front () ? "" : ",",
+		    scenario->name,
+		    ops,
+		    errors,
+		    bytes,
+		    elapsed,
+		    bytes / 1e6 / elapsed,
+		    ops / elapsed,
+		    bench::percentile (latency, 50.0) * 1e3,
+		    bench::percentile (latency, 99.0) * 1e3,
+		    bench::percentile (latency, 100.0) * 1e3,
+		    cpu,
+		    cpu - clientCpu,
+		    gb > 0.0 ? cpu / gb : 0.0,
+		    gb > 0.0 ? (cpu - clientCpu) / gb : 0.0);
+		std::fflush (fp);
+	}
+
+	std::fprintf (fp, "\n  }\n}\n");
+
+	if (output)
+		std::fclose (fp);
+
+	server.stop ();
+
+	return totalErrors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
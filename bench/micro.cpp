@@ -0,0 +1,477 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Microbenchmarks for the per-command and per-entry helpers
+//
+// Times the helpers from ftpUtil.h and the IOBuffer primitives on realistic and adversarial
+// inputs, and counts heap allocations per call through a replaced global allocator.
+
+#include "allocTrack.h"
+#include "ftpUtil.h"
+#include "ioBuffer.h"
+#include "latencyHistogram.h"
+#include "log.h"
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+#if !FTPD_ALLOC_TRACKING
+/// \brief Allocations since start
+std::size_t s_allocations = 0;
+
+/// \brief Bytes allocated since start
+std::size_t s_allocatedBytes = 0;
+
+/// \brief Allocate and count
+/// \param size_ Size to allocate
+void *countedAlloc (std::size_t const size_)
+{
+	++s_allocations;
+	s_allocatedBytes += size_;
+
+	if (auto const p = std::malloc (size_ ? size_ : 1))
+		return p;
+
+	throw std::bad_alloc ();
+}
+#endif
+
+/// \brief Get allocations and bytes allocated since start
+std::pair<std::uint64_t, std::uint64_t> allocated ()
+{
+#if FTPD_ALLOC_TRACKING
+	// the tracking build replaces the allocator itself
+	auto const total = alloc::total ();
+	return {total.allocations, total.bytes};
+#else
+	return {s_allocations, s_allocatedBytes};
+#endif
+}
+
+/// \brief Prevent the compiler from discarding a value
+/// \param value_ Value to keep
+template <typename T>
+void keep (T const &value_)
+{
+	asm volatile ("" : : "r"(&value_) : "memory");
+}
+
+/// \brief Benchmark result
+struct Result
+{
+	/// \brief Benchmark name
+	std::string name;
+
+	/// \brief Nanoseconds per call
+	double ns;
+
+	/// \brief Allocations per call
+	double allocations;
+
+	/// \brief Bytes allocated per call
+	double bytes;
+};
+
+/// \brief Benchmark results
+std::vector<Result> s_results;
+
+/// \brief Name filter
+char const *s_filter = nullptr;
+
+/// \brief Target measurement time per benchmark
+double s_seconds = 0.25;
+
+/// \brief Run a benchmark
+/// \param name_ Benchmark name
+/// \param fn_ Function to benchmark
+template <typename F>
+void run (char const *const name_, F &&fn_)
+{
+	if (s_filter && !std::strstr (name_, s_filter))
+		return;
+
+	using clock = std::chrono::steady_clock;
+
+	auto const measure = [&] (std::uint64_t const iterations_) {
+		auto const start = clock::now ();
+		for (std::uint64_t i = 0; i < iterations_; ++i)
+			fn_ ();
+		return std::chrono::duration<double> (clock::now () - start).count ();
+	};
+
+	// calibrate
+	std::uint64_t iterations = 1;
+	double elapsed;
+	while ((elapsed = measure (iterations)) < s_seconds / 10.0)
+		iterations *= 2;
+
+	iterations = std::max<std::uint64_t> (1, iterations * (s_seconds / elapsed));
+
+	auto const [allocations, bytes] = allocated ();
+
+	elapsed = measure (iterations);
+
+	auto const [allocationsEnd, bytesEnd] = allocated ();
+
+	auto const &result = s_results.emplace_back (Result{
+	    .name        = name_,
+	    .ns          = elapsed * 1e9 / iterations,
+	    .allocations = static_cast<double> (allocationsEnd - allocations) / iterations,
+	    .bytes       = static_cast<double> (bytesEnd - bytes) / iterations,
+	});
+
+	std::printf ("%-36s %12.1f %10.2f %12.1f\n",
+	    result.name.c_str (),
+	    result.ns,
+	    result.allocations,
+	    result.bytes);
+	std::fflush (stdout);
+}
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options] [filter]\n"
+	    "  -t, --time SEC     target seconds per benchmark (default 0.25)\n"
+	    "  -o, --output FILE  write JSON results to FILE\n",
+	    prog_);
+}
+}
+
+#if !FTPD_ALLOC_TRACKING
+void *operator new (std::size_t const size_)
+{
+	return countedAlloc (size_);
+}
+
+void *operator new[] (std::size_t const size_)
+{
+	return countedAlloc (size_);
+}
+
+void operator delete (void *const p_) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete (void *const p_, std::size_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_, std::size_t) noexcept
+{
+	std::free (p_);
+}
+#endif
+
+int main (int argc_, char *argv_[])
+{
+	char const *output = nullptr;
+
+	static option const longOptions[] = {
+	    {"time", required_argument, nullptr, 't'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "t:o:h", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 't':
+			s_seconds = std::max (0.001, std::strtod (optarg, nullptr));
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc_)
+		s_filter = argv_[optind];
+
+	// scratch tree for resolvePath, which stats the parent directory
+	auto const tmp = std::getenv ("TMPDIR");
+	auto root      = std::string (tmp && *tmp ? tmp : "/tmp") + "/ftpd-micro.XXXXXX";
+	if (!::mkdtemp (root.data ()) || ::mkdir ((root + "/a").c_str (), 0755) != 0 ||
+	    ::mkdir ((root + "/a/b").c_str (), 0755) != 0)
+	{
+		std::fprintf (stderr, "Failed to create scratch directory: %s\n", std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::printf ("%-36s %12s %10s %12s\n", "benchmark", "ns/call", "allocs", "bytes");
+
+	// parseCommand
+	{
+		std::string typical = "RETR /switch/ftpd/ftpd.nro\r\n";
+		run ("parseCommand/typical",
+		    [&] { keep (ftp::parseCommand (typical.data (), typical.size ())); });
+
+		std::string pipelined;
+		for (unsigned i = 0; i < 64; ++i)
+			pipelined += "NOOP\r\n";
+		run ("parseCommand/pipelined64", [&] {
+			auto p   = pipelined.data ();
+			auto end = p + pipelined.size ();
+			while (p < end)
+			{
+				auto const [delim, next] = ftp::parseCommand (p, end - p);
+				keep (delim);
+				p = next;
+			}
+		});
+
+		std::string partial (4096, 'A');
+		run ("parseCommand/undelimited4k",
+		    [&] { keep (ftp::parseCommand (partial.data (), partial.size ())); });
+
+		std::string bareCr (4096, '\r');
+		run ("parseCommand/bareCr4k",
+		    [&] { keep (ftp::parseCommand (bareCr.data (), bareCr.size ())); });
+	}
+
+	// decodePath (decoding is idempotent after the first pass, but the scan cost is the same)
+	{
+		std::string typical = "/switch/ftpd/some file name.txt";
+		run ("decodePath/typical", [&] {
+			ftp::decodePath (typical.data (), typical.size ());
+			keep (typical);
+		});
+
+		std::string encoded (4096, '\0');
+		for (std::size_t i = 0; i < encoded.size (); i += 2)
+			encoded[i] = 'x';
+		run ("decodePath/manyEscapes4k", [&] {
+			ftp::decodePath (encoded.data (), encoded.size ());
+			keep (encoded);
+		});
+	}
+
+	// encodePath
+	{
+		std::string_view const shortName = "a.txt";
+		run ("encodePath/short", [&] { keep (ftp::encodePath (shortName)); });
+
+		std::string const typical = "/switch/ftpd/some file name.txt";
+		run ("encodePath/typical", [&] { keep (ftp::encodePath (typical)); });
+		run ("encodePath/typicalQuotes", [&] { keep (ftp::encodePath (typical, true)); });
+
+		std::string newlines (255, 'n');
+		for (std::size_t i = 0; i < newlines.size (); i += 4)
+			newlines[i] = '\n';
+		run ("encodePath/newlines255", [&] { keep (ftp::encodePath (newlines)); });
+
+		std::string quotes (255, 'q');
+		for (std::size_t i = 0; i < quotes.size (); i += 4)
+			quotes[i] = '"';
+		run ("encodePath/quotes255", [&] { keep (ftp::encodePath (quotes, true)); });
+	}
+
+	// buildPath
+	{
+		run ("buildPath/relative", [&] { keep (ftp::buildPath ("/switch/ftpd", "ftpd.nro")); });
+		run ("buildPath/absolute",
+		    [&] { keep (ftp::buildPath ("/switch/ftpd", "/3ds/ftpd.3dsx")); });
+
+		std::string slashes;
+		for (unsigned i = 0; i < 200; ++i)
+			slashes += "/a//";
+		run ("buildPath/slashes800", [&] { keep (ftp::buildPath ("/", slashes)); });
+
+		std::string const longName (255, 'x');
+		run ("buildPath/longName", [&] { keep (ftp::buildPath ("/switch/ftpd", longName)); });
+	}
+
+	// resolvePath
+	{
+		auto const typical = root + "/a/b/file.txt";
+		run ("resolvePath/typical", [&] { keep (ftp::resolvePath (typical)); });
+
+		auto dots = root;
+		for (unsigned i = 0; i < 100; ++i)
+			dots += "/./a/b/../..";
+		dots += "/file.txt";
+		run ("resolvePath/dots100", [&] { keep (ftp::resolvePath (dots)); });
+
+		auto dotdot = root;
+		for (unsigned i = 0; i < 100; ++i)
+			dotdot += "/a/..";
+		dotdot += "/../../../../../../file.txt";
+		run ("resolvePath/dotdot100", [&] { keep (ftp::resolvePath (dotdot)); });
+
+		run ("buildResolvedPath/relative",
+		    [&] { keep (ftp::buildResolvedPath (root, "a/b/file.txt")); });
+	}
+
+	// fillDirent
+	{
+		struct stat st;
+		if (::stat (root.c_str (), &st) != 0)
+		{
+			std::fprintf (stderr, "stat %s: %s\n", root.c_str (), std::strerror (errno));
+			return EXIT_FAILURE;
+		}
+
+		IOBuffer buffer (65536);
+		auto const now = std::time (nullptr);
+
+		auto const facts = ftp::MlstFacts{
+		    .type     = true,
+		    .size     = true,
+		    .modify   = true,
+		    .perm     = true,
+		    .unixMode = true,
+		};
+
+		auto const dirent = [&] (char const *const name_,
+		                        ftp::ListMode const mode_,
+		                        std::string_view const path_) {
+			run (name_, [&] {
+				buffer.clear ();
+				keep (ftp::fillDirent (buffer, mode_, facts, now, st, path_));
+			});
+		};
+
+		std::string_view const typical = "some file name.txt";
+		std::string const longName (255, 'x');
+
+		dirent ("fillDirent/LIST", ftp::ListMode::LIST, typical);
+		dirent ("fillDirent/LIST/longName", ftp::ListMode::LIST, longName);
+		dirent ("fillDirent/MLSD", ftp::ListMode::MLSD, typical);
+		dirent ("fillDirent/MLST", ftp::ListMode::MLST, typical);
+		dirent ("fillDirent/NLST", ftp::ListMode::NLST, typical);
+		dirent ("fillDirent/STAT", ftp::ListMode::STAT, typical);
+
+		// entries appended until the buffer is full, as a listing does
+		run ("fillDirent/LIST/fill64k", [&] {
+			buffer.clear ();
+			while (ftp::fillDirent (buffer, ftp::ListMode::LIST, facts, now, st, typical) == 0)
+				;
+			keep (buffer);
+		});
+	}
+
+	// IOBuffer
+	{
+		IOBuffer buffer (65536);
+		std::vector<char> segment (1448, 'x');
+
+		run ("IOBuffer/produceConsume1448", [&] {
+			std::memcpy (buffer.freeArea (), segment.data (), segment.size ());
+			buffer.markUsed (segment.size ());
+			keep (*buffer.usedArea ());
+			buffer.markFree (buffer.usedSize ());
+		});
+
+		run ("IOBuffer/coalesceHalf", [&] {
+			buffer.clear ();
+			buffer.markUsed (buffer.capacity () / 2);
+			buffer.markFree (buffer.capacity () / 4);
+			buffer.coalesce ();
+			keep (buffer);
+		});
+
+		run ("IOBuffer/construct64k", [&] {
+			IOBuffer temp (65536);
+			keep (temp);
+		});
+	}
+
+	// LatencyHistogram
+	{
+		LatencyHistogram histogram;
+		std::uint64_t value = 0x9E3779B97F4A7C15ull;
+
+		run ("LatencyHistogram/record", [&] {
+			value = value * 6364136223846793005ull + 1442695040888963407ull;
+			histogram.record (value >> 36);
+		});
+
+		run ("LatencyHistogram/percentile", [&] { keep (histogram.percentile (99.0)); });
+	}
+
+	// log
+	{
+		auto const reply = std::string_view ("226 OK\r\n");
+		unsigned count   = 0;
+
+		run ("log/response", [&] { addLog (RESPONSE, reply); });
+		run ("log/info", [&] { info ("Transferred %u bytes\n", ++count); });
+	}
+
+	// clean up scratch tree
+	::rmdir ((root + "/a/b").c_str ());
+	::rmdir ((root + "/a").c_str ());
+	::rmdir (root.c_str ());
+
+	if (output)
+	{
+		auto const fp = std::fopen (output, "w");
+		if (!fp)
+		{
+			std::fprintf (stderr, "Failed to open %s: %s\n", output, std::strerror (errno));
+			return EXIT_FAILURE;
+		}
+
+		std::fprintf (fp, "{\n  \"server\": \"%s\",\n  \"benchmarks\": [", STATUS_STRING);
+		for (auto const &result : s_results)
+			std::fprintf (fp,
+			    "%s\n    {\"name\": \"%s\", \"ns\": %.2f, \"allocations\": %.3f, \"bytes\": %.1f}",
+			    &result == &s_results.front () ? "" : ",",
+			    result.name.c_str (),
+			    result.ns,
+			    result.allocations,
+			    result.bytes);
+		std::fprintf (fp, "\n  ]\n}\n");
+		std::fclose (fp);
+	}
+}
@@ -0,0 +1,832 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Connection-scaling soak benchmark
+//
+// Ramps up thousands of authenticated, mostly-idle control connections against the in-process
+// server. Each connection sends a NOOP every interval. At every step the benchmark records NOOP
+// latency, accept latency, server loop iteration time and RSS per connection, then writes a JSON
+// report and an SVG plot so scaling cliffs are visible.
+
+#include "harness.h"
+
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+/// \brief Soak options
+struct Options
+{
+	/// \brief Maximum connections
+	unsigned max = 4000;
+
+	/// \brief Connections added per step
+	unsigned step = 250;
+
+	/// \brief Seconds between NOOPs on each connection
+	double interval = 1.0;
+
+	/// \brief Seconds to measure at each step
+	double hold = 3.0;
+
+	/// \brief Whether to render headless UI frames
+	bool draw = true;
+};
+
+/// \brief Measurements at one step
+struct Step
+{
+	/// \brief Open connections
+	unsigned connections;
+
+	/// \brief NOOP latencies (ms)
+	double noopP50, noopP99, noopMax;
+
+	/// \brief NOOPs completed per second
+	double noopRate;
+
+	/// \brief NOOP failures
+	std::uint64_t errors;
+
+	/// \brief Connect-to-greeting latencies (ms)
+	double acceptP50, acceptP99;
+
+	/// \brief Connections accepted per second while ramping
+	double acceptRate;
+
+	/// \brief Server loop iteration time (ms)
+	double loopMean, loopMax;
+
+	/// \brief Server loop iterations per second
+	double loopRate;
+
+	/// \brief Resident set size (bytes)
+	std::uint64_t rss;
+
+	/// \brief RSS growth per connection (bytes)
+	double rssPerConnection;
+
+	/// \brief Process CPU utilization while measuring
+	double cpu;
+};
+
+/// \brief Drives periodic NOOPs on idle connections
+class Driver
+{
+public:
+	~Driver ()
+	{
+		stop ();
+	}
+
+	/// \brief Constructor
+	/// \param interval_ Seconds between NOOPs on each connection
+	explicit Driver (double const interval_) : m_interval (interval_)
+	{
+	}
+
+	/// \brief Start driver thread
+	bool start ()
+	{
+		m_epoll = ::epoll_create1 (EPOLL_CLOEXEC);
+		if (m_epoll < 0)
+			return false;
+
+		m_thread = std::thread (&Driver::run, this);
+		return true;
+	}
+
+	/// \brief Stop driver thread and close connections
+	void stop ()
+	{
+		if (m_thread.joinable ())
+		{
+			m_quit = true;
+			m_thread.join ();
+		}
+
+		for (auto const &[fd, connection] : m_connections)
+			::close (fd);
+		m_connections.clear ();
+
+		if (m_epoll >= 0)
+			::close (m_epoll);
+		m_epoll = -1;
+	}
+
+	/// \brief Hand an authenticated control socket to the driver
+	/// \param fd_ Control socket
+	void add (int const fd_)
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		m_pending.emplace_back (fd_);
+	}
+
+	/// \brief Take NOOP latencies recorded since the previous call
+	/// \param[out] errors_ Failures since the previous call
+	std::vector<double> take (std::uint64_t &errors_)
+	{
+		auto const lock = std::scoped_lock (m_lock);
+		errors_         = std::exchange (m_errors, 0);
+		return std::exchange (m_latency, {});
+	}
+
+private:
+	/// \brief Connection state
+	struct Connection
+	{
+		/// \brief When the outstanding NOOP was sent (0 if none)
+		double sent = 0.0;
+
+		/// \brief Pending input
+		std::string input;
+	};
+
+	/// \brief Scheduled NOOP
+	struct Timer
+	{
+		/// \brief Deadline
+		double when;
+
+		/// \brief Control socket
+		int fd;
+
+		bool operator> (Timer const &that_) const
+		{
+			return when > that_.when;
+		}
+	};
+
+	/// \brief Thread entry point
+	void run ()
+	{
+		std::mt19937 rng (0x5eed);
+		std::uniform_real_distribution<double> jitter (0.0, m_interval);
+
+		std::vector<epoll_event> events (1024);
+		std::vector<double> latency;
+		std::uint64_t errors = 0;
+
+		auto const fail = [&] (int const fd_) {
+			::epoll_ctl (m_epoll, EPOLL_CTL_DEL, fd_, nullptr);
+			::close (fd_);
+			m_connections.erase (fd_);
+			++errors;
+		};
+
+		while (!m_quit)
+		{
+			// adopt new connections, spreading their NOOPs across the interval
+			{
+				std::vector<int> pending;
+				{
+					auto const lock = std::scoped_lock (m_lock);
+					pending.swap (m_pending);
+				}
+
+				auto const now = bench::now ();
+				for (auto const fd : pending)
+				{
+					epoll_event event{};
+					event.events  = EPOLLIN;
+					event.data.fd = fd;
+					if (::epoll_ctl (m_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+					{
+						::close (fd);
+						++errors;
+						continue;
+					}
+
+					m_connections[fd];
+					m_timers.push ({now + jitter (rng), fd});
+				}
+			}
+
+			auto timeout = 5;
+			if (!m_timers.empty ())
+			{
+				auto const wait = (m_timers.top ().when - bench::now ()) * 1e3;
+				timeout         = std::clamp (static_cast<int> (wait), 0, 5);
+			}
+
+			auto const rc = ::epoll_wait (m_epoll, events.data (), events.size (), timeout);
+			if (rc < 0 && errno != EINTR)
+			{
+				std::fprintf (stderr, "epoll_wait: %s\n", std::strerror (errno));
+				break;
+			}
+
+			auto const now = bench::now ();
+			for (int i = 0; i < rc; ++i)
+			{
+				auto const fd = events[i].data.fd;
+				auto const it = m_connections.find (fd);
+				if (it == std::end (m_connections))
+					continue;
+
+				auto &connection = it->second;
+
+				char buffer[1024];
+				auto const bytes = ::recv (fd, buffer, sizeof (buffer), MSG_DONTWAIT);
+				if (bytes <= 0)
+				{
+					if (bytes < 0 && (errno == EAGAIN || errno == EINTR))
+						continue;
+
+					fail (fd);
+					continue;
+				}
+
+				connection.input.append (buffer, bytes);
+
+				std::size_t pos;
+				while ((pos = connection.input.find ("\r\n")) != std::string::npos)
+				{
+					auto const ok = connection.input.compare (0, 4, "200 ") == 0;
+					connection.input.erase (0, pos + 2);
+
+					if (!ok || connection.sent == 0.0)
+					{
+						++errors;
+						continue;
+					}
+
+					latency.emplace_back (now - connection.sent);
+					connection.sent = 0.0;
+					m_timers.push ({now + m_interval, fd});
+				}
+			}
+
+			// send due NOOPs
+			while (!m_timers.empty () && m_timers.top ().when <= now)
+			{
+				auto const fd = m_timers.top ().fd;
+				m_timers.pop ();
+
+				auto const it = m_connections.find (fd);
+				if (it == std::end (m_connections))
+					continue;
+
+				static char const noop[] = "NOOP\r\n";
+				if (::send (fd, noop, sizeof (noop) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+				    sizeof (noop) - 1)
+				{
+					fail (fd);
+					continue;
+				}
+
+				it->second.sent = now;
+			}
+
+			if (!latency.empty () || errors)
+			{
+				auto const lock = std::scoped_lock (m_lock);
+				m_latency.insert (std::end (m_latency), std::begin (latency), std::end (latency));
+				m_errors += errors;
+
+				latency.clear ();
+				errors = 0;
+			}
+		}
+	}
+
+	/// \brief Seconds between NOOPs on each connection
+	double const m_interval;
+
+	/// \brief epoll instance
+	int m_epoll = -1;
+
+	/// \brief Driver thread
+	std::thread m_thread;
+
+	/// \brief Whether driver thread should quit
+	std::atomic_bool m_quit = false;
+
+	/// \brief Connections (driver thread only)
+	std::unordered_map<int, Connection> m_connections;
+
+	/// \brief NOOP schedule (driver thread only)
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<>> m_timers;
+
+	/// \brief Lock for the members below
+	std::mutex m_lock;
+
+	/// \brief Connections waiting to be adopted
+	std::vector<int> m_pending;
+
+	/// \brief Recorded NOOP latencies (seconds)
+	std::vector<double> m_latency;
+
+	/// \brief Recorded failures
+	std::uint64_t m_errors = 0;
+};
+
+/// \brief Plot series
+struct Series
+{
+	/// \brief Legend name
+	char const *name;
+
+	/// \brief Stroke color
+	char const *color;
+
+	/// \brief Values, one per step
+	std::vector<double> values;
+};
+
+/// \brief Draw a line chart
+/// \param fp_ Output file
+/// \param x_ Chart left
+/// \param y_ Chart top
+/// \param title_ Chart title
+/// \param steps_ Steps providing the x axis
+/// \param series_ Series to plot
+void plot (std::FILE *const fp_,
+    double const x_,
+    double const y_,
+    char const *const title_,
+    std::vector<Step> const &steps_,
+    std::vector<Series> const &series_)
+{
+	constexpr double WIDTH  = 520.0;
+	constexpr double HEIGHT = 300.0;
+	constexpr double LEFT   = 70.0;
+	constexpr double RIGHT  = 20.0;
+	constexpr double TOP    = 40.0;
+	constexpr double BOTTOM = 45.0;
+
+	auto const plotWidth  = WIDTH - LEFT - RIGHT;
+	auto const plotHeight = HEIGHT - TOP - BOTTOM;
+
+	double xMax = 1.0;
+	double yMax = 0.0;
+	for (auto const &step : steps_)
+		xMax = std::max (xMax, static_cast<double> (step.connections));
+	for (auto const &series : series_)
+		for (auto const value : series.values)
+			yMax = std::max (yMax, value);
+	if (yMax <= 0.0)
+		yMax = 1.0;
+	yMax *= 1.1;
+
+	auto const px = [&] (double const v_) { return x_ + LEFT + v_ / xMax * plotWidth; };
+	auto const py = [&] (double const v_) {
+		return y_ + TOP + plotHeight - v_ / yMax * plotHeight;
+	};
+
+	std::fprintf (fp_,
+	    "<text x=\"%.1f\" y=\"%.1f\" font-size=\"15\" font-weight=\"bold\">%s</text>\n",
+	    x_ + LEFT,
+	    y_ + 22.0,
+	    title_);
+
+	// grid and axis labels
+	for (int i = 0; i <= 4; ++i)
+	{
+		auto const yv = yMax * i / 4.0;
+		auto const xv = xMax * i / 4.0;
+
+		std::fprintf (fp_,
+		    "<line x1=\"%.1f\" y1=\"%.1f\" x2=\"%.1f\" y2=\"%.1f\" stroke=\"#ddd\"/>\n"
+		    "<text x=\"%.1f\" y=\"%.1f\" font-size=\"11\" text-anchor=\"end\">%.3g</text>\n"
+		    "<text x=\"%.1f\" y=\"%.1f\" font-size=\"11\" text-anchor=\"middle\">%.0f</text>\n",
+		    px (0.0),
+		    py (yv),
+		    px (xMax),
+		    py (yv),
+		    px (0.0) - 6.0,
+		    py (yv) + 4.0,
+		    yv,
+		    px (xv),
+		    py (0.0) + 16.0,
+		    xv);
+	}
+
+	std::fprintf (fp_,
+	    "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%.1f\" fill=\"none\" "
+	    "stroke=\"#333\"/>\n"
+	    "<text x=\"%.1f\" y=\"%.1f\" font-size=\"12\" text-anchor=\"middle\">connections</text>\n",
+	    px (0.0),
+	    py (yMax),
+	    plotWidth,
+	    plotHeight,
+	    px (xMax / 2.0),
+	    py (0.0) + 34.0);
+
+	for (std::size_t s = 0; s < series_.size (); ++s)
+	{
+		auto const &series = series_[s];
+
+		std::fprintf (fp_,
+		    "<polyline fill=\"none\" stroke=\"%s\" stroke-width=\"2\" points=\"",
+		    series.color);
+		for (std::size_t i = 0; i < steps_.size (); ++i)
+			std::fprintf (fp_, "%.1f,%.1f ", px (steps_[i].connections), py (series.values[i]));
+		std::fprintf (fp_, "\"/>\n");
+
+		for (std::size_t i = 0; i < steps_.size (); ++i)
+			std::fprintf (fp_,
+			    "<circle cx=\"%.1f\" cy=\"%.1f\" r=\"3\" fill=\"%s\"/>\n",
+			    px (steps_[i].connections),
+			    py (series.values[i]),
+			    series.color);
+
+		std::fprintf (fp_,
+		    "<text x=\"%.1f\" y=\"%.1f\" font-size=\"12\" fill=\"%s\">%s</text>\n",
+		    x_ + LEFT + 10.0 + 150.0 * s,
+		    y_ + TOP + 14.0,
+		    series.color,
+		    series.name);
+	}
+}
+
+/// \brief Extract one value per step
+/// \param steps_ Steps
+/// \param member_ Member to extract
+template <typename T>
+std::vector<double> column (std::vector<Step> const &steps_, T Step::*member_)
+{
+	std::vector<double> values;
+	for (auto const &step : steps_)
+		values.emplace_back (static_cast<double> (step.*member_));
+	return values;
+}
+
+/// \brief Write JSON report
+/// \param path_ Output path
+/// \param options_ Soak options
+/// \param steps_ Steps
+bool writeJson (std::string const &path_, Options const &options_, std::vector<Step> const &steps_)
+{
+	auto const fp = std::fopen (path_.c_str (), "w");
+	if (!fp)
+		return false;
+
+	std::fprintf (fp,
+	    "{\n"
+	    "  \"server\": \"%s\",\n"
+	    "  \"interval\": %.3f,\n"
+	    "  \"hold\": %.3f,\n"
+	    "  \"steps\": [",
+	    STATUS_STRING,
+	    options_.interval,
+	    options_.hold);
+
+	for (auto const &step : steps_)
+	{
+		std::fprintf (fp,
+		    "%s\n"
+		    "    {\n"
+		    "      \"connections\": %u,\n"
+		    "      \"noop_p50_ms\": %.3f,\n"
+		    "      \"noop_p99_ms\": %.3f,\n"
+		    "      \"noop_max_ms\": %.3f,\n"
+		    "      \"noop_per_s\": %.2f,\n"
+		    "      \"errors\": %" PRIu64 ",\n"
+		    "      \"accept_p50_ms\": %.3f,\n"
+		    "      \"accept_p99_ms\": %.3f,\n"
+		    "      \"accept_per_s\": %.2f,\n"
+		    "      \"loop_mean_ms\": %.3f,\n"
+		    "      \"loop_max_ms\": %.3f,\n"
+		    "      \"loop_per_s\": %.2f,\n"
+		    "      \"rss\": %" PRIu64 ",\n"
+		    "      \"rss_per_connection\": %.0f,\n"
+		    "      \"cpu\": %.3f\n"
+		    "    }",
+		    &step == &steps_.front () ? "" : ",",
+		    step.connections,
+		    step.noopP50,
+		    step.noopP99,
+		    step.noopMax,
+		    step.noopRate,
+		    step.errors,
+		    step.acceptP50,
+		    step.acceptP99,
+		    step.acceptRate,
+		    step.loopMean,
+		    step.loopMax,
+		    step.loopRate,
+		    step.rss,
+		    step.rssPerConnection,
+		    step.cpu);
+	}
+
+	std::fprintf (fp, "\n  ]\n}\n");
+	return std::fclose (fp) == 0;
+}
+
+/// \brief Write SVG report
+/// \param path_ Output path
+/// \param steps_ Steps
+bool writeSvg (std::string const &path_, std::vector<Step> const &steps_)
+{
+	auto const fp = std::fopen (path_.c_str (), "w");
+	if (!fp)
+		return false;
+
+	std::fprintf (fp,
+	    "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"1040\" height=\"640\" "
+	    "font-family=\"sans-serif\">\n"
+	    "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n");
+
+	plot (fp,
+	    0.0,
+	    0.0,
+	    "NOOP latency (ms)",
+	    steps_,
+	    {
+	        {"p50", "#1f77b4", column (steps_, &Step::noopP50)},
+	        {"p99", "#d62728", column (steps_, &Step::noopP99)},
+	    });
+
+	plot (fp,
+	    520.0,
+	    0.0,
+	    "Server loop iteration (ms)",
+	    steps_,
+	    {
+	        {"mean", "#1f77b4", column (steps_, &Step::loopMean)},
+	        {"max", "#d62728", column (steps_, &Step::loopMax)},
+	    });
+
+	std::vector<double> rssKiB;
+	for (auto const &step : steps_)
+		rssKiB.emplace_back (step.rssPerConnection / 1024.0);
+
+	plot (fp,
+	    0.0,
+	    320.0,
+	    "RSS per connection (KiB)",
+	    steps_,
+	    {
+	        {"rss", "#2ca02c", rssKiB},
+	    });
+
+	plot (fp,
+	    520.0,
+	    320.0,
+	    "Accept latency (ms)",
+	    steps_,
+	    {
+	        {"p50", "#1f77b4", column (steps_, &Step::acceptP50)},
+	        {"p99", "#d62728", column (steps_, &Step::acceptP99)},
+	    });
+
+	std::fprintf (fp, "</svg>\n");
+	return std::fclose (fp) == 0;
+}
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options]\n"
+	    "  -m, --max N          maximum connections (default 4000)\n"
+	    "  -s, --step N         connections added per step (default 250)\n"
+	    "  -i, --interval SEC   seconds between NOOPs per connection (default 1)\n"
+	    "  -H, --hold SEC       seconds measured per step (default 3)\n"
+	    "  -o, --output PREFIX  write PREFIX.json and PREFIX.svg (default ftpd-soak)\n"
+	    "  -n, --no-draw        don't render headless UI frames\n",
+	    prog_);
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Options options;
+	std::string output = "ftpd-soak";
+
+	static option const longOptions[] = {
+	    {"max", required_argument, nullptr, 'm'},
+	    {"step", required_argument, nullptr, 's'},
+	    {"interval", required_argument, nullptr, 'i'},
+	    {"hold", required_argument, nullptr, 'H'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"no-draw", no_argument, nullptr, 'n'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "m:s:i:H:o:nh", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'm':
+			options.max = std::strtoul (optarg, nullptr, 0);
+			break;
+
+		case 's':
+			options.step = std::max (1ul, std::strtoul (optarg, nullptr, 0));
+			break;
+
+		case 'i':
+			options.interval = std::max (0.001, std::strtod (optarg, nullptr));
+			break;
+
+		case 'H':
+			options.hold = std::strtod (optarg, nullptr);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		case 'n':
+			options.draw = false;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// client and server ends both live in this process
+	rlimit limit;
+	if (::getrlimit (RLIMIT_NOFILE, &limit) == 0)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit (RLIMIT_NOFILE, &limit);
+
+		auto const usable = (limit.rlim_cur > 256 ? limit.rlim_cur - 256 : 0) / 2;
+		if (options.max > usable)
+		{
+			std::fprintf (stderr,
+			    "Limiting to %lu connections (RLIMIT_NOFILE %lu)\n",
+			    static_cast<unsigned long> (usable),
+			    static_cast<unsigned long> (limit.rlim_cur));
+			options.max = usable;
+		}
+	}
+
+	// write the output into the current directory, not the server's scratch directory
+	if (output.front () != '/')
+	{
+		char cwd[4096];
+		if (::getcwd (cwd, sizeof (cwd)))
+			output = std::string (cwd) + '/' + output;
+	}
+
+	bench::Server server;
+	if (!server.start (options.draw, "bench", "bench"))
+		return EXIT_FAILURE;
+
+	Driver driver (options.interval);
+	if (!driver.start ())
+	{
+		std::fprintf (stderr, "epoll_create1: %s\n", std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::this_thread::sleep_for (500ms);
+	auto const rssBase = bench::rss ();
+
+	std::vector<Step> steps;
+	unsigned connections = 0;
+	bool failed          = false;
+
+	while (!failed && connections < options.max)
+	{
+		auto const target = std::min (connections + options.step, options.max);
+
+		std::vector<double> accept;
+		auto const rampStart = bench::now ();
+		while (connections < target)
+		{
+			bench::Client client;
+
+			auto const start = bench::now ();
+			if (!client.connect (server.port ()))
+			{
+				std::fprintf (
+				    stderr, "connect #%u failed: %s\n", connections, std::strerror (errno));
+				failed = true;
+				break;
+			}
+			accept.emplace_back (bench::now () - start);
+
+			if (client.command ("USER bench") != 331 || client.command ("PASS bench") != 230)
+			{
+				std::fprintf (
+				    stderr, "login #%u failed: %s\n", connections, client.reply ().c_str ());
+				failed = true;
+				break;
+			}
+
+			driver.add (client.release ());
+			++connections;
+		}
+
+		auto const rampTime = bench::now () - rampStart;
+		if (accept.empty ())
+			break;
+
+		// let the new connections settle into their NOOP cadence before measuring
+		std::this_thread::sleep_for (std::chrono::duration<double> (options.interval));
+
+		std::uint64_t errors = 0;
+		driver.take (errors);
+
+		auto const loop0  = server.server ().loopStats ();
+		auto const cpu0   = bench::processCpu ();
+		auto const start  = bench::now ();
+
+		std::this_thread::sleep_for (std::chrono::duration<double> (options.hold));
+
+		auto latency      = driver.take (errors);
+		auto const loop1  = server.server ().loopStats ();
+		auto const cpu    = bench::processCpu () - cpu0;
+		auto const window = bench::now () - start;
+		auto const rss    = bench::rss ();
+
+		auto const iterations = loop1.iterations - loop0.iterations;
+		auto const loopTime   = std::chrono::duration<double> (loop1.total - loop0.total).count ();
+
+		Step step{};
+		step.connections      = connections;
+		step.noopP50          = bench::percentile (latency, 50.0) * 1e3;
+		step.noopP99          = bench::percentile (latency, 99.0) * 1e3;
+		step.noopMax          = bench::percentile (latency, 100.0) * 1e3;
+		step.noopRate         = latency.size () / window;
+		step.errors           = errors;
+		step.acceptP50        = bench::percentile (accept, 50.0) * 1e3;
+		step.acceptP99        = bench::percentile (accept, 99.0) * 1e3;
+		step.acceptRate       = accept.size () / rampTime;
+		step.loopMean         = iterations ? loopTime / iterations * 1e3 : 0.0;
+		step.loopMax          = std::chrono::duration<double> (loop1.max).count () * 1e3;
+		step.loopRate         = iterations / window;
+		step.rss              = rss;
+		step.rssPerConnection = rss > rssBase ? double (rss - rssBase) / connections : 0.0;
+		step.cpu              = cpu / window;
+
+		std::fprintf (stderr,
+		    "%6u conns: noop p50 %.3fms p99 %.3fms, accept %.1f/s, loop %.3fms (max %.3fms), "
+		    "%.1f KiB/conn, %" PRIu64 " errors\n",
+		    step.connections,
+		    step.noopP50,
+		    step.noopP99,
+		    step.acceptRate,
+		    step.loopMean,
+		    step.loopMax,
+		    step.rssPerConnection / 1024.0,
+		    step.errors);
+
+		steps.emplace_back (step);
+	}
+
+	driver.stop ();
+	server.stop ();
+
+	if (!writeJson (output + ".json", options, steps) || !writeSvg (output + ".svg", steps))
+	{
+		std::fprintf (
+		    stderr, "Failed to write report %s: %s\n", output.c_str (), std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::fprintf (stderr, "Wrote %s.json and %s.svg\n", output.c_str (), output.c_str ());
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,570 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// ftpd implements FTPS based on:
+// - RFC 4217 (https://tools.ietf.org/html/rfc4217)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// FTPS throughput benchmark
+//
+// Runs the in-process server with a generated self-signed certificate and retrieves /dev/zero
+// repeatedly in three modes: plaintext, TLS with user-space record encryption, and TLS with kTLS
+// requested. Protected data connections resume the control connection's session, as real clients
+// do. Reports throughput next to the CPU the server burned, plus whether the kernel took over the
+// records, so the cost of encryption (and what kTLS saves) can be read off directly.
+
+#include "harness.h"
+
+#include "ftpConfig.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+/// \brief Benchmark options
+struct Options
+{
+	/// \brief Seconds per mode
+	double duration = 3.0;
+
+	/// \brief Bytes per retrieval
+	std::uint64_t size = 64 * 1024 * 1024;
+};
+
+/// \brief Benchmark mode
+struct Mode
+{
+	/// \brief Mode name
+	char const *name;
+
+	/// \brief Whether the connections are protected
+	bool tls;
+
+	/// \brief Whether to request kTLS
+	bool ktls;
+};
+
+/// \brief Server-wide TLS counters from SITE STATS
+struct Counters
+{
+	/// \brief Completed handshakes
+	std::uint64_t handshakes = 0;
+
+	/// \brief Resumed handshakes
+	std::uint64_t resumed = 0;
+
+	/// \brief Connections whose sends the kernel encrypts
+	std::uint64_t ktlsSend = 0;
+};
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options]\n"
+	    "  -d, --duration SEC   seconds per mode (default 3)\n"
+	    "  -s, --size BYTES     bytes per retrieval (default 64MiB)\n"
+	    "  -o, --output FILE    write JSON report to FILE (default stdout)\n",
+	    prog_);
+}
+
+/// \brief Write a self-signed certificate and its key
+/// \param cert_ Certificate path
+/// \param key_ Key path
+bool writeCertificate (std::string const &cert_, std::string const &key_)
+{
+	auto const key  = EVP_EC_gen ("P-256");
+	auto const x509 = X509_new ();
+
+	auto ok = key && x509;
+	if (ok)
+	{
+		ASN1_INTEGER_set (X509_get_serialNumber (x509), 1);
+		X509_gmtime_adj (X509_getm_notBefore (x509), 0);
+		X509_gmtime_adj (X509_getm_notAfter (x509), 24 * 60 * 60);
+		X509_set_pubkey (x509, key);
+
+		auto const name = X509_get_subject_name (x509);
+		X509_NAME_add_entry_by_txt (
+		    name, "CN", MBSTRING_ASC, reinterpret_cast<unsigned char const *> ("ftpd"), -1, -1, 0);
+		X509_set_issuer_name (x509, name);
+
+		ok = X509_sign (x509, key, EVP_sha256 ()) > 0;
+	}
+
+	if (ok)
+	{
+		auto const fp = std::fopen (cert_.c_str (), "w");
+		ok            = fp && PEM_write_X509 (fp, x509);
+		if (fp)
+			std::fclose (fp);
+	}
+
+	if (ok)
+	{
+		auto const fp = std::fopen (key_.c_str (), "w");
+		ok = fp && PEM_write_PrivateKey (fp, key, nullptr, nullptr, 0, nullptr, nullptr);
+		if (fp)
+			std::fclose (fp);
+	}
+
+	X509_free (x509);
+	EVP_PKEY_free (key);
+	return ok;
+}
+
+/// \brief Blocking FTPS client
+/// \note Only implements what the benchmark needs (AUTH TLS, PROT P, PASV, RETR)
+class TlsClient
+{
+public:
+	~TlsClient ()
+	{
+		SSL_free (m_ssl);
+		if (m_fd >= 0)
+			::close (m_fd);
+	}
+
+	/// \brief Connect, secure the control connection and protect data connections
+	/// \param context_ Client context
+	/// \param port_ Server port
+	bool connect (SSL_CTX *const context_, std::uint16_t const port_)
+	{
+		// the greeting and AUTH are plaintext
+		bench::Client client;
+		if (!client.connect (port_) || client.command ("AUTH TLS") != 234)
+			return false;
+
+		m_fd  = client.release ();
+		m_ssl = SSL_new (context_);
+		if (!m_ssl || !SSL_set_fd (m_ssl, m_fd) || SSL_connect (m_ssl) != 1)
+			return false;
+
+		return command ("PBSZ 0") == 200 && command ("PROT P") == 200;
+	}
+
+	/// \brief Send command and read reply
+	/// \param command_ Command line (without CRLF)
+	/// \returns Reply code, -1 on error
+	int command (std::string_view const command_)
+	{
+		std::string line (command_);
+		line += "\r\n";
+
+		std::size_t written;
+		if (SSL_write_ex (m_ssl, line.data (), line.size (), &written) != 1)
+			return -1;
+
+		return readReply ();
+	}
+
+	/// \brief Last reply
+	std::string const &reply () const
+	{
+		return m_reply;
+	}
+
+	/// \brief Retrieve file over a protected data connection
+	/// \param context_ Client context
+	/// \param path_ Path to retrieve
+	/// \param[out] bytes_ Bytes received
+	/// \param[out] resumed_ Whether the data connection resumed the control session
+	bool retrieve (SSL_CTX *const context_,
+	    std::string_view const path_,
+	    std::uint64_t &bytes_,
+	    bool &resumed_)
+	{
+		auto const fd = openData ();
+		if (fd < 0)
+			return false;
+
+		std::string command = "RETR ";
+		command += path_;
+		if (this->command (command) != 150)
+		{
+			::close (fd);
+			return false;
+		}
+
+		// the session ticket arrived with the control traffic
+		auto const ssl     = SSL_new (context_);
+		auto const session = SSL_get1_session (m_ssl);
+
+		auto ok = ssl && SSL_set_fd (ssl, fd) && (!session || SSL_set_session (ssl, session)) &&
+		          SSL_connect (ssl) == 1;
+		SSL_SESSION_free (session);
+
+		if (ok)
+		{
+			resumed_ = SSL_session_reused (ssl);
+
+			std::vector<char> buffer (256 * 1024);
+			std::size_t read;
+			while (SSL_read_ex (ssl, buffer.data (), buffer.size (), &read) == 1)
+				bytes_ += read;
+
+			ok = SSL_get_error (ssl, 0) == SSL_ERROR_ZERO_RETURN ||
+			     SSL_get_error (ssl, 0) == SSL_ERROR_SYSCALL;
+		}
+
+		ERR_clear_error ();
+		SSL_free (ssl);
+		::close (fd);
+
+		return readReply () == 226 && ok;
+	}
+
+private:
+	/// \brief Open passive data connection
+	/// \returns Data socket, -1 on error
+	int openData ()
+	{
+		if (command ("PASV") != 227)
+			return -1;
+
+		// 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)
+		auto const pos = m_reply.find ('(');
+		unsigned h[4];
+		unsigned p[2];
+		if (pos == std::string::npos ||
+		    std::sscanf (m_reply.c_str () + pos,
+		        "(%u,%u,%u,%u,%u,%u)",
+		        &h[0],
+		        &h[1],
+		        &h[2],
+		        &h[3],
+		        &p[0],
+		        &p[1]) != 6)
+			return -1;
+
+		auto const fd = ::socket (AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+
+		sockaddr_in addr{};
+		addr.sin_family      = AF_INET;
+		addr.sin_port        = htons ((p[0] << 8) | p[1]);
+		addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+		if (::connect (fd, reinterpret_cast<sockaddr const *> (&addr), sizeof (addr)) != 0)
+		{
+			::close (fd);
+			return -1;
+		}
+
+		return fd;
+	}
+
+	/// \brief Read reply
+	/// \returns Reply code, -1 on error
+	int readReply ()
+	{
+		m_reply.clear ();
+
+		std::string line;
+		if (!readLine (line) || line.size () < 3)
+			return -1;
+
+		m_reply = line;
+
+		auto const code = std::atoi (line.substr (0, 3).c_str ());
+		if (line.size () > 3 && line[3] == '-')
+		{
+			// multi-line reply ends with "<code> "
+			auto const last = line.substr (0, 3) + ' ';
+			do
+			{
+				if (!readLine (line))
+					return -1;
+
+				m_reply += '\n';
+				m_reply += line;
+			} while (line.compare (0, 4, last) != 0);
+		}
+
+		return code;
+	}
+
+	/// \brief Read a reply line
+	/// \param[out] line_ Line read (without CRLF)
+	bool readLine (std::string &line_)
+	{
+		while (true)
+		{
+			auto const pos = m_input.find ("\r\n");
+			if (pos != std::string::npos)
+			{
+				line_.assign (m_input, 0, pos);
+				m_input.erase (0, pos + 2);
+				return true;
+			}
+
+			char buffer[4096];
+			std::size_t read;
+			if (SSL_read_ex (m_ssl, buffer, sizeof (buffer), &read) != 1)
+				return false;
+
+			m_input.append (buffer, read);
+		}
+	}
+
+	/// \brief Control connection
+	SSL *m_ssl = nullptr;
+
+	/// \brief Control socket
+	int m_fd = -1;
+
+	/// \brief Pending control input
+	std::string m_input;
+
+	/// \brief Last reply
+	std::string m_reply;
+};
+
+/// \brief Read server-wide TLS counters
+/// \param client_ Client to ask
+/// \param[out] counters_ Counters read
+bool readCounters (TlsClient &client_, Counters &counters_)
+{
+	if (client_.command ("SITE STATS") != 211)
+		return false;
+
+	auto const tls = std::strstr (client_.reply ().c_str (), "\"tls\":{");
+	return tls && std::sscanf (tls,
+	                  "\"tls\":{\"enabled\":true,\"handshakes\":%" SCNu64 ",\"resumed\":%" SCNu64
+	                  ",\"ktls_send\":%" SCNu64,
+	                  &counters_.handshakes,
+	                  &counters_.resumed,
+	                  &counters_.ktlsSend) == 3;
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Options options;
+	char const *output = nullptr;
+
+	static option const longOptions[] = {
+	    {"duration", required_argument, nullptr, 'd'},
+	    {"size", required_argument, nullptr, 's'},
+	    {"output", required_argument, nullptr, 'o'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "d:s:o:h", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'd':
+			options.duration = std::strtod (optarg, nullptr);
+			break;
+
+		case 's':
+			options.size = std::strtoull (optarg, nullptr, 0);
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// no UI thread, so the process CPU is the server's plus the client's
+	bench::Server server;
+	if (!server.start (false))
+		return EXIT_FAILURE;
+
+	auto const cert = server.root () + "/cert.pem";
+	auto const key  = server.root () + "/key.pem";
+	if (!writeCertificate (cert, key))
+	{
+		std::fprintf (stderr, "Failed to generate certificate\n");
+		return EXIT_FAILURE;
+	}
+
+	// the certificate is self-signed, so there is nothing to verify against
+	auto const context = SSL_CTX_new (TLS_client_method ());
+	if (!context)
+		return EXIT_FAILURE;
+	SSL_CTX_set_verify (context, SSL_VERIFY_NONE, nullptr);
+
+	auto const fp = output ? std::fopen (output, "w") : stdout;
+	if (!fp)
+	{
+		std::fprintf (stderr, "Failed to open %s: %s\n", output, std::strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	std::fprintf (fp,
+	    "{\n"
+	    "  \"server\": \"%s\",\n"
+	    "  \"openssl\": \"%s\",\n"
+	    "  \"cpus\": %u,\n"
+	    "  \"duration\": %.3f,\n"
+	    "  \"size\": %" PRIu64 ",\n"
+	    "  \"modes\": [",
+	    STATUS_STRING,
+	    OpenSSL_version (OPENSSL_VERSION),
+	    std::thread::hardware_concurrency (),
+	    options.duration,
+	    options.size);
+
+	static Mode const modes[] = {
+	    {"plain", false, false},
+	    {"tls", true, false},
+	    {"ktls", true, true},
+	};
+
+	auto const path = "/dev/zero/" + std::to_string (options.size);
+
+	std::uint64_t totalErrors = 0;
+	for (auto const &mode : modes)
+	{
+		server.server ().updateConfig ([&] (FtpConfig &config_) {
+			config_.setTlsCert (cert);
+			config_.setTlsKey (key);
+			config_.setKtls (mode.ktls);
+			return true;
+		});
+
+		bench::Client client;
+		TlsClient tlsClient;
+		auto const port      = server.port ();
+		auto const connected = mode.tls ? tlsClient.connect (context, port) : client.connect (port);
+		if (!connected)
+		{
+			std::fprintf (stderr, "Failed to connect (%s)\n", mode.name);
+			return EXIT_FAILURE;
+		}
+
+		Counters before;
+		if (mode.tls && !readCounters (tlsClient, before))
+		{
+			std::fprintf (stderr, "Failed to read TLS statistics\n");
+			return EXIT_FAILURE;
+		}
+
+		std::uint64_t bytes   = 0;
+		std::uint64_t xfers   = 0;
+		std::uint64_t resumed = 0;
+		std::uint64_t errors  = 0;
+
+		auto const cpuStart    = bench::processCpu ();
+		auto const clientStart = bench::threadCpu ();
+		auto const start       = bench::now ();
+		auto const deadline    = start + options.duration;
+
+		while (bench::now () < deadline)
+		{
+			std::uint64_t received = 0;
+			bool reused            = false;
+			auto const ok          = mode.tls ?
+			                             tlsClient.retrieve (context, path, received, reused) :
+			                             client.retrieve (path, received);
+
+			if (!ok || received != options.size)
+			{
+				++errors;
+				break;
+			}
+
+			bytes += received;
+			++xfers;
+			resumed += reused;
+		}
+
+		auto const elapsed   = bench::now () - start;
+		auto const clientCpu = bench::threadCpu () - clientStart;
+		auto const serverCpu = bench::processCpu () - cpuStart - clientCpu;
+
+		Counters after = before;
+		if (mode.tls && !readCounters (tlsClient, after))
+			++errors;
+
+		if (mode.tls)
+			tlsClient.command ("QUIT");
+		else
+			client.command ("QUIT");
+
+		totalErrors += errors;
+
+		std::fprintf (fp,
+		    "%s\n"
+		    "    {\n"
+		    "      \"mode\": \"%s\",\n"
+		    "      \"transfers\": %" PRIu64 ",\n"
+		    "      \"errors\": %" PRIu64 ",\n"
+		    "      \"resumed\": %" PRIu64 ",\n"
+		    "      \"ktls_send\": %s,\n"
+		    "      \"mb_per_s\": %.2f,\n"
+		    "      \"server_cpu_s\": %.3f,\n"
+		    "      \"server_cpu_pct\": %.1f,\n"
+		    "      \"server_cpu_ns_per_byte\": %.3f\n"
+		    "    }",
+		    &mode == std::begin (modes) ? "" : ",",
+		    mode.name,
+		    xfers,
+		    errors,
+		    resumed,
+		    after.ktlsSend > before.ktlsSend ? "true" : "false",
+		    bytes / elapsed / 1e6,
+		    serverCpu,
+		    serverCpu / elapsed * 100.0,
+		    bytes ? serverCpu / bytes * 1e9 : 0.0);
+		std::fflush (fp);
+	}
+
+	std::fprintf (fp, "\n  ]\n}\n");
+
+	if (output)
+		std::fclose (fp);
+
+	SSL_CTX_free (context);
+	server.stop ();
+
+	return totalErrors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
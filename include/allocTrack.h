@@ -0,0 +1,105 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#ifndef FTPD_ALLOC_TRACKING
+#define FTPD_ALLOC_TRACKING 0
+#endif
+
+#if FTPD_ALLOC_TRACKING
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// \brief Heap allocation tracking
+/// Replaces the global allocator with one that counts allocations against the calling thread's
+/// current tag, e.g. the command being handled or the transfer step being run. Without
+/// FTPD_ALLOC_TRACKING the tag macros compile to nothing.
+namespace alloc
+{
+/// \brief Maximum number of distinct tags
+constexpr std::size_t MAX_TAGS = 256;
+
+/// \brief Name of the tag for allocations outside any scope
+constexpr char const *UNTAGGED = "untagged";
+
+/// \brief Allocation counts
+struct Counts
+{
+	/// \brief Number of times the tag's scope was entered
+	std::uint64_t operations;
+	/// \brief Number of allocations
+	std::uint64_t allocations;
+	/// \brief Bytes allocated
+	std::uint64_t bytes;
+};
+
+/// \brief Tagged scope
+/// \note Scopes nest; allocations are counted against the innermost one
+class Scope
+{
+public:
+	~Scope ();
+
+	/// \brief Parameterized constructor
+	/// \param tag_ Tag name; must outlive the process
+	Scope (char const *tag_);
+
+	Scope (Scope const &that_) = delete;
+
+	Scope &operator= (Scope const &that_) = delete;
+
+private:
+	/// \brief Enclosing scope's tag
+	void *const m_previous;
+};
+
+/// \brief Get counts of a tag
+/// \param tag_ Tag name
+/// \note Tags with the same name are summed
+Counts counts (char const *tag_);
+
+/// \brief Get counts of all tags
+Counts total ();
+
+/// \brief Reset all counts
+void reset ();
+
+/// \brief Append one JSON object per tag, ordered by allocations
+/// \param out_ Output string
+/// \param limit_ Maximum size to append
+/// \returns Number of tags that didn't fit
+unsigned report (std::string &out_, std::size_t limit_);
+}
+
+#define ALLOC_CONCAT_(a_, b_) a_##b_
+#define ALLOC_CONCAT(a_, b_) ALLOC_CONCAT_ (a_, b_)
+
+/// \brief Count allocations in the enclosing scope against a tag
+#define ALLOC_SCOPE(tag_) alloc::Scope ALLOC_CONCAT (allocScope, __LINE__) (tag_)
+#else
+#define ALLOC_SCOPE(tag_)                                                                          \
+	do                                                                                             \
+	{                                                                                              \
+	} while (0)
+#endif
@@ -0,0 +1,85 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ftpFeatures.h"
+#include "sha256.h"
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+
+#if FTPD_HAS_DEDUP
+/// \brief Content-addressed upload deduplication
+/// The index maps a SHA-256 digest to a file holding that content. Entries are validated against
+/// the file's device, inode, size and mtime before use, so stale entries are simply ignored.
+namespace dedup
+{
+/// \brief Index lookup statistics
+struct Stats
+{
+	/// \brief Lookups which found live content
+	std::uint64_t hits;
+
+	/// \brief Lookups which found nothing or a stale entry
+	std::uint64_t misses;
+};
+
+/// \brief Get index lookup statistics
+Stats stats ();
+
+/// \brief Set index path
+/// \param path_ Path to persistent index
+void setIndexPath (std::string path_);
+
+/// \brief Look up a live file with the given content
+/// \param digest_ Content digest
+/// \returns Path of existing file, or nullopt if none
+std::optional<std::string> find (Sha256::Digest const &digest_);
+
+/// \brief Look up the digest of a file
+/// \param st_ File status
+/// \returns Digest if the file is indexed and unmodified
+std::optional<Sha256::Digest> digest (struct stat const &st_);
+
+/// \brief Add a file to the index
+/// \param digest_ Content digest
+/// \param path_ File path
+/// \param st_ File status
+/// \note Paths with line breaks are not indexed
+void insert (Sha256::Digest const &digest_, std::string const &path_, struct stat const &st_);
+
+/// \brief Replace a file with a clone of another file
+/// \param from_ Existing file with the same content
+/// \param to_ File to replace
+/// \note Tries a reflink first and falls back to a hardlink
+bool clone (std::string const &from_, std::string const &to_);
+
+/// \brief Give a file its own inode if it is hardlinked
+/// \param path_ File to unshare
+/// \note Must be called before writing to a file which may have been deduplicated
+bool unshare (std::string const &path_);
+}
+#endif
@@ -0,0 +1,115 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ioBuffer.h"
+
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+namespace fs
+{
+/// \brief Virtual device under /dev
+///
+/// Synthetic sources and sinks for load testing without the disk on the critical path:
+/// - /dev/null                            empty source, discarding sink
+/// - /dev/zero[/<size>]                   zeros
+/// - /dev/random[/<size>[/<seed>]]        pseudo-random, incompressible
+/// - /dev/compressible[/<size>[/<seed>]]  pseudo-random, a little over half size under deflate
+///
+/// Sizes accept a K/M/G/T suffix (powers of 1024); sources without a size are unbounded.
+/// Every device discards and counts written data. /devZero is kept as an alias of /dev/zero.
+class DevFile
+{
+public:
+	/// \brief Whether a path names a virtual device
+	/// \param path_ Absolute path
+	static bool match (std::string_view path_);
+
+	/// \brief Whether a path names a virtual directory leading to a device
+	/// \param path_ Absolute path
+	/// \note /dev and devices that accept more arguments, e.g. /dev/random/1M, so clients
+	/// that CWD into each path component can reach /dev/random/1M/42
+	static bool matchDirectory (std::string_view path_);
+
+	/// \brief bool cast operator
+	explicit operator bool () const;
+
+	/// \brief Open device
+	/// \param path_ Absolute path
+	/// \note Fails with EINVAL on a malformed or out-of-range size or seed
+	bool open (std::string_view path_);
+
+	/// \brief Close device
+	void close ();
+
+	/// \brief Device size
+	/// \note Returns -1 for unbounded sources
+	std::int64_t size () const;
+
+	/// \brief Bytes read or written so far, including the seek offset
+	std::uint64_t position () const;
+
+	/// \brief Seek to position
+	/// \param pos_ Position
+	bool seek (std::uint64_t pos_);
+
+	/// \brief Read data
+	/// \param buffer_ Output buffer
+	/// \note Returns 0 at end of device
+	std::make_signed_t<std::size_t> read (IOBuffer &buffer_);
+
+	/// \brief Write (discard) data
+	/// \param buffer_ Input data; emptied
+	std::make_signed_t<std::size_t> write (IOBuffer &buffer_);
+
+private:
+	/// \brief Device type
+	enum class Type
+	{
+		NONE,
+		SINK,
+		ZERO,
+		RANDOM,
+		COMPRESSIBLE,
+	};
+
+	/// \brief Fill with pseudo-random data
+	/// \param buffer_ Output buffer
+	/// \param size_ Size to fill
+	void fill (char *buffer_, std::size_t size_) const;
+
+	/// \brief Device type
+	Type m_type = Type::NONE;
+
+	/// \brief Device size
+	std::uint64_t m_size = 0;
+
+	/// \brief Generator seed
+	std::uint64_t m_seed = 0;
+
+	/// \brief Current position
+	std::uint64_t m_position = 0;
+};
+}
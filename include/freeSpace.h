@@ -0,0 +1,92 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// \brief Cached free space of the served mount points
+/// A refresher (a background thread, or the server loop on NDS) runs statvfs on a timer, and
+/// writers adjust the cached values by the bytes they write or delete in between, so the network
+/// thread never waits on statvfs. Reads are lock-free.
+namespace freespace
+{
+/// \brief Interval between refreshes
+constexpr auto REFRESH_INTERVAL = std::chrono::seconds (10);
+
+/// \brief Cache statistics
+struct Stats
+{
+	/// \brief Number of reads
+	std::uint64_t reads;
+
+	/// \brief Number of statvfs refreshes
+	std::uint64_t refreshes;
+};
+
+/// \brief Start tracking mount points
+/// \param mounts_ Mount points; the root mount is always tracked as mount 0
+/// \note Refreshes once before returning
+void start (std::vector<std::string> const &mounts_);
+
+/// \brief Stop tracking
+void stop ();
+
+#ifdef __NDS__
+/// \brief Refresh if due
+/// \note Called by the server loop
+void update ();
+#endif
+
+/// \brief Request an early refresh, e.g. after the filesystem changed in ways not tracked
+void refresh ();
+
+/// \brief Find the mount point holding a path
+/// \param path_ Absolute path
+/// \returns Index of the longest matching mount point, or 0 (root)
+unsigned find (std::string_view path_);
+
+/// \brief Get cached available bytes
+/// \param mount_ Mount point index
+/// \returns Available bytes, or nullopt before the first refresh
+std::optional<std::uint64_t> available (unsigned mount_);
+
+/// \brief Adjust cached available bytes
+/// \param mount_ Mount point index
+/// \param bytes_ Bytes consumed; negative if freed
+void consume (unsigned mount_, std::int64_t bytes_);
+
+/// \brief Number of tracked mount points
+unsigned mounts ();
+
+/// \brief Get mount point path
+/// \param mount_ Mount point index
+std::string const &path (unsigned mount_);
+
+/// \brief Get cache statistics
+Stats stats ();
+}
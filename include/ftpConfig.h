@@ -22,25 +22,39 @@
 
 #pragma once
 
-#include "platform.h"
+#include "ftpFeatures.h"
 
 #include <gsl/gsl>
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <memory>
-#include <mutex>
 #include <string>
 #include <string_view>
 
 class FtpConfig;
 using UniqueFtpConfig = std::unique_ptr<FtpConfig>;
 
+/// \brief Immutable config snapshot
+using SharedFtpConfig = std::shared_ptr<FtpConfig const>;
+
 /// \brief FTP config
+/// \note The server shares the current config as an immutable snapshot; changes are made to a
+/// copy which replaces it (see FtpServer::updateConfig)
 class FtpConfig
 {
 public:
 	~FtpConfig ();
 
+	/// \brief Copy constructor
+	/// \param that_ Object to copy
+	FtpConfig (FtpConfig const &that_);
+
+	/// \brief Copy assignment
+	/// \param that_ Object to copy
+	FtpConfig &operator= (FtpConfig const &that_);
+
 	/// \brief Create config
 	static UniqueFtpConfig create ();
 
@@ -48,13 +62,12 @@ public:
 	/// \param path_ Path to config file
 	static UniqueFtpConfig load (gsl::not_null<gsl::czstring> path_);
 
-#ifndef __NDS__
-	std::scoped_lock<platform::Mutex> lockGuard ();
-#endif
-
 	/// \brief Save config
 	/// \param path_ Path to config file
-	bool save (gsl::not_null<gsl::czstring> path_);
+	bool save (gsl::not_null<gsl::czstring> path_) const;
+
+	/// \brief Get path the config was loaded from
+	std::string const &path () const;
 
 	/// \brief Get user
 	std::string const &user () const;
@@ -71,6 +84,83 @@ public:
 	/// \brief Get deflate level
 	int deflateLevel () const;
 
+	/// \brief Whether to log commands
+	bool logCommands () const;
+
+	/// \brief Whether to log responses
+	bool logResponses () const;
+
+	/// \brief Get extra mount points to track free space of (comma-separated)
+	std::string const &freeSpaceMounts () const;
+
+	/// \brief Get transfer buffer size
+	std::size_t xferBufferSize () const;
+
+	/// \brief Get file buffer size
+	std::size_t fileBufferSize () const;
+
+	/// \brief Get data socket buffer size
+	/// \returns Buffer size, or 0 to leave it to the stack (and its autotuning)
+	std::size_t sockBufferSize () const;
+
+	/// \brief Get response buffer size
+	std::size_t responseBufferSize () const;
+
+#if FTPD_HAS_TCP_INFO
+	/// \brief Whether to size transfer buffers from measured RTT and throughput
+	bool autoTune () const;
+#endif
+
+#if FTPD_HAS_BUSY_POLL
+	/// \brief Get time to busy-poll for activity before blocking
+	/// \returns Busy-poll time, or 0 to block right away
+	std::chrono::microseconds busyPoll () const;
+
+	/// \brief Get CPU to pin the server thread to
+	/// \returns CPU index, or -1 to leave it to the scheduler
+	int pinCpu () const;
+#endif
+
+#if FTPD_HAS_TLS
+	/// \brief Get TLS certificate chain path
+	/// \returns Path, or empty if TLS is disabled
+	std::string const &tlsCert () const;
+
+	/// \brief Get TLS private key path
+	/// \returns Path, or empty if the key is in the certificate file
+	std::string const &tlsKey () const;
+
+	/// \brief Whether to hand TLS record encryption to the kernel where supported
+	bool ktls () const;
+
+	/// \brief Whether logins and data connections must be protected by TLS
+	bool tlsRequired () const;
+#endif
+
+#if FTPD_HAS_DEDUP
+	/// \brief Whether to deduplicate uploads
+	bool dedup () const;
+
+	/// \brief Get dedup index path
+	std::string const &dedupIndex () const;
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Get stats segment name
+	std::string const &statsSegment () const;
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+	/// \brief Get transfer journal path
+	std::string const &journal () const;
+
+	/// \brief Get number of records per transfer journal file; 0 if disabled
+	std::size_t journalRecords () const;
+
+	/// \brief Get transfer journal rotation period
+	std::chrono::seconds journalRotate () const;
+#endif
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	/// \note only effective on 3DS
@@ -116,6 +206,109 @@ public:
 	/// \param level_ Deflate level
 	bool setDeflateLevel (int level_);
 
+	/// \brief Set whether to log commands
+	/// \param log_ Whether to log commands
+	void setLogCommands (bool log_);
+
+	/// \brief Set whether to log responses
+	/// \param log_ Whether to log responses
+	void setLogResponses (bool log_);
+
+	/// \brief Set extra mount points to track free space of
+	/// \param mounts_ Comma-separated mount points
+	/// \note Takes effect on restart
+	void setFreeSpaceMounts (std::string mounts_);
+
+	/// \brief Set transfer buffer size
+	/// \param size_ Buffer size
+	/// \note Takes effect on the next transfer
+	bool setXferBufferSize (std::size_t size_);
+
+	/// \brief Set file buffer size
+	/// \param size_ Buffer size; 0 for unbuffered
+	/// \note Takes effect on the next transfer
+	bool setFileBufferSize (std::size_t size_);
+
+	/// \brief Set data socket buffer size
+	/// \param size_ Buffer size; 0 to leave it to the stack
+	/// \note Takes effect on the next data connection
+	bool setSockBufferSize (std::size_t size_);
+
+	/// \brief Set response buffer size
+	/// \param size_ Buffer size
+	/// \note Takes effect on the next session
+	bool setResponseBufferSize (std::size_t size_);
+
+#if FTPD_HAS_TCP_INFO
+	/// \brief Set whether to size transfer buffers from measured RTT and throughput
+	/// \param autoTune_ Whether to auto-tune
+	void setAutoTune (bool autoTune_);
+#endif
+
+#if FTPD_HAS_BUSY_POLL
+	/// \brief Set time to busy-poll for activity before blocking
+	/// \param time_ Busy-poll time; 0 to block right away
+	/// \note Sockets pick it up on the next connection
+	bool setBusyPoll (std::chrono::microseconds time_);
+
+	/// \brief Set CPU to pin the server thread to
+	/// \param cpu_ CPU index; -1 to leave it to the scheduler
+	bool setPinCpu (int cpu_);
+#endif
+
+#if FTPD_HAS_TLS
+	/// \brief Set TLS certificate chain path
+	/// \param path_ Certificate chain path (PEM); empty to disable TLS
+	void setTlsCert (std::string path_);
+
+	/// \brief Set TLS private key path
+	/// \param path_ Private key path (PEM); empty if the key is in the certificate file
+	void setTlsKey (std::string path_);
+
+	/// \brief Set whether to hand TLS record encryption to the kernel where supported
+	/// \param ktls_ Whether to use kTLS
+	/// \note Connections pick it up on their next handshake
+	void setKtls (bool ktls_);
+
+	/// \brief Set whether logins and data connections must be protected by TLS
+	/// \param required_ Whether TLS is required
+	void setTlsRequired (bool required_);
+#endif
+
+#if FTPD_HAS_DEDUP
+	/// \brief Set whether to deduplicate uploads
+	/// \param dedup_ Whether to deduplicate uploads
+	void setDedup (bool dedup_);
+
+	/// \brief Set dedup index path
+	/// \param path_ Dedup index path
+	void setDedupIndex (std::string path_);
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Set stats segment name
+	/// \param name_ Shared memory object name; empty (`statsSegment=` in the file) to disable
+	/// \note Takes effect on restart
+	void setStatsSegment (std::string name_);
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+	/// \brief Set transfer journal path
+	/// \param path_ Journal path; empty (`journal=` in the file) to disable
+	/// \note Takes effect on restart
+	void setJournal (std::string path_);
+
+	/// \brief Set number of records per transfer journal file
+	/// \param records_ Records per file; 0 to disable
+	/// \note Takes effect on restart
+	void setJournalRecords (std::size_t records_);
+
+	/// \brief Set transfer journal rotation period
+	/// \param rotate_ Rotation period
+	/// \note Takes effect on restart
+	void setJournalRotate (std::chrono::seconds rotate_);
+#endif
+
 #ifdef __3DS__
 	/// \brief Set whether to get mtime
 	/// \param getMTime_ Whether to get mtime
@@ -139,10 +332,8 @@ public:
 private:
 	FtpConfig ();
 
-#ifndef __NDS__
-	/// \brief Mutex
-	mutable platform::Mutex m_lock;
-#endif
+	/// \brief Config file path
+	std::string m_path = FTPDCONFIG;
 
 	/// \brief Username
 	std::string m_user;
@@ -159,6 +350,78 @@ private:
 	/// \brief Deflate level
 	int m_deflateLevel;
 
+	/// \brief Whether to log commands
+	bool m_logCommands = true;
+
+	/// \brief Whether to log responses
+	bool m_logResponses = true;
+
+	/// \brief Extra mount points to track free space of
+	std::string m_freeSpaceMounts;
+
+	/// \brief Transfer buffer size
+	std::size_t m_xferBufferSize;
+
+	/// \brief File buffer size
+	std::size_t m_fileBufferSize;
+
+	/// \brief Data socket buffer size; 0 to leave it to the stack
+	std::size_t m_sockBufferSize;
+
+	/// \brief Response buffer size
+	std::size_t m_responseBufferSize;
+
+#if FTPD_HAS_TCP_INFO
+	/// \brief Whether to size transfer buffers from measured RTT and throughput
+	bool m_autoTune = false;
+#endif
+
+#if FTPD_HAS_BUSY_POLL
+	/// \brief Time to busy-poll for activity before blocking
+	std::chrono::microseconds m_busyPoll{0};
+
+	/// \brief CPU to pin the server thread to; -1 to leave it to the scheduler
+	int m_pinCpu = -1;
+#endif
+
+#if FTPD_HAS_TLS
+	/// \brief TLS certificate chain path
+	std::string m_tlsCert;
+
+	/// \brief TLS private key path
+	std::string m_tlsKey;
+
+	/// \brief Whether to hand TLS record encryption to the kernel where supported
+	bool m_ktls = true;
+
+	/// \brief Whether logins and data connections must be protected by TLS
+	bool m_tlsRequired = false;
+#endif
+
+#if FTPD_HAS_DEDUP
+	/// \brief Whether to deduplicate uploads
+	bool m_dedup = false;
+
+	/// \brief Dedup index path
+	std::string m_dedupIndex = FTPDCONFIG ".dedup";
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Stats segment name
+	std::string m_statsSegment = "/ftpd-stats";
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+	/// \brief Transfer journal path
+	std::string m_journal = FTPDCONFIG ".journal";
+
+	/// \brief Number of records per transfer journal file
+	std::size_t m_journalRecords;
+
+	/// \brief Transfer journal rotation period
+	std::chrono::seconds m_journalRotate;
+#endif
+
 #ifdef __3DS__
 	/// \brief Whether to get mtime
 	bool m_getMTime = true;
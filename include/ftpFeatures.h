@@ -0,0 +1,49 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Optional features, for headers that only need to know which members to declare
+
+#if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
+#define FTPD_HAS_DEDUP 0
+#define FTPD_HAS_STATS_SEGMENT 0
+#define FTPD_HAS_XFER_JOURNAL 0
+#else
+#define FTPD_HAS_DEDUP 1
+#define FTPD_HAS_STATS_SEGMENT 1
+#define FTPD_HAS_XFER_JOURNAL 1
+#endif
+
+#ifdef __linux__
+#define FTPD_HAS_TCP_INFO 1
+#define FTPD_HAS_BUSY_POLL 1
+#else
+#define FTPD_HAS_TCP_INFO 0
+#define FTPD_HAS_BUSY_POLL 0
+#endif
+
+#if defined(__linux__) && FTPD_TLS
+#define FTPD_HAS_TLS 1
+#else
+#define FTPD_HAS_TLS 0
+#endif
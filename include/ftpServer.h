@@ -26,6 +26,8 @@
 #include "ftpSession.h"
 #include "platform.h"
 #include "socket.h"
+#include "statsSegment.h"
+#include "xferJournal.h"
 
 #ifndef CLASSIC
 #include <curl/curl.h>
@@ -34,6 +36,7 @@
 #include <atomic>
 #include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -56,12 +59,33 @@ public:
 	/// \brief Create server
 	static UniqueFtpServer create ();
 
+	/// \brief Create server
+	/// \param config_ FTP config
+	static UniqueFtpServer create (UniqueFtpConfig config_);
+
+#if FTPD_HEADLESS
+	/// \brief Apply a reloaded config
+	/// \param config_ New config
+	/// \note Restarts the listener if the port changed; existing sessions are kept. Changes to
+	/// the settings only read at startup are logged as requiring a restart
+	void reload (UniqueFtpConfig config_);
+#endif
+
+	/// \brief Get current config
+	/// \note Takes no server mutex; std::atomic<std::shared_ptr> may use a short internal lock
+	/// (as libstdc++'s does), but readers don't wait in practice. The snapshot stays valid and
+	/// unchanged while it is held
+	SharedFtpConfig config () const;
+
+	/// \brief Change the config
+	/// \param update_ Applies the change to a copy; returns false to discard it
+	/// \returns Whether the change was published
+	/// \note update_ may run more than once if another change races with it
+	bool updateConfig (std::function<bool (FtpConfig &)> const &update_);
+
 	/// \brief Get free space
 	static std::string getFreeSpace ();
 
-	/// \brief Update free space
-	static void updateFreeSpace ();
-
 	/// \brief Server start time
 	static std::time_t startTime ();
 
@@ -70,6 +94,41 @@ public:
 	static int tzOffset ();
 #endif
 
+#ifndef __NDS__
+	/// \brief Server loop statistics
+	struct LoopStats
+	{
+		/// \brief Number of loop iterations
+		std::uint64_t iterations;
+
+		/// \brief Total time spent in loop iterations
+		std::chrono::nanoseconds total;
+
+		/// \brief Longest loop iteration since the previous query
+		std::chrono::nanoseconds max;
+	};
+
+	/// \brief Get server loop statistics
+	/// \note Resets the longest iteration
+	LoopStats loopStats ();
+#endif
+
+	/// \brief Append machine-readable statistics
+	/// \param out_ Output string
+	/// \param self_ Requesting session
+	/// \param all_ Whether to include every session or only the requesting one
+	/// \param limit_ Maximum size to append; sessions that don't fit are counted as omitted
+	/// \note Emits one JSON object per line, formatted as reply continuation lines. Must be
+	/// called from the server thread.
+	void writeStats (std::string &out_, FtpSession const &self_, bool all_, std::size_t limit_);
+
+#if FTPD_HAS_XFER_JOURNAL
+	/// \brief Append a finished transfer to the transfer journal
+	/// \param record_ Transfer record
+	/// \note Must be called from the server thread
+	void recordTransfer (journal::Record const &record_);
+#endif
+
 private:
 	/// \brief Paramterized constructor
 	/// \param config_ FTP config
@@ -81,6 +140,26 @@ private:
 	/// \brief Handle when network is lost
 	void handleNetworkLost ();
 
+	/// \brief Server status published for drawing
+	struct Snapshot
+	{
+		/// \brief Listen address; empty while waiting for the network
+		std::string address;
+
+		/// \brief Listen port
+		std::uint16_t port = 0;
+
+		/// \brief Free space
+		std::string freeSpace;
+
+		/// \brief Sessions
+		std::vector<FtpSession::Snapshot> sessions;
+	};
+
+	/// \brief Sample transfer rates, auto-tune buffers and publish a snapshot for drawing
+	/// \note Rate limited to SNAPSHOT_INTERVAL
+	void publishSnapshot ();
+
 #ifndef CLASSIC
 	/// \brief Show menu in the current window
 	void showMenu ();
@@ -95,19 +174,25 @@ private:
 	/// \brief Server loop
 	void loop ();
 
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Publish statistics to the shared-memory segment
+	void publishStats ();
+#endif
+
 	/// \brief Thread entry point
 	void threadFunc ();
 
 #ifndef __NDS__
 	/// \brief Thread
 	platform::Thread m_thread;
-
-	/// \brief Mutex
-	platform::Mutex m_lock;
 #endif
 
-	/// \brief Config
-	UniqueFtpConfig m_config;
+	/// \brief Current config
+#ifdef __NDS__
+	SharedFtpConfig m_config;
+#else
+	std::atomic<SharedFtpConfig> m_config;
+#endif
 
 	/// \brief Listen socket
 	UniqueSocket m_socket;
@@ -120,18 +205,75 @@ private:
 	/// \brief ImGui window name
 	std::string m_name;
 
+#if FTPD_HAS_XFER_JOURNAL
+	/// \brief Transfer journal
+	/// \note Declared before the sessions so it outlives them
+	journal::Journal m_journal;
+
+	/// \brief Whether the transfer journal failed since it last succeeded
+	bool m_journalFailed = false;
+#endif
+
 	/// \brief Sessions
 	std::vector<UniqueFtpSession> m_sessions;
 
 	/// \brief Whether thread should quit
 	std::atomic_bool m_quit = false;
 
+	/// \brief Whether the listener should be restarted, e.g. after a port change
+	std::atomic_bool m_restart = false;
+
+	/// \brief Last snapshot publish time
+	platform::steady_clock::time_point m_snapshotPublished;
+
+	/// \brief Latest snapshot; the UI only ever reads this, never live server state
+#ifdef __NDS__
+	std::shared_ptr<Snapshot const> m_snapshot;
+#else
+	std::atomic<std::shared_ptr<Snapshot const>> m_snapshot;
+#endif
+
+#ifndef CLASSIC
+	/// \brief Snapshot being drawn (UI thread only)
+	std::shared_ptr<Snapshot const> m_drawSnapshot;
+#endif
+
+	/// \brief Number of accepted connections
+	std::uint64_t m_accepts = 0;
+
+#if FTPD_HAS_BUSY_POLL
+	/// \brief CPU the server thread is pinned to; -1 if not pinned
+	int m_pinnedCpu = -1;
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Shared-memory statistics segment
+	stats::SegmentMap m_statsSegment;
+
+	/// \brief Last statistics publish time
+	platform::steady_clock::time_point m_statsPublished;
+
+	/// \brief Number of session slots in use at the last publish
+	std::size_t m_statsSlots = 0;
+#endif
+
+#ifndef __NDS__
+	/// \brief Number of loop iterations
+	std::atomic<std::uint64_t> m_loopIterations = 0;
+
+	/// \brief Total loop time in nanoseconds
+	std::atomic<std::uint64_t> m_loopTotal = 0;
+
+	/// \brief Longest loop iteration in nanoseconds
+	std::atomic<std::uint64_t> m_loopMax = 0;
+#endif
+
 #ifndef CLASSIC
 	/// \brief Log upload cURL context
 	CURLM *m_uploadLogCurlM = nullptr;
 	/// \brief Log upload mime context
 	curl_mime *m_uploadLogMime = nullptr;
-	/// \brief Log upload cURL context
+	/// \brief Log upload cURL context; owned by the network thread while set
 	std::atomic<CURL *> m_uploadLogCurl = nullptr;
 
 	/// \brief Log upload data
@@ -167,6 +309,11 @@ private:
 	/// \brief Deflate level setting
 	int m_deflateLevelSetting = Z_NO_COMPRESSION;
 
+#if FTPD_HAS_DEDUP
+	/// \brief Upload dedup setting
+	bool m_dedupSetting = false;
+#endif
+
 #ifdef __3DS__
 	/// \brief getMTime setting
 	bool m_getMTimeSetting;
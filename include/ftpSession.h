@@ -22,11 +22,17 @@
 
 #pragma once
 
+#include "dedup.h"
+#include "devFile.h"
 #include "fs.h"
 #include "ftpConfig.h"
+#include "ftpUtil.h"
 #include "ioBuffer.h"
+#include "latencyHistogram.h"
 #include "platform.h"
 #include "socket.h"
+#include "statsSegment.h"
+#include "task.h"
 
 #if __has_include(<glob.h>)
 #include <glob.h>
@@ -41,13 +47,19 @@
 using stat_t = struct stat;
 
 #include <chrono>
+#include <cstdint>
 #include <ctime>
 #include <memory>
 #include <optional>
+#include <span>
+#include <string>
 #include <string_view>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+class FtpServer;
+
 class FtpSession;
 using UniqueFtpSession = std::unique_ptr<FtpSession>;
 
@@ -57,65 +69,126 @@ class FtpSession
 public:
 	~FtpSession ();
 
+	/// \brief Session status published for drawing
+	struct Snapshot
+	{
+		/// \brief ImGui window name
+		std::string windowName;
+
+		/// \brief Current work item, or working directory when idle
+		std::string status;
+
+		/// \brief Current file position
+		std::uint64_t filePosition = 0;
+
+		/// \brief File size of current transfer
+		std::uint64_t fileSize = 0;
+
+#ifndef CLASSIC
+		/// \brief Transfer rate
+		float xferRate = 0.0f;
+
+		/// \brief File position history deltas
+		std::vector<float> positionDeltas;
+
+		/// \brief Session state name
+		char const *state = nullptr;
+
+		/// \brief Connection descriptions
+		std::vector<std::string> connections;
+#endif
+	};
+
 	/// \brief Whether session sockets are all inactive
 	bool dead ();
 
+	/// \brief Sample the transfer rate
+	/// \note Called by the server thread at a fixed interval
+	void updateRate ();
+
+#if FTPD_HAS_TCP_INFO
+	/// \brief Grow the transfer buffers to the measured bandwidth-delay product
+	/// \note Called by the server thread at a fixed interval; no-op unless enabled in the config
+	void autoTune ();
+#endif
+
+	/// \brief Fill a snapshot of the session status
+	/// \param snapshot_ Snapshot to fill
+	/// \note Must be called from the server thread
+	void snapshot (Snapshot &snapshot_) const;
+
 	/// \brief Draw session status
-	void draw ();
+	/// \param snapshot_ Session snapshot
+	static void draw (Snapshot const &snapshot_);
 
 	/// \brief Draw session connections
-	void drawConnections ();
+	/// \param snapshot_ Session snapshot
+	static void drawConnections (Snapshot const &snapshot_);
+
+	/// \brief Append machine-readable statistics as a JSON object
+	/// \param out_ Output string
+	/// \param self_ Whether this is the requesting session
+	void writeStats (std::string &out_, bool self_) const;
+
+#if FTPD_HAS_STATS_SEGMENT
+	/// \brief Fill shared-memory statistics record
+	/// \param record_ Record to fill
+	void fillStats (stats::SessionRecord &record_) const;
+#endif
+
+	/// \brief Accumulate buffer usage
+	/// \param capacity_ Total buffer capacity
+	/// \param used_ Total buffer bytes in use
+	void bufferUsage (std::size_t &capacity_, std::size_t &used_) const;
+
+	/// \brief Append latency histograms by command verb and transfer phase
+	/// \param out_ Output string
+	/// \param limit_ Maximum size to append
+	/// \returns Number of histograms that didn't fit
+	/// \note One JSON object per continuation line
+	static unsigned writeLatency (std::string &out_, std::size_t limit_);
+
+	/// \brief Get control-channel latency
+	/// \note Time from poll wakeup until a ready command socket has been serviced; commands are
+	/// serviced before any transfer quanta
+	static LatencyHistogram const &controlLatency ();
 
 	/// \brief Create session
-	/// \param config_ FTP config
+	/// \param server_ Owning server
 	/// \param commandSocket_ Command socket
-	static UniqueFtpSession create (FtpConfig &config_, UniqueSocket commandSocket_);
+	static UniqueFtpSession create (FtpServer &server_, UniqueSocket commandSocket_);
+
+	/// \brief Get frame arena of the session's coroutines
+	co::Arena &frameArena ();
 
 	/// \brief Poll for activity
 	/// \param sessions_ Sessions to poll
-	static bool poll (std::vector<UniqueFtpSession> const &sessions_);
+	/// \param serverSockets_ Server sockets to wait on with the sessions; revents are set on return
+	/// \param spin_ Time to keep polling without blocking before waiting for activity
+	static bool poll (std::vector<UniqueFtpSession> const &sessions_,
+	    std::span<Socket::PollInfo> serverSockets_ = {},
+	    std::chrono::microseconds spin_            = std::chrono::microseconds (0));
 
 private:
 	/// \brief Command buffer size
 	constexpr static auto COMMAND_BUFFERSIZE = 4096;
 
-#ifdef __NDS__
-	/// \brief Response buffer size
-	constexpr static auto RESPONSE_BUFFERSIZE = 4096;
-
-	/// \brief Transfer buffersize
-	constexpr static auto XFER_BUFFERSIZE = 8192;
-#else
-	/// \brief Response buffer size
-	constexpr static auto RESPONSE_BUFFERSIZE = 32768;
-
-	/// \brief Transfer buffersize
-	constexpr static auto XFER_BUFFERSIZE = 65536;
-#endif
-
-	/// \brief File buffersize
-	constexpr static auto FILE_BUFFERSIZE = 4 * XFER_BUFFERSIZE;
-
 #if defined(__NDS__)
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = 4096;
-
 	/// \brief Amount of file position history to keep
 	constexpr static auto POSITION_HISTORY = 60;
 #elif defined(__3DS__)
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = 32768;
-
 	/// \brief Amount of file position history to keep
 	constexpr static auto POSITION_HISTORY = 100;
 #else
-	/// \brief Socket buffer size
-	constexpr static auto SOCK_BUFFERSIZE = XFER_BUFFERSIZE;
-
 	/// \brief Amount of file position history to keep
 	constexpr static auto POSITION_HISTORY = 300;
 #endif
 
+#if FTPD_HAS_TCP_INFO
+	/// \brief Largest transfer buffer auto-tuning will grow to
+	constexpr static std::size_t AUTOTUNE_BUFFERSIZE = 4 * 1024 * 1024;
+#endif
+
 	/// \brief Session state
 	enum class State
 	{
@@ -133,19 +206,64 @@ private:
 	};
 
 	/// \brief Transfer directory mode
-	enum class XferDirMode
+	using XferDirMode = ftp::ListMode;
+
+	/// \brief Per-verb command statistics
+	struct CommandStats
+	{
+		/// \brief Number of commands handled
+		std::uint64_t count = 0;
+
+		/// \brief Total handler time in nanoseconds
+		std::uint64_t total = 0;
+
+		/// \brief Longest handler time in nanoseconds
+		std::uint64_t max = 0;
+	};
+
+	/// \brief Transfer phase timestamps, from command receipt to the final reply being sent
+	struct XferPhases
 	{
-		LIST,
-		MLSD,
-		MLST,
-		NLST,
-		STAT,
+		/// \brief Command received
+		platform::steady_clock::time_point command;
+		/// \brief File or directory opened
+		platform::steady_clock::time_point opened;
+		/// \brief Data connection established
+		platform::steady_clock::time_point connected;
+		/// \brief First data byte sent or received
+		platform::steady_clock::time_point firstByte;
+		/// \brief Transfer finished
+		platform::steady_clock::time_point lastByte;
+
+		/// \brief Transfer path
+		std::string path;
+
+		/// \brief Data socket bytes when the transfer started
+		std::uint64_t startBytes = 0;
+		/// \brief Data socket bytes transferred
+		std::uint64_t bytes = 0;
+
+		/// \brief Command index in handlers
+		std::size_t verb = 0;
+
+		/// \brief Whether a transfer is in progress
+		bool active = false;
+		/// \brief Whether the final reply is waiting to be sent
+		bool pending = false;
+		/// \brief Whether the transfer succeeded
+		bool ok = false;
+		/// \brief Whether data was received
+		bool recv = false;
+		/// \brief Whether the transfer was a directory listing
+		bool listing = false;
+		/// \brief Whether MODE Z was used
+		bool deflate = false;
 	};
 
 	/// \brief Parameterized constructor
-	/// \param config_ FTP config
+	/// \param server_ Owning server
 	/// \param commandSocket_ Command socket
-	FtpSession (FtpConfig &config_, UniqueSocket commandSocket_);
+	FtpSession (FtpServer &server_, UniqueSocket commandSocket_);
 
 	/// \brief Whether session is authorized
 	bool authorized () const;
@@ -166,6 +284,13 @@ private:
 	/// \brief Close data socket
 	void closeData ();
 
+	/// \brief Record first data byte of the transfer
+	void xferFirstByte ();
+
+	/// \brief Record transfer phases once the final reply is sent
+	/// \param sent_ Time the final reply was sent
+	void xferPhasesDone (platform::steady_clock::time_point sent_);
+
 	/// \brief Change working directory
 	bool changeDir (char const *args_);
 
@@ -175,6 +300,19 @@ private:
 	/// \brief Connect data socket
 	bool dataConnect ();
 
+	/// \brief Wait for the data connection
+	/// \note PASV waits for the client to connect, PORT for our connect to complete
+	co::Ready dataReady ();
+
+	/// \brief Finish opening the data connection
+	/// \param revents_ Ready events of dataReady; 0 if it timed out
+	/// \returns false if the transfer was ended
+	bool dataOpened (int revents_);
+
+	/// \brief Finish sending on data socket before the final reply
+	/// \returns false if the transfer must wait for the socket to be writable
+	bool dataFinish ();
+
 	/// \brief Perform stat and apply tz offset to mtime
 	/// \param path_ Path to stat
 	/// \param st_ Output stat
@@ -196,6 +334,19 @@ private:
 	/// \param type_ MLST type
 	int fillDirent (std::string const &path_, char const *type_ = nullptr);
 
+	/// \brief Clear the transfer buffers and size them from the config, or as auto-tuned
+	void resetXferBuffers ();
+
+	/// \brief Apply the configured data socket buffer size
+	/// \param socket_ Data or PASV socket
+	void setSockBufferSize (Socket &socket_);
+
+#if FTPD_HAS_BUSY_POLL
+	/// \brief Apply the configured busy-poll time
+	/// \param socket_ Command or data socket
+	void setBusyPoll (Socket &socket_);
+#endif
+
 	/// \brief Transfer file
 	/// \param args_ Command arguments
 	/// \param mode_ Transfer file mode
@@ -207,19 +358,27 @@ private:
 	/// \param workaround_ Workaround broken clients who use LIST -a/-l
 	void xferDir (char const *args_, XferDirMode mode_, bool workaround_);
 
+#if FTPD_HAS_DEDUP
+	/// \brief Deduplicate finished upload
+	void dedupUpload ();
+#endif
+
 	/// \brief Read command
 	/// \param events_ Poll events
 	void readCommand (int events_);
 
-	/// \brief Write response
+	/// \brief Write queued responses
+	/// \note Replies of pipelined commands go out together in one write
 	void writeResponse ();
 
-	/// \brief Send response
+	/// \brief Queue response
 	/// \param fmt_ Message format
+	/// \note Written by the next writeResponse, or right away if the buffer is full
 	__attribute__ ((format (printf, 2, 3))) void sendResponse (char const *fmt_, ...);
 
-	/// \brief Send response
+	/// \brief Queue response
 	/// \param response_ Response message
+	/// \note Written by the next writeResponse, or right away if the buffer is full
 	void sendResponse (std::string_view response_);
 
 	/// \brief Deflate buffer
@@ -229,30 +388,51 @@ private:
 	/// \brief Inflate buffer
 	bool inflateBuffer ();
 
-	/// \brief Transfer function
-	bool (FtpSession::*m_transfer) () = nullptr;
+	/// \brief Send from the transfer buffer
+	/// \returns Bytes sent; 0 if the data socket would block; -1 if the transfer was ended
+	std::make_signed_t<std::size_t> sendXfer ();
+
+	/// \brief Start transfer coroutine
+	/// \param transfer_ Transfer coroutine
+	/// \param name_ Trace and allocation tag of the transfer
+	/// \note The transfer first runs on the next pass of the event loop
+	void startTransfer (co::Task<> transfer_, char const *name_);
+
+	/// \brief Resume transfer coroutine
+	/// \param revents_ Ready events of the awaited socket; 0 if the deadline passed
+	void resumeTransfer (int revents_);
+
+	/// \brief Destroy transfer coroutine
+	/// \note A running transfer ends itself, so this does nothing while resuming
+	void cancelTransfer ();
 
 	/// \brief Transfer directory list
-	bool listTransfer ();
+	co::Task<> listTransfer ();
 
 #if FTPD_HAS_GLOB
 	/// \brief Transfer glob list
-	bool globTransfer ();
+	co::Task<> globTransfer ();
 #endif
 
 	/// \brief Transfer download
-	bool retrieveTransfer ();
+	co::Task<> retrieveTransfer ();
 
 	/// \brief Transfer upload
-	bool storeTransfer ();
+	co::Task<> storeTransfer ();
 
-#ifndef __NDS__
-	/// \brief Mutex
-	platform::Mutex m_lock;
+#if FTPD_HAS_DEDUP
+	/// \brief Hash a file for HASH
+	co::Task<> hashTransfer ();
 #endif
 
-	/// \brief FTP config
-	FtpConfig &m_config;
+	/// \brief Owning server
+	FtpServer &m_server;
+
+	/// \brief Session id
+	std::uint64_t const m_id;
+
+	/// \brief Config snapshot, refreshed before each command
+	SharedFtpConfig m_config;
 
 	/// \brief Command socket
 	SharedSocket m_commandSocket;
@@ -292,6 +472,9 @@ private:
 	/// \brief Current work item
 	std::string m_workItem;
 
+	/// \brief User name sent by the client
+	std::string m_userName;
+
 	/// \brief ImGui window name
 	std::string m_windowName;
 
@@ -301,6 +484,12 @@ private:
 	/// \brief Position from REST command
 	std::uint64_t m_restartPosition = 0;
 
+	/// \brief Size from ALLO command
+	std::uint64_t m_allocHint = 0;
+
+	/// \brief Free space mount point of the current upload
+	unsigned m_freeSpaceMount = 0;
+
 	/// \brief Current file position
 	std::uint64_t m_filePosition = 0;
 	/// \brief Current z-stream position
@@ -321,12 +510,57 @@ private:
 	/// \brief Transfer rate (EWMA low-pass filtered)
 	float m_xferRate;
 
+#if FTPD_HAS_TCP_INFO
+	/// \brief Round-trip time of the data connection, as last measured by auto-tuning
+	std::chrono::microseconds m_rtt{};
+
+	/// \brief Transfer buffer size reached by auto-tuning; kept for the rest of the session
+	std::size_t m_tunedBufferSize = 0;
+#endif
+
 	/// \brief Session state
 	State m_state = State::COMMAND;
 
+	/// \brief Time the current state was entered
+	platform::steady_clock::time_point m_stateStart = platform::steady_clock::now ();
+
+	/// \brief Nanoseconds spent in each completed state
+	std::uint64_t m_stateTime[3] = {};
+
+	/// \brief Command statistics, indexed like handlers
+	std::vector<CommandStats> m_commandStats;
+
+	/// \brief Time the current command was received
+	platform::steady_clock::time_point m_commandStart;
+	/// \brief Current command index in handlers
+	std::size_t m_commandIndex = 0;
+
+	/// \brief Phases of the current or last transfer
+	XferPhases m_xferPhases;
+
+	/// \brief Number of unrecognized commands
+	std::uint64_t m_invalidCommands = 0;
+
+	/// \brief Bytes received on the command socket
+	std::uint64_t m_controlIn = 0;
+	/// \brief Bytes sent on the command socket
+	std::uint64_t m_controlOut = 0;
+	/// \brief Responses queued on the command socket
+	std::uint64_t m_responses = 0;
+	/// \brief Writes to the command socket
+	std::uint64_t m_responseWrites = 0;
+
+	/// \brief Bytes received on data sockets
+	std::uint64_t m_dataIn = 0;
+	/// \brief Bytes sent on data sockets
+	std::uint64_t m_dataOut = 0;
+
 	/// \brief File being transferred
 	fs::File m_file;
 
+	/// \brief Virtual device being transferred
+	fs::DevFile m_devFile;
+
 	/// \brief Directory being transferred
 	fs::Dir m_dir;
 
@@ -364,9 +598,29 @@ private:
 	/// \brief Directory transfer mode
 	XferDirMode m_xferDirMode;
 
+	/// \brief Frame arena; outlives the transfer
+	co::Arena m_arena;
+
+	/// \brief Transfer coroutine
+	co::Task<> m_transfer;
+
+	/// \brief What the transfer waits for
+	co::Wait m_wait;
+
+	/// \brief Trace and allocation tag of the transfer
+	char const *m_transferName = nullptr;
+
+	/// \brief Whether HASH is reading a file; later commands wait in the command buffer
+	bool m_hashing = false;
+
 	/// \brief z-stream
 	std::unique_ptr<z_stream, int (*) (z_streamp)> m_zStream;
 
+#if FTPD_HAS_DEDUP
+	/// \brief Upload content hash
+	Sha256 m_hash;
+#endif
+
 	/// \brief Last activity timestamp
 	time_t m_timestamp;
 
@@ -374,6 +628,8 @@ private:
 	bool m_authorizedUser : 1;
 	/// \brief Whether password has been authorized
 	bool m_authorizedPass : 1;
+	/// \brief Whether the server accepts any user
+	bool m_anonymous : 1;
 	/// \brief Whether previous command was PASV
 	bool m_pasv : 1;
 	/// \brief Whether previous command was PORT
@@ -388,8 +644,8 @@ private:
 	bool m_deflate : 1;
 	/// \brief Whether we finished processing z-stream
 	bool m_zFlushed : 1;
-	/// \brief Whether we finished reading data
-	bool m_eof : 1;
+	/// \brief Whether the transfer coroutine is running
+	bool m_resuming : 1;
 
 	/// \brief Whether MLST type fact is enabled
 	bool m_mlstType : 1;
@@ -402,8 +658,15 @@ private:
 	/// \brief Whether MLST unix.mode fact is enabled
 	bool m_mlstUnixMode : 1;
 
-	/// \brief Whether emulating /dev/zero
-	bool m_devZero : 1;
+	/// \brief Whether hashing upload for deduplication
+	bool m_dedup : 1;
+
+	/// \brief Whether to start TLS once the AUTH reply is out
+	bool m_startTls : 1;
+	/// \brief Whether PBSZ was received on the protected control connection
+	bool m_pbsz : 1;
+	/// \brief Whether data connections are protected (PROT P)
+	bool m_protPrivate : 1;
 
 	/// \brief Abort a transfer
 	/// \param args_ Command arguments
@@ -417,6 +680,12 @@ private:
 	/// \param args_ Command arguments
 	void APPE (char const *args_);
 
+#if FTPD_HAS_TLS
+	/// \brief Start TLS on the control connection
+	/// \param args_ Command arguments
+	void AUTH (char const *args_);
+#endif
+
 	/// \brief CWD to parent directory
 	/// \param args_ Command arguments
 	void CDUP (char const *args_);
@@ -433,6 +702,12 @@ private:
 	/// \param args_ Command arguments
 	void FEAT (char const *args_);
 
+#if FTPD_HAS_DEDUP
+	/// \brief Get file hash
+	/// \param args_ Command arguments
+	void HASH (char const *args_);
+#endif
+
 	/// \brief Print server help
 	/// \param args_ Command arguments
 	void HELP (char const *args_);
@@ -481,10 +756,22 @@ private:
 	/// \param args_ Command arguments
 	void PASV (char const *args_);
 
+#if FTPD_HAS_TLS
+	/// \brief Set protection buffer size
+	/// \param args_ Command arguments
+	void PBSZ (char const *args_);
+#endif
+
 	/// \brief Provide an address to connect to for data transfers
 	/// \param args_ Command arguments
 	void PORT (char const *args_);
 
+#if FTPD_HAS_TLS
+	/// \brief Set data channel protection level
+	/// \param args_ Command arguments
+	void PROT (char const *args_);
+#endif
+
 	/// \brief Print working directory
 	/// \param args_ Command arguments
 	void PWD (char const *args_);
@@ -0,0 +1,130 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ioBuffer.h"
+
+#include <sys/stat.h>
+
+#include <cstddef>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <utility>
+
+/// \brief Internal FTP helpers
+/// \note Shared by FtpSession and the microbenchmarks; not a stable interface
+namespace ftp
+{
+/// \brief Directory listing mode
+enum class ListMode
+{
+	LIST,
+	MLSD,
+	MLST,
+	NLST,
+	STAT,
+};
+
+/// \brief Enabled MLST facts
+struct MlstFacts
+{
+	/// \brief Whether type fact is enabled
+	bool type : 1;
+	/// \brief Whether size fact is enabled
+	bool size : 1;
+	/// \brief Whether modify fact is enabled
+	bool modify : 1;
+	/// \brief Whether perm fact is enabled
+	bool perm : 1;
+	/// \brief Whether unix.mode fact is enabled
+	bool unixMode : 1;
+};
+
+/// \brief Case-insensitive string compare
+/// \param lhs_ Left string
+/// \param rhs_ Right string
+int compare (std::string_view lhs_, std::string_view rhs_);
+
+/// \brief Parse command
+/// \param buffer_ Buffer to parse
+/// \param size_ Size of buffer
+/// \returns {delimiterPos, nextPos}
+std::pair<char *, char *> parseCommand (char *buffer_, std::size_t size_);
+
+/// \brief Decode path
+/// \param buffer_ Buffer to decode
+/// \param size_ Size of buffer
+void decodePath (char *buffer_, std::size_t size_);
+
+/// \brief Encode path
+/// \param buffer_ Buffer to encode
+/// \param quotes_ Whether to encode quotes
+std::string encodePath (std::string_view buffer_, bool quotes_ = false);
+
+/// \brief Get parent directory name of a path
+/// \param path_ Path to get parent of
+std::string dirName (std::string_view path_);
+
+/// \brief Resolve path
+/// \param path_ Path to resolve
+std::string resolvePath (std::string_view path_);
+
+/// \brief Build path from a parent and child
+/// \param cwd_ Parent directory
+/// \param args_ Child component
+std::string buildPath (std::string_view cwd_, std::string_view args_);
+
+/// \brief Build resolved path from a parent and child
+/// \param cwd_ Parent directory
+/// \param args_ Child component
+std::string buildResolvedPath (std::string_view cwd_, std::string_view args_);
+
+/// \brief Format directory entry into buffer
+/// \param buffer_ Buffer to fill
+/// \param mode_ Listing mode
+/// \param facts_ Enabled MLST facts
+/// \param now_ Current time (selects the LIST timestamp format)
+/// \param st_ Entry status
+/// \param path_ Encoded entry path
+/// \param type_ MLST type fact override
+/// \returns 0 on success, EAGAIN if the buffer is too small, otherwise errno
+int fillDirent (IOBuffer &buffer_,
+    ListMode mode_,
+    MlstFacts facts_,
+    std::time_t now_,
+    struct stat const &st_,
+    std::string_view path_,
+    char const *type_ = nullptr);
+
+/// \brief Append formatted text
+/// \param out_ Output string
+/// \param fmt_ Format
+__attribute__ ((format (printf, 2, 3))) void
+    appendFormat (std::string &out_, char const *fmt_, ...);
+
+/// \brief Append quoted and escaped JSON string
+/// \param out_ Output string
+/// \param str_ String to append
+void appendJsonString (std::string &out_, std::string_view str_);
+}
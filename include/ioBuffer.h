@@ -64,6 +64,13 @@ public:
 	/// \brief Get buffer capacity
 	std::size_t capacity () const;
 
+	/// \brief Change buffer capacity
+	/// \param size_ New capacity; must hold usedArea
+	/// [unusable][usedArea][freeArea]
+	///  becomes
+	/// [usedArea][freeArea++++++++++++++++]
+	void resize (std::size_t size_);
+
 	/// \brief Clear buffer; usedArea becomes empty
 	/// [unusable][usedArea][++++++freeArea]
 	///  becomes
@@ -81,7 +88,7 @@ private:
 	std::unique_ptr<char[]> m_buffer;
 
 	/// \brief Buffer size
-	std::size_t const m_size;
+	std::size_t m_size;
 
 	/// \brief Start of usedArea
 	std::size_t m_start = 0;
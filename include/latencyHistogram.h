@@ -0,0 +1,86 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// \brief Log-linear (HDR-style) latency histogram
+///
+/// Each power of two is split into 2^SUB_BITS linear sub-buckets, so every recorded value is
+/// within 12.5% of its bucket bound. Recording is a few shifts and an increment.
+class LatencyHistogram
+{
+public:
+	/// \brief log2 of sub-buckets per power of two
+	constexpr static unsigned SUB_BITS = 3;
+	/// \brief log2 of the largest distinct value; larger values land in the last bucket
+	constexpr static unsigned MAX_BITS = 36;
+	/// \brief Number of buckets
+	constexpr static std::size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+	/// \brief Record a value
+	/// \param value_ Value (nanoseconds)
+	void record (std::uint64_t value_);
+
+	/// \brief Number of recorded values
+	std::uint64_t count () const;
+
+	/// \brief Sum of recorded values
+	std::uint64_t total () const;
+
+	/// \brief Largest recorded value
+	std::uint64_t max () const;
+
+	/// \brief Get percentile
+	/// \param percentile_ Percentile [0,100]
+	/// \note Returns the upper bound of the bucket holding the percentile, capped at max()
+	std::uint64_t percentile (double percentile_) const;
+
+	/// \brief Append JSON members (count, mean, percentiles, max and non-empty buckets)
+	/// \param out_ Output string
+	/// \note Buckets are [upper bound, count] pairs
+	void write (std::string &out_) const;
+
+	/// \brief Get bucket index of a value
+	/// \param value_ Value
+	static std::size_t bucket (std::uint64_t value_);
+
+	/// \brief Get largest value of a bucket
+	/// \param bucket_ Bucket index
+	static std::uint64_t upperBound (std::size_t bucket_);
+
+private:
+	/// \brief Bucket counts
+	std::uint32_t m_buckets[BUCKETS] = {};
+
+	/// \brief Number of recorded values
+	std::uint64_t m_count = 0;
+
+	/// \brief Sum of recorded values
+	std::uint64_t m_total = 0;
+
+	/// \brief Largest recorded value
+	std::uint64_t m_max = 0;
+};
@@ -48,6 +48,16 @@ void drawLog ();
 std::string getLog ();
 #endif
 
+/// \brief Set whether a log level is recorded
+/// \param level_ Log level
+/// \param enable_ Whether to record messages of this level
+void setLogEnabled (LogLevel level_, bool enable_);
+
+/// \brief Whether a log level is recorded
+/// \param level_ Log level
+/// \note Messages of disabled levels are dropped before they are formatted
+bool logEnabled (LogLevel level_);
+
 /// \brief Add debug message to bound log
 /// \param fmt_ Message format
 __attribute__ ((format (printf, 1, 2))) void debug (char const *fmt_, ...);
@@ -7,6 +7,7 @@
 // ftpd implements mdns based on the following:
 // - RFC 1035 (https://datatracker.ietf.org/doc/html/rfc1035)
 // - RFC 6762 (https://datatracker.ietf.org/doc/html/rfc6762)
+// - RFC 6763 (https://datatracker.ietf.org/doc/html/rfc6763)
 //
 // Copyright (C) 2024 Michael Theall
 //
@@ -28,13 +29,45 @@
 #include "sockAddr.h"
 #include "socket.h"
 
-#include <cstddef>
+#include <cstdint>
+#include <string_view>
 
 namespace mdns
 {
-void setHostname (std::string hostname_);
+/// \brief Responder statistics
+struct Stats
+{
+	/// \brief Number of datagrams read
+	std::uint64_t packets;
+
+	/// \brief Number of queries answered
+	std::uint64_t answered;
+
+	/// \brief Number of multicast answers suppressed by the one-second rate limit
+	std::uint64_t suppressed;
+
+	/// \brief Number of datagrams dropped as malformed, looped back or not a query
+	std::uint64_t ignored;
+};
 
+/// \brief Create non-blocking socket joined to the mDNS group
 UniqueSocket createSocket ();
 
-void handleSocket (Socket *socket_, SockAddr const &addr_);
+/// \brief Set advertised host and FTP service
+/// \param hostname_ Hostname; empty for the platform hostname
+/// \param addr_ Listen address
+/// \note Cheap when nothing changed; otherwise rebuilds the prebuilt records, and probes again
+/// if the hostname changed
+void setService (std::string_view hostname_, SockAddr const &addr_);
+
+/// \brief Send probes and announcements that are due
+/// \param socket_ mDNS socket
+void update (Socket *socket_);
+
+/// \brief Answer every pending query
+/// \param socket_ mDNS socket
+void handleSocket (Socket *socket_);
+
+/// \brief Get responder statistics
+Stats stats ();
 }
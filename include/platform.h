@@ -83,6 +83,11 @@ bool loop ();
 /// \brief Platform render
 void render ();
 
+#if FTPD_HEADLESS
+/// \brief Whether a config reload was requested since the last call
+bool reloadRequested ();
+#endif
+
 /// \brief Deinitialize platform
 void exit ();
 
@@ -0,0 +1,77 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/// \brief SHA-256 hash
+class Sha256
+{
+public:
+	/// \brief Digest type
+	using Digest = std::array<std::uint8_t, 32>;
+
+	Sha256 ();
+
+	/// \brief Reset hash state
+	void reset ();
+
+	/// \brief Hash data
+	/// \param data_ Data to hash
+	/// \param size_ Size of data
+	void update (void const *data_, std::size_t size_);
+
+	/// \brief Finish hash
+	/// \note The hash must be reset before it can be reused
+	Digest finish ();
+
+	/// \brief Convert digest to lowercase hex string
+	/// \param digest_ Digest to convert
+	static std::string toHex (Digest const &digest_);
+
+	/// \brief Parse digest from hex string
+	/// \param hex_ Hex string to parse
+	/// \param[out] digest_ Parsed digest
+	static bool fromHex (std::string_view hex_, Digest &digest_);
+
+private:
+	/// \brief Process a 64-byte block
+	/// \param block_ Block to process
+	void transform (std::uint8_t const *block_);
+
+	/// \brief Hash state
+	std::array<std::uint32_t, 8> m_state;
+
+	/// \brief Pending block
+	std::array<std::uint8_t, 64> m_block;
+
+	/// \brief Number of bytes in pending block
+	std::size_t m_blockSize;
+
+	/// \brief Total number of bytes hashed
+	std::uint64_t m_length;
+};
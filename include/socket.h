@@ -22,10 +22,12 @@
 
 #pragma once
 
+#include "ftpFeatures.h"
 #include "ioBuffer.h"
 #include "sockAddr.h"
 
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 #ifdef __NDS__
@@ -49,6 +51,11 @@ extern "C" int poll (pollfd *fds_, nfds_t nfds_, int timeout_);
 #include <poll.h>
 #endif
 
+#if FTPD_HAS_TLS
+struct ssl_st;
+struct ssl_ctx_st;
+#endif
+
 class Socket;
 using UniqueSocket = std::unique_ptr<Socket>;
 using SharedSocket = std::shared_ptr<Socket>;
@@ -63,6 +70,19 @@ public:
 		eDatagram = SOCK_DGRAM,  ///< Datagram socket
 	};
 
+	/// \brief TCP tuning applied to a socket
+	struct Tuning
+	{
+		/// \brief Whether Nagle's algorithm is disabled
+		bool noDelay = false;
+
+		/// \brief Unsent bytes above which the socket stops polling writable; 0 if unset
+		std::size_t notSentLowat = 0;
+
+		/// \brief Time the stack busy-polls the device queue for this socket; 0 if unset
+		std::chrono::microseconds busyPoll{0};
+	};
+
 	/// \brief Poll info
 	struct PollInfo
 	{
@@ -98,6 +118,7 @@ public:
 
 	/// \brief Shutdown socket
 	/// \param how_ Type of shutdown (\sa ::shutdown)
+	/// \note Sends a TLS close_notify first when shutting down writes
 	bool shutdown (int how_);
 
 	/// \brief Set linger option
@@ -121,6 +142,101 @@ public:
 	/// \param size_ Buffer size
 	bool setSendBufferSize (std::size_t size_);
 
+	/// \brief Disable Nagle's algorithm, so small writes are sent without waiting for ACKs
+	/// \param noDelay_ Whether to disable Nagle's algorithm
+	bool setNoDelay (bool noDelay_ = true);
+
+	/// \brief Limit unsent data, so the socket polls writable only when a useful amount fits
+	/// \param bytes_ Unsent byte limit
+	/// \note Only supported on Linux; elsewhere fails with ENOSYS
+	bool setNotSentLowat (std::size_t bytes_);
+
+	/// \brief Busy-poll the device queue on blocking receives and polls instead of waiting for
+	/// an interrupt
+	/// \param time_ Busy-poll time; 0 to disable
+	/// \note Only supported on Linux; elsewhere fails with ENOSYS. Raising it may need
+	/// CAP_NET_ADMIN, and poll() only busy-polls if net.core.busy_poll is set
+	bool setBusyPoll (std::chrono::microseconds time_);
+
+	/// \brief Get TCP tuning applied by the setters
+	Tuning const &tuning () const;
+
+	/// \brief Get recv buffer size
+	/// \returns Buffer size as reported by the stack, or 0 on error
+	std::size_t recvBufferSize () const;
+
+	/// \brief Get send buffer size
+	/// \returns Buffer size as reported by the stack, or 0 on error
+	std::size_t sendBufferSize () const;
+
+#if FTPD_HAS_TCP_INFO
+	/// \brief TCP connection measurements
+	struct TcpInfo
+	{
+		/// \brief Smoothed round-trip time measured by the sender
+		std::chrono::microseconds rtt;
+
+		/// \brief Minimum round-trip time measured by the sender; excludes queueing delay
+		std::chrono::microseconds minRtt;
+
+		/// \brief Round-trip time estimated by the receiver
+		std::chrono::microseconds rcvRtt;
+
+		/// \brief Most recent delivery rate in bytes per second
+		std::uint64_t deliveryRate;
+
+		/// \brief Segments sent, including retransmissions and pure ACKs
+		std::uint32_t segsOut;
+	};
+
+	/// \brief Get TCP connection measurements
+	/// \param[out] info_ Measurements
+	bool tcpInfo (TcpInfo &info_) const;
+#endif
+
+#if FTPD_HAS_TLS
+	/// \brief TLS connection state
+	struct TlsInfo
+	{
+		/// \brief Whether the handshake has completed
+		bool established;
+
+		/// \brief Whether the handshake resumed an earlier session
+		bool resumed;
+
+		/// \brief Whether the kernel encrypts what is sent (kTLS)
+		bool ktlsSend;
+
+		/// \brief Whether the kernel decrypts what is received (kTLS)
+		bool ktlsRecv;
+
+		/// \brief Protocol version name
+		char const *version;
+
+		/// \brief Cipher name
+		char const *cipher;
+	};
+
+	/// \brief Start TLS as the server side
+	/// \param context_ TLS context
+	/// \note The handshake runs in the reads and writes that follow; poll() waits for whichever
+	/// direction it needs
+	bool startTls (ssl_ctx_st *context_);
+
+	/// \brief Send TLS close_notify
+	/// \returns false if it must be retried once poll() reports the socket writable
+	/// \note Without TLS, or if the peer is gone, there is nothing to wait for
+	bool closeNotify ();
+
+	/// \brief Whether TLS was started
+	bool tls () const;
+
+	/// \brief Get TLS connection state
+	/// \param[out] info_ Connection state
+	/// \returns false if TLS wasn't started
+	bool tlsInfo (TlsInfo &info_) const;
+#endif
+
 #ifndef __NDS__
 	/// \brief Join multicast group
 	/// \param addr_ Multicast group address
@@ -211,9 +327,32 @@ private:
 	/// \param Socket fd
 	int const m_fd;
 
+	/// \param TCP tuning
+	Tuning m_tuning;
+
 	/// \param Whether listening
 	bool m_listening : 1;
 
 	/// \param Whether connected
 	bool m_connected : 1;
+
+#if FTPD_HAS_TLS
+	/// \brief Map a failed TLS read or write to a return value and errno
+	/// \param rc_ OpenSSL return value
+	/// \param[out] want_ Events the operation waits for
+	/// \param op_ Operation name to log
+	std::make_signed_t<std::size_t> tlsError (int rc_, int &want_, char const *op_);
+
+	/// \param TLS connection
+	ssl_st *m_ssl = nullptr;
+
+	/// \param Events a TLS read waits for; a handshake may need POLLOUT
+	int m_tlsReadWant = POLLIN;
+
+	/// \param Events a TLS write waits for; a handshake may need POLLIN
+	int m_tlsWriteWant = POLLOUT;
+
+	/// \param Error that ended a TLS read after it had data; reported by the next read
+	int m_tlsReadError = 0;
+#endif
 };
@@ -0,0 +1,244 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ftpFeatures.h"
+
+#if FTPD_HAS_STATS_SEGMENT
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// \brief Shared-memory statistics segment
+/// The server publishes its counters into a POSIX shared memory object laid out as a server record
+/// followed by fixed-size session slots. Each record is guarded by its own seqlock, so monitors
+/// such as ftpd-top can map the segment read-only and sample it at any rate without taking locks
+/// or touching the control channel.
+namespace stats
+{
+/// \brief Segment magic ("ftpd")
+constexpr std::uint32_t SEGMENT_MAGIC = 0x64707466;
+
+/// \brief Segment layout version
+constexpr std::uint32_t SEGMENT_VERSION = 2;
+
+/// \brief Number of session slots
+constexpr std::size_t SEGMENT_SLOTS = 256;
+
+/// \brief Server record
+struct ServerRecord
+{
+	/// \brief Server process id
+	std::uint64_t pid;
+	/// \brief Server start time (seconds since epoch)
+	std::int64_t startTime;
+	/// \brief Publish time (CLOCK_MONOTONIC nanoseconds)
+	std::uint64_t updated;
+
+	/// \brief Number of accepted connections
+	std::uint64_t accepts;
+	/// \brief Number of active sessions
+	std::uint32_t sessions;
+	/// \brief Number of sessions without a slot
+	std::uint32_t unpublished;
+
+	/// \brief Number of loop iterations
+	std::uint64_t loopIterations;
+	/// \brief Total loop time in nanoseconds
+	std::uint64_t loopTotal;
+	/// \brief Longest loop iteration in nanoseconds
+	std::uint64_t loopMax;
+
+	/// \brief Number of command socket wakeups serviced
+	std::uint64_t controlCount;
+	/// \brief 99th percentile of control-channel latency in nanoseconds
+	std::uint64_t controlP99;
+	/// \brief Longest control-channel latency in nanoseconds
+	std::uint64_t controlMax;
+
+	/// \brief Total session buffer capacity
+	std::uint64_t bufferCapacity;
+	/// \brief Total session buffer bytes in use
+	std::uint64_t bufferUsed;
+};
+
+/// \brief Session record
+struct SessionRecord
+{
+	/// \brief Session id; 0 if the slot is unused
+	std::uint64_t id;
+
+	/// \brief Peer address
+	char peer[48];
+	/// \brief Peer port
+	std::uint16_t port;
+	/// \brief Session state (0 command, 1 data connect, 2 data transfer)
+	std::uint8_t state;
+	/// \brief Whether the data connection receives
+	std::uint8_t recv;
+
+	/// \brief Current work item (truncated)
+	char workItem[256];
+
+	/// \brief Transfer position
+	std::uint64_t position;
+	/// \brief Transfer size
+	std::uint64_t size;
+	/// \brief Transfer rate in bytes/s (EWMA)
+	double rate;
+
+	/// \brief Bytes received on the command socket
+	std::uint64_t controlIn;
+	/// \brief Bytes sent on the command socket
+	std::uint64_t controlOut;
+	/// \brief Bytes received on data sockets
+	std::uint64_t dataIn;
+	/// \brief Bytes sent on data sockets
+	std::uint64_t dataOut;
+
+	/// \brief Nanoseconds spent in each state
+	std::uint64_t stateTime[3];
+
+	/// \brief Number of commands handled
+	std::uint64_t commands;
+	/// \brief Total handler time in nanoseconds
+	std::uint64_t commandTime;
+	/// \brief Number of unrecognized commands
+	std::uint64_t invalidCommands;
+};
+
+/// \brief Seqlock-guarded record
+/// The sequence is odd while the record is being written
+template <typename T>
+struct alignas (64) Seqlocked
+{
+	/// \brief Sequence number
+	std::atomic<std::uint32_t> seq;
+
+	/// \brief Record
+	T record;
+};
+
+/// \brief Segment layout
+struct Segment
+{
+	/// \brief Segment magic
+	std::uint32_t magic;
+	/// \brief Segment layout version
+	std::uint32_t version;
+	/// \brief Number of session slots
+	std::uint32_t slots;
+	/// \brief Size of a session slot
+	std::uint32_t slotSize;
+
+	/// \brief Server record
+	Seqlocked<ServerRecord> server;
+
+	/// \brief Session slots
+	Seqlocked<SessionRecord> sessions[SEGMENT_SLOTS];
+};
+
+static_assert (std::atomic<std::uint32_t>::is_always_lock_free);
+
+/// \brief Publish a record
+/// \param slot_ Slot to write
+/// \param record_ Record to publish
+/// \note Single writer only
+template <typename T>
+void store (Seqlocked<T> &slot_, T const &record_)
+{
+	auto const seq = slot_.seq.load (std::memory_order_relaxed);
+	slot_.seq.store (seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	slot_.record = record_;
+
+	slot_.seq.store (seq + 2, std::memory_order_release);
+}
+
+/// \brief Read a consistent copy of a record
+/// \param slot_ Slot to read
+/// \param record_ Output record
+/// \returns Whether a consistent copy was read before giving up
+template <typename T>
+bool load (Seqlocked<T> const &slot_, T &record_)
+{
+	for (unsigned i = 0; i < 1000; ++i)
+	{
+		auto const seq = slot_.seq.load (std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		record_ = slot_.record;
+
+		std::atomic_thread_fence (std::memory_order_acquire);
+		if (slot_.seq.load (std::memory_order_relaxed) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/// \brief Mapped statistics segment
+class SegmentMap
+{
+public:
+	~SegmentMap ();
+
+	SegmentMap ();
+
+	SegmentMap (SegmentMap const &that_) = delete;
+
+	SegmentMap &operator= (SegmentMap const &that_) = delete;
+
+	/// \brief Create and map a segment for writing
+	/// \param name_ Shared memory object name
+	bool create (std::string name_);
+
+	/// \brief Map an existing segment for reading
+	/// \param name_ Shared memory object name
+	/// \note Fails with EPROTO on a layout mismatch
+	bool open (std::string name_);
+
+	/// \brief Unmap segment; removes it if created
+	void close ();
+
+	/// \brief Mapped segment
+	Segment *get () const;
+
+	/// \brief Shared memory object name
+	std::string const &name () const;
+
+private:
+	/// \brief Mapped segment
+	Segment *m_segment = nullptr;
+
+	/// \brief Shared memory object name
+	std::string m_name;
+
+	/// \brief Whether this map created the segment
+	bool m_owner = false;
+};
+}
+#endif
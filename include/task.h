@@ -0,0 +1,548 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ioBuffer.h"
+#include "platform.h"
+#include "socket.h"
+
+#include <cassert>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+/// \brief Coroutine execution layer for session transfers
+/// A transfer is a straight-line coroutine. It suspends on a socket readiness or deadline it
+/// records in a Wait, and the session's event loop resumes it when poll() reports that socket or
+/// the deadline passes. Frames come from the session's Arena.
+namespace co
+{
+/// \brief Recycling allocator for coroutine frames
+/// A session runs one transfer at a time, so the same few frame sizes repeat. Freed frames are
+/// kept for reuse, and steady-state transfers don't touch the heap.
+class Arena
+{
+public:
+	~Arena ();
+
+	Arena ();
+
+	Arena (Arena const &that_) = delete;
+
+	Arena &operator= (Arena const &that_) = delete;
+
+	/// \brief Allocate frame
+	/// \param arena_ Arena to allocate from; nullptr for the heap
+	/// \param size_ Frame size
+	static void *allocate (Arena *arena_, std::size_t size_);
+
+	/// \brief Release frame to the arena it came from
+	/// \param frame_ Frame to release
+	static void deallocate (void *frame_) noexcept;
+
+	/// \brief Bytes held by the arena, in use or free
+	std::size_t capacity () const;
+
+	/// \brief Frames that had to be allocated from the heap
+	std::uint64_t misses () const;
+
+private:
+	/// \brief Frame header
+	struct alignas (std::max_align_t) Block
+	{
+		/// \brief Owning arena; nullptr for heap frames
+		Arena *arena;
+		/// \brief Next free block
+		Block *next;
+		/// \brief Frame capacity
+		std::size_t size;
+	};
+
+	/// \brief Free blocks
+	Block *m_free = nullptr;
+
+	/// \brief Bytes held
+	std::size_t m_capacity = 0;
+
+	/// \brief Blocks in use
+	std::size_t m_used = 0;
+
+	/// \brief Heap allocations
+	std::uint64_t m_misses = 0;
+};
+
+/// \brief Get frame arena of a coroutine's owner
+/// \param owner_ Object a member coroutine runs on
+/// \note Member coroutines of classes without frameArena() use the heap
+template <typename Owner>
+Arena *ownerArena (Owner &owner_)
+{
+	if constexpr (requires { owner_.frameArena (); })
+		return &owner_.frameArena ();
+	else
+		return nullptr;
+}
+
+template <typename T>
+class Task;
+
+/// \brief Promise state shared by every Task
+class PromiseBase
+{
+public:
+	/// \brief Allocate frame of a member coroutine from its owner's arena
+	/// \param size_ Frame size
+	/// \param owner_ Object the coroutine runs on
+	template <typename Owner, typename... Args>
+	static void *operator new (std::size_t const size_, Owner &owner_, Args &&...)
+	{
+		return Arena::allocate (ownerArena (owner_), size_);
+	}
+
+	/// \brief Allocate frame from the heap
+	/// \param size_ Frame size
+	static void *operator new (std::size_t const size_)
+	{
+		return Arena::allocate (nullptr, size_);
+	}
+
+	/// \brief Release frame
+	/// \param frame_ Frame to release
+	static void operator delete (void *const frame_) noexcept
+	{
+		Arena::deallocate (frame_);
+	}
+
+	/// \brief Tasks start when first resumed or awaited
+	std::suspend_always initial_suspend () noexcept
+	{
+		return {};
+	}
+
+	/// \brief Resume the awaiting task, if any
+	auto final_suspend () noexcept
+	{
+		struct Final
+		{
+			bool await_ready () noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend (std::coroutine_handle<>) noexcept
+			{
+				return continuation ? continuation : std::noop_coroutine ();
+			}
+
+			void await_resume () noexcept
+			{
+			}
+
+			std::coroutine_handle<> continuation;
+		};
+
+		return Final{m_continuation};
+	}
+
+	/// \brief Transfers report their errors as replies; nothing is thrown
+	void unhandled_exception () noexcept
+	{
+		std::terminate ();
+	}
+
+private:
+	template <typename T>
+	friend class Task;
+
+	/// \brief Task awaiting this one
+	std::coroutine_handle<> m_continuation;
+};
+
+/// \brief Promise holding a result
+template <typename T>
+class Promise : public PromiseBase
+{
+public:
+	/// \brief Store result
+	/// \param value_ Result
+	void return_value (T value_)
+	{
+		m_value = std::move (value_);
+	}
+
+protected:
+	/// \brief Result
+	T m_value{};
+};
+
+/// \brief Promise without a result
+template <>
+class Promise<void> : public PromiseBase
+{
+public:
+	void return_void () noexcept
+	{
+	}
+};
+
+/// \brief Lazily started coroutine
+/// \tparam T Result type
+/// Awaiting a task runs it and resumes the awaiting coroutine when it finishes; the root task is
+/// resumed by whoever owns it.
+template <typename T = void>
+class Task
+{
+public:
+	/// \brief Promise type
+	class promise_type : public Promise<T>
+	{
+	public:
+		Task get_return_object () noexcept
+		{
+			return Task (std::coroutine_handle<promise_type>::from_promise (*this));
+		}
+
+	private:
+		friend class Task;
+	};
+
+	~Task ()
+	{
+		if (m_handle)
+			m_handle.destroy ();
+	}
+
+	Task () = default;
+
+	Task (Task const &that_) = delete;
+
+	/// \brief Move constructor
+	/// \param that_ Object to move from
+	Task (Task &&that_) noexcept : m_handle (std::exchange (that_.m_handle, nullptr))
+	{
+	}
+
+	Task &operator= (Task const &that_) = delete;
+
+	/// \brief Move assignment
+	/// \param that_ Object to move from
+	/// \note Destroys the current coroutine, which must not be running
+	Task &operator= (Task &&that_) noexcept
+	{
+		if (this != &that_)
+		{
+			if (m_handle)
+				m_handle.destroy ();
+			m_handle = std::exchange (that_.m_handle, nullptr);
+		}
+
+		return *this;
+	}
+
+	/// \brief Whether a coroutine is held
+	explicit operator bool () const
+	{
+		return static_cast<bool> (m_handle);
+	}
+
+	/// \brief Whether the coroutine finished
+	bool done () const
+	{
+		return m_handle.done ();
+	}
+
+	/// \brief Coroutine to resume first
+	std::coroutine_handle<> handle () const
+	{
+		return m_handle;
+	}
+
+	/// \brief Run task until it finishes, then resume the awaiting coroutine
+	auto operator co_await () && noexcept
+	{
+		struct Awaiter
+		{
+			bool await_ready () noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<> await_suspend (std::coroutine_handle<> const handle_) noexcept
+			{
+				task.m_handle.promise ().m_continuation = handle_;
+				return task.m_handle;
+			}
+
+			T await_resume () noexcept
+			{
+				if constexpr (!std::is_void_v<T>)
+					return std::move (task.m_handle.promise ().m_value);
+			}
+
+			Task &task;
+		};
+
+		return Awaiter{*this};
+	}
+
+private:
+	/// \brief Parameterized constructor
+	/// \param handle_ Coroutine
+	explicit Task (std::coroutine_handle<promise_type> const handle_) : m_handle (handle_)
+	{
+	}
+
+	/// \brief Coroutine
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+/// \brief What a suspended coroutine waits for
+/// \note Filled by the awaitables below; the event loop polls socket for events, and resumes
+/// handle once they are ready or the deadline passes
+struct Wait
+{
+	/// \brief Time point type
+	using time_point = platform::steady_clock::time_point;
+
+	/// \brief Whether a coroutine is waiting
+	explicit operator bool () const
+	{
+		return static_cast<bool> (handle);
+	}
+
+	/// \brief Wait for nothing
+	void clear ()
+	{
+		*this = {};
+	}
+
+	/// \brief Coroutine to resume
+	std::coroutine_handle<> handle;
+
+	/// \brief Socket to poll; nullptr to wait only for the deadline
+	Socket *socket = nullptr;
+
+	/// \brief Events to poll for
+	int events = 0;
+
+	/// \brief Ready events; 0 if the deadline passed first
+	int revents = 0;
+
+	/// \brief Time to resume even if the socket isn't ready
+	time_point deadline = time_point::max ();
+
+	/// \brief Whether the coroutine can continue without waiting for the socket
+	bool yielded = false;
+};
+
+/// \brief Awaitable socket readiness or deadline
+class Ready
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param wait_ Wait to record in
+	/// \param socket_ Socket to poll; nullptr to wait only for the deadline
+	/// \param events_ Events to poll for
+	/// \param deadline_ Time to give up
+	Ready (Wait &wait_, Socket *const socket_, int const events_, Wait::time_point const deadline_)
+	    : m_wait (wait_), m_socket (socket_), m_events (events_), m_deadline (deadline_)
+	{
+		// nothing would ever resume it
+		assert (socket_ || deadline_ != Wait::time_point::max ());
+	}
+
+	bool await_ready () noexcept
+	{
+		return false;
+	}
+
+	void await_suspend (std::coroutine_handle<> const handle_) noexcept
+	{
+		m_wait.handle   = handle_;
+		m_wait.socket   = m_socket;
+		m_wait.events   = m_events;
+		m_wait.revents  = 0;
+		m_wait.deadline = m_deadline;
+		m_wait.yielded  = false;
+	}
+
+	/// \returns Ready events; 0 if the deadline passed first
+	int await_resume () noexcept
+	{
+		return m_wait.revents;
+	}
+
+private:
+	/// \brief Wait to record in
+	Wait &m_wait;
+
+	/// \brief Socket to poll
+	Socket *const m_socket;
+
+	/// \brief Events to poll for
+	int const m_events;
+
+	/// \brief Time to give up
+	Wait::time_point const m_deadline;
+};
+
+/// \brief Wait until a socket is ready
+/// \param wait_ Wait to record in
+/// \param socket_ Socket to poll
+/// \param events_ Events to poll for
+/// \param deadline_ Time to give up
+inline Ready ready (Wait &wait_,
+    Socket &socket_,
+    int const events_,
+    Wait::time_point const deadline_ = Wait::time_point::max ())
+{
+	return Ready (wait_, &socket_, events_, deadline_);
+}
+
+/// \brief Wait until a deadline
+/// \param wait_ Wait to record in
+/// \param deadline_ Time to resume
+inline Ready sleepUntil (Wait &wait_, Wait::time_point const deadline_)
+{
+	return Ready (wait_, nullptr, 0, deadline_);
+}
+
+/// \brief Awaitable end of a transfer step
+/// \note The owner resumes a yielded coroutine straight away while its quantum lasts, and then
+/// once the socket is ready, or on its next pass if there is no socket, so other sessions get a
+/// turn
+class Yield : public Ready
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param wait_ Wait to record in
+	/// \param socket_ Socket to poll once the quantum is used up
+	/// \param events_ Events to poll for
+	Yield (Wait &wait_, Socket &socket_, int const events_)
+	    : Ready (wait_, &socket_, events_, Wait::time_point::max ()), m_wait (wait_)
+	{
+	}
+
+	/// \brief Parameterized constructor
+	/// \param wait_ Wait to record in
+	Yield (Wait &wait_)
+	    : Ready (wait_, nullptr, 0, platform::steady_clock::now ()), m_wait (wait_)
+	{
+	}
+
+	void await_suspend (std::coroutine_handle<> const handle_) noexcept
+	{
+		Ready::await_suspend (handle_);
+		m_wait.yielded = true;
+	}
+
+	void await_resume () noexcept
+	{
+	}
+
+private:
+	/// \brief Wait to record in
+	Wait &m_wait;
+};
+
+/// \brief End a transfer step
+/// \param wait_ Wait to record in
+/// \param socket_ Socket to poll once the quantum is used up
+/// \param events_ Events to poll for
+inline Yield yield (Wait &wait_, Socket &socket_, int const events_)
+{
+	return Yield (wait_, socket_, events_);
+}
+
+/// \brief End a step of work that waits on no socket
+/// \param wait_ Wait to record in
+inline Yield yield (Wait &wait_)
+{
+	return Yield (wait_);
+}
+
+/// \brief Awaitable file read or write
+/// \tparam File File type (fs::File or fs::DevFile)
+/// \tparam WRITE Whether to write
+/// \note Only a seam for now: the read or write runs inline and blocks the network thread. The
+/// consoles have no async file API, and although Linux has one (io_uring, or a worker thread),
+/// FtpServer::loop can only wake for socket readiness or a deadline, so nothing could resume the
+/// transfer when the I/O completes
+template <typename File, bool WRITE>
+class FileIO
+{
+public:
+	/// \brief Parameterized constructor
+	/// \param file_ File
+	/// \param buffer_ Buffer to fill or drain
+	FileIO (File &file_, IOBuffer &buffer_) : m_file (file_), m_buffer (buffer_)
+	{
+	}
+
+	bool await_ready () noexcept
+	{
+		return true;
+	}
+
+	void await_suspend (std::coroutine_handle<>) noexcept
+	{
+	}
+
+	/// \returns Bytes transferred, 0 at end of file, -1 on error
+	std::make_signed_t<std::size_t> await_resume ()
+	{
+		if constexpr (WRITE)
+			return m_file.write (m_buffer);
+		else
+			return m_file.read (m_buffer);
+	}
+
+private:
+	/// \brief File
+	File &m_file;
+
+	/// \brief Buffer
+	IOBuffer &m_buffer;
+};
+
+/// \brief Read file into buffer
+/// \param file_ File
+/// \param buffer_ Buffer to fill
+template <typename File>
+FileIO<File, false> read (File &file_, IOBuffer &buffer_)
+{
+	return FileIO<File, false> (file_, buffer_);
+}
+
+/// \brief Write buffer to file
+/// \param file_ File
+/// \param buffer_ Buffer to drain
+template <typename File>
+FileIO<File, true> write (File &file_, IOBuffer &buffer_)
+{
+	return FileIO<File, true> (file_, buffer_);
+}
+}
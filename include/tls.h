@@ -0,0 +1,73 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// ftpd implements FTPS based on the following:
+// - RFC 4217 (https://datatracker.ietf.org/doc/html/rfc4217)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "socket.h"
+
+#if FTPD_HAS_TLS
+#include <cstdint>
+#include <string_view>
+
+/// \brief Server TLS context for explicit FTPS (AUTH TLS)
+/// Handshakes run in user space through OpenSSL. Where the kernel supports it, the negotiated keys
+/// are then handed to kTLS, so records are encrypted in the socket layer and transfers keep their
+/// plain send path.
+namespace tls
+{
+/// \brief TLS statistics
+struct Stats
+{
+	/// \brief Number of completed handshakes
+	std::uint64_t handshakes;
+
+	/// \brief Number of handshakes that resumed an earlier session
+	std::uint64_t resumed;
+
+	/// \brief Number of connections whose sends are encrypted by the kernel
+	std::uint64_t ktlsSend;
+
+	/// \brief Number of connections whose receives are decrypted by the kernel
+	std::uint64_t ktlsRecv;
+
+	/// \brief Number of fatal alerts sent
+	std::uint64_t alerts;
+};
+
+/// \brief Configure server context
+/// \param cert_ Certificate chain path (PEM); empty to disable TLS
+/// \param key_ Private key path (PEM); empty if it is in the certificate file
+/// \param ktls_ Whether to hand record encryption to the kernel where supported
+/// \note Cheap when nothing changed; connections keep the context they started with
+void configure (std::string_view cert_, std::string_view key_, bool ktls_);
+
+/// \brief Get server context
+/// \returns Context, or nullptr if TLS is disabled or the certificate failed to load
+ssl_ctx_st *context ();
+
+/// \brief Get TLS statistics
+Stats stats ();
+}
+#endif
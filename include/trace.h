@@ -0,0 +1,117 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#ifndef FTPD_TRACE
+#define FTPD_TRACE 0
+#endif
+
+#if FTPD_TRACE
+#include <cstddef>
+#include <cstdint>
+
+/// \brief Event tracing
+/// Trace points record complete events into a lock-free ring owned by the calling thread. The
+/// rings can be dumped at any time as Chrome trace JSON, which loads in Perfetto or
+/// chrome://tracing. Without FTPD_TRACE the trace point macros compile to nothing.
+namespace trace
+{
+/// \brief Events kept per thread; older events are overwritten
+#if defined(__3DS__) || defined(__SWITCH__)
+constexpr std::size_t RING_SIZE = 16384;
+#else
+constexpr std::size_t RING_SIZE = 65536;
+#endif
+
+/// \brief Maximum number of traced threads
+constexpr std::size_t MAX_THREADS = 16;
+
+/// \brief Default dump path
+constexpr char const *DEFAULT_PATH = FTPDCONFIG ".trace.json";
+
+/// \brief Get trace clock (nanoseconds since the first trace point)
+std::uint64_t now ();
+
+/// \brief Record complete event
+/// \param name_ Event name; must outlive the trace
+/// \param start_ Start time from now()
+/// \param arg_ Event argument
+void record (char const *name_, std::uint64_t start_, std::int64_t arg_);
+
+/// \brief Write all rings as Chrome trace JSON
+/// \param path_ Output path
+/// \returns Number of events written, or -1 on error (errno is set)
+long dump (char const *path_);
+
+/// \brief Request a dump from a signal handler
+void requestDump ();
+
+/// \brief Whether a dump was requested; clears the request
+bool dumpRequested ();
+
+/// \brief Scoped trace point
+class Scope
+{
+public:
+	~Scope ();
+
+	/// \brief Parameterized constructor
+	/// \param name_ Event name; must outlive the trace
+	/// \param arg_ Event argument
+	Scope (char const *name_, std::int64_t arg_ = 0);
+
+	Scope (Scope const &that_) = delete;
+
+	Scope &operator= (Scope const &that_) = delete;
+
+private:
+	/// \brief Event name
+	char const *const m_name;
+
+	/// \brief Event argument
+	std::int64_t const m_arg;
+
+	/// \brief Start time
+	std::uint64_t const m_start;
+};
+}
+
+#define TRACE_CONCAT_(a_, b_) a_##b_
+#define TRACE_CONCAT(a_, b_) TRACE_CONCAT_ (a_, b_)
+
+/// \brief Trace the enclosing scope
+#define TRACE_SCOPE(name_) trace::Scope TRACE_CONCAT (traceScope, __LINE__) (name_)
+
+/// \brief Trace the enclosing scope with an argument
+#define TRACE_SCOPE_ARG(name_, arg_)                                                               \
+	trace::Scope TRACE_CONCAT (traceScope, __LINE__) (name_, arg_)
+#else
+#define TRACE_SCOPE(name_)                                                                         \
+	do                                                                                             \
+	{                                                                                              \
+	} while (0)
+#define TRACE_SCOPE_ARG(name_, arg_)                                                               \
+	do                                                                                             \
+	{                                                                                              \
+	} while (0)
+#endif
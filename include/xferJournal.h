@@ -0,0 +1,182 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "ftpFeatures.h"
+
+#if FTPD_HAS_XFER_JOURNAL
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/// \brief Binary transfer journal
+/// Every finished transfer is appended as a fixed-size record to a preallocated, memory-mapped
+/// file, so recording a transfer is a copy into the mapping. Files are rotated when full or after a
+/// period, and ftpd-xferlog converts them to wu-ftpd xferlog text.
+namespace journal
+{
+/// \brief File magic ("ftjl")
+constexpr std::uint32_t FILE_MAGIC = 0x6c6a7466;
+
+/// \brief File layout version
+constexpr std::uint32_t FILE_VERSION = 1;
+
+/// \brief Default number of records per file
+constexpr std::size_t DEFAULT_RECORDS = 65536;
+
+/// \brief Default rotation period
+constexpr std::chrono::seconds DEFAULT_ROTATE = std::chrono::hours (24);
+
+/// \brief Transfer record
+struct Record
+{
+	/// \brief Completion time (nanoseconds since epoch)
+	std::int64_t time;
+	/// \brief Session id
+	std::uint64_t session;
+	/// \brief Bytes transferred on the data connection
+	std::uint64_t bytes;
+	/// \brief Nanoseconds from command to final reply
+	std::uint64_t duration;
+	/// \brief Phase durations in nanoseconds: open, connect, first byte, transfer, reply
+	std::uint64_t phases[5];
+
+	/// \brief Peer port
+	std::uint16_t port;
+	/// \brief Direction ('o' outgoing, 'i' incoming)
+	char direction;
+	/// \brief Access mode ('r' real user, 'a' anonymous)
+	char access;
+	/// \brief Whether the transfer completed
+	std::uint8_t complete;
+	/// \brief Whether MODE Z was used
+	std::uint8_t deflate;
+	/// \brief Whether the transfer was a directory listing
+	std::uint8_t listing;
+	/// \brief Reserved
+	std::uint8_t reserved;
+
+	/// \brief Command verb
+	char verb[8];
+	/// \brief Peer address
+	char peer[48];
+	/// \brief User name (truncated)
+	char user[32];
+	/// \brief Path (truncated)
+	char path[344];
+};
+
+static_assert (sizeof (Record) == 512);
+
+/// \brief File header; records follow it
+struct Header
+{
+	/// \brief File magic
+	std::uint32_t magic;
+	/// \brief File layout version
+	std::uint32_t version;
+	/// \brief Size of a record
+	std::uint32_t recordSize;
+	/// \brief Reserved
+	std::uint32_t reserved;
+
+	/// \brief Number of record slots
+	std::uint64_t capacity;
+	/// \brief Creation time (nanoseconds since epoch)
+	std::int64_t created;
+
+	/// \brief Number of records written; published after each record is copied
+	std::atomic<std::uint64_t> records;
+
+	/// \brief Padding to keep records aligned
+	char padding[sizeof (Record) - 40];
+};
+
+static_assert (sizeof (Header) == sizeof (Record));
+static_assert (std::atomic<std::uint64_t>::is_always_lock_free);
+
+/// \brief Format a record as a wu-ftpd xferlog line
+/// \param record_ Record to format
+/// \returns Line including the trailing newline
+std::string toXferlog (Record const &record_);
+
+/// \brief Append-only journal writer
+class Journal
+{
+public:
+	~Journal ();
+
+	Journal ();
+
+	Journal (Journal const &that_) = delete;
+
+	Journal &operator= (Journal const &that_) = delete;
+
+	/// \brief Open a journal for appending
+	/// \param path_ Journal path; rotated files get a timestamp suffix
+	/// \param records_ Records per file
+	/// \param rotate_ Maximum age of a file before it is rotated
+	/// \note Continues an existing journal with the same layout; anything else is rotated away
+	bool open (std::string path_, std::size_t records_, std::chrono::seconds rotate_);
+
+	/// \brief Unmap journal
+	void close ();
+
+	/// \brief Append a record
+	/// \param record_ Record to append
+	/// \returns Whether the record was written
+	/// \note Single writer only
+	bool append (Record const &record_);
+
+	/// \brief Journal path
+	std::string const &path () const;
+
+private:
+	/// \brief Map the journal file, creating it if needed
+	bool map ();
+
+	/// \brief Rename the journal file aside and start a new one
+	bool rotate ();
+
+	/// \brief Journal path
+	std::string m_path;
+
+	/// \brief Mapped file header
+	Header *m_header = nullptr;
+
+	/// \brief Mapped records
+	Record *m_records = nullptr;
+
+	/// \brief Number of records per new file
+	std::size_t m_capacity = 0;
+
+	/// \brief Rotation period
+	std::chrono::seconds m_rotate{};
+
+	/// \brief Time at which the current file is rotated (nanoseconds since epoch)
+	std::int64_t m_rotateAt = 0;
+};
+}
+#endif
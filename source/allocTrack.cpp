@@ -0,0 +1,294 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "allocTrack.h"
+
+#if FTPD_ALLOC_TRACKING
+#include "ftpUtil.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+namespace
+{
+/// \brief Tag counters
+struct Tag
+{
+	/// \brief Tag name
+	std::atomic<char const *> name = nullptr;
+	/// \brief Number of times the tag's scope was entered
+	std::atomic<std::uint64_t> operations = 0;
+	/// \brief Number of allocations
+	std::atomic<std::uint64_t> allocations = 0;
+	/// \brief Bytes allocated
+	std::atomic<std::uint64_t> bytes = 0;
+};
+
+/// \brief Tag table, open addressed by name pointer
+Tag s_tags[alloc::MAX_TAGS];
+
+/// \brief Allocations outside any scope, or beyond the tag table
+Tag s_untagged;
+
+/// \brief Calling thread's current tag
+thread_local Tag *t_tag = nullptr;
+
+/// \brief Find or insert tag
+/// \param name_ Tag name
+Tag &lookup (char const *const name_)
+{
+	auto const hash = (reinterpret_cast<std::uintptr_t> (name_) >> 3) * 0x9E3779B1u;
+	for (std::size_t i = 0; i < alloc::MAX_TAGS; ++i)
+	{
+		auto &tag = s_tags[(hash + i) % alloc::MAX_TAGS];
+
+		// a failed exchange loads the winner's name
+		char const *name = nullptr;
+		if (tag.name.compare_exchange_strong (name, name_, std::memory_order_acq_rel) ||
+		    name == name_)
+			return tag;
+	}
+
+	return s_untagged;
+}
+
+/// \brief Allocate and count
+/// \param size_ Size to allocate
+/// \param align_ Alignment
+void *allocate (std::size_t const size_, std::size_t const align_ = 0)
+{
+	auto &tag = t_tag ? *t_tag : s_untagged;
+	tag.allocations.fetch_add (1, std::memory_order_relaxed);
+	tag.bytes.fetch_add (size_, std::memory_order_relaxed);
+
+	// aligned_alloc requires a multiple of the alignment
+	auto const p = align_ ? std::aligned_alloc (align_, (size_ + align_ - 1) / align_ * align_)
+	                      : std::malloc (size_ ? size_ : 1);
+	if (!p)
+		throw std::bad_alloc ();
+
+	return p;
+}
+
+/// \brief Get tag counts
+/// \param tag_ Tag
+alloc::Counts load (Tag const &tag_)
+{
+	return {
+	    .operations  = tag_.operations.load (std::memory_order_relaxed),
+	    .allocations = tag_.allocations.load (std::memory_order_relaxed),
+	    .bytes       = tag_.bytes.load (std::memory_order_relaxed),
+	};
+}
+
+/// \brief Add counts
+/// \param lhs_ Counts to add to
+/// \param rhs_ Counts to add
+void add (alloc::Counts &lhs_, alloc::Counts const &rhs_)
+{
+	lhs_.operations += rhs_.operations;
+	lhs_.allocations += rhs_.allocations;
+	lhs_.bytes += rhs_.bytes;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+alloc::Scope::~Scope ()
+{
+	t_tag = static_cast<Tag *> (m_previous);
+}
+
+alloc::Scope::Scope (char const *const tag_) : m_previous (t_tag)
+{
+	auto &tag = lookup (tag_);
+	tag.operations.fetch_add (1, std::memory_order_relaxed);
+	t_tag = &tag;
+}
+
+alloc::Counts alloc::counts (char const *const tag_)
+{
+	Counts counts{};
+	if (std::strcmp (tag_, UNTAGGED) == 0)
+		add (counts, load (s_untagged));
+
+	for (auto const &tag : s_tags)
+	{
+		auto const name = tag.name.load (std::memory_order_acquire);
+		if (name && std::strcmp (name, tag_) == 0)
+			add (counts, load (tag));
+	}
+
+	return counts;
+}
+
+alloc::Counts alloc::total ()
+{
+	auto counts = load (s_untagged);
+	for (auto const &tag : s_tags)
+		add (counts, load (tag));
+
+	return counts;
+}
+
+void alloc::reset ()
+{
+	auto const clear = [] (Tag &tag_) {
+		tag_.operations.store (0, std::memory_order_relaxed);
+		tag_.allocations.store (0, std::memory_order_relaxed);
+		tag_.bytes.store (0, std::memory_order_relaxed);
+	};
+
+	clear (s_untagged);
+	for (auto &tag : s_tags)
+		clear (tag);
+}
+
+unsigned alloc::report (std::string &out_, std::size_t const limit_)
+{
+	struct Entry
+	{
+		char const *name;
+		Counts counts;
+	};
+
+	// tags with the same name from different literals are merged
+	std::vector<Entry> entries;
+	entries.emplace_back (Entry{UNTAGGED, load (s_untagged)});
+	for (auto const &tag : s_tags)
+	{
+		auto const name = tag.name.load (std::memory_order_acquire);
+		if (!name)
+			continue;
+
+		auto const it = std::find_if (std::begin (entries),
+		    std::end (entries),
+		    [name] (auto const &entry_) { return std::strcmp (entry_.name, name) == 0; });
+		if (it == std::end (entries))
+			entries.emplace_back (Entry{name, load (tag)});
+		else
+			add (it->counts, load (tag));
+	}
+
+	std::sort (std::begin (entries), std::end (entries), [] (auto const &lhs_, auto const &rhs_) {
+		return lhs_.counts.allocations > rhs_.counts.allocations;
+	});
+
+	std::string line;
+	std::size_t size = 0;
+	unsigned omitted = 0;
+	for (auto const &entry : entries)
+	{
+		if (!entry.counts.allocations && !entry.counts.operations)
+			continue;
+
+		auto const operations = std::max<std::uint64_t> (entry.counts.operations, 1);
+
+		line = " {\"tag\":";
+		ftp::appendJsonString (line, entry.name);
+		ftp::appendFormat (line,
+		    ",\"operations\":%" PRIu64 ",\"allocations\":%" PRIu64 ",\"bytes\":%" PRIu64
+		    ",\"allocations_per_operation\":%.2f,\"bytes_per_operation\":%.1f}\r\n",
+		    entry.counts.operations,
+		    entry.counts.allocations,
+		    entry.counts.bytes,
+		    static_cast<double> (entry.counts.allocations) / operations,
+		    static_cast<double> (entry.counts.bytes) / operations);
+
+		if (size + line.size () > limit_)
+			++omitted;
+		else
+		{
+			out_ += line;
+			size += line.size ();
+		}
+	}
+
+	return omitted;
+}
+
+///////////////////////////////////////////////////////////////////////////
+void *operator new (std::size_t const size_)
+{
+	return allocate (size_);
+}
+
+void *operator new[] (std::size_t const size_)
+{
+	return allocate (size_);
+}
+
+void *operator new (std::size_t const size_, std::align_val_t const align_)
+{
+	return allocate (size_, static_cast<std::size_t> (align_));
+}
+
+void *operator new[] (std::size_t const size_, std::align_val_t const align_)
+{
+	return allocate (size_, static_cast<std::size_t> (align_));
+}
+
+void operator delete (void *const p_) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete (void *const p_, std::size_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_, std::size_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete (void *const p_, std::align_val_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_, std::align_val_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete (void *const p_, std::size_t, std::align_val_t) noexcept
+{
+	std::free (p_);
+}
+
+void operator delete[] (void *const p_, std::size_t, std::align_val_t) noexcept
+{
+	std::free (p_);
+}
+#endif
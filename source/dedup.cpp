@@ -0,0 +1,404 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "dedup.h"
+
+#if FTPD_HAS_DEDUP
+#include "fs.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+/// \brief Index entry
+struct Entry
+{
+	/// \brief File path
+	std::string path;
+	/// \brief Device
+	std::uint64_t dev;
+	/// \brief Inode
+	std::uint64_t ino;
+	/// \brief File size
+	std::uint64_t size;
+	/// \brief Modification time
+	std::int64_t mtime;
+};
+
+/// \brief Index path
+std::string s_indexPath;
+
+/// \brief Whether the index has been loaded
+bool s_loaded = false;
+
+/// \brief Index by digest
+std::map<Sha256::Digest, Entry> s_index;
+
+/// \brief Digest by {dev, ino}
+std::map<std::pair<std::uint64_t, std::uint64_t>, Sha256::Digest> s_inodes;
+
+/// \brief Lookups which found live content
+std::uint64_t s_hits = 0;
+
+/// \brief Lookups which found nothing or a stale entry
+std::uint64_t s_misses = 0;
+
+/// \brief Whether entry matches file status
+/// \param entry_ Entry to check
+/// \param st_ File status
+bool matches (Entry const &entry_, struct stat const &st_)
+{
+	return entry_.dev == static_cast<std::uint64_t> (st_.st_dev) &&
+	       entry_.ino == static_cast<std::uint64_t> (st_.st_ino) &&
+	       entry_.size == static_cast<std::uint64_t> (st_.st_size) &&
+	       entry_.mtime == static_cast<std::int64_t> (st_.st_mtime);
+}
+
+/// \brief Whether entry still refers to the indexed content
+/// \param entry_ Entry to check
+bool live (Entry const &entry_)
+{
+	struct stat st;
+	if (::stat (entry_.path.c_str (), &st) != 0)
+		return false;
+
+	return S_ISREG (st.st_mode) && matches (entry_, st);
+}
+
+/// \brief Write an entry to the index file
+/// \param fp_ Index file
+/// \param digest_ Content digest
+/// \param entry_ Entry to write
+void writeEntry (std::FILE *const fp_, Sha256::Digest const &digest_, Entry const &entry_)
+{
+	(void)std::fprintf (fp_,
+	    "%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRId64 " %s\n",
+	    Sha256::toHex (digest_).c_str (),
+	    entry_.size,
+	    entry_.dev,
+	    entry_.ino,
+	    entry_.mtime,
+	    entry_.path.c_str ());
+}
+
+/// \brief Load index
+/// \note Drops stale entries and compacts the index file
+void load ()
+{
+	if (s_loaded)
+		return;
+
+	s_loaded = true;
+
+	auto fp = fs::File ();
+	if (!fp.open (s_indexPath.c_str ()))
+		return;
+
+	std::size_t lines = 0;
+
+	std::string_view line;
+	while (!(line = fp.readLine ()).empty ())
+	{
+		++lines;
+
+		Entry entry;
+		char hex[65];
+		int pos = 0;
+		if (std::sscanf (line.data (),
+		        "%64s %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64 " %n",
+		        hex,
+		        &entry.size,
+		        &entry.dev,
+		        &entry.ino,
+		        &entry.mtime,
+		        &pos) != 5 ||
+		    pos <= 0 || static_cast<std::size_t> (pos) >= line.size ())
+		{
+			error ("Ignoring dedup index entry '%s'\n", line.data ());
+			continue;
+		}
+
+		Sha256::Digest digest;
+		if (!Sha256::fromHex (hex, digest))
+		{
+			error ("Ignoring dedup index entry '%s'\n", line.data ());
+			continue;
+		}
+
+		entry.path = line.substr (pos);
+		if (!live (entry))
+			continue;
+
+		s_inodes[{entry.dev, entry.ino}] = digest;
+		s_index[digest]                  = std::move (entry);
+	}
+
+	fp.close ();
+
+	if (lines == s_index.size ())
+		return;
+
+	// rewrite without the stale entries
+	auto const tmp = s_indexPath + ".tmp";
+	if (!fp.open (tmp.c_str (), "wb"))
+		return;
+
+	for (auto const &[digest, entry] : s_index)
+		writeEntry (fp, digest, entry);
+
+	fp.close ();
+
+	if (::rename (tmp.c_str (), s_indexPath.c_str ()) != 0)
+		error ("rename %s: %s\n", tmp.c_str (), std::strerror (errno));
+}
+
+/// \brief Copy file contents
+/// \param from_ Source path
+/// \param to_ Destination path
+/// \param mode_ Destination mode
+bool copy (char const *const from_, char const *const to_, mode_t const mode_)
+{
+	auto const in = ::open (from_, O_RDONLY);
+	if (in < 0)
+		return false;
+
+	auto const out = ::open (to_, O_WRONLY | O_CREAT | O_EXCL, mode_);
+	if (out < 0)
+	{
+		::close (in);
+		return false;
+	}
+
+	bool ok = true;
+
+#ifdef FICLONE
+	if (::ioctl (out, FICLONE, in) != 0)
+#endif
+	{
+		std::vector<char> buffer (65536);
+		while (true)
+		{
+			auto const rc = ::read (in, buffer.data (), buffer.size ());
+			if (rc <= 0)
+			{
+				ok = rc == 0;
+				break;
+			}
+
+			if (::write (out, buffer.data (), rc) != rc)
+			{
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	::close (in);
+	if (::close (out) != 0)
+		ok = false;
+
+	if (!ok)
+		::unlink (to_);
+
+	return ok;
+}
+}
+
+dedup::Stats dedup::stats ()
+{
+	return {.hits = s_hits, .misses = s_misses};
+}
+
+void dedup::setIndexPath (std::string path_)
+{
+	if (s_indexPath == path_)
+		return;
+
+	s_indexPath = std::move (path_);
+	s_loaded    = false;
+	s_index.clear ();
+	s_inodes.clear ();
+}
+
+std::optional<std::string> dedup::find (Sha256::Digest const &digest_)
+{
+	load ();
+
+	auto const it = s_index.find (digest_);
+	if (it == std::end (s_index))
+	{
+		++s_misses;
+		return std::nullopt;
+	}
+
+	if (!live (it->second))
+	{
+		++s_misses;
+		s_inodes.erase ({it->second.dev, it->second.ino});
+		s_index.erase (it);
+		return std::nullopt;
+	}
+
+	++s_hits;
+	return it->second.path;
+}
+
+std::optional<Sha256::Digest> dedup::digest (struct stat const &st_)
+{
+	load ();
+
+	auto const it = s_inodes.find (
+	    {static_cast<std::uint64_t> (st_.st_dev), static_cast<std::uint64_t> (st_.st_ino)});
+	if (it == std::end (s_inodes))
+		return std::nullopt;
+
+	auto const entry = s_index.find (it->second);
+	if (entry == std::end (s_index) || !matches (entry->second, st_))
+		return std::nullopt;
+
+	return it->second;
+}
+
+void dedup::insert (Sha256::Digest const &digest_,
+    std::string const &path_,
+    struct stat const &st_)
+{
+	// the index holds one entry per line; a client-chosen name must not add entries of its own
+	if (path_.find_first_of ("\r\n") != std::string::npos)
+		return;
+
+	load ();
+
+	auto entry = Entry{
+	    .path  = path_,
+	    .dev   = static_cast<std::uint64_t> (st_.st_dev),
+	    .ino   = static_cast<std::uint64_t> (st_.st_ino),
+	    .size  = static_cast<std::uint64_t> (st_.st_size),
+	    .mtime = static_cast<std::int64_t> (st_.st_mtime),
+	};
+
+	auto const it = s_index.find (digest_);
+	if (it != std::end (s_index))
+	{
+		if (it->second.path == entry.path && matches (it->second, st_))
+			return;
+
+		s_inodes.erase ({it->second.dev, it->second.ino});
+	}
+
+	// append to the index file
+	auto fp = fs::File ();
+	if (fp.open (s_indexPath.c_str (), "ab"))
+		writeEntry (fp, digest_, entry);
+	else
+		error (
+		    "Failed to update dedup index %s: %s\n", s_indexPath.c_str (), std::strerror (errno));
+
+	s_inodes[{entry.dev, entry.ino}] = digest_;
+	s_index[digest_]                 = std::move (entry);
+}
+
+bool dedup::clone (std::string const &from_, std::string const &to_)
+{
+	struct stat st;
+	if (::stat (from_.c_str (), &st) != 0)
+		return false;
+
+	auto const tmp = to_ + ".ftpd-dedup";
+
+#ifdef FICLONE
+	// prefer a reflink so the copies stay independent
+	{
+		auto const in = ::open (from_.c_str (), O_RDONLY);
+		if (in >= 0)
+		{
+			auto const out = ::open (tmp.c_str (), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+			if (out >= 0)
+			{
+				auto const rc = ::ioctl (out, FICLONE, in);
+				::close (out);
+				::close (in);
+
+				if (rc == 0 && ::rename (tmp.c_str (), to_.c_str ()) == 0)
+					return true;
+
+				::unlink (tmp.c_str ());
+			}
+			else
+				::close (in);
+		}
+	}
+#endif
+
+	// fall back to a hardlink
+	if (::link (from_.c_str (), tmp.c_str ()) != 0)
+		return false;
+
+	if (::rename (tmp.c_str (), to_.c_str ()) != 0)
+	{
+		::unlink (tmp.c_str ());
+		return false;
+	}
+
+	return true;
+}
+
+bool dedup::unshare (std::string const &path_)
+{
+	struct stat st;
+	if (::stat (path_.c_str (), &st) != 0)
+		return errno == ENOENT;
+
+	if (!S_ISREG (st.st_mode) || st.st_nlink <= 1)
+		return true;
+
+	auto const tmp = path_ + ".ftpd-dedup";
+	if (!copy (path_.c_str (), tmp.c_str (), st.st_mode & 07777))
+		return false;
+
+	if (::rename (tmp.c_str (), path_.c_str ()) != 0)
+	{
+		::unlink (tmp.c_str ());
+		return false;
+	}
+
+	return true;
+}
+#endif
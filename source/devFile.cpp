@@ -0,0 +1,337 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "devFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+/// \brief Size of unbounded sources
+constexpr auto UNBOUNDED = std::numeric_limits<std::uint64_t>::max ();
+
+/// \brief Split the next path component
+/// \param path_ Path; advanced past the component
+std::string_view nextComponent (std::string_view &path_)
+{
+	auto const pos       = path_.find ('/');
+	auto const component = path_.substr (0, pos);
+
+	path_.remove_prefix (pos == std::string_view::npos ? path_.size () : pos + 1);
+	return component;
+}
+
+/// \brief Parse a number
+/// \param str_ String to parse
+/// \param value_ Parsed value
+/// \param suffix_ Whether to accept a K/M/G/T suffix
+bool parseNumber (std::string_view const str_, std::uint64_t &value_, bool const suffix_)
+{
+	auto const end = str_.data () + str_.size ();
+
+	auto const [ptr, ec] = std::from_chars (str_.data (), end, value_);
+	if (ec != std::errc () || ptr == str_.data ())
+		return false;
+
+	if (ptr == end)
+		return true;
+
+	if (!suffix_ || ptr + 1 != end)
+		return false;
+
+	unsigned shift;
+	switch (*ptr)
+	{
+	case 'k':
+	case 'K':
+		shift = 10;
+		break;
+
+	case 'm':
+	case 'M':
+		shift = 20;
+		break;
+
+	case 'g':
+	case 'G':
+		shift = 30;
+		break;
+
+	case 't':
+	case 'T':
+		shift = 40;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (value_ > (UNBOUNDED >> shift))
+		return false;
+
+	value_ <<= shift;
+	return true;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+bool fs::DevFile::match (std::string_view path_)
+{
+	if (path_ == "/devZero")
+		return true;
+
+	if (!path_.starts_with ("/dev/"))
+		return false;
+
+	path_.remove_prefix (5);
+
+	auto const name = nextComponent (path_);
+	return name == "null" || name == "zero" || name == "random" || name == "compressible";
+}
+
+bool fs::DevFile::matchDirectory (std::string_view path_)
+{
+	if (path_ == "/dev")
+		return true;
+
+	DevFile devFile;
+	if (path_ == "/devZero" || !devFile.open (path_))
+		return false;
+
+	path_.remove_prefix (5);
+	nextComponent (path_);
+
+	unsigned args = 0;
+	for (; !path_.empty (); ++args)
+		nextComponent (path_);
+
+	switch (devFile.m_type)
+	{
+	case Type::ZERO:
+		return args < 1;
+
+	case Type::RANDOM:
+	case Type::COMPRESSIBLE:
+		return args < 2;
+
+	default:
+		return false;
+	}
+}
+
+fs::DevFile::operator bool () const
+{
+	return m_type != Type::NONE;
+}
+
+bool fs::DevFile::open (std::string_view path_)
+{
+	close ();
+
+	if (!match (path_))
+	{
+		errno = ENOENT;
+		return false;
+	}
+
+	if (path_ == "/devZero")
+	{
+		m_type = Type::ZERO;
+		m_size = UNBOUNDED;
+		return true;
+	}
+
+	path_.remove_prefix (5);
+
+	auto const name = nextComponent (path_);
+
+	Type type;
+	unsigned maxArgs;
+	if (name == "null")
+	{
+		type    = Type::SINK;
+		maxArgs = 0;
+	}
+	else if (name == "zero")
+	{
+		type    = Type::ZERO;
+		maxArgs = 1;
+	}
+	else if (name == "random")
+	{
+		type    = Type::RANDOM;
+		maxArgs = 2;
+	}
+	else
+	{
+		type    = Type::COMPRESSIBLE;
+		maxArgs = 2;
+	}
+
+	auto size = type == Type::SINK ? 0 : UNBOUNDED;
+	auto seed = std::uint64_t{0};
+
+	for (unsigned i = 0; !path_.empty (); ++i)
+	{
+		auto const arg = nextComponent (path_);
+		if (i >= maxArgs || !parseNumber (arg, i == 0 ? size : seed, i == 0) ||
+		    (i == 0 && size > std::numeric_limits<std::int64_t>::max ()))
+		{
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	m_type = type;
+	m_size = size;
+	m_seed = seed;
+	return true;
+}
+
+void fs::DevFile::close ()
+{
+	m_type     = Type::NONE;
+	m_size     = 0;
+	m_seed     = 0;
+	m_position = 0;
+}
+
+std::int64_t fs::DevFile::size () const
+{
+	if (m_size == UNBOUNDED)
+		return -1;
+
+	return m_size;
+}
+
+std::uint64_t fs::DevFile::position () const
+{
+	return m_position;
+}
+
+bool fs::DevFile::seek (std::uint64_t const pos_)
+{
+	if (m_type == Type::NONE)
+	{
+		errno = EBADF;
+		return false;
+	}
+
+	if (m_type != Type::SINK && pos_ > m_size)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_position = pos_;
+	return true;
+}
+
+std::make_signed_t<std::size_t> fs::DevFile::read (IOBuffer &buffer_)
+{
+	if (m_type == Type::NONE)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	if (m_type == Type::SINK || m_position >= m_size)
+		return 0;
+
+	auto const size = std::min<std::uint64_t> (buffer_.freeSize (), m_size - m_position);
+	if (size == 0)
+		return 0;
+
+	if (m_type == Type::ZERO)
+		std::memset (buffer_.freeArea (), 0, size);
+	else
+		fill (buffer_.freeArea (), size);
+
+	buffer_.markUsed (size);
+	m_position += size;
+
+	return size;
+}
+
+std::make_signed_t<std::size_t> fs::DevFile::write (IOBuffer &buffer_)
+{
+	if (m_type == Type::NONE)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	auto const size = buffer_.usedSize ();
+	buffer_.clear ();
+	m_position += size;
+
+	return size;
+}
+
+void fs::DevFile::fill (char *buffer_, std::size_t const size_) const
+{
+	// Counter-based splitmix64: each 8-byte word depends only on the seed and its index, so
+	// seeking is free and the loop has no carried state for the compiler to serialize on.
+	// The compressible variant keeps 4 random bits per byte, which deflate codes in a little
+	// over half the size.
+	auto const compressible = m_type == Type::COMPRESSIBLE;
+	auto const mask         = compressible ? UINT64_C (0x0F0F0F0F0F0F0F0F) : UNBOUNDED;
+	auto const bits         = compressible ? UINT64_C (0x4040404040404040) : 0;
+	auto const seed         = m_seed;
+
+	auto const generate = [=] (std::uint64_t const index_) {
+		auto z = seed + (index_ + 1) * UINT64_C (0x9E3779B97F4A7C15);
+		z      = (z ^ (z >> 30)) * UINT64_C (0xBF58476D1CE4E5B9);
+		z      = (z ^ (z >> 27)) * UINT64_C (0x94D049BB133111EB);
+		return ((z ^ (z >> 31)) & mask) | bits;
+	};
+
+	auto const end = buffer_ + size_;
+	auto index     = m_position / sizeof (std::uint64_t);
+
+	// leading partial word
+	if (auto const skip = m_position % sizeof (std::uint64_t); skip != 0)
+	{
+		auto const word = generate (index++);
+		auto const size = std::min<std::size_t> (sizeof (word) - skip, size_);
+		std::memcpy (buffer_, reinterpret_cast<char const *> (&word) + skip, size);
+		buffer_ += size;
+	}
+
+	while (static_cast<std::size_t> (end - buffer_) >= sizeof (std::uint64_t))
+	{
+		auto const word = generate (index++);
+		std::memcpy (buffer_, &word, sizeof (word));
+		buffer_ += sizeof (word);
+	}
+
+	// trailing partial word
+	if (buffer_ != end)
+	{
+		auto const word = generate (index);
+		std::memcpy (buffer_, &word, end - buffer_);
+	}
+}
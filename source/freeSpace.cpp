@@ -0,0 +1,259 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "freeSpace.h"
+
+#include "platform.h"
+
+#include <sys/statvfs.h>
+using statvfs_t = struct statvfs;
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+#if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
+/// \brief Root mount point
+constexpr char const *ROOT = "sdmc:/";
+#else
+/// \brief Root mount point
+constexpr char const *ROOT = "/";
+#endif
+
+#ifndef __NDS__
+/// \brief How often the refresher checks for refresh requests
+constexpr auto POLL_INTERVAL = std::chrono::milliseconds (100);
+#endif
+
+/// \brief Tracked mount point
+struct Mount
+{
+	/// \brief Parameterized constructor
+	/// \param path_ Mount point path
+	Mount (std::string path_) : path (std::move (path_))
+	{
+	}
+
+	/// \brief Mount point path
+	std::string const path;
+
+	/// \brief Available bytes; negative before the first refresh
+	std::atomic<std::int64_t> available = -1;
+};
+
+/// \brief Tracked mount points; fixed between start () and stop ()
+std::vector<std::unique_ptr<Mount>> s_mounts;
+
+/// \brief Whether a refresh was requested
+std::atomic_bool s_refresh = false;
+
+/// \brief Number of reads
+std::atomic<std::uint64_t> s_reads = 0;
+
+/// \brief Number of refreshes
+std::atomic<std::uint64_t> s_refreshes = 0;
+
+#ifdef __NDS__
+/// \brief Next scheduled refresh
+platform::steady_clock::time_point s_next;
+#else
+/// \brief Whether the refresher should quit
+std::atomic_bool s_quit = false;
+
+/// \brief Whether the refresher is running
+bool s_running = false;
+
+/// \brief Refresher thread
+platform::Thread s_thread;
+#endif
+
+/// \brief Refresh every mount point
+void refreshAll ()
+{
+	for (auto const &mount : s_mounts)
+	{
+		statvfs_t st = {};
+		if (::statvfs (mount->path.c_str (), &st) != 0)
+			continue;
+
+		// writes racing with this store are lost, and corrected by the next refresh
+		mount->available.store (
+		    static_cast<std::int64_t> (st.f_bsize) * st.f_bavail, std::memory_order_relaxed);
+	}
+
+	s_refreshes.fetch_add (1, std::memory_order_relaxed);
+}
+
+#ifndef __NDS__
+/// \brief Refresher thread entry point
+void refresher ()
+{
+	auto next = platform::steady_clock::now () + freespace::REFRESH_INTERVAL;
+	while (!s_quit.load (std::memory_order_relaxed))
+	{
+		auto const now = platform::steady_clock::now ();
+		if (s_refresh.exchange (false, std::memory_order_relaxed) || now >= next)
+		{
+			refreshAll ();
+			next = now + freespace::REFRESH_INTERVAL;
+		}
+
+		platform::Thread::sleep (POLL_INTERVAL);
+	}
+}
+#endif
+}
+
+void freespace::start (std::vector<std::string> const &mounts_)
+{
+	stop ();
+
+	s_mounts.emplace_back (std::make_unique<Mount> (ROOT));
+	for (auto path : mounts_)
+	{
+		while (path.size () > 1 && path.back () == '/')
+			path.pop_back ();
+
+		if (path.empty () || path == ROOT)
+			continue;
+
+		s_mounts.emplace_back (std::make_unique<Mount> (std::move (path)));
+	}
+
+	// have values before the first client connects
+	refreshAll ();
+
+#ifdef __NDS__
+	s_next = platform::steady_clock::now () + REFRESH_INTERVAL;
+#else
+	s_quit    = false;
+	s_thread  = platform::Thread (refresher);
+	s_running = true;
+#endif
+}
+
+void freespace::stop ()
+{
+#ifndef __NDS__
+	if (s_running)
+	{
+		s_quit = true;
+		s_thread.join ();
+		s_running = false;
+	}
+#endif
+
+	s_mounts.clear ();
+}
+
+#ifdef __NDS__
+void freespace::update ()
+{
+	auto const now = platform::steady_clock::now ();
+	if (!s_refresh.exchange (false) && now < s_next)
+		return;
+
+	refreshAll ();
+	s_next = now + REFRESH_INTERVAL;
+}
+#endif
+
+void freespace::refresh ()
+{
+	s_refresh.store (true, std::memory_order_relaxed);
+}
+
+unsigned freespace::find (std::string_view const path_)
+{
+	unsigned best        = 0;
+	std::size_t bestSize = 0;
+	for (unsigned i = 1; i < s_mounts.size (); ++i)
+	{
+		auto const &mount = s_mounts[i]->path;
+		if (mount.size () <= bestSize || !path_.starts_with (mount))
+			continue;
+
+		// match whole path components only
+		if (path_.size () != mount.size () && path_[mount.size ()] != '/')
+			continue;
+
+		best     = i;
+		bestSize = mount.size ();
+	}
+
+	return best;
+}
+
+std::optional<std::uint64_t> freespace::available (unsigned const mount_)
+{
+	s_reads.fetch_add (1, std::memory_order_relaxed);
+
+	if (mount_ >= s_mounts.size ())
+		return std::nullopt;
+
+	auto const available = s_mounts[mount_]->available.load (std::memory_order_relaxed);
+	if (available < 0)
+		return std::nullopt;
+
+	return available;
+}
+
+void freespace::consume (unsigned const mount_, std::int64_t const bytes_)
+{
+	if (mount_ >= s_mounts.size () || bytes_ == 0)
+		return;
+
+	auto &available = s_mounts[mount_]->available;
+
+	// keep the value known-valid: never go below zero, never touch an unknown value
+	auto value = available.load (std::memory_order_relaxed);
+	while (value >= 0 &&
+	       !available.compare_exchange_weak (value,
+	           std::max<std::int64_t> (value - bytes_, 0),
+	           std::memory_order_relaxed))
+		;
+}
+
+unsigned freespace::mounts ()
+{
+	return s_mounts.size ();
+}
+
+std::string const &freespace::path (unsigned const mount_)
+{
+	return s_mounts[mount_]->path;
+}
+
+freespace::Stats freespace::stats ()
+{
+	return {
+	    .reads     = s_reads.load (std::memory_order_relaxed),
+	    .refreshes = s_refreshes.load (std::memory_order_relaxed),
+	};
+}
@@ -22,6 +22,7 @@
 
 #include "fs.h"
 #include "ioBuffer.h"
+#include "trace.h"
 
 #include <gsl/pointers>
 #include <gsl/util>
@@ -133,6 +134,8 @@ void fs::File::setBufferSize (std::size_t const size_)
 bool fs::File::open (gsl::not_null<char const *> const path_,
     gsl::not_null<char const *> const mode_)
 {
+	TRACE_SCOPE ("File::open");
+
 	gsl::owner<FILE *> fp = std::fopen (path_, mode_);
 	if (!fp)
 		return false;
@@ -159,6 +162,8 @@ std::make_signed_t<std::size_t> fs::File::seek (std::make_signed_t<std::size_t>
 std::make_signed_t<std::size_t> fs::File::read (gsl::not_null<void *> const buffer_,
     std::size_t const size_)
 {
+	TRACE_SCOPE_ARG ("File::read", size_);
+
 	assert (buffer_);
 	assert (size_ > 0);
 
@@ -228,6 +233,8 @@ bool fs::File::readAll (gsl::not_null<void *> const buffer_, std::size_t const s
 std::make_signed_t<std::size_t> fs::File::write (gsl::not_null<void const *> const buffer_,
     std::size_t const size_)
 {
+	TRACE_SCOPE_ARG ("File::write", size_);
+
 	assert (buffer_);
 	assert (size_ > 0);
 
@@ -290,6 +297,8 @@ fs::Dir::operator DIR * () const
 
 bool fs::Dir::open (gsl::not_null<char const *> const path_)
 {
+	TRACE_SCOPE ("Dir::open");
+
 	auto const dp = ::opendir (path_);
 	if (!dp)
 		return false;
@@ -25,6 +25,7 @@
 #include "fs.h"
 #include "log.h"
 #include "platform.h"
+#include "xferJournal.h"
 
 #include <gsl/pointers>
 
@@ -33,12 +34,17 @@
 #include <sys/stat.h>
 using stat_t = struct stat;
 
+#if FTPD_HAS_BUSY_POLL
+#include <sched.h>
+#endif
+
 #include <cctype>
 #include <cerrno>
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <mutex>
 #include <string>
 #include <string_view>
 #include <system_error>
@@ -49,6 +55,36 @@ namespace
 constexpr std::uint16_t DEFAULT_PORT = 5000;
 constexpr int DEFAULT_DEFLATE_LEVEL  = 6;
 
+#ifdef __NDS__
+constexpr std::size_t DEFAULT_XFER_BUFFERSIZE     = 8192;
+constexpr std::size_t DEFAULT_RESPONSE_BUFFERSIZE = 4096;
+constexpr std::size_t DEFAULT_SOCK_BUFFERSIZE     = 4096;
+#else
+constexpr std::size_t DEFAULT_XFER_BUFFERSIZE     = 65536;
+constexpr std::size_t DEFAULT_RESPONSE_BUFFERSIZE = 32768;
+#if defined(__3DS__)
+constexpr std::size_t DEFAULT_SOCK_BUFFERSIZE = 32768;
+#elif defined(__SWITCH__)
+constexpr std::size_t DEFAULT_SOCK_BUFFERSIZE = DEFAULT_XFER_BUFFERSIZE;
+#else
+// forcing SO_SNDBUF/SO_RCVBUF disables the kernel's autotuning
+constexpr std::size_t DEFAULT_SOCK_BUFFERSIZE = 0;
+#endif
+#endif
+
+constexpr std::size_t DEFAULT_FILE_BUFFERSIZE = 4 * DEFAULT_XFER_BUFFERSIZE;
+
+/// \brief Smallest buffer size; a response line must fit
+constexpr std::size_t MIN_BUFFERSIZE = 1024;
+
+/// \brief Largest buffer size
+constexpr std::size_t MAX_BUFFERSIZE = 16 * 1024 * 1024;
+
+#if FTPD_HAS_BUSY_POLL
+/// \brief Longest busy-poll time; the session poll blocks for at most 100ms anyway
+constexpr auto MAX_BUSY_POLL = std::chrono::microseconds (100000);
+#endif
+
 bool mkdirParent (std::string_view const path_)
 {
 	auto pos = path_.find_first_of ('/');
@@ -105,12 +141,43 @@ bool parseInt (T &out_, std::string_view const val_)
 
 	return true;
 }
+
+bool parseBool (bool &out_, std::string_view const key_, std::string_view const val_)
+{
+	if (val_ == "0" || val_ == "1")
+	{
+		out_ = val_ == "1";
+		return true;
+	}
+
+	error ("Invalid value for %.*s: %.*s\n",
+	    gsl::narrow_cast<int> (key_.size ()),
+	    key_.data (),
+	    gsl::narrow_cast<int> (val_.size ()),
+	    val_.data ());
+	return false;
+}
 }
 
 ///////////////////////////////////////////////////////////////////////////
 FtpConfig::~FtpConfig () = default;
 
-FtpConfig::FtpConfig () : m_port (DEFAULT_PORT), m_deflateLevel (DEFAULT_DEFLATE_LEVEL)
+FtpConfig::FtpConfig (FtpConfig const &that_) = default;
+
+FtpConfig &FtpConfig::operator= (FtpConfig const &that_) = default;
+
+FtpConfig::FtpConfig ()
+    : m_port (DEFAULT_PORT),
+      m_deflateLevel (DEFAULT_DEFLATE_LEVEL),
+      m_xferBufferSize (DEFAULT_XFER_BUFFERSIZE),
+      m_fileBufferSize (DEFAULT_FILE_BUFFERSIZE),
+      m_sockBufferSize (DEFAULT_SOCK_BUFFERSIZE),
+      m_responseBufferSize (DEFAULT_RESPONSE_BUFFERSIZE)
+#if FTPD_HAS_XFER_JOURNAL
+      ,
+      m_journalRecords (journal::DEFAULT_RECORDS),
+      m_journalRotate (journal::DEFAULT_ROTATE)
+#endif
 {
 }
 
@@ -121,7 +188,8 @@ UniqueFtpConfig FtpConfig::create ()
 
 UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 {
-	auto config = create ();
+	auto config     = create ();
+	config->m_path = path_.get ();
 
 	auto fp = fs::File ();
 	if (!fp.open (path_))
@@ -142,7 +210,8 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 
 		auto const key = strip (std::string_view (line).substr (0, pos));
 		auto const val = strip (std::string_view (line).substr (pos + 1));
-		if (key.empty () || val.empty ())
+		// an empty stats segment name or journal path disables it
+		if (key.empty () || (val.empty () && key != "statsSegment" && key != "journal"))
 		{
 			error ("Ignoring '%s'\n", line.c_str ());
 			continue;
@@ -158,31 +227,102 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 			parseInt (port, val);
 		else if (key == "deflateLevel")
 			parseInt (deflateLevel, val);
-#ifdef __3DS__
-		else if (key == "mtime")
+		else if (key == "logCommands" || key == "logResponses")
 		{
-			if (val == "0")
-				config->m_getMTime = false;
-			else if (val == "1")
-				config->m_getMTime = true;
-			else
-				error ("Invalid value for mtime: %.*s\n",
+			auto &setting = key == "logCommands" ? config->m_logCommands : config->m_logResponses;
+			parseBool (setting, key, val);
+		}
+		else if (key == "freeSpaceMounts")
+			config->m_freeSpaceMounts = val;
+		else if (key == "xferBufferSize" || key == "fileBufferSize" || key == "sockBufferSize" ||
+		         key == "responseBufferSize")
+		{
+			auto const setter = key == "xferBufferSize"   ? &FtpConfig::setXferBufferSize
+			                    : key == "fileBufferSize" ? &FtpConfig::setFileBufferSize
+			                    : key == "sockBufferSize" ? &FtpConfig::setSockBufferSize
+			                                              : &FtpConfig::setResponseBufferSize;
+
+			std::size_t size;
+			if (!parseInt (size, val) || !(config.get ()->*setter) (size))
+				error ("Invalid value for %.*s: %.*s\n",
+				    gsl::narrow_cast<int> (key.size ()),
+				    key.data (),
 				    gsl::narrow_cast<int> (val.size ()),
 				    val.data ());
 		}
+#if FTPD_HAS_TCP_INFO
+		else if (key == "autoTune")
+			parseBool (config->m_autoTune, key, val);
 #endif
-#ifdef __SWITCH__
-		else if (key == "ap")
+#if FTPD_HAS_BUSY_POLL
+		else if (key == "busyPoll")
+		{
+			unsigned time;
+			if (!parseInt (time, val) || !config->setBusyPoll (std::chrono::microseconds (time)))
+				error ("Invalid value for busyPoll: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+		else if (key == "pinCpu")
+		{
+			int cpu;
+			if (!parseInt (cpu, val) || !config->setPinCpu (cpu))
+				error ("Invalid value for pinCpu: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+#endif
+#if FTPD_HAS_TLS
+		else if (key == "tlsCert")
+			config->m_tlsCert = val;
+		else if (key == "tlsKey")
+			config->m_tlsKey = val;
+		else if (key == "ktls")
+			parseBool (config->m_ktls, key, val);
+		else if (key == "tlsRequired")
+			parseBool (config->m_tlsRequired, key, val);
+#endif
+#if FTPD_HAS_DEDUP
+		else if (key == "dedup")
+			parseBool (config->m_dedup, key, val);
+		else if (key == "dedupIndex")
+			config->m_dedupIndex = val;
+#endif
+#if FTPD_HAS_STATS_SEGMENT
+		else if (key == "statsSegment")
+			config->m_statsSegment = val;
+#endif
+#if FTPD_HAS_XFER_JOURNAL
+		else if (key == "journal")
+			config->m_journal = val;
+		else if (key == "journalRecords")
 		{
-			if (val == "0")
-				config->m_enableAP = false;
-			else if (val == "1")
-				config->m_enableAP = true;
+			std::size_t records;
+			if (parseInt (records, val))
+				config->m_journalRecords = records;
 			else
-				error ("Invalid value for ap: %.*s\n",
+				error ("Invalid value for journalRecords: %.*s\n",
 				    gsl::narrow_cast<int> (val.size ()),
 				    val.data ());
 		}
+		else if (key == "journalRotate")
+		{
+			unsigned seconds;
+			if (parseInt (seconds, val) && seconds > 0)
+				config->m_journalRotate = std::chrono::seconds (seconds);
+			else
+				error ("Invalid value for journalRotate: %.*s\n",
+				    gsl::narrow_cast<int> (val.size ()),
+				    val.data ());
+		}
+#endif
+#ifdef __3DS__
+		else if (key == "mtime")
+			parseBool (config->m_getMTime, key, val);
+#endif
+#ifdef __SWITCH__
+		else if (key == "ap")
+			parseBool (config->m_enableAP, key, val);
 		else if (key == "ssid")
 			config->m_ssid = val;
 		else if (key == "passphrase")
@@ -196,14 +336,7 @@ UniqueFtpConfig FtpConfig::load (gsl::not_null<gsl::czstring> const path_)
 	return config;
 }
 
-#ifndef __NDS__
-std::scoped_lock<platform::Mutex> FtpConfig::lockGuard ()
-{
-	return std::scoped_lock<platform::Mutex> (m_lock);
-}
-#endif
-
-bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
+bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_) const
 {
 	if (!mkdirParent (path_.get ()))
 		return false;
@@ -219,7 +352,48 @@ bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
 	if (!m_hostname.empty ())
 		(void)std::fprintf (fp, "hostname=%s\n", m_hostname.c_str ());
 	(void)std::fprintf (fp, "port=%u\n", m_port);
-	(void)std::fprintf (fp, "deflateLevel=%u", m_deflateLevel);
+	(void)std::fprintf (fp, "deflateLevel=%u\n", m_deflateLevel);
+	(void)std::fprintf (fp, "logCommands=%u\n", m_logCommands);
+	(void)std::fprintf (fp, "logResponses=%u\n", m_logResponses);
+	if (!m_freeSpaceMounts.empty ())
+		(void)std::fprintf (fp, "freeSpaceMounts=%s\n", m_freeSpaceMounts.c_str ());
+	(void)std::fprintf (fp, "xferBufferSize=%zu\n", m_xferBufferSize);
+	(void)std::fprintf (fp, "fileBufferSize=%zu\n", m_fileBufferSize);
+	(void)std::fprintf (fp, "sockBufferSize=%zu\n", m_sockBufferSize);
+	(void)std::fprintf (fp, "responseBufferSize=%zu\n", m_responseBufferSize);
+#if FTPD_HAS_TCP_INFO
+	(void)std::fprintf (fp, "autoTune=%u\n", m_autoTune);
+#endif
+#if FTPD_HAS_BUSY_POLL
+	(void)std::fprintf (fp, "busyPoll=%lld\n", static_cast<long long> (m_busyPoll.count ()));
+	(void)std::fprintf (fp, "pinCpu=%d\n", m_pinCpu);
+#endif
+#if FTPD_HAS_TLS
+	if (!m_tlsCert.empty ())
+		(void)std::fprintf (fp, "tlsCert=%s\n", m_tlsCert.c_str ());
+	if (!m_tlsKey.empty ())
+		(void)std::fprintf (fp, "tlsKey=%s\n", m_tlsKey.c_str ());
+	(void)std::fprintf (fp, "ktls=%u\n", m_ktls);
+	(void)std::fprintf (fp, "tlsRequired=%u\n", m_tlsRequired);
+#endif
+
+#if FTPD_HAS_DEDUP
+	(void)std::fprintf (fp, "dedup=%u\n", m_dedup);
+	if (!m_dedupIndex.empty ())
+		(void)std::fprintf (fp, "dedupIndex=%s\n", m_dedupIndex.c_str ());
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	(void)std::fprintf (fp, "statsSegment=%s\n", m_statsSegment.c_str ());
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+	(void)std::fprintf (fp, "journal=%s\n", m_journal.c_str ());
+	(void)std::fprintf (fp, "journalRecords=%zu\n", m_journalRecords);
+	(void)std::fprintf (fp,
+	    "journalRotate=%lld\n",
+	    static_cast<long long> (m_journalRotate.count ()));
+#endif
 
 #ifdef __3DS__
 	(void)std::fprintf (fp, "mtime=%u\n", m_getMTime);
@@ -236,6 +410,11 @@ bool FtpConfig::save (gsl::not_null<gsl::czstring> const path_)
 	return true;
 }
 
+std::string const &FtpConfig::path () const
+{
+	return m_path;
+}
+
 std::string const &FtpConfig::user () const
 {
 	return m_user;
@@ -261,6 +440,118 @@ int FtpConfig::deflateLevel () const
 	return m_deflateLevel;
 }
 
+bool FtpConfig::logCommands () const
+{
+	return m_logCommands;
+}
+
+bool FtpConfig::logResponses () const
+{
+	return m_logResponses;
+}
+
+#if FTPD_HAS_DEDUP
+bool FtpConfig::dedup () const
+{
+	return m_dedup;
+}
+
+std::string const &FtpConfig::dedupIndex () const
+{
+	return m_dedupIndex;
+}
+#endif
+
+std::string const &FtpConfig::freeSpaceMounts () const
+{
+	return m_freeSpaceMounts;
+}
+
+std::size_t FtpConfig::xferBufferSize () const
+{
+	return m_xferBufferSize;
+}
+
+std::size_t FtpConfig::fileBufferSize () const
+{
+	return m_fileBufferSize;
+}
+
+std::size_t FtpConfig::sockBufferSize () const
+{
+	return m_sockBufferSize;
+}
+
+std::size_t FtpConfig::responseBufferSize () const
+{
+	return m_responseBufferSize;
+}
+
+#if FTPD_HAS_TCP_INFO
+bool FtpConfig::autoTune () const
+{
+	return m_autoTune;
+}
+#endif
+
+#if FTPD_HAS_BUSY_POLL
+std::chrono::microseconds FtpConfig::busyPoll () const
+{
+	return m_busyPoll;
+}
+
+int FtpConfig::pinCpu () const
+{
+	return m_pinCpu;
+}
+#endif
+
+#if FTPD_HAS_TLS
+std::string const &FtpConfig::tlsCert () const
+{
+	return m_tlsCert;
+}
+
+std::string const &FtpConfig::tlsKey () const
+{
+	return m_tlsKey;
+}
+
+bool FtpConfig::ktls () const
+{
+	return m_ktls;
+}
+
+bool FtpConfig::tlsRequired () const
+{
+	return m_tlsRequired;
+}
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+std::string const &FtpConfig::statsSegment () const
+{
+	return m_statsSegment;
+}
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+std::string const &FtpConfig::journal () const
+{
+	return m_journal;
+}
+
+std::size_t FtpConfig::journalRecords () const
+{
+	return m_journalRecords;
+}
+
+std::chrono::seconds FtpConfig::journalRotate () const
+{
+	return m_journalRotate;
+}
+#endif
+
 #ifdef __3DS__
 bool FtpConfig::getMTime () const
 {
@@ -350,6 +641,160 @@ bool FtpConfig::setDeflateLevel (int const level_)
 	return true;
 }
 
+void FtpConfig::setLogCommands (bool const log_)
+{
+	m_logCommands = log_;
+}
+
+void FtpConfig::setLogResponses (bool const log_)
+{
+	m_logResponses = log_;
+}
+
+void FtpConfig::setFreeSpaceMounts (std::string mounts_)
+{
+	m_freeSpaceMounts = std::move (mounts_);
+}
+
+bool FtpConfig::setXferBufferSize (std::size_t const size_)
+{
+	if (size_ < MIN_BUFFERSIZE || size_ > MAX_BUFFERSIZE)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_xferBufferSize = size_;
+	return true;
+}
+
+bool FtpConfig::setFileBufferSize (std::size_t const size_)
+{
+	if (size_ > MAX_BUFFERSIZE)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_fileBufferSize = size_;
+	return true;
+}
+
+bool FtpConfig::setSockBufferSize (std::size_t const size_)
+{
+	if (size_ != 0 && (size_ < MIN_BUFFERSIZE || size_ > MAX_BUFFERSIZE))
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_sockBufferSize = size_;
+	return true;
+}
+
+bool FtpConfig::setResponseBufferSize (std::size_t const size_)
+{
+	if (size_ < MIN_BUFFERSIZE || size_ > MAX_BUFFERSIZE)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_responseBufferSize = size_;
+	return true;
+}
+
+#if FTPD_HAS_TCP_INFO
+void FtpConfig::setAutoTune (bool const autoTune_)
+{
+	m_autoTune = autoTune_;
+}
+#endif
+
+#if FTPD_HAS_BUSY_POLL
+bool FtpConfig::setBusyPoll (std::chrono::microseconds const time_)
+{
+	if (time_.count () < 0 || time_ > MAX_BUSY_POLL)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_busyPoll = time_;
+	return true;
+}
+
+bool FtpConfig::setPinCpu (int const cpu_)
+{
+	if (cpu_ < -1 || cpu_ >= CPU_SETSIZE)
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	m_pinCpu = cpu_;
+	return true;
+}
+#endif
+
+#if FTPD_HAS_TLS
+void FtpConfig::setTlsCert (std::string path_)
+{
+	m_tlsCert = std::move (path_);
+}
+
+void FtpConfig::setTlsKey (std::string path_)
+{
+	m_tlsKey = std::move (path_);
+}
+
+void FtpConfig::setKtls (bool const ktls_)
+{
+	m_ktls = ktls_;
+}
+
+void FtpConfig::setTlsRequired (bool const required_)
+{
+	m_tlsRequired = required_;
+}
+#endif
+
+#if FTPD_HAS_DEDUP
+void FtpConfig::setDedup (bool const dedup_)
+{
+	m_dedup = dedup_;
+}
+
+void FtpConfig::setDedupIndex (std::string path_)
+{
+	m_dedupIndex = std::move (path_);
+}
+#endif
+
+#if FTPD_HAS_STATS_SEGMENT
+void FtpConfig::setStatsSegment (std::string name_)
+{
+	m_statsSegment = std::move (name_);
+}
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+void FtpConfig::setJournal (std::string path_)
+{
+	m_journal = std::move (path_);
+}
+
+void FtpConfig::setJournalRecords (std::size_t const records_)
+{
+	m_journalRecords = records_;
+}
+
+void FtpConfig::setJournalRotate (std::chrono::seconds const rotate_)
+{
+	m_journalRotate = rotate_;
+}
+#endif
+
 #ifdef __3DS__
 void FtpConfig::setGetMTime (bool const getMTime_)
 {
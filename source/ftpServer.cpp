@@ -22,14 +22,19 @@
 
 #include "ftpServer.h"
 
+#include "allocTrack.h"
+#include "freeSpace.h"
 #include "fs.h"
 #include "ftpConfig.h"
 #include "ftpSession.h"
+#include "ftpUtil.h"
 #include "licenses.h"
 #include "log.h"
 #include "platform.h"
 #include "sockAddr.h"
 #include "socket.h"
+#include "tls.h"
+#include "trace.h"
 
 #ifndef __NDS__
 #include "mdns.h"
@@ -55,54 +60,69 @@
 #endif
 #endif
 
-#include <sys/statvfs.h>
-using statvfs_t = struct statvfs;
+#if FTPD_HAS_BUSY_POLL
+#include <sched.h>
+#endif
+#include <unistd.h>
 
 #include <algorithm>
 #include <array>
 #include <atomic>
 #include <cctype>
 #include <chrono>
+#include <cinttypes>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <functional>
 #include <mutex>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
 #include <utility>
 #include <vector>
 using namespace std::chrono_literals;
 
-#ifdef __NDS__
-#define LOCKED(x) x
-#else
-#define LOCKED(x)                                                                                  \
-	do                                                                                             \
-	{                                                                                              \
-		auto const lock = std::scoped_lock (m_lock);                                               \
-		x;                                                                                         \
-	} while (0)
-#endif
-
 namespace
 {
 /// \brief Application start time
 auto const s_startTime = std::time (nullptr);
 
-#ifdef __3DS__
-/// \brief Timezone offset in seconds (only used on 3DS)
-int s_tzOffset = 0;
+/// \brief Minimum interval between snapshots published for drawing
+constexpr auto SNAPSHOT_INTERVAL = 100ms;
+
+#if FTPD_HAS_STATS_SEGMENT
+/// \brief Minimum interval between stats segment updates
+constexpr auto STATS_INTERVAL = 50ms;
 #endif
 
-#ifndef __NDS__
-/// \brief Mutex for s_freeSpace
-platform::Mutex s_lock;
+#if FTPD_HAS_BUSY_POLL
+/// \brief Pin the calling thread to a CPU
+/// \param cpu_ CPU index; -1 to restore the process affinity
+bool pinThread (int const cpu_)
+{
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	if (cpu_ < 0)
+	{
+		// the main thread keeps the affinity the process started with
+		if (::sched_getaffinity (::getpid (), sizeof (set), &set) != 0)
+			return false;
+	}
+	else
+		CPU_SET (cpu_, &set);
+
+	// pid 0 is the calling thread
+	return ::sched_setaffinity (0, sizeof (set), &set) == 0;
+}
 #endif
 
-/// \brief Free space string
-std::string s_freeSpace;
+#ifdef __3DS__
+/// \brief Timezone offset in seconds (only used on 3DS)
+int s_tzOffset = 0;
+#endif
 
 #ifndef CLASSIC
 #ifndef NDEBUG
@@ -214,6 +234,8 @@ FtpServer::~FtpServer ()
 	m_thread.join ();
 #endif
 
+	freespace::stop ();
+
 #ifndef CLASSIC
 	if (m_uploadLogCurl)
 	{
@@ -228,15 +250,52 @@ FtpServer::~FtpServer ()
 }
 
 FtpServer::FtpServer (UniqueFtpConfig config_)
-    : m_config (std::move (config_))
+    : m_config (SharedFtpConfig (std::move (config_)))
 #ifndef CLASSIC
       ,
-      m_hostnameSetting (m_config->hostname ())
+      m_hostnameSetting (config ()->hostname ())
 #endif
 {
-#ifndef __NDS__
-	mdns::setHostname (m_config->hostname ());
+	auto const config = this->config ();
+
+	setLogEnabled (COMMAND, config->logCommands ());
+	setLogEnabled (RESPONSE, config->logResponses ());
+
+#if FTPD_HAS_STATS_SEGMENT
+	auto const &statsSegment = config->statsSegment ();
+	if (!statsSegment.empty () && !m_statsSegment.create (statsSegment))
+		error ("Failed to create stats segment %s: %s\n",
+		    statsSegment.c_str (),
+		    std::strerror (errno));
+#endif
+
+#if FTPD_HAS_XFER_JOURNAL
+	auto const &journalPath = config->journal ();
+	if (config->journalRecords () != 0 && !journalPath.empty () &&
+	    !m_journal.open (journalPath, config->journalRecords (), config->journalRotate ()))
+		error ("Failed to open transfer journal %s: %s\n",
+		    journalPath.c_str (),
+		    std::strerror (errno));
+#endif
+
+	m_snapshot = std::make_shared<Snapshot const> ();
 
+	// track free space of the configured mount points
+	{
+		auto const &mounts = config->freeSpaceMounts ();
+
+		std::vector<std::string> paths;
+		for (std::size_t pos = 0; pos <= mounts.size ();)
+		{
+			auto const end = std::min (mounts.find (',', pos), mounts.size ());
+			paths.emplace_back (mounts.substr (pos, end - pos));
+			pos = end + 1;
+		}
+
+		freespace::start (paths);
+	}
+
+#ifndef __NDS__
 	m_thread = platform::Thread (std::bind (&FtpServer::threadFunc, this));
 #endif
 
@@ -249,24 +308,31 @@ FtpServer::FtpServer (UniqueFtpConfig config_)
 
 void FtpServer::draw ()
 {
+	ALLOC_SCOPE ("FtpServer::draw");
+
 #ifdef __NDS__
 	loop ();
 #endif
 
+#ifdef __NDS__
+	auto const snapshot = m_snapshot;
+#else
+	auto const snapshot = m_snapshot.load (std::memory_order_acquire);
+#endif
+
 #ifdef CLASSIC
 	{
+		auto const listening = !snapshot->address.empty ();
+
 		char port[7];
-#ifndef __NDS__
-		auto const lock = std::scoped_lock (m_lock);
-#endif
-		if (m_socket)
-			std::sprintf (port, ":%u", m_socket->sockName ().port ());
+		if (listening)
+			std::sprintf (port, ":%u", snapshot->port);
 
 		consoleSelect (&g_statusConsole);
 		std::printf ("\x1b[0;0H\x1b[32;1m%s \x1b[36;1m%s%s",
 		    STATUS_STRING,
-		    m_socket ? m_socket->sockName ().name () : "Waiting on WiFi",
-		    m_socket ? port : "");
+		    listening ? snapshot->address.c_str () : "Waiting on WiFi",
+		    listening ? port : "");
 
 #ifndef __NDS__
 		char timeBuffer[16];
@@ -280,30 +346,24 @@ void FtpServer::draw ()
 		std::fflush (stdout);
 	}
 
+	if (!snapshot->freeSpace.empty ())
 	{
-#ifndef __NDS__
-		auto const lock = std::scoped_lock (s_lock);
-#endif
-		if (!s_freeSpace.empty ())
-		{
-			consoleSelect (&g_statusConsole);
-			std::printf ("\x1b[0;%uH\x1b[32;1m%s",
-			    static_cast<unsigned> (g_statusConsole.windowWidth - s_freeSpace.size () + 1),
-			    s_freeSpace.c_str ());
-			std::fflush (stdout);
-		}
+		auto const &freeSpace = snapshot->freeSpace;
+
+		consoleSelect (&g_statusConsole);
+		std::printf ("\x1b[0;%uH\x1b[32;1m%s",
+		    static_cast<unsigned> (g_statusConsole.windowWidth - freeSpace.size () + 1),
+		    freeSpace.c_str ());
+		std::fflush (stdout);
 	}
 
 	{
-#ifndef __NDS__
-		auto const lock = std::scoped_lock (m_lock);
-#endif
 		consoleSelect (&g_sessionConsole);
 		std::fputs ("\x1b[2J", stdout);
-		for (auto &session : m_sessions)
+		for (auto const &session : snapshot->sessions)
 		{
-			session->draw ();
-			if (&session != &m_sessions.back ())
+			FtpSession::draw (session);
+			if (&session != &snapshot->sessions.back ())
 				std::fputc ('\n', stdout);
 		}
 		std::fflush (stdout);
@@ -311,6 +371,8 @@ void FtpServer::draw ()
 
 	drawLog ();
 #else
+	m_drawSnapshot = snapshot;
+
 	auto const &io    = ImGui::GetIO ();
 	auto const width  = io.DisplaySize.x;
 	auto const height = io.DisplaySize.y;
@@ -325,13 +387,15 @@ void FtpServer::draw ()
 	{
 		std::array<char, 64> title{};
 
-		{
-			auto const serverLock = std::scoped_lock (m_lock);
+		if (!snapshot->address.empty ())
 			std::snprintf (title.data (),
 			    title.size (),
-			    STATUS_STRING " %s###ftpd",
-			    m_socket ? m_name.c_str () : "Waiting for WiFi...");
-		}
+			    STATUS_STRING " [%s]:%u###ftpd",
+			    snapshot->address.c_str (),
+			    snapshot->port);
+		else
+			std::snprintf (
+			    title.data (), title.size (), STATUS_STRING " Waiting for WiFi...###ftpd");
 
 		ImGui::Begin (title.data (),
 		    nullptr,
@@ -371,11 +435,8 @@ void FtpServer::draw ()
 	ImGui::Separator ();
 #endif
 
-	{
-		auto const lock = std::scoped_lock (m_lock);
-		for (auto &session : m_sessions)
-			session->draw ();
-	}
+	for (auto const &session : snapshot->sessions)
+		FtpSession::draw (session);
 
 	ImGui::End ();
 #endif
@@ -388,38 +449,100 @@ bool FtpServer::quit ()
 
 UniqueFtpServer FtpServer::create ()
 {
-	updateFreeSpace ();
-
-	auto config = FtpConfig::load (FTPDCONFIG);
+	return create (FtpConfig::load (FTPDCONFIG));
+}
 
-	return UniqueFtpServer (new FtpServer (std::move (config)));
+UniqueFtpServer FtpServer::create (UniqueFtpConfig config_)
+{
+	return UniqueFtpServer (new FtpServer (std::move (config_)));
 }
 
-std::string FtpServer::getFreeSpace ()
+#if FTPD_HEADLESS
+void FtpServer::reload (UniqueFtpConfig config_)
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
+	// settings only read at startup; the new values are kept for the next one
+	std::vector<char const *> pending;
+
+	bool restart = false;
+	updateConfig ([&] (FtpConfig &config) {
+		pending.clear ();
+		restart = config_->port () != config.port ();
+
+		if (config_->freeSpaceMounts () != config.freeSpaceMounts ())
+			pending.emplace_back ("freeSpaceMounts");
+#if FTPD_HAS_STATS_SEGMENT
+		if (config_->statsSegment () != config.statsSegment ())
+			pending.emplace_back ("statsSegment");
+#endif
+#if FTPD_HAS_XFER_JOURNAL
+		if (config_->journal () != config.journal ())
+			pending.emplace_back ("journal");
+		if (config_->journalRecords () != config.journalRecords ())
+			pending.emplace_back ("journalRecords");
+		if (config_->journalRotate () != config.journalRotate ())
+			pending.emplace_back ("journalRotate");
 #endif
-	return s_freeSpace;
+
+		// everything else is read as it is used
+		config = *config_;
+		return true;
+	});
+
+	setLogEnabled (COMMAND, config_->logCommands ());
+	setLogEnabled (RESPONSE, config_->logResponses ());
+
+	if (restart)
+		m_restart = true;
+
+	info ("Reloaded %s\n", config_->path ().c_str ());
+	for (auto const name : pending)
+		info ("Changing %s requires restart\n", name);
 }
+#endif
 
-void FtpServer::updateFreeSpace ()
+SharedFtpConfig FtpServer::config () const
 {
-	statvfs_t st = {};
-#if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
-	if (::statvfs ("sdmc:/", &st) != 0)
+#ifdef __NDS__
+	return m_config;
 #else
-	if (::statvfs ("/", &st) != 0)
+	return m_config.load (std::memory_order_acquire);
 #endif
-		return;
+}
 
-	auto freeSpace = fs::printSize (static_cast<std::uint64_t> (st.f_bsize) * st.f_bfree);
+bool FtpServer::updateConfig (std::function<bool (FtpConfig &)> const &update_)
+{
+#ifdef __NDS__
+	auto config = std::make_shared<FtpConfig> (*m_config);
+	if (!update_ (*config))
+		return false;
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
+	m_config = std::move (config);
+	return true;
+#else
+	// copy-on-write; retry if another change was published in the meantime
+	auto current = m_config.load (std::memory_order_acquire);
+	while (true)
+	{
+		auto config = std::make_shared<FtpConfig> (*current);
+		if (!update_ (*config))
+			return false;
+
+		if (m_config.compare_exchange_weak (current,
+		        std::move (config),
+		        std::memory_order_acq_rel,
+		        std::memory_order_acquire))
+			return true;
+	}
 #endif
-	if (freeSpace != s_freeSpace)
-		s_freeSpace = std::move (freeSpace);
+}
+
+std::string FtpServer::getFreeSpace ()
+{
+	auto const available = freespace::available (0);
+	if (!available)
+		return {};
+
+	return fs::printSize (*available);
 }
 
 std::time_t FtpServer::startTime ()
@@ -427,6 +550,162 @@ std::time_t FtpServer::startTime ()
 	return s_startTime;
 }
 
+#ifndef __NDS__
+FtpServer::LoopStats FtpServer::loopStats ()
+{
+	return {
+	    .iterations = m_loopIterations.load (std::memory_order_relaxed),
+	    .total      = std::chrono::nanoseconds (m_loopTotal.load (std::memory_order_relaxed)),
+	    .max        = std::chrono::nanoseconds (m_loopMax.exchange (0, std::memory_order_relaxed)),
+	};
+}
+#endif
+
+void FtpServer::writeStats (std::string &out_,
+    FtpSession const &self_,
+    bool const all_,
+    std::size_t const limit_)
+{
+	std::size_t capacity = 0;
+	std::size_t used     = 0;
+	for (auto const &session : m_sessions)
+		session->bufferUsage (capacity, used);
+
+	std::string server;
+	ftp::appendFormat (server,
+	    " {\"server\":\"%s\",\"uptime\":%" PRIu64 ",\"accepts\":%" PRIu64 ",\"sessions\":%zu",
+	    STATUS_STRING,
+	    static_cast<std::uint64_t> (std::time (nullptr) - s_startTime),
+	    m_accepts,
+	    m_sessions.size ());
+
+	ftp::appendFormat (server, ",\"buffers\":{\"capacity\":%zu,\"used\":%zu}", capacity, used);
+
+#ifndef __NDS__
+	auto const iterations = m_loopIterations.load (std::memory_order_relaxed);
+	ftp::appendFormat (server,
+	    ",\"loop\":{\"iterations\":%" PRIu64 ",\"mean_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}",
+	    iterations,
+	    iterations ? m_loopTotal.load (std::memory_order_relaxed) / iterations : 0,
+	    m_loopMax.load (std::memory_order_relaxed));
+#endif
+
+	auto const &control = FtpSession::controlLatency ();
+	ftp::appendFormat (server,
+	    ",\"control\":{\"count\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+	    ",\"max_ns\":%" PRIu64 "}",
+	    control.count (),
+	    control.percentile (50.0),
+	    control.percentile (99.0),
+	    control.max ());
+
+#if FTPD_HAS_BUSY_POLL
+	ftp::appendFormat (server,
+	    ",\"busy_poll\":{\"spin_us\":%lld,\"cpu\":%d}",
+	    static_cast<long long> (config ()->busyPoll ().count ()),
+	    m_pinnedCpu);
+#endif
+
+	auto const freeSpaceStats = freespace::stats ();
+	ftp::appendFormat (server,
+	    ",\"caches\":{\"free_space\":{\"reads\":%" PRIu64 ",\"refreshes\":%" PRIu64
+	    ",\"mounts\":[",
+	    freeSpaceStats.reads,
+	    freeSpaceStats.refreshes);
+
+	for (unsigned i = 0; i < freespace::mounts (); ++i)
+	{
+		auto const available = freespace::available (i);
+		ftp::appendFormat (server, "%s{\"path\":", i ? "," : "");
+		ftp::appendJsonString (server, freespace::path (i));
+		if (available)
+			ftp::appendFormat (server, ",\"available\":%" PRIu64 "}", *available);
+		else
+			server += ",\"available\":null}";
+	}
+	server += "]}";
+
+#ifndef __NDS__
+	auto const mdnsStats = mdns::stats ();
+	ftp::appendFormat (server,
+	    ",\"mdns\":{\"packets\":%" PRIu64 ",\"answered\":%" PRIu64 ",\"suppressed\":%" PRIu64
+	    ",\"ignored\":%" PRIu64 "}",
+	    mdnsStats.packets,
+	    mdnsStats.answered,
+	    mdnsStats.suppressed,
+	    mdnsStats.ignored);
+#endif
+
+#if FTPD_HAS_TLS
+	auto const tlsStats = tls::stats ();
+	ftp::appendFormat (server,
+	    ",\"tls\":{\"enabled\":%s,\"handshakes\":%" PRIu64 ",\"resumed\":%" PRIu64
+	    ",\"ktls_send\":%" PRIu64 ",\"ktls_recv\":%" PRIu64 ",\"alerts\":%" PRIu64 "}",
+	    tls::context () ? "true" : "false",
+	    tlsStats.handshakes,
+	    tlsStats.resumed,
+	    tlsStats.ktlsSend,
+	    tlsStats.ktlsRecv,
+	    tlsStats.alerts);
+#endif
+
+#if FTPD_HAS_DEDUP
+	auto const dedupStats = dedup::stats ();
+	ftp::appendFormat (server,
+	    ",\"dedup\":{\"hits\":%" PRIu64 ",\"misses\":%" PRIu64 "}",
+	    dedupStats.hits,
+	    dedupStats.misses);
+#endif
+
+	server += '}';
+
+	// leave room for the omitted count and the end of the server line
+	auto const budget = limit_ > server.size () + 32 ? limit_ - server.size () - 32 : 0;
+
+	std::string sessions;
+	std::string line;
+	unsigned omitted = 0;
+	for (auto const &session : m_sessions)
+	{
+		if (!all_ && session.get () != &self_)
+			continue;
+
+		line = ' ';
+		session->writeStats (line, session.get () == &self_);
+		line += "\r\n";
+
+		if (sessions.size () + line.size () > budget)
+			++omitted;
+		else
+			sessions += line;
+	}
+
+	if (omitted)
+		ftp::appendFormat (server, ",\"omitted\":%u", omitted);
+
+	out_ += server;
+	out_ += "}\r\n";
+	out_ += sessions;
+}
+
+#if FTPD_HAS_XFER_JOURNAL
+void FtpServer::recordTransfer (journal::Record const &record_)
+{
+	if (m_journal.append (record_))
+	{
+		m_journalFailed = false;
+		return;
+	}
+
+	// report once until the journal recovers
+	if (!m_journalFailed && !m_journal.path ().empty ())
+		error ("Failed to write transfer journal %s: %s\n",
+		    m_journal.path ().c_str (),
+		    std::strerror (errno));
+	m_journalFailed = true;
+}
+#endif
+
 #ifdef __3DS__
 int FtpServer::tzOffset ()
 {
@@ -440,14 +719,7 @@ void FtpServer::handleNetworkFound ()
 	if (!platform::networkAddress (addr))
 		return;
 
-	std::uint16_t port;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config->lockGuard ();
-#endif
-		port = m_config->port ();
-	}
+	auto const port = config ()->port ();
 
 	addr.setPort (port);
 
@@ -472,14 +744,15 @@ void FtpServer::handleNetworkFound ()
 
 	info ("Started server at %s\n", m_name.c_str ());
 
-	LOCKED (m_socket = std::move (socket));
+	m_socket = std::move (socket);
 
-#ifndef __NDS__
+	// a headless listener is bound to the wildcard address, which can't be announced
+#if !defined(__NDS__) && !FTPD_HEADLESS
 	socket = mdns::createSocket ();
 	if (!socket)
 		return;
 
-	LOCKED (m_mdnsSocket = std::move (socket));
+	m_mdnsSocket = std::move (socket);
 #endif
 }
 
@@ -488,18 +761,18 @@ void FtpServer::handleNetworkLost ()
 	{
 		// destroy sessions
 		std::vector<UniqueFtpSession> sessions;
-		LOCKED (sessions = std::move (m_sessions));
+		sessions = std::move (m_sessions);
 	}
 
 	{
 		UniqueSocket sock;
 
 		// destroy command socket
-		LOCKED (sock = std::move (m_socket));
+		sock = std::move (m_socket);
 
 #ifndef __NDS__
 		// destroy mDNS socket
-		LOCKED (sock = std::move (m_mdnsSocket));
+		sock = std::move (m_mdnsSocket);
 #endif
 	}
 
@@ -523,15 +796,15 @@ void FtpServer::showMenu ()
 			if (ImGui::MenuItem ("Settings"))
 				m_showSettings = true;
 
-			if (ImGui::MenuItem ("Upload Log"))
+			// the network thread owns the upload state from when the handle is published until
+			// it clears it again, so neither thread takes a lock
+			if (ImGui::MenuItem ("Upload Log") &&
+			    !m_uploadLogCurl.load (std::memory_order_acquire))
 			{
-#ifndef __NDS__
-				auto const lock = std::scoped_lock (m_lock);
-#endif
 				if (!m_uploadLogCurlM)
 					m_uploadLogCurlM = curl_multi_init ();
 
-				if (m_uploadLogCurlM && !m_uploadLogCurl.load (std::memory_order_relaxed))
+				if (m_uploadLogCurlM)
 				{
 					m_uploadLogData = getLog ();
 
@@ -566,7 +839,7 @@ void FtpServer::showMenu ()
 
 					// signal network thread to process
 					m_uploadLogMime = mime;
-					m_uploadLogCurl.store (handle, std::memory_order_relaxed);
+					m_uploadLogCurl.store (handle, std::memory_order_release);
 				}
 			}
 
@@ -589,34 +862,36 @@ void FtpServer::showMenu ()
 	{
 		if (!prevShowSettings)
 		{
-#ifndef __NDS__
-			auto const lock = m_config->lockGuard ();
-#endif
+			auto const config = this->config ();
 
-			m_userSetting = m_config->user ();
+			m_userSetting = config->user ();
 			m_userSetting.resize (32);
 
-			m_passSetting = m_config->pass ();
+			m_passSetting = config->pass ();
 			m_passSetting.resize (32);
 
-			m_hostnameSetting = m_config->hostname ();
+			m_hostnameSetting = config->hostname ();
 			m_hostnameSetting.resize (32);
 
-			m_portSetting = m_config->port ();
+			m_portSetting = config->port ();
 
-			m_deflateLevelSetting = m_config->deflateLevel ();
+			m_deflateLevelSetting = config->deflateLevel ();
+
+#if FTPD_HAS_DEDUP
+			m_dedupSetting = config->dedup ();
+#endif
 
 #ifdef __3DS__
-			m_getMTimeSetting = m_config->getMTime ();
+			m_getMTimeSetting = config->getMTime ();
 #endif
 
 #ifdef __SWITCH__
-			m_enableAPSetting = m_config->enableAP ();
+			m_enableAPSetting = config->enableAP ();
 
-			m_ssidSetting = m_config->ssid ();
+			m_ssidSetting = config->ssid ();
 			m_ssidSetting.resize (19);
 
-			m_passphraseSetting = m_config->passphrase ();
+			m_passphraseSetting = config->passphrase ();
 			m_passphraseSetting.resize (63);
 #endif
 
@@ -677,6 +952,10 @@ void FtpServer::showSettings ()
 		ImGui::SliderInt (
 		    "Deflate Level", &m_deflateLevelSetting, Z_NO_COMPRESSION, Z_BEST_COMPRESSION);
 
+#if FTPD_HAS_DEDUP
+		ImGui::Checkbox ("Dedup uploads", &m_dedupSetting);
+#endif
+
 #ifdef __3DS__
 		ImGui::Checkbox ("Get mtime", &m_getMTimeSetting);
 #endif
@@ -735,39 +1014,40 @@ void FtpServer::showSettings ()
 			m_showSettings = false;
 			ImGui::CloseCurrentPopup ();
 
-#ifndef __NDS__
-			auto const lock = m_config->lockGuard ();
-#endif
+			updateConfig ([this] (FtpConfig &config_) {
+				config_.setUser (m_userSetting);
+				config_.setPass (m_passSetting);
+				config_.setHostname (m_hostnameSetting);
+				config_.setPort (m_portSetting);
+				config_.setDeflateLevel (m_deflateLevelSetting);
 
-			m_config->setUser (m_userSetting);
-			m_config->setPass (m_passSetting);
-			m_config->setHostname (m_hostnameSetting);
-			m_config->setPort (m_portSetting);
-			m_config->setDeflateLevel (m_deflateLevelSetting);
+#if FTPD_HAS_DEDUP
+				config_.setDedup (m_dedupSetting);
+#endif
 
 #ifdef __3DS__
-			m_config->setGetMTime (m_getMTimeSetting);
+				config_.setGetMTime (m_getMTimeSetting);
 #endif
 
 #ifdef __SWITCH__
-			m_config->setEnableAP (m_enableAPSetting);
-			m_config->setSSID (m_ssidSetting);
-			m_config->setPassphrase (m_passphraseSetting);
-			m_apError = false;
+				config_.setEnableAP (m_enableAPSetting);
+				config_.setSSID (m_ssidSetting);
+				config_.setPassphrase (m_passphraseSetting);
 #endif
+				return true;
+			});
 
-			UniqueSocket socket;
-			LOCKED (socket = std::move (m_socket));
+#ifdef __SWITCH__
+			m_apError = false;
+#endif
 
-			mdns::setHostname (m_hostnameSetting);
+			m_restart = true;
 		}
 
 		if (save)
 		{
-#ifndef __NDS__
-			auto const lock = m_config->lockGuard ();
-#endif
-			if (!m_config->save (FTPDCONFIG))
+			auto const config = this->config ();
+			if (!config->save (config->path ().c_str ()))
 				error ("Failed to save config\n");
 		}
 
@@ -779,6 +1059,9 @@ void FtpServer::showSettings ()
 			m_passSetting     = defaults->pass ();
 			m_hostnameSetting = defaults->hostname ();
 			m_portSetting     = defaults->port ();
+#if FTPD_HAS_DEDUP
+			m_dedupSetting = defaults->dedup ();
+#endif
 #ifdef __3DS__
 			m_getMTimeSetting = defaults->getMTime ();
 #endif
@@ -838,8 +1121,8 @@ void FtpServer::showAbout ()
 		ImGui::Separator ();
 		if (ImGui::TreeNode ("Connections"))
 		{
-			for (auto const &session : m_sessions)
-				session->drawConnections ();
+			for (auto const &session : m_drawSnapshot->sessions)
+				FtpSession::drawConnections (session);
 			ImGui::TreePop ();
 		}
 
@@ -929,25 +1212,44 @@ void FtpServer::showAbout ()
 
 void FtpServer::loop ()
 {
+	TRACE_SCOPE ("FtpServer::loop");
+	ALLOC_SCOPE ("FtpServer::loop");
+
+#ifdef __NDS__
+	freespace::update ();
+#endif
+
+	auto const config = this->config ();
+
+#if FTPD_HAS_BUSY_POLL
+	if (auto const cpu = config->pinCpu (); cpu != m_pinnedCpu)
+	{
+		// only try once per setting
+		if (!pinThread (cpu))
+			error ("Failed to pin server thread to CPU %d: %s\n", cpu, std::strerror (errno));
+		else if (cpu >= 0)
+			info ("Pinned server thread to CPU %d\n", cpu);
+		m_pinnedCpu = cpu;
+	}
+#endif
+
+#if FTPD_HAS_TLS
+	tls::configure (config->tlsCert (), config->tlsKey (), config->ktls ());
+#endif
+
+	if (m_restart.exchange (false))
+	{
+		UniqueSocket socket;
+		socket = std::move (m_socket);
+	}
+
 	if (!m_socket)
 	{
 #ifndef CLASSIC
 #ifdef __SWITCH__
 		if (!m_apError)
-		{
-			bool enable;
-			std::string ssid;
-			std::string passphrase;
-
-			{
-				auto const lock = m_config->lockGuard ();
-				enable          = m_config->enableAP ();
-				ssid            = m_config->ssid ();
-				passphrase      = m_config->passphrase ();
-			}
-
-			m_apError = !platform::enableAP (enable, ssid, passphrase);
-		}
+			m_apError =
+			    !platform::enableAP (config->enableAP (), config->ssid (), config->passphrase ());
 #endif
 #endif
 
@@ -957,8 +1259,7 @@ void FtpServer::loop ()
 
 #ifndef CLASSIC
 	{
-		auto const lock = std::scoped_lock (m_lock);
-		if (m_uploadLogCurl.load (std::memory_order_relaxed))
+		if (m_uploadLogCurl.load (std::memory_order_acquire))
 		{
 			int busy      = 0;
 			auto const mc = curl_multi_perform (m_uploadLogCurlM, &busy);
@@ -970,7 +1271,7 @@ void FtpServer::loop ()
 				curl_easy_cleanup (m_uploadLogCurl);
 				curl_mime_free (m_uploadLogMime);
 				m_uploadLogMime = nullptr;
-				m_uploadLogCurl.store (nullptr, std::memory_order_relaxed);
+				m_uploadLogCurl.store (nullptr, std::memory_order_release);
 			}
 			else
 			{
@@ -999,7 +1300,7 @@ void FtpServer::loop ()
 					curl_easy_cleanup (m_uploadLogCurl);
 					curl_mime_free (m_uploadLogMime);
 					m_uploadLogMime = nullptr;
-					m_uploadLogCurl.store (nullptr, std::memory_order_relaxed);
+					m_uploadLogCurl.store (nullptr, std::memory_order_release);
 				}
 			}
 		}
@@ -1022,8 +1323,9 @@ void FtpServer::loop ()
 			auto socket = m_socket->accept ();
 			if (socket)
 			{
-				auto session = FtpSession::create (*m_config, std::move (socket));
-				LOCKED (m_sessions.emplace_back (std::move (session)));
+				++m_accepts;
+				auto session = FtpSession::create (*this, std::move (socket));
+				m_sessions.emplace_back (std::move (session));
 			}
 			else
 			{
@@ -1034,18 +1336,34 @@ void FtpServer::loop ()
 	}
 
 #ifndef __NDS__
-	// poll mDNS socket
-	if (m_socket && m_mdnsSocket)
-		mdns::handleSocket (m_mdnsSocket.get (), m_socket->sockName ());
+	// the listen and mDNS sockets wait with the sessions, so a connection or a query wakes the
+	// loop at once; connections are accepted at the top of the next iteration
+	std::optional<std::array<Socket::PollInfo, 2>> serverInfo;
+	std::size_t serverCount = 0;
+	if (m_socket)
+	{
+		serverInfo.emplace (std::array<Socket::PollInfo, 2>{
+		    {{*m_socket, POLLIN, 0}, {*m_socket, POLLIN, 0}}});
+		++serverCount;
+
+		if (m_mdnsSocket)
+		{
+			mdns::setService (config->hostname (), m_socket->sockName ());
+			mdns::update (m_mdnsSocket.get ());
+			(*serverInfo)[serverCount++] = {*m_mdnsSocket, POLLIN, 0};
+		}
+	}
+
+	auto const serverSockets =
+	    serverInfo ? std::span (serverInfo->data (), serverCount) : std::span<Socket::PollInfo> ();
+#else
+	auto const serverSockets = std::span<Socket::PollInfo> ();
 #endif
 
 	{
 		std::vector<UniqueFtpSession> deadSessions;
 		{
 			// remove dead sessions
-#ifndef __NDS__
-			auto const lock = std::scoped_lock (m_lock);
-#endif
 			auto it = std::begin (m_sessions);
 			while (it != std::end (m_sessions))
 			{
@@ -1062,20 +1380,173 @@ void FtpServer::loop ()
 	}
 
 	// poll sessions
-	if (!m_sessions.empty ())
+	if (!m_sessions.empty () || !serverSockets.empty ())
 	{
-		if (!FtpSession::poll (m_sessions))
+#if FTPD_HAS_BUSY_POLL
+		if (!FtpSession::poll (m_sessions, serverSockets, config->busyPoll ()))
+#else
+		if (!FtpSession::poll (m_sessions, serverSockets))
+#endif
+			handleNetworkLost ();
+#ifndef __NDS__
+		// an erroring listen socket would otherwise wake every poll
+		else if (serverCount > 0 && ((*serverInfo)[0].revents & ~POLLIN))
 			handleNetworkLost ();
+		else if (serverCount > 1 && ((*serverInfo)[1].revents & POLLIN))
+			mdns::handleSocket (m_mdnsSocket.get ());
+#endif
 	}
 #ifndef __NDS__
 	// avoid busy polling in background thread
 	else
 		platform::Thread::sleep (16ms);
 #endif
+
+#if FTPD_HAS_STATS_SEGMENT
+	publishStats ();
+#endif
+
+	publishSnapshot ();
+
+#if FTPD_TRACE
+	// dump requested by signal
+	if (trace::dumpRequested ())
+	{
+		auto const events = trace::dump (trace::DEFAULT_PATH);
+		if (events < 0)
+			error ("Failed to write %s: %s\n", trace::DEFAULT_PATH, std::strerror (errno));
+		else
+			info ("Wrote %ld trace events to %s\n", events, trace::DEFAULT_PATH);
+	}
+#endif
+}
+
+void FtpServer::publishSnapshot ()
+{
+	// bounded publish rate keeps the cost independent of loop and frame rates
+	auto const now = platform::steady_clock::now ();
+	if (now - m_snapshotPublished < SNAPSHOT_INTERVAL)
+		return;
+
+	m_snapshotPublished = now;
+
+	for (auto const &session : m_sessions)
+	{
+		session->updateRate ();
+#if FTPD_HAS_TCP_INFO
+		session->autoTune ();
+#endif
+	}
+
+#if !FTPD_HEADLESS
+	ALLOC_SCOPE ("FtpServer::publishSnapshot");
+
+	// build a new snapshot; the one being drawn is released by the UI when it is done
+	auto snapshot = std::make_shared<Snapshot> ();
+	if (m_socket)
+	{
+		auto const &sockName = m_socket->sockName ();
+		snapshot->address    = sockName.name ();
+		snapshot->port       = sockName.port ();
+	}
+
+	snapshot->freeSpace = getFreeSpace ();
+
+	snapshot->sessions.resize (m_sessions.size ());
+	for (std::size_t i = 0; i < m_sessions.size (); ++i)
+		m_sessions[i]->snapshot (snapshot->sessions[i]);
+
+#ifdef __NDS__
+	m_snapshot = std::move (snapshot);
+#else
+	m_snapshot.store (std::move (snapshot), std::memory_order_release);
+#endif
+#endif
 }
 
+#if FTPD_HAS_STATS_SEGMENT
+void FtpServer::publishStats ()
+{
+	auto const segment = m_statsSegment.get ();
+	if (!segment)
+		return;
+
+	// bounded publish rate keeps the cost independent of loop frequency
+	auto const now = platform::steady_clock::now ();
+	if (now - m_statsPublished < STATS_INTERVAL)
+		return;
+
+	m_statsPublished = now;
+
+	auto const slots = std::min (m_sessions.size (), stats::SEGMENT_SLOTS);
+
+	auto const updated = std::chrono::steady_clock::now ().time_since_epoch ();
+
+	stats::ServerRecord server = {};
+	server.pid         = ::getpid ();
+	server.startTime   = s_startTime;
+	server.updated     = std::chrono::duration_cast<std::chrono::nanoseconds> (updated).count ();
+	server.accepts     = m_accepts;
+	server.sessions    = m_sessions.size ();
+	server.unpublished = m_sessions.size () - slots;
+
+	server.loopIterations = m_loopIterations.load (std::memory_order_relaxed);
+	server.loopTotal      = m_loopTotal.load (std::memory_order_relaxed);
+	server.loopMax        = m_loopMax.load (std::memory_order_relaxed);
+
+	auto const &control = FtpSession::controlLatency ();
+	server.controlCount = control.count ();
+	server.controlP99   = control.percentile (99.0);
+	server.controlMax   = control.max ();
+
+	std::size_t capacity = 0;
+	std::size_t used     = 0;
+	for (auto const &session : m_sessions)
+		session->bufferUsage (capacity, used);
+
+	server.bufferCapacity = capacity;
+	server.bufferUsed     = used;
+
+	stats::store (segment->server, server);
+
+	// sessions are packed into the leading slots; vacated slots are cleared
+	stats::SessionRecord record;
+	for (std::size_t i = 0; i < slots; ++i)
+	{
+		m_sessions[i]->fillStats (record);
+		stats::store (segment->sessions[i], record);
+	}
+
+	record = {};
+	for (std::size_t i = slots; i < m_statsSlots; ++i)
+		stats::store (segment->sessions[i], record);
+
+	m_statsSlots = slots;
+}
+#endif
+
 void FtpServer::threadFunc ()
 {
+#ifdef __NDS__
 	while (!m_quit)
 		loop ();
+#else
+	while (!m_quit)
+	{
+		auto const start = platform::steady_clock::now ();
+
+		loop ();
+
+		auto const duration = static_cast<std::uint64_t> (
+		    std::chrono::duration_cast<std::chrono::nanoseconds> (
+		        platform::steady_clock::now () - start)
+		        .count ());
+
+		// single writer; a racing reset in loopStats can at worst drop one sample
+		m_loopIterations.fetch_add (1, std::memory_order_relaxed);
+		m_loopTotal.fetch_add (duration, std::memory_order_relaxed);
+		if (duration > m_loopMax.load (std::memory_order_relaxed))
+			m_loopMax.store (duration, std::memory_order_relaxed);
+	}
+#endif
 }
@@ -22,10 +22,14 @@
 
 #include "ftpSession.h"
 
+#include "allocTrack.h"
+#include "freeSpace.h"
 #include "ftpServer.h"
+#include "ftpUtil.h"
 #include "log.h"
-#include "mdns.h"
 #include "platform.h"
+#include "tls.h"
+#include "trace.h"
 
 #ifndef CLASSIC
 #include <imgui.h>
@@ -42,6 +46,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <charconv>
 #include <chrono>
 #include <cinttypes>
 #include <cstdarg>
@@ -49,260 +54,93 @@
 #include <ctime>
 #include <mutex>
 #include <string>
+#include <string_view>
+#include <utility>
 using namespace std::chrono_literals;
 
 #if defined(__NDS__) || defined(__3DS__) || defined(__SWITCH__)
 #define lstat stat
 #endif
 
-#ifdef __NDS__
-#define LOCKED(x) x
-#else
-#define LOCKED(x)                                                                                  \
-	do                                                                                             \
-	{                                                                                              \
-		auto const lock = std::scoped_lock (m_lock);                                               \
-		x;                                                                                         \
-	} while (0)
-#endif
+using ftp::buildPath;
+using ftp::buildResolvedPath;
+using ftp::compare;
+using ftp::decodePath;
+using ftp::encodePath;
+using ftp::parseCommand;
+using ftp::resolvePath;
 
 namespace
 {
 /// \brief Idle timeout
 constexpr auto IDLE_TIMEOUT = 60;
 
-/// \brief Check if string view is a C string
-/// \param str_ String to check
-bool isCString (std::string_view const str_)
-{
-	return str_.find_first_of ('\0') != std::string_view::npos;
-}
-
-/// \brief Case-insensitive string compare
-/// \param lhs_ Left string
-/// \param rhs_ Right string
-int compare (std::string_view const lhs_, std::string_view const rhs_)
-{
-	if (isCString (lhs_) && isCString (rhs_))
-		return ::strcasecmp (lhs_.data (), rhs_.data ());
-
-	auto const maxLen = std::min (lhs_.size (), rhs_.size ());
-	for (unsigned i = 0; i < maxLen; ++i)
-	{
-		auto const l = std::tolower (lhs_[i]);
-		auto const r = std::tolower (rhs_[i]);
-		if (l != r)
-			return l - r;
-	}
-
-	return gsl::narrow_cast<int> (lhs_.size ()) - gsl::narrow_cast<int> (rhs_.size ());
-}
-
-/// \brief Parse command
-/// \param buffer_ Buffer to parse
-/// \param size_ Size of buffer
-/// \returns {delimiterPos, nextPos}
-std::pair<char *, char *> parseCommand (char *const buffer_, std::size_t const size_)
-{
-	// look for \r\n or \n delimiter
-	auto const end = &buffer_[size_];
-	for (auto p = buffer_; p < end; ++p)
-	{
-		if (p[0] == '\r' && p < end - 1 && p[1] == '\n')
-			return {p, &p[2]};
-
-		if (p[0] == '\n')
-			return {p, &p[1]};
-	}
-
-	return {nullptr, nullptr};
-}
-
-/// \brief Decode path
-/// \param buffer_ Buffer to decode
-/// \param size_ Size of buffer
-void decodePath (char *const buffer_, std::size_t const size_)
-{
-	auto const end = &buffer_[size_];
-	for (auto p = buffer_; p < end; ++p)
-	{
-		// this is an encoded \n
-		if (*p == '\0')
-			*p = '\n';
-	}
-}
-
-/// \brief Encode path
-/// \param buffer_ Buffer to encode
-/// \param quotes_ Whether to encode quotes
-std::string encodePath (std::string_view const buffer_, bool const quotes_ = false)
-{
-	// check if the buffer has \n
-	bool const lf = std::memchr (buffer_.data (), '\n', buffer_.size ());
-
-	auto end = std::end (buffer_);
+/// \brief Time to wait for a data connection
+/// \note Shorter than IDLE_TIMEOUT, so the client gets a reply instead of a dropped session
+constexpr auto CONNECT_TIMEOUT = std::chrono::seconds (30);
 
-	std::size_t numQuotes = 0;
-	if (quotes_)
-	{
-		// check for \" that needs to be encoded
-		auto p = buffer_.data ();
-		do
-		{
-			p = static_cast<char const *> (std::memchr (p, '"', end - p));
-			if (p)
-			{
-				++p;
-				++numQuotes;
-			}
-		} while (p);
-	}
+/// \brief Transfer steps per readiness of the data socket
+constexpr auto TRANSFER_QUANTUM = 10;
 
-	// if nothing needs escaping, return it as-is
-	if (!lf && !numQuotes)
-		return std::string (buffer_);
+/// \brief Longest run of transfer quanta before command sockets are checked again
+constexpr auto CONTROL_SLICE = std::chrono::milliseconds (1);
 
-	// reserve output buffer
-	std::string path (buffer_.size () + numQuotes, '\0');
-	auto in  = buffer_.data ();
-	auto out = path.data ();
+/// \brief Last assigned session id
+std::uint64_t s_lastId = 0;
 
-	// encode into the output buffer
-	while (in < end)
-	{
-		if (*in == '\n')
-		{
-			// encoded \n is \0
-			*out++ = '\0';
-		}
-		else if (quotes_ && *in == '"')
-		{
-			// encoded \" is \"\"
-			*out++ = '"';
-			*out++ = '"';
-		}
-		else
-			*out++ = *in;
-		++in;
-	}
+/// \brief Transfer phase names, in order
+char const *const xferPhaseNames[] = {
+    "open",
+    "connect",
+    "first_byte",
+    "transfer",
+    "reply",
+    "total",
+};
 
-	return path;
-}
+/// \brief Handler latency by verb, indexed like handlers; allocated on first use
+/// \note Shared by all sessions, which only run on the server thread
+std::vector<std::unique_ptr<LatencyHistogram>> s_commandLatency;
 
-/// \brief Get parent directory name of a path
-/// \param path_ Path to get parent of
-std::string dirName (std::string_view const path_)
-{
-	// remove last path component
-	auto const dir = std::string (path_.substr (0, path_.rfind ('/')));
-	if (dir.empty ())
-		return "/";
+/// \brief Latency of successful transfers by phase
+LatencyHistogram s_xferLatency[std::size (xferPhaseNames)];
 
-	return dir;
-}
+/// \brief Time from poll wakeup until a ready command socket has been serviced
+LatencyHistogram s_controlLatency;
 
-/// \brief Resolve path
-/// \param path_ Path to resolve
-std::string resolvePath (std::string_view const path_)
+/// \brief Stat a virtual device path
+/// \param path_ Absolute path
+/// \param st_ Output status
+/// \returns 1 if path_ names a virtual device or directory, 0 if not, or -1 (with errno set) if
+/// the device can't be opened
+/// \note Sized devices are regular files; the rest are directories if clients reach sized
+/// variants through them, else character devices
+int devStat (std::string const &path_, stat_t &st_)
 {
-	assert (!path_.empty ());
-	assert (path_[0] == '/');
-
-	// make sure parent is a directory
-	stat_t st;
-	if (::stat (dirName (path_).c_str (), &st) != 0)
-		return {};
-
-	if (!S_ISDIR (st.st_mode))
-	{
-		errno = ENOTDIR;
-		return {};
-	}
-
-	// split path components
-	std::vector<std::string_view> components;
-
-	std::size_t pos = 1;
-	auto next       = path_.find ('/', pos);
-	while (next != std::string::npos)
-	{
-		if (next != pos)
-			components.emplace_back (path_.substr (pos, next - pos));
-		pos  = next + 1;
-		next = path_.find ('/', pos);
-	}
+	auto const device    = fs::DevFile::match (path_);
+	auto const directory = fs::DevFile::matchDirectory (path_);
+	if (!device && !directory)
+		return 0;
 
-	if (pos != path_.size ())
-		components.emplace_back (path_.substr (pos));
+	st_          = stat_t{};
+	st_.st_mode  = directory ? S_IFDIR | 0555 : S_IFCHR | 0666;
+	st_.st_nlink = 1;
+	st_.st_mtime = FtpServer::startTime ();
 
-	// collapse . and ..
-	auto it = std::begin (components);
-	while (it != std::end (components))
+	if (device)
 	{
-		if (*it == ".")
-		{
-			it = components.erase (it);
-			continue;
-		}
+		fs::DevFile devFile;
+		if (!devFile.open (path_))
+			return -1;
 
-		if (*it == "..")
+		if (devFile.size () >= 0)
 		{
-			if (it != std::begin (components))
-				it = components.erase (std::prev (it));
-			it = components.erase (it);
-			continue;
+			st_.st_mode = S_IFREG | 0666;
+			st_.st_size = devFile.size ();
 		}
-
-		++it;
-	}
-
-	// join path components
-	std::string outPath = "/";
-	for (auto const &component : components)
-	{
-		outPath += component;
-		outPath.push_back ('/');
-	}
-
-	if (outPath.size () > 1)
-		outPath.pop_back ();
-
-	return outPath;
-}
-
-/// \brief Build path from a parent and child
-/// \param cwd_ Parent directory
-/// \param args_ Child component
-std::string buildPath (std::string_view const cwd_, std::string_view const args_)
-{
-	std::string path;
-
-	// absolute path
-	if (args_[0] == '/')
-		path = std::string (args_);
-	// relative path
-	else
-		path = std::string (cwd_) + '/' + std::string (args_);
-
-	// coalesce consecutive slashes
-	auto it = std::begin (path);
-	while (it != std::end (path))
-	{
-		if (it != std::begin (path) && *it == '/' && *std::prev (it) == '/')
-			it = path.erase (it);
-		else
-			++it;
 	}
 
-	return path;
-}
-
-/// \brief Build resolved path from a parent and child
-/// \param cwd_ Parent directory
-/// \param args_ Child component
-std::string buildResolvedPath (std::string_view const cwd_, std::string_view const args_)
-{
-	return resolvePath (buildPath (cwd_, args_));
+	return 1;
 }
 }
 
@@ -369,21 +207,29 @@ void FtpSession::Glob::clear () noexcept
 ///////////////////////////////////////////////////////////////////////////
 FtpSession::~FtpSession ()
 {
+	// record a transfer cut short by shutdown
+	if (m_xferPhases.active)
+		setState (State::COMMAND, false, false);
+
 	closeCommand ();
 	closePasv ();
 	closeData ();
 }
 
-FtpSession::FtpSession (FtpConfig &config_, UniqueSocket commandSocket_)
-    : m_config (config_),
+FtpSession::FtpSession (FtpServer &server_, UniqueSocket commandSocket_)
+    : m_server (server_),
+      m_id (++s_lastId),
+      m_config (server_.config ()),
       m_commandSocket (std::move (commandSocket_)),
       m_commandBuffer (COMMAND_BUFFERSIZE),
-      m_responseBuffer (RESPONSE_BUFFERSIZE),
-      m_xferBuffer (XFER_BUFFERSIZE),
-      m_zStreamBuffer (XFER_BUFFERSIZE),
+      m_responseBuffer (m_config->responseBufferSize ()),
+      m_xferBuffer (m_config->xferBufferSize ()),
+      m_zStreamBuffer (m_config->xferBufferSize ()),
+      m_commandStats (handlers.size ()),
       m_zStream (nullptr, nullptr),
       m_authorizedUser (false),
       m_authorizedPass (false),
+      m_anonymous (false),
       m_pasv (false),
       m_port (false),
       m_recv (false),
@@ -391,23 +237,21 @@ FtpSession::FtpSession (FtpConfig &config_, UniqueSocket commandSocket_)
       m_urgent (false),
       m_deflate (false),
       m_zFlushed (false),
-      m_eof (false),
+      m_resuming (false),
       m_mlstType (true),
       m_mlstSize (true),
       m_mlstModify (true),
       m_mlstPerm (true),
       m_mlstUnixMode (false),
-      m_devZero (false)
+      m_dedup (false),
+      m_startTls (false),
+      m_pbsz (false),
+      m_protPrivate (false)
 {
-	{
-#ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
-#endif
-		if (m_config.user ().empty ())
-			m_authorizedUser = true;
-		if (m_config.pass ().empty ())
-			m_authorizedPass = true;
-	}
+	if (m_config->user ().empty ())
+		m_authorizedUser = m_anonymous = true;
+	if (m_config->pass ().empty ())
+		m_authorizedPass = true;
 
 	char buffer[32];
 	std::sprintf (buffer, "Session#%p", this);
@@ -418,156 +262,491 @@ FtpSession::FtpSession (FtpConfig &config_, UniqueSocket commandSocket_)
 
 	m_commandSocket->setNonBlocking ();
 
+	// replies are small and latency-bound; don't let Nagle hold them for a delayed ACK
+	m_commandSocket->setNoDelay ();
+
+#if FTPD_HAS_BUSY_POLL
+	setBusyPoll (*m_commandSocket);
+#endif
+
 	sendResponse ("220 Hello!\r\n");
 }
 
 bool FtpSession::dead ()
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (m_lock);
-#endif
 	if (m_commandSocket || m_pasvSocket || m_dataSocket)
 		return false;
 
 	return true;
 }
 
-void FtpSession::draw ()
+void FtpSession::updateRate ()
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (m_lock);
-#endif
+	if (!m_fileSize && !m_filePosition)
+		return;
 
-#ifdef CLASSIC
-	if (m_filePosition)
+	// MiB/s plot lines
+	for (std::size_t i = 0; i < POSITION_HISTORY - 1; ++i)
 	{
-		std::fputs (fs::printSize (m_filePosition).c_str (), stdout);
-		std::fputc (' ', stdout);
+		m_filePositionDeltas[i]  = m_filePositionHistory[i + 1] - m_filePositionHistory[i];
+		m_filePositionHistory[i] = m_filePositionHistory[i + 1];
 	}
 
-	std::fputs (m_workItem.empty () ? m_cwd.c_str () : m_workItem.c_str (), stdout);
-#else
-#ifdef __3DS__
-	ImGui::BeginChild (m_windowName.c_str (), ImVec2 (0.0f, 45.0f), true);
-#else
-	ImGui::BeginChild (m_windowName.c_str (), ImVec2 (0.0f, 80.0f), true);
-#endif
+	auto const diff = m_filePosition - m_filePositionHistory[POSITION_HISTORY - 1];
+	m_filePositionDeltas[POSITION_HISTORY - 1]  = diff;
+	m_filePositionHistory[POSITION_HISTORY - 1] = m_filePosition;
 
-	if (!m_workItem.empty ())
-		ImGui::TextUnformatted (m_workItem.c_str ());
+	if (m_xferRate == -1.0f)
+	{
+		m_xferRate         = 0.0f;
+		m_filePositionTime = platform::steady_clock::now ();
+	}
 	else
-		ImGui::TextUnformatted (m_cwd.c_str ());
+	{
+		auto const now      = platform::steady_clock::now ();
+		auto const timeDiff = now - m_filePositionTime;
+		m_filePositionTime  = now;
+
+		auto const rate =
+		    gsl::narrow_cast<float> (diff) / std::chrono::duration<float> (timeDiff).count ();
+		auto const alpha = 0.1f;
+		m_xferRate       = alpha * rate + (1.0f - alpha) * m_xferRate;
+	}
+}
+
+#if FTPD_HAS_TCP_INFO
+void FtpSession::autoTune ()
+{
+	// MODE Z keeps pointers into the buffers across calls
+	if (!m_config->autoTune () || m_state != State::DATA_TRANSFER || !m_dataSocket || m_deflate)
+		return;
+
+	Socket::TcpInfo info;
+	if (!m_dataSocket->tcpInfo (info))
+		return;
+
+	// the sender's RTT estimate goes stale on a connection that only receives; the minimum
+	// excludes queueing delay, which would otherwise grow with the buffers
+	m_rtt = m_recv && info.rcvRtt.count () ? info.rcvRtt : info.minRtt;
+
+	// the kernel only measures the delivery rate of data it sends
+	auto const rate = std::max (static_cast<double> (m_send ? info.deliveryRate : 0),
+	    static_cast<double> (std::max (m_xferRate, 0.0f)));
+	auto const bdp =
+	    static_cast<std::size_t> (rate * std::chrono::duration<double> (m_rtt).count ());
+
+	// grow in powers of two so reallocations stay rare
+	auto size = m_xferBuffer.capacity ();
+	while (size < bdp && size < AUTOTUNE_BUFFERSIZE)
+		size *= 2;
+
+	size = std::min (size, AUTOTUNE_BUFFERSIZE);
+	if (size <= m_xferBuffer.capacity ())
+		return;
 
-	if (m_fileSize)
-		ImGui::Text (
-		    "%s/%s", fs::printSize (m_filePosition).c_str (), fs::printSize (m_fileSize).c_str ());
-	else if (m_filePosition)
-		ImGui::Text ("%s/???", fs::printSize (m_filePosition).c_str ());
+	m_xferBuffer.resize (size);
+	m_tunedBufferSize = size;
+	m_dataSocket->setNotSentLowat (size);
 
-	if (m_fileSize || m_filePosition)
+	// a fixed socket buffer has to keep up too; otherwise the kernel tunes it
+	if (auto const sockSize = m_config->sockBufferSize (); sockSize != 0 && sockSize < size)
 	{
-		// MiB/s plot lines
-		for (std::size_t i = 0; i < POSITION_HISTORY - 1; ++i)
-		{
-			m_filePositionDeltas[i]  = m_filePositionHistory[i + 1] - m_filePositionHistory[i];
-			m_filePositionHistory[i] = m_filePositionHistory[i + 1];
-		}
+		m_dataSocket->setRecvBufferSize (size);
+		m_dataSocket->setSendBufferSize (size);
+	}
+}
+#endif
+
+void FtpSession::snapshot (Snapshot &snapshot_) const
+{
+	snapshot_.windowName   = m_windowName;
+	snapshot_.status       = m_workItem.empty () ? m_cwd : m_workItem;
+	snapshot_.filePosition = m_filePosition;
+	snapshot_.fileSize     = m_fileSize;
+
+#ifndef CLASSIC
+	snapshot_.xferRate = m_xferRate;
+	snapshot_.positionDeltas.assign (std::begin (m_filePositionDeltas),
+	    std::end (m_filePositionDeltas));
+
+	static char const *const stateStrings[] = {
+	    "Command",
+	    "Data Connect",
+	    "Data Transfer",
+	};
 
-		auto const diff = m_filePosition - m_filePositionHistory[POSITION_HISTORY - 1];
-		m_filePositionDeltas[POSITION_HISTORY - 1]  = diff;
-		m_filePositionHistory[POSITION_HISTORY - 1] = m_filePosition;
+	snapshot_.state = stateStrings[static_cast<int> (m_state)];
 
-		if (m_xferRate == -1.0f)
+#ifdef NO_IPV6
+	char peerName[INET_ADDRSTRLEN];
+	char sockName[INET_ADDRSTRLEN];
+#else
+	char peerName[INET6_ADDRSTRLEN];
+	char sockName[INET6_ADDRSTRLEN];
+#endif
+
+	auto &connections = snapshot_.connections;
+	connections.clear ();
+
+	auto const add = [&] (char const *const kind_, Socket const &socket_, bool const peer_) {
+		socket_.sockName ().name (sockName, sizeof (sockName));
+
+		std::string text = kind_;
+		text += ' ';
+		if (peer_)
 		{
-			m_xferRate         = 0.0f;
-			m_filePositionTime = platform::steady_clock::now ();
+			socket_.peerName ().name (peerName, sizeof (peerName));
+			text += peerName;
+			text += " -> ";
 		}
-		else
-		{
-			auto const now      = platform::steady_clock::now ();
-			auto const timeDiff = now - m_filePositionTime;
-			m_filePositionTime  = now;
+		text += sockName;
 
-			auto const rate =
-			    gsl::narrow_cast<float> (diff) / std::chrono::duration<float> (timeDiff).count ();
-			auto const alpha = 0.01f;
-			m_xferRate       = alpha * rate + (1.0f - alpha) * m_xferRate;
-		}
+		connections.emplace_back (std::move (text));
+	};
+
+	if (m_commandSocket)
+		add (m_commandSocket == m_dataSocket ? "Command/Data" : "Command", *m_commandSocket, true);
+
+	if (m_pasvSocket)
+		add ("PASV", *m_pasvSocket, false);
+
+	if (m_dataSocket && m_dataSocket != m_commandSocket)
+		add ("Data", *m_dataSocket, true);
+
+	for (auto const &sock : m_pendingCloseSocket)
+	{
+		if (sock)
+			add ("Closing", *sock, true);
+	}
+#endif
+}
+
+void FtpSession::draw (Snapshot const &snapshot_)
+{
+#ifdef CLASSIC
+	if (snapshot_.filePosition)
+	{
+		std::fputs (fs::printSize (snapshot_.filePosition).c_str (), stdout);
+		std::fputc (' ', stdout);
+	}
 
-		auto const rateString = fs::printSize (m_xferRate) + "/s";
+	std::fputs (snapshot_.status.c_str (), stdout);
+#else
+#ifdef __3DS__
+	ImGui::BeginChild (snapshot_.windowName.c_str (), ImVec2 (0.0f, 45.0f), true);
+#else
+	ImGui::BeginChild (snapshot_.windowName.c_str (), ImVec2 (0.0f, 80.0f), true);
+#endif
+
+	ImGui::TextUnformatted (snapshot_.status.c_str ());
+
+	if (snapshot_.fileSize)
+		ImGui::Text ("%s/%s",
+		    fs::printSize (snapshot_.filePosition).c_str (),
+		    fs::printSize (snapshot_.fileSize).c_str ());
+	else if (snapshot_.filePosition)
+		ImGui::Text ("%s/???", fs::printSize (snapshot_.filePosition).c_str ());
+
+	if (snapshot_.fileSize || snapshot_.filePosition)
+	{
+		auto const rateString = fs::printSize (snapshot_.xferRate) + "/s";
 
 		ImGui::SameLine ();
-		ImGui::PlotLines (
-		    "", m_filePositionDeltas, IM_ARRAYSIZE (m_filePositionDeltas), 0, rateString.c_str ());
+		ImGui::PlotLines ("",
+		    snapshot_.positionDeltas.data (),
+		    gsl::narrow_cast<int> (snapshot_.positionDeltas.size ()),
+		    0,
+		    rateString.c_str ());
 	}
 
 	ImGui::EndChild ();
 #endif
 }
 
-void FtpSession::drawConnections ()
+void FtpSession::drawConnections (Snapshot const &snapshot_)
 {
 #ifndef CLASSIC
-#ifdef NO_IPV6
-	char peerName[INET_ADDRSTRLEN];
-	char sockName[INET_ADDRSTRLEN];
+	ImGui::TextWrapped ("State: %s", snapshot_.state);
+	for (auto const &connection : snapshot_.connections)
+		ImGui::TextWrapped ("%s", connection.c_str ());
 #else
-	char peerName[INET6_ADDRSTRLEN];
-	char sockName[INET6_ADDRSTRLEN];
+	(void)snapshot_;
 #endif
+}
 
-	static char const *const stateStrings[] = {
-	    "Command",
-	    "Data Connect",
-	    "Data Transfer",
+void FtpSession::writeStats (std::string &out_, bool const self_) const
+{
+	static char const *const stateNames[] = {
+	    "command",
+	    "data_connect",
+	    "data_transfer",
 	};
 
-	ImGui::TextWrapped ("State: %s", stateStrings[static_cast<int> (m_state)]);
+	// include time spent in the current state so far
+	std::uint64_t stateTime[std::size (stateNames)];
+	std::copy (std::begin (m_stateTime), std::end (m_stateTime), std::begin (stateTime));
+	auto const current = platform::steady_clock::now () - m_stateStart;
+	stateTime[static_cast<int> (m_state)] +=
+	    std::chrono::duration_cast<std::chrono::nanoseconds> (current).count ();
+
+	ftp::appendFormat (out_, "{\"session\":%" PRIu64, m_id);
+	if (self_)
+		out_ += ",\"self\":true";
+
 	if (m_commandSocket)
 	{
-		m_commandSocket->peerName ().name (peerName, sizeof (peerName));
-		m_commandSocket->sockName ().name (sockName, sizeof (sockName));
+		auto const &peerName = m_commandSocket->peerName ();
+		out_ += ",\"peer\":";
+		ftp::appendJsonString (out_, peerName.name ());
+		ftp::appendFormat (out_, ",\"port\":%u", peerName.port ());
+	}
 
-		if (m_commandSocket == m_dataSocket)
-			ImGui::TextWrapped ("Command/Data %s -> %s", peerName, sockName);
-		else
-			ImGui::TextWrapped ("Command %s -> %s", peerName, sockName);
+	ftp::appendFormat (out_, ",\"state\":\"%s\"", stateNames[static_cast<int> (m_state)]);
+	if (m_state == State::DATA_TRANSFER)
+		out_ += m_recv ? ",\"direction\":\"recv\"" : ",\"direction\":\"send\"";
+
+	out_ += ",\"cwd\":";
+	ftp::appendJsonString (out_, m_cwd);
+	out_ += ",\"work_item\":";
+	ftp::appendJsonString (out_, m_workItem);
+
+	ftp::appendFormat (out_,
+	    ",\"position\":%" PRIu64 ",\"size\":%" PRIu64 ",\"rate\":%.0f",
+	    m_filePosition,
+	    m_fileSize,
+	    std::max (m_xferRate, 0.0f));
+
+	ftp::appendFormat (out_,
+	    ",\"bytes\":{\"control_in\":%" PRIu64 ",\"control_out\":%" PRIu64
+	    ",\"data_in\":%" PRIu64 ",\"data_out\":%" PRIu64 "}",
+	    m_controlIn,
+	    m_controlOut,
+	    m_dataIn,
+	    m_dataOut);
+
+	// coalescing shows as fewer writes than responses
+	ftp::appendFormat (out_,
+	    ",\"responses\":{\"queued\":%" PRIu64 ",\"writes\":%" PRIu64,
+	    m_responses,
+	    m_responseWrites);
+#if FTPD_HAS_TCP_INFO
+	if (Socket::TcpInfo info; m_commandSocket && m_commandSocket->tcpInfo (info))
+		ftp::appendFormat (out_, ",\"segments\":%" PRIu32, info.segsOut);
+#endif
+	out_ += '}';
+
+	out_ += ",\"state_ns\":{";
+	for (std::size_t i = 0; i < std::size (stateNames); ++i)
+		ftp::appendFormat (out_, "%s\"%s\":%" PRIu64, i ? "," : "", stateNames[i], stateTime[i]);
+	out_ += '}';
+
+	std::size_t capacity = 0;
+	std::size_t used     = 0;
+	bufferUsage (capacity, used);
+	ftp::appendFormat (out_,
+	    ",\"buffers\":{\"capacity\":%zu,\"used\":%zu,\"xfer\":%zu",
+	    capacity,
+	    used,
+	    m_xferBuffer.capacity ());
+	if (m_dataSocket)
+	{
+		ftp::appendFormat (out_,
+		    ",\"sock_rcv\":%zu,\"sock_snd\":%zu",
+		    m_dataSocket->recvBufferSize (),
+		    m_dataSocket->sendBufferSize ());
+	}
+#if FTPD_HAS_TCP_INFO
+	if (m_rtt.count ())
+		ftp::appendFormat (out_, ",\"rtt_us\":%lld", static_cast<long long> (m_rtt.count ()));
+#endif
+	out_ += '}';
+
+	// TCP tuning per socket
+	auto sep                = "";
+	auto const appendTuning = [&] (char const *const name_, Socket const &socket_) {
+		auto const &tuning = socket_.tuning ();
+		ftp::appendFormat (out_,
+		    "%s\"%s\":{\"nodelay\":%s,\"notsent_lowat\":%zu,\"busy_poll_us\":%lld}",
+		    sep,
+		    name_,
+		    tuning.noDelay ? "true" : "false",
+		    tuning.notSentLowat,
+		    static_cast<long long> (tuning.busyPoll.count ()));
+#if FTPD_HAS_TLS
+		if (Socket::TlsInfo tls; socket_.tlsInfo (tls))
+		{
+			out_.pop_back ();
+			ftp::appendFormat (out_,
+			    ",\"tls\":{\"established\":%s,\"version\":\"%s\",\"cipher\":\"%s\","
+			    "\"resumed\":%s,\"ktls_send\":%s,\"ktls_recv\":%s}}",
+			    tls.established ? "true" : "false",
+			    tls.version,
+			    tls.cipher ? tls.cipher : "",
+			    tls.resumed ? "true" : "false",
+			    tls.ktlsSend ? "true" : "false",
+			    tls.ktlsRecv ? "true" : "false");
+		}
+#endif
+		sep = ",";
+	};
+
+	out_ += ",\"sockets\":{";
+	if (m_commandSocket)
+		appendTuning ("control", *m_commandSocket);
+	if (m_dataSocket)
+		appendTuning ("data", *m_dataSocket);
+	out_ += '}';
+
+	ftp::appendFormat (out_, ",\"invalid_commands\":%" PRIu64 ",\"commands\":{", m_invalidCommands);
+	bool first = true;
+	for (std::size_t i = 0; i < m_commandStats.size (); ++i)
+	{
+		auto const &stats = m_commandStats[i];
+		if (!stats.count)
+			continue;
+
+		ftp::appendFormat (out_,
+		    "%s\"%.*s\":{\"count\":%" PRIu64 ",\"total_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}",
+		    first ? "" : ",",
+		    static_cast<int> (handlers[i].first.size ()),
+		    handlers[i].first.data (),
+		    stats.count,
+		    stats.total,
+		    stats.max);
+		first = false;
+	}
+	out_ += "}}";
+}
+
+#if FTPD_HAS_STATS_SEGMENT
+void FtpSession::fillStats (stats::SessionRecord &record_) const
+{
+	record_    = {};
+	record_.id = m_id;
+
+	if (m_commandSocket)
+	{
+		auto const &peerName = m_commandSocket->peerName ();
+		peerName.name (record_.peer, sizeof (record_.peer));
+		record_.port = peerName.port ();
 	}
 
-	if (m_pasvSocket)
+	record_.state = static_cast<std::uint8_t> (m_state);
+	record_.recv  = m_recv;
+
+	auto const workItem = m_workItem.empty () ? std::string_view (m_cwd) : m_workItem;
+	auto const size     = std::min (workItem.size (), sizeof (record_.workItem) - 1);
+	std::memcpy (record_.workItem, workItem.data (), size);
+
+	record_.position   = m_filePosition;
+	record_.size       = m_fileSize;
+	record_.rate       = std::max (m_xferRate, 0.0f);
+	record_.controlIn  = m_controlIn;
+	record_.controlOut = m_controlOut;
+	record_.dataIn     = m_dataIn;
+	record_.dataOut    = m_dataOut;
+
+	std::copy (std::begin (m_stateTime), std::end (m_stateTime), std::begin (record_.stateTime));
+	auto const current = platform::steady_clock::now () - m_stateStart;
+	record_.stateTime[static_cast<int> (m_state)] +=
+	    std::chrono::duration_cast<std::chrono::nanoseconds> (current).count ();
+
+	for (auto const &stats : m_commandStats)
 	{
-		m_pasvSocket->sockName ().name (sockName, sizeof (sockName));
-		ImGui::TextWrapped ("PASV %s", sockName);
+		record_.commands += stats.count;
+		record_.commandTime += stats.total;
 	}
 
-	if (m_dataSocket && m_dataSocket != m_commandSocket)
+	record_.invalidCommands = m_invalidCommands;
+}
+#endif
+
+unsigned FtpSession::writeLatency (std::string &out_, std::size_t const limit_)
+{
+	std::string line;
+	std::size_t size = 0;
+	unsigned omitted = 0;
+
+	auto const append = [&] {
+		line += "}\r\n";
+
+		if (size + line.size () > limit_)
+			++omitted;
+		else
+		{
+			out_ += line;
+			size += line.size ();
+		}
+	};
+
+	for (std::size_t i = 0; i < s_commandLatency.size (); ++i)
 	{
-		m_dataSocket->peerName ().name (peerName, sizeof (peerName));
-		m_dataSocket->sockName ().name (sockName, sizeof (sockName));
-		ImGui::TextWrapped ("Data %s -> %s", peerName, sockName);
+		if (!s_commandLatency[i])
+			continue;
+
+		line = " {\"command\":\"";
+		line += handlers[i].first;
+		line += "\",";
+		s_commandLatency[i]->write (line);
+		append ();
 	}
 
-	for (auto const &sock : m_pendingCloseSocket)
+	for (std::size_t i = 0; i < std::size (xferPhaseNames); ++i)
 	{
-		if (!sock)
+		if (!s_xferLatency[i].count ())
 			continue;
 
-		sock->peerName ().name (peerName, sizeof (peerName));
-		sock->sockName ().name (sockName, sizeof (sockName));
-		ImGui::TextWrapped ("Closing %s -> %s", peerName, sockName);
+		line = " {\"phase\":\"";
+		line += xferPhaseNames[i];
+		line += "\",";
+		s_xferLatency[i].write (line);
+		append ();
 	}
-#endif
+
+	if (s_controlLatency.count ())
+	{
+		line = " {\"channel\":\"control\",";
+		s_controlLatency.write (line);
+		append ();
+	}
+
+	return omitted;
+}
+
+LatencyHistogram const &FtpSession::controlLatency ()
+{
+	return s_controlLatency;
+}
+
+void FtpSession::bufferUsage (std::size_t &capacity_, std::size_t &used_) const
+{
+	for (auto const buffer : {&m_commandBuffer, &m_responseBuffer, &m_xferBuffer, &m_zStreamBuffer})
+	{
+		capacity_ += buffer->capacity ();
+		used_ += buffer->usedSize ();
+	}
+}
+
+UniqueFtpSession FtpSession::create (FtpServer &server_, UniqueSocket commandSocket_)
+{
+	return UniqueFtpSession (new FtpSession (server_, std::move (commandSocket_)));
 }
 
-UniqueFtpSession FtpSession::create (FtpConfig &config_, UniqueSocket commandSocket_)
+co::Arena &FtpSession::frameArena ()
 {
-	return UniqueFtpSession (new FtpSession (config_, std::move (commandSocket_)));
+	return m_arena;
 }
 
-bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
+bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_,
+    std::span<Socket::PollInfo> const serverSockets_,
+    std::chrono::microseconds const spin_)
 {
-	// poll for pending close sockets first
-	std::vector<Socket::PollInfo> pollInfo;
+	TRACE_SCOPE ("FtpSession::poll");
+	ALLOC_SCOPE ("FtpSession::poll");
+
+	// poll for pending close sockets first; the list is reused between calls
+	thread_local std::vector<Socket::PollInfo> pollInfo;
+	pollInfo.clear ();
 	for (auto &session : sessions_)
 	{
 		for (auto &pending : session->m_pendingCloseSocket)
@@ -611,10 +790,20 @@ bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
 		}
 	}
 
-	// poll for everything else
+	// poll for everything else; pollSessions holds the session index of each entry, and
+	// pollWaits the entries transfers wait on
+	thread_local std::vector<std::size_t> pollSessions;
+	thread_local std::vector<std::size_t> pollWaits;
 	pollInfo.clear ();
-	for (auto &session : sessions_)
+	pollSessions.clear ();
+	pollWaits.clear ();
+
+	// a transfer deadline can cut the poll short
+	auto const start = platform::steady_clock::now ();
+	auto timeout     = std::chrono::milliseconds (100);
+	for (std::size_t index = 0; index < sessions_.size (); ++index)
 	{
+		auto const &session = sessions_[index];
 		if (session->m_commandSocket)
 		{
 			pollInfo.emplace_back (*session->m_commandSocket, POLLIN | POLLPRI, 0);
@@ -622,140 +811,188 @@ bool FtpSession::poll (std::vector<UniqueFtpSession> const &sessions_)
 				pollInfo.back ().events |= POLLOUT;
 		}
 
-		switch (session->m_state)
+		auto const &wait = session->m_wait;
+		if (wait && wait.socket)
 		{
-		case State::COMMAND:
-			// we are waiting to read a command
-			break;
+			pollWaits.emplace_back (pollInfo.size ());
+			pollInfo.emplace_back (*wait.socket, wait.events, 0);
+		}
 
-		case State::DATA_CONNECT:
-			if (session->m_pasv)
-			{
-				assert (!session->m_port);
-				// we are waiting for a PASV connection
-				pollInfo.emplace_back (*session->m_pasvSocket, POLLIN, 0);
-			}
-			else
-			{
-				// we are waiting to complete a PORT connection
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
-			}
-			break;
+		if (wait && wait.deadline != co::Wait::time_point::max ())
+		{
+			timeout = std::min (timeout,
+			    std::max (std::chrono::milliseconds (0),
+			        std::chrono::ceil<std::chrono::milliseconds> (wait.deadline - start)));
+		}
 
-		case State::DATA_TRANSFER:
-			// we need to transfer data
-			if (session->m_recv)
-			{
-				assert (!session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLIN, 0);
-			}
-			else
-			{
-				assert (session->m_send);
-				pollInfo.emplace_back (*session->m_dataSocket, POLLOUT, 0);
-			}
-			break;
-		}
+		pollSessions.resize (pollInfo.size (), index);
 	}
 
+	// server sockets go last, past the entries that have a session
+	pollInfo.insert (std::end (pollInfo), std::begin (serverSockets_), std::end (serverSockets_));
+
 	if (pollInfo.empty ())
 		return true;
 
-	// poll for activity
-	auto const rc = Socket::poll (pollInfo.data (), pollInfo.size (), 100ms);
+	// poll for activity; spinning first skips the wakeup latency of a blocking poll
+	auto rc = 0;
+	if (spin_.count () > 0 && timeout.count () > 0 && !sessions_.empty ())
+	{
+		auto const deadline = platform::steady_clock::now () + spin_;
+		do
+		{
+			rc = Socket::poll (pollInfo.data (), pollInfo.size (), 0ms);
+		} while (rc == 0 && platform::steady_clock::now () < deadline);
+	}
+
+	if (rc == 0)
+		rc = Socket::poll (pollInfo.data (), pollInfo.size (), timeout);
 	if (rc < 0)
 	{
 		error ("poll: %s\n", std::strerror (errno));
 		return false;
 	}
 
+	for (std::size_t index = 0; index < serverSockets_.size (); ++index)
+		serverSockets_[index].revents = pollInfo[pollSessions.size () + index].revents;
+	pollInfo.erase (std::next (std::begin (pollInfo), pollSessions.size ()), std::end (pollInfo));
+
 	auto const now = std::time (nullptr);
 
-	for (auto &session : sessions_)
+	thread_local std::vector<bool> handled;
+	handled.assign (sessions_.size (), false);
+
+	// sessions that read commands or lost the command socket since the poll; their data poll
+	// results may be stale
+	thread_local std::vector<bool> commanded;
+	commanded.assign (sessions_.size (), false);
+
+	// service a ready command socket; checked_ is when its readiness was last checked
+	auto const serviceCommand = [] (FtpSession &session_,
+	                                int const revents_,
+	                                platform::steady_clock::time_point const checked_) {
+		if (revents_ & ~(POLLIN | POLLPRI | POLLOUT))
+			debug ("Command revents 0x%X\n", revents_);
+
+		if (revents_ & (POLLIN | POLLPRI))
+		{
+			session_.readCommand (revents_);
+
+			// includes commands of sessions serviced earlier in the same pass
+			s_controlLatency.record (static_cast<std::uint64_t> (
+			    std::chrono::duration_cast<std::chrono::nanoseconds> (
+			        platform::steady_clock::now () - checked_)
+			        .count ()));
+		}
+
+		// one write for the replies of every command read, plus any left over
+		if (revents_ & (POLLIN | POLLPRI | POLLOUT))
+			session_.writeResponse ();
+
+		if (revents_ & (POLLERR | POLLHUP))
+			session_.closeCommand ();
+	};
+
+	// control work first: a command never waits behind another session's transfer quanta
+	auto checked = platform::steady_clock::now ();
+	for (std::size_t index = 0; index < pollInfo.size (); ++index)
 	{
-		bool handled = false;
-		for (auto const &i : pollInfo)
+		auto const &i = pollInfo[index];
+		if (!i.revents)
+			continue;
+
+		handled[pollSessions[index]] = true;
+
+		auto const &session = sessions_[pollSessions[index]];
+		if (&i.socket.get () != session->m_commandSocket.get ())
+			continue;
+
+		if (i.revents & ~POLLOUT)
+			commanded[pollSessions[index]] = true;
+		serviceCommand (*session, i.revents, checked);
+	}
+
+	// re-check the command sockets between transfer quanta once a time slice has passed
+	thread_local std::vector<Socket::PollInfo> controlInfo;
+	thread_local std::vector<std::size_t> controlSessions;
+	auto const checkControl = [&] {
+		auto const start = platform::steady_clock::now ();
+		if (start - checked < CONTROL_SLICE)
+			return;
+
+		// commands may have closed sockets, so rebuild the set from the sessions
+		controlInfo.clear ();
+		controlSessions.clear ();
+		for (std::size_t index = 0; index < sessions_.size (); ++index)
 		{
-			if (!i.revents)
+			auto const &session = sessions_[index];
+			if (!session->m_commandSocket)
 				continue;
 
-			handled = true;
+			controlInfo.emplace_back (*session->m_commandSocket, POLLIN | POLLPRI, 0);
+			if (session->m_responseBuffer.usedSize () != 0)
+				controlInfo.back ().events |= POLLOUT;
+			controlSessions.emplace_back (index);
+		}
 
-			// check command socket
-			if (&i.socket.get () == session->m_commandSocket.get ())
-			{
-				if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-					debug ("Command revents 0x%X\n", i.revents);
+		auto const previous = checked;
+		checked             = start;
+		if (controlInfo.empty ())
+			return;
 
-				if (!session->m_dataSocket && (i.revents & POLLOUT))
-					session->writeResponse ();
+		if (Socket::poll (controlInfo.data (), controlInfo.size (), 0ms) <= 0)
+			return;
 
-				if (i.revents & (POLLIN | POLLPRI))
-					session->readCommand (i.revents);
+		for (std::size_t index = 0; index < controlInfo.size (); ++index)
+		{
+			auto const &i = controlInfo[index];
+			if (!i.revents)
+				continue;
 
-				if (i.revents & (POLLERR | POLLHUP))
-					session->closeCommand ();
-			}
+			handled[controlSessions[index]] = true;
+			if (i.revents & ~POLLOUT)
+				commanded[controlSessions[index]] = true;
+			serviceCommand (*sessions_[controlSessions[index]], i.revents, previous);
+		}
+	};
 
-			// check the data socket
-			if (&i.socket.get () == session->m_pasvSocket.get () ||
-			    &i.socket.get () == session->m_dataSocket.get ())
-			{
-				switch (session->m_state)
-				{
-				case State::COMMAND:
-					std::abort ();
-					break;
+	// then transfers whose socket is ready
+	for (auto const index : pollWaits)
+	{
+		auto const &i = pollInfo[index];
+		if (!i.revents)
+			continue;
 
-				case State::DATA_CONNECT:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
+		// a command may have ended the transfer or closed the socket; pick it up on the next poll
+		auto const &session = sessions_[pollSessions[index]];
+		if (commanded[pollSessions[index]] || &i.socket.get () != session->m_wait.socket)
+			continue;
 
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & POLLIN)
-					{
-						// we need to accept the PASV connection
-						session->dataAccept ();
-					}
-					else if (i.revents & POLLOUT)
-					{
-						// PORT connection completed
-						auto const &sockName = session->m_dataSocket->peerName ();
-						info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
+		session->resumeTransfer (i.revents);
+		checkControl ();
+	}
 
-						session->sendResponse ("150 Ready\r\n");
-						session->setState (State::DATA_TRANSFER, true, false);
-					}
-					break;
+	// and transfers whose deadline passed, including the ones commands just started
+	auto const expired = platform::steady_clock::now ();
+	for (std::size_t index = 0; index < sessions_.size (); ++index)
+	{
+		auto const &session = sessions_[index];
+		if (!session->m_wait || session->m_wait.deadline > expired)
+			continue;
 
-				case State::DATA_TRANSFER:
-					if (i.revents & ~(POLLIN | POLLPRI | POLLOUT))
-						debug ("Data revents 0x%X\n", i.revents);
+		handled[index] = true;
+		session->resumeTransfer (0);
+		checkControl ();
+	}
 
-					// we need to transfer data
-					if (i.revents & (POLLERR | POLLHUP))
-					{
-						session->sendResponse ("426 Data connection failed\r\n");
-						session->setState (State::COMMAND, true, true);
-					}
-					else if (i.revents & (POLLIN | POLLOUT))
-					{
-						for (unsigned i = 0; i < 10; ++i)
-						{
-							if (!((*session).*(session->m_transfer)) ())
-								break;
-						}
-					}
-					break;
-				}
-			}
-		}
+	// replies queued by transfers, one write per session
+	for (auto const &session : sessions_)
+		session->writeResponse ();
 
-		if (!handled && now - session->m_timestamp >= IDLE_TIMEOUT)
+	for (std::size_t index = 0; index < sessions_.size (); ++index)
+	{
+		auto const &session = sessions_[index];
+		if (!handled[index] && now - session->m_timestamp >= IDLE_TIMEOUT)
 		{
 			session->closeCommand ();
 			session->closePasv ();
@@ -773,6 +1010,47 @@ bool FtpSession::authorized () const
 
 void FtpSession::setState (State const state_, bool const closePasv_, bool const closeData_)
 {
+	if (state_ != m_state)
+	{
+		auto const now = platform::steady_clock::now ();
+		m_stateTime[static_cast<int> (m_state)] +=
+		    std::chrono::duration_cast<std::chrono::nanoseconds> (now - m_stateStart).count ();
+		m_stateStart = now;
+
+		// transfer phase boundaries
+		if (m_state == State::COMMAND)
+		{
+			// a pipelined transfer can start before the previous reply went out
+			if (m_xferPhases.pending)
+				xferPhasesDone (now);
+
+			m_xferPhases.command    = m_commandStart;
+			m_xferPhases.opened     = now;
+			m_xferPhases.connected  = {};
+			m_xferPhases.firstByte  = {};
+			m_xferPhases.startBytes = m_dataIn + m_dataOut;
+			m_xferPhases.verb       = m_commandIndex;
+			m_xferPhases.ok         = false;
+			m_xferPhases.active     = true;
+		}
+
+		if (state_ == State::DATA_TRANSFER)
+			m_xferPhases.connected = now;
+		else if (state_ == State::COMMAND && m_xferPhases.active)
+		{
+			m_xferPhases.lastByte = now;
+			m_xferPhases.path     = m_workItem;
+			m_xferPhases.bytes    = m_dataIn + m_dataOut - m_xferPhases.startBytes;
+			m_xferPhases.deflate  = m_deflate;
+			m_xferPhases.active   = false;
+			m_xferPhases.pending  = true;
+
+			// the final reply couldn't be queued, so there is nothing to wait for
+			if (m_responseBuffer.empty () || !m_commandSocket)
+				xferPhasesDone (now);
+		}
+	}
+
 	m_state     = state_;
 	m_timestamp = std::time (nullptr);
 
@@ -783,54 +1061,149 @@ void FtpSession::setState (State const state_, bool const closePasv_, bool const
 
 	if (state_ == State::COMMAND)
 	{
-		{
-#ifndef __NDS__
-			auto const lock = std::scoped_lock (m_lock);
-#endif
+		cancelTransfer ();
 
-			m_restartPosition = 0;
-			m_fileSize        = 0;
-			m_filePosition    = 0;
+		m_restartPosition = 0;
+		m_fileSize        = 0;
+		m_filePosition    = 0;
 
-			for (auto &pos : m_filePositionHistory)
-				pos = 0;
-			m_xferRate = -1.0f;
+		for (auto &pos : m_filePositionHistory)
+			pos = 0;
+		m_xferRate = -1.0f;
 
-			m_workItem.clear ();
-		}
+		m_workItem.clear ();
 
-		m_devZero = false;
+		m_dedup = false;
 		m_file.close ();
+		m_devFile.close ();
 		m_dir.close ();
 		m_zStream.reset ();
 	}
 }
 
+void FtpSession::xferFirstByte ()
+{
+	if (m_xferPhases.firstByte == platform::steady_clock::time_point{})
+		m_xferPhases.firstByte = platform::steady_clock::now ();
+}
+
+void FtpSession::xferPhasesDone (platform::steady_clock::time_point const sent_)
+{
+	auto &phases   = m_xferPhases;
+	phases.pending = false;
+
+	// phases that never happened take no time
+	auto const connected = phases.connected == platform::steady_clock::time_point{}
+	                           ? phases.lastByte
+	                           : phases.connected;
+	auto const firstByte = phases.firstByte == platform::steady_clock::time_point{}
+	                           ? phases.lastByte
+	                           : phases.firstByte;
+
+	auto const nanoseconds = [] (auto const from_, auto const to_) {
+		return static_cast<std::uint64_t> (
+		    std::chrono::duration_cast<std::chrono::nanoseconds> (to_ - from_).count ());
+	};
+
+	std::uint64_t const durations[] = {
+	    nanoseconds (phases.command, phases.opened),
+	    nanoseconds (phases.opened, connected),
+	    nanoseconds (connected, firstByte),
+	    nanoseconds (firstByte, phases.lastByte),
+	    nanoseconds (phases.lastByte, sent_),
+	    nanoseconds (phases.command, sent_),
+	};
+	static_assert (std::size (durations) == std::size (xferPhaseNames));
+
+	// failures would skew the distributions; they are still logged
+	if (phases.ok)
+	{
+		for (std::size_t i = 0; i < std::size (durations); ++i)
+			s_xferLatency[i].record (durations[i]);
+	}
+
+	auto const verb = handlers[phases.verb].first;
+	info ("%.*s %s %s: %" PRIu64 " bytes, open %.3fms, connect %.3fms, first byte %.3fms, "
+	      "transfer %.3fms, reply %.3fms\n",
+	    static_cast<int> (verb.size ()),
+	    verb.data (),
+	    phases.ok ? "complete" : "failed",
+	    phases.path.c_str (),
+	    phases.bytes,
+	    durations[0] / 1e6,
+	    durations[1] / 1e6,
+	    durations[2] / 1e6,
+	    durations[3] / 1e6,
+	    durations[4] / 1e6);
+
+#if FTPD_HAS_XFER_JOURNAL
+	auto const now = std::chrono::system_clock::now ().time_since_epoch ();
+
+	journal::Record record{};
+	record.time     = std::chrono::duration_cast<std::chrono::nanoseconds> (now).count ();
+	record.session  = m_id;
+	record.bytes    = phases.bytes;
+	record.duration = durations[5];
+	std::copy_n (std::begin (durations), std::size (record.phases), std::begin (record.phases));
+
+	record.direction = phases.recv ? 'i' : 'o';
+	record.access    = m_anonymous ? 'a' : 'r';
+	record.complete  = phases.ok;
+	record.deflate   = phases.deflate;
+	record.listing   = phases.listing;
+
+	// fields are truncated to fit; the journal tolerates a missing terminator
+	auto const copyField = [] (auto &field_, std::string_view const value_) {
+		std::memcpy (field_, value_.data (), std::min (value_.size (), sizeof (field_)));
+	};
+
+	copyField (record.verb, verb);
+	copyField (record.user, m_userName);
+	copyField (record.path, phases.path);
+	if (m_commandSocket)
+	{
+		auto const &peer = m_commandSocket->peerName ();
+		peer.name (record.peer, sizeof (record.peer));
+		record.port = peer.port ();
+	}
+
+	m_server.recordTransfer (record);
+#endif
+}
+
 void FtpSession::closeSocket (SharedSocket &socket_)
 {
 	if (socket_ && socket_.unique ())
 	{
 		socket_->shutdown (SHUT_WR);
 		socket_->setLinger (true, 0s);
-		LOCKED (m_pendingCloseSocket.emplace_back (std::move (socket_)));
+		m_pendingCloseSocket.emplace_back (std::move (socket_));
 	}
 	else
-		LOCKED (socket_.reset ());
+		socket_.reset ();
 }
 
 void FtpSession::closeCommand ()
 {
+	// the final reply will never be sent
+	if (m_xferPhases.pending)
+		xferPhasesDone (platform::steady_clock::now ());
+
 	closeSocket (m_commandSocket);
 }
 
 void FtpSession::closePasv ()
 {
+	cancelTransfer ();
+
 	UniqueSocket pasv;
-	LOCKED (pasv = std::move (m_pasvSocket));
+	pasv = std::move (m_pasvSocket);
 }
 
 void FtpSession::closeData ()
 {
+	cancelTransfer ();
+
 	closeSocket (m_dataSocket);
 
 	m_recv = false;
@@ -845,9 +1218,16 @@ bool FtpSession::changeDir (char const *const args_)
 		auto const pos = m_cwd.find_last_of ('/');
 		assert (pos != std::string::npos);
 		if (pos == 0)
-			LOCKED (m_cwd = "/");
+			m_cwd = "/";
 		else
-			LOCKED (m_cwd = m_cwd.substr (0, pos));
+			m_cwd = m_cwd.substr (0, pos);
+		return true;
+	}
+
+	// virtual device directories shadow the filesystem
+	if (auto path = buildPath (m_cwd, args_); fs::DevFile::matchDirectory (path))
+	{
+		m_cwd = std::move (path);
 		return true;
 	}
 
@@ -865,10 +1245,38 @@ bool FtpSession::changeDir (char const *const args_)
 		return false;
 	}
 
-	LOCKED (m_cwd = path);
+	m_cwd = path;
 	return true;
 }
 
+void FtpSession::setSockBufferSize (Socket &socket_)
+{
+	// leave the stack's autotuning alone unless a size is configured
+	auto size = m_config->sockBufferSize ();
+	if (size == 0)
+		return;
+
+#if FTPD_HAS_TCP_INFO
+	// keep up with a transfer buffer grown by auto-tuning, as autoTune () does
+	if (m_config->autoTune ())
+		size = std::max (size, m_tunedBufferSize);
+#endif
+
+	socket_.setRecvBufferSize (size);
+	socket_.setSendBufferSize (size);
+}
+
+#if FTPD_HAS_BUSY_POLL
+void FtpSession::setBusyPoll (Socket &socket_)
+{
+	auto const time = m_config->busyPoll ();
+	if (time.count () == 0)
+		return;
+
+	socket_.setBusyPoll (time);
+}
+#endif
+
 bool FtpSession::dataAccept ()
 {
 	if (!m_pasv)
@@ -881,7 +1289,7 @@ bool FtpSession::dataAccept ()
 	m_pasv = false;
 
 	auto peer = m_pasvSocket->accept ();
-	LOCKED (m_dataSocket = std::move (peer));
+	m_dataSocket = std::move (peer);
 	if (!m_dataSocket)
 	{
 		sendResponse ("425 Failed to establish connection\r\n");
@@ -890,8 +1298,11 @@ bool FtpSession::dataAccept ()
 	}
 
 #ifndef __3DS__
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setSockBufferSize (*m_dataSocket);
+#endif
+	m_dataSocket->setNotSentLowat (m_xferBuffer.capacity ());
+#if FTPD_HAS_BUSY_POLL
+	setBusyPoll (*m_dataSocket);
 #endif
 
 	if (!m_dataSocket->setNonBlocking ())
@@ -901,6 +1312,16 @@ bool FtpSession::dataAccept ()
 		return false;
 	}
 
+#if FTPD_HAS_TLS
+	// the handshake runs on the first transfer read or write
+	if (m_protPrivate && (!tls::context () || !m_dataSocket->startTls (tls::context ())))
+	{
+		sendResponse ("425 Failed to establish TLS\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+#endif
+
 	// we are ready to transfer data
 	sendResponse ("150 Ready\r\n");
 	setState (State::DATA_TRANSFER, true, false);
@@ -914,16 +1335,25 @@ bool FtpSession::dataConnect ()
 	m_port = false;
 
 	auto data = Socket::create (Socket::eStream);
-	LOCKED (m_dataSocket = std::move (data));
+	m_dataSocket = std::move (data);
 	if (!m_dataSocket)
 		return false;
 
-	m_dataSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_dataSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setSockBufferSize (*m_dataSocket);
+	m_dataSocket->setNotSentLowat (m_xferBuffer.capacity ());
+#if FTPD_HAS_BUSY_POLL
+	setBusyPoll (*m_dataSocket);
+#endif
 
 	if (!m_dataSocket->setNonBlocking ())
 		return false;
 
+#if FTPD_HAS_TLS
+	// we are still the TLS server; the handshake runs on the first transfer read or write
+	if (m_protPrivate && (!tls::context () || !m_dataSocket->startTls (tls::context ())))
+		return false;
+#endif
+
 	if (!m_dataSocket->connect (m_portAddr))
 	{
 		if (errno != EINPROGRESS)
@@ -938,6 +1368,52 @@ bool FtpSession::dataConnect ()
 	return true;
 }
 
+co::Ready FtpSession::dataReady ()
+{
+	auto const deadline = platform::steady_clock::now () + CONNECT_TIMEOUT;
+	if (m_pasv)
+	{
+		assert (!m_port);
+		return co::ready (m_wait, *m_pasvSocket, POLLIN, deadline);
+	}
+
+	return co::ready (m_wait, *m_dataSocket, POLLOUT, deadline);
+}
+
+bool FtpSession::dataOpened (int const revents_)
+{
+	if (!revents_)
+	{
+		sendResponse ("425 Can't open data connection\r\n");
+		setState (State::COMMAND, true, true);
+		return false;
+	}
+
+	// we need to accept the PASV connection
+	if (m_pasv)
+		return dataAccept ();
+
+	// PORT connection completed
+	auto const &sockName = m_dataSocket->peerName ();
+	info ("Connected to [%s]:%u\n", sockName.name (), sockName.port ());
+
+	sendResponse ("150 Ready\r\n");
+	setState (State::DATA_TRANSFER, true, false);
+	return true;
+}
+
+bool FtpSession::dataFinish ()
+{
+#if FTPD_HAS_TLS
+	// close_notify precedes the reply, so the client can tell the data was not truncated; STAT
+	// and MLST reply on the control connection, which stays up
+	if (m_dataSocket && m_dataSocket != m_commandSocket)
+		return m_dataSocket->closeNotify ();
+#endif
+
+	return true;
+}
+
 int FtpSession::tzStat (char const *const path_, stat_t *st_)
 {
 	auto const rc = ::stat (path_, st_);
@@ -945,7 +1421,7 @@ int FtpSession::tzStat (char const *const path_, stat_t *st_)
 		return rc;
 
 #ifdef __3DS__
-	if (m_config.getMTime ())
+	if (m_config->getMTime ())
 	{
 		std::uint64_t mtime = 0;
 		auto const rc       = archive_getmtime (path_, &mtime);
@@ -966,7 +1442,7 @@ int FtpSession::tzLStat (char const *const path_, stat_t *st_)
 		return rc;
 
 #ifdef __3DS__
-	if (m_config.getMTime ())
+	if (m_config->getMTime ())
 	{
 		std::uint64_t mtime = 0;
 		auto const rc       = archive_getmtime (path_, &mtime);
@@ -984,284 +1460,21 @@ int FtpSession::fillDirent (stat_t const &st_, std::string_view const path_, cha
 {
 	auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
 
-	auto const buffer = ioBuffer.freeArea ();
-	auto const size   = ioBuffer.freeSize ();
-
-	std::size_t pos = 0;
-
-	if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
-	{
-		if (m_xferDirMode == XferDirMode::MLST)
-		{
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = ' ';
-		}
-
-		// type fact
-		if (m_mlstType)
-		{
-			if (!type_)
-			{
-				type_ = "???";
-				if (S_ISREG (st_.st_mode))
-					type_ = "file";
-				else if (S_ISDIR (st_.st_mode))
-					type_ = "dir";
-#if !defined(__3DS__) && !defined(__SWITCH__)
-				else if (S_ISLNK (st_.st_mode))
-					type_ = "os.unix=symlink";
-				else if (S_ISCHR (st_.st_mode))
-					type_ = "os.unix=character";
-				else if (S_ISBLK (st_.st_mode))
-					type_ = "os.unix=block";
-				else if (S_ISFIFO (st_.st_mode))
-					type_ = "os.unix=fifo";
-				else if (S_ISSOCK (st_.st_mode))
-					type_ = "os.unix=socket";
-#endif
-			}
-
-			auto const rc = std::snprintf (&buffer[pos], size - pos, "Type=%s;", type_);
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
-		}
-
-		// size fact
-		if (m_mlstSize)
-		{
-			auto const rc = std::snprintf (&buffer[pos],
-			    size - pos,
-			    "Size=%llu;",
-			    static_cast<unsigned long long> (st_.st_size));
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
-		}
-
-		// mtime fact
-		if (m_mlstModify)
-		{
-			auto const tm = std::gmtime (&st_.st_mtime);
-			if (!tm)
-				return errno;
-
-			auto const rc = std::strftime (&buffer[pos], size - pos, "Modify=%Y%m%d%H%M%S;", tm);
-			if (rc == 0)
-				return EAGAIN;
-
-			pos += rc;
-		}
-
-		// permission fact
-		if (m_mlstPerm)
-		{
-			auto const header = "Perm=";
-			if (size - pos < std::strlen (header))
-				return EAGAIN;
-
-			std::strcpy (&buffer[pos], header);
-			pos += std::strlen (header);
-
-			// append permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'a';
-			}
-
-			// create permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'c';
-			}
-
-			// delete permission
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = 'd';
-
-			// chdir permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IXUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'e';
-			}
-
-			// rename permission
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = 'f';
-
-			// list permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IRUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'l';
-			}
-
-			// mkdir permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'm';
-			}
-
-			// purge permission
-			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'p';
-			}
-
-			// read permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IRUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'r';
-			}
-
-			// write permission
-			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
-			{
-				if (pos >= size)
-					return EAGAIN;
-				buffer[pos++] = 'w';
-			}
-
-			if (pos >= size)
-				return EAGAIN;
-			buffer[pos++] = ';';
-		}
-
-		// unix mode fact
-		if (m_mlstUnixMode)
-		{
-			auto const mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
-
-			auto const rc = std::snprintf (&buffer[pos],
-			    size - pos,
-			    "UNIX.mode=0%lo;",
-			    static_cast<unsigned long> (st_.st_mode & mask));
-			if (rc < 0)
-				return errno;
-			if (static_cast<std::size_t> (rc) > size - pos)
-				return EAGAIN;
-
-			pos += rc;
-		}
-
-		// make sure space precedes name
-		if (buffer[pos - 1] != ' ')
-		{
-			if (pos >= size)
-				return EAGAIN;
-
-			buffer[pos++] = ' ';
-		}
-	}
-	else if (m_xferDirMode != XferDirMode::NLST)
-	{
-		if (m_xferDirMode == XferDirMode::STAT)
-		{
-			if (pos >= size)
-				return EAGAIN;
-
-			buffer[pos++] = ' ';
-		}
-
-#ifdef __3DS__
-		auto const owner = "3DS";
-		auto const group = "3DS";
-#elif defined(__SWITCH__)
-		auto const owner = "Switch";
-		auto const group = "Switch";
-#else
-		char owner[32];
-		char group[32];
-		std::sprintf (owner, "%d", st_.st_uid);
-		std::sprintf (group, "%d", st_.st_gid);
-#endif
-		// perms nlinks owner group size
-		auto rc = std::snprintf (&buffer[pos],
-		    size - pos,
-		    "%c%c%c%c%c%c%c%c%c%c %lu %s %s %llu ",
-		    // clang-format off
-		    S_ISREG (st_.st_mode)  ? '-' :
-		    S_ISDIR (st_.st_mode)  ? 'd' :
-#if !defined(__3DS__) && !defined(__SWITCH__)
-		    S_ISLNK (st_.st_mode)  ? 'l' :
-		    S_ISCHR (st_.st_mode)  ? 'c' :
-		    S_ISBLK (st_.st_mode)  ? 'b' :
-		    S_ISFIFO (st_.st_mode) ? 'p' :
-		    S_ISSOCK (st_.st_mode) ? 's' :
-#endif
-		    '?',
-		    // clang-format on
-		    st_.st_mode & S_IRUSR ? 'r' : '-',
-		    st_.st_mode & S_IWUSR ? 'w' : '-',
-		    st_.st_mode & S_IXUSR ? 'x' : '-',
-		    st_.st_mode & S_IRGRP ? 'r' : '-',
-		    st_.st_mode & S_IWGRP ? 'w' : '-',
-		    st_.st_mode & S_IXGRP ? 'x' : '-',
-		    st_.st_mode & S_IROTH ? 'r' : '-',
-		    st_.st_mode & S_IWOTH ? 'w' : '-',
-		    st_.st_mode & S_IXOTH ? 'x' : '-',
-		    static_cast<unsigned long> (st_.st_nlink),
-		    owner,
-		    group,
-		    static_cast<unsigned long long> (st_.st_size));
-		if (rc < 0)
-			return errno;
-
-		if (static_cast<std::size_t> (rc) > size - pos)
-			return EAGAIN;
-
-		pos += rc;
-
-		// timestamp
-		auto const tm = std::gmtime (&st_.st_mtime);
-		if (!tm)
-			return errno;
-
-		auto fmt = "%b %e %Y ";
-		if (m_timestamp > st_.st_mtime && m_timestamp - st_.st_mtime < (60 * 60 * 24 * 365 / 2))
-			fmt = "%b %e %H:%M ";
-		rc = std::strftime (&buffer[pos], size - pos, fmt, tm);
-		if (rc < 0)
-			return errno;
-		if (static_cast<std::size_t> (rc) > size - pos)
-			return EAGAIN;
-
-		pos += rc;
-	}
-
-	if (size - pos < path_.size () + 2)
-		return EAGAIN;
+	auto const facts = ftp::MlstFacts{
+	    .type     = m_mlstType,
+	    .size     = m_mlstSize,
+	    .modify   = m_mlstModify,
+	    .perm     = m_mlstPerm,
+	    .unixMode = m_mlstUnixMode,
+	};
 
-	// path
-	std::memcpy (&buffer[pos], path_.data (), path_.size ());
-	pos += path_.size ();
-	buffer[pos++] = '\r';
-	buffer[pos++] = '\n';
+	auto const used = ioBuffer.usedSize ();
+	auto const rc =
+	    ftp::fillDirent (ioBuffer, m_xferDirMode, facts, m_timestamp, st_, path_, type_);
+	if (rc != 0)
+		return rc;
 
-	ioBuffer.markUsed (pos);
-	LOCKED (m_filePosition += pos);
+	m_filePosition += ioBuffer.usedSize () - used;
 
 	return 0;
 }
@@ -1275,13 +1488,31 @@ int FtpSession::fillDirent (std::string const &path_, char const *type_)
 	return fillDirent (st, encodePath (path_), type_);
 }
 
-void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
+void FtpSession::resetXferBuffers ()
 {
-	m_zFlushed = false;
-	m_eof      = false;
+	auto const size = m_config->xferBufferSize ();
 
 	m_xferBuffer.clear ();
+#if FTPD_HAS_TCP_INFO
+	// the next transfer most likely crosses the same path; don't start over
+	if (m_config->autoTune ())
+		m_xferBuffer.resize (std::max (size, m_tunedBufferSize));
+	else
+#endif
+		m_xferBuffer.resize (size);
+
 	m_zStreamBuffer.clear ();
+	m_zStreamBuffer.resize (size);
+}
+
+void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
+{
+	m_zFlushed = false;
+
+	// ALLO only applies to the next transfer
+	auto const allocHint = std::exchange (m_allocHint, 0);
+
+	resetXferBuffers ();
 
 	if (m_deflate)
 	{
@@ -1300,7 +1531,7 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 
 		if (mode_ == XferFileMode::RETR)
 		{
-			if (deflateInit (m_zStream.get (), m_config.deflateLevel ()) != Z_OK)
+			if (deflateInit (m_zStream.get (), m_config->deflateLevel ()) != Z_OK)
 			{
 				sendResponse ("550 %s\r\n", m_zStream->msg ? m_zStream->msg : "zlib error");
 				setState (State::COMMAND, true, true);
@@ -1318,18 +1549,33 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 		}
 	}
 
-	// build the path of the file to transfer
-	auto const path = buildResolvedPath (m_cwd, args_);
-	if (path.empty ())
+	// virtual devices shadow the filesystem
+	auto path = buildPath (m_cwd, args_);
+	if (fs::DevFile::match (path))
 	{
-		sendResponse ("553 %s\r\n", std::strerror (errno));
-		setState (State::COMMAND, true, true);
-		return;
-	}
+		if (!m_devFile.open (path))
+		{
+			sendResponse ("553 %s\r\n", std::strerror (errno));
+			setState (State::COMMAND, true, true);
+			return;
+		}
 
-	if (path == "/devZero")
+		if (m_restartPosition != 0 && !m_devFile.seek (m_restartPosition))
+		{
+			sendResponse ("450 %s\r\n", std::strerror (errno));
+			setState (State::COMMAND, true, true);
+			return;
+		}
+
+		m_fileSize = std::max<std::int64_t> (m_devFile.size (), 0);
+		m_filePosition = m_restartPosition;
+	}
+	// build the path of the file to transfer
+	else if (path = resolvePath (path); path.empty ())
 	{
-		m_devZero = true;
+		sendResponse ("553 %s\r\n", std::strerror (errno));
+		setState (State::COMMAND, true, true);
+		return;
 	}
 	else if (mode_ == XferFileMode::RETR)
 	{
@@ -1348,9 +1594,9 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			return;
 		}
 
-		LOCKED (m_fileSize = st.st_size);
+		m_fileSize = st.st_size;
 
-		m_file.setBufferSize (FILE_BUFFERSIZE);
+		m_file.setBufferSize (m_config->fileBufferSize ());
 
 		if (m_restartPosition != 0)
 		{
@@ -1361,7 +1607,7 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			}
 		}
 
-		LOCKED (m_filePosition = m_restartPosition);
+		m_filePosition = m_restartPosition;
 	}
 	else
 	{
@@ -1373,6 +1619,38 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 		else if (m_restartPosition != 0)
 			mode = "r+b";
 
+		// refuse an upload announced by ALLO that can't fit, before anything is unlinked or
+		// truncated
+		m_freeSpaceMount     = freespace::find (path);
+		auto const available = freespace::available (m_freeSpaceMount);
+		if (allocHint && available && allocHint > *available)
+		{
+			sendResponse ("552 Insufficient storage space\r\n");
+			return;
+		}
+
+#if FTPD_HAS_DEDUP
+		// the index outlives the setting; files deduplicated earlier are still shared
+		dedup::setIndexPath (m_config->dedupIndex ());
+
+		// only whole-file uploads can be hashed
+		m_dedup = m_config->dedup () && !append && m_restartPosition == 0;
+
+		// never write through a link shared with another upload, even with dedup turned off
+		stat_t st;
+		if (::stat (path.c_str (), &st) == 0 && st.st_nlink > 1 && dedup::digest (st))
+		{
+			if (m_dedup ? ::unlink (path.c_str ()) != 0 : !dedup::unshare (path))
+			{
+				sendResponse ("450 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
+
+		if (m_dedup)
+			m_hash.reset ();
+#endif
+
 		// open file in write mode
 		if (!m_file.open (path.c_str (), mode))
 		{
@@ -1380,9 +1658,7 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			return;
 		}
 
-		FtpServer::updateFreeSpace ();
-
-		m_file.setBufferSize (FILE_BUFFERSIZE);
+		m_file.setBufferSize (m_config->fileBufferSize ());
 
 		// check if this had REST but not APPE
 		if (m_restartPosition != 0 && !append)
@@ -1395,7 +1671,7 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 			}
 		}
 
-		LOCKED (m_filePosition = m_restartPosition);
+		m_filePosition = m_restartPosition;
 	}
 
 	if (!m_port && !m_pasv)
@@ -1406,6 +1682,8 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 	}
 
 	setState (State::DATA_CONNECT, false, true);
+	m_xferPhases.recv    = mode_ != XferFileMode::RETR;
+	m_xferPhases.listing = false;
 
 	// setup connection
 	if (m_port && !dataConnect ())
@@ -1418,18 +1696,18 @@ void FtpSession::xferFile (char const *const args_, XferFileMode const mode_)
 	// set up the transfer
 	if (mode_ == XferFileMode::RETR)
 	{
-		m_recv     = false;
-		m_send     = true;
-		m_transfer = &FtpSession::retrieveTransfer;
+		m_recv = false;
+		m_send = true;
+		startTransfer (retrieveTransfer (), "retrieveTransfer");
 	}
 	else
 	{
-		m_recv     = true;
-		m_send     = false;
-		m_transfer = &FtpSession::storeTransfer;
+		m_recv = true;
+		m_send = false;
+		startTransfer (storeTransfer (), "storeTransfer");
 	}
 
-	LOCKED (m_workItem = path);
+	m_workItem = path;
 }
 
 void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool const workaround_)
@@ -1439,12 +1717,10 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	m_recv        = false;
 	m_send        = true;
 	m_zFlushed    = false;
-	m_eof         = false;
 
 	m_filePosition    = 0;
 	m_zStreamPosition = 0;
-	m_xferBuffer.clear ();
-	m_zStreamBuffer.clear ();
+	resetXferBuffers ();
 
 	if (m_deflate)
 	{
@@ -1457,7 +1733,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		m_zStream->next_out  = Z_NULL;
 		m_zStream->avail_out = 0;
 
-		if (deflateInit (m_zStream.get (), m_config.deflateLevel ()) != Z_OK)
+		if (deflateInit (m_zStream.get (), m_config->deflateLevel ()) != Z_OK)
 		{
 			sendResponse ("550 %s\r\n", m_zStream->msg ? m_zStream->msg : "zlib error");
 			setState (State::COMMAND, true, true);
@@ -1465,8 +1741,6 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		}
 	}
 
-	m_transfer = &FtpSession::listTransfer;
-
 	if (std::strlen (args_) > 0)
 	{
 		// work around broken clients that think LIST -a/-l is valid
@@ -1474,8 +1748,25 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		                            (args_[1] == 'a' || args_[1] == 'l') &&
 		                            (args_[2] == '\0' || args_[2] == ' ');
 
+		// virtual devices shadow the filesystem; only MLST describes their directories, which
+		// can't be listed
+		auto path = buildPath (m_cwd, args_);
+		stat_t st;
+		auto dev = devStat (path, st);
+		if (dev > 0 && S_ISDIR (st.st_mode) && mode_ != XferDirMode::MLST)
+			dev = 0;
+
+		if (dev < 0)
+		{
+			sendResponse ("550 %s\r\n", std::strerror (errno));
+			setState (State::COMMAND, true, true);
+			return;
+		}
+
 		// an argument was provided
-		auto const path = buildResolvedPath (m_cwd, args_);
+		if (dev == 0)
+			path = buildResolvedPath (m_cwd, args_);
+
 		if (path.empty ())
 		{
 			if (needWorkaround)
@@ -1489,8 +1780,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 			return;
 		}
 
-		stat_t st;
-		if (tzStat (path.c_str (), &st) != 0)
+		if (dev == 0 && tzStat (path.c_str (), &st) != 0)
 		{
 			if (needWorkaround)
 			{
@@ -1513,7 +1803,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 				return;
 			}
 
-			LOCKED (m_workItem = path);
+			m_workItem = path;
 		}
 		else if (S_ISDIR (st.st_mode))
 		{
@@ -1539,7 +1829,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 				}
 			}
 
-			LOCKED (m_workItem = m_lwd);
+			m_workItem = m_lwd;
 		}
 		else if (mode_ == XferDirMode::MLSD)
 		{
@@ -1572,12 +1862,14 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 				return;
 			}
 
-			LOCKED (m_workItem = path);
+			m_workItem = path;
 		}
 	}
 	else if (mode_ == XferDirMode::MLST)
 	{
-		auto const rc = fillDirent (m_cwd);
+		// the cwd may be a virtual device directory
+		stat_t st;
+		auto const rc = devStat (m_cwd, st) > 0 ? fillDirent (st, m_cwd) : fillDirent (m_cwd);
 		if (rc != 0)
 		{
 			sendResponse ("550 %s\r\n", std::strerror (rc));
@@ -1585,7 +1877,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 			return;
 		}
 
-		LOCKED (m_workItem = m_cwd);
+		m_workItem = m_cwd;
 	}
 	else if (!m_dir.open (m_cwd.c_str ()))
 	{
@@ -1611,7 +1903,7 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 			}
 		}
 
-		LOCKED (m_workItem = m_lwd);
+		m_workItem = m_lwd;
 	}
 
 	if (mode_ == XferDirMode::MLST || mode_ == XferDirMode::STAT)
@@ -1619,8 +1911,11 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 		// this is a little different; we have to send the data over the command socket
 		sendResponse ("250-Status\r\n");
 		setState (State::DATA_TRANSFER, true, true);
-		LOCKED (m_dataSocket = m_commandSocket);
+		m_xferPhases.recv    = false;
+		m_xferPhases.listing = true;
+		m_dataSocket = m_commandSocket;
 		m_send = true;
+		startTransfer (listTransfer (), "listTransfer");
 		return;
 	}
 
@@ -1633,6 +1928,8 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	}
 
 	setState (State::DATA_CONNECT, false, true);
+	m_xferPhases.recv    = false;
+	m_xferPhases.listing = true;
 	m_send = true;
 
 	// setup connection
@@ -1640,11 +1937,40 @@ void FtpSession::xferDir (char const *const args_, XferDirMode const mode_, bool
 	{
 		sendResponse ("425 Can't open data connection\r\n");
 		setState (State::COMMAND, true, true);
+		return;
 	}
+
+	startTransfer (listTransfer (), "listTransfer");
 }
 
+#if FTPD_HAS_DEDUP
+void FtpSession::dedupUpload ()
+{
+	// flush the upload so its status is final
+	m_file.close ();
+
+	auto const digest = m_hash.finish ();
+
+	stat_t st;
+	if (::stat (m_workItem.c_str (), &st) != 0 || st.st_size == 0)
+		return;
+
+	auto const existing = dedup::find (digest);
+	if (existing && *existing != m_workItem && dedup::clone (*existing, m_workItem))
+	{
+		info ("Deduplicated %s -> %s\n", m_workItem.c_str (), existing->c_str ());
+		freespace::refresh ();
+		return;
+	}
+
+	dedup::insert (digest, m_workItem, st);
+}
+#endif
+
 void FtpSession::readCommand (int const events_)
 {
+	ALLOC_SCOPE ("readCommand");
+
 #ifndef __NDS__
 	// check out-of-band data
 	if (events_ & POLLPRI)
@@ -1669,6 +1995,9 @@ void FtpSession::readCommand (int const events_)
 			else
 				m_timestamp = std::time (nullptr);
 
+			if (rc > 0)
+				m_controlIn += rc;
+
 			return;
 		}
 
@@ -1688,15 +2017,24 @@ void FtpSession::readCommand (int const events_)
 		else
 			m_timestamp = std::time (nullptr);
 
+		m_controlIn += rc;
+
 		// reset the command buffer
 		m_commandBuffer.clear ();
 		return;
 	}
 #endif
 
+	// the next bytes are a TLS handshake; wait until the AUTH reply is out
+	if (m_startTls)
+		return;
+
 	if (events_ & POLLIN)
 	{
-		// prepare to receive data
+		// prepare to receive data; commands queued behind HASH leave it in the socket
+		if (m_commandBuffer.freeSize () == 0 && m_hashing)
+			return;
+
 		if (m_commandBuffer.freeSize () == 0)
 		{
 			error ("Exceeded command buffer size\n");
@@ -1704,10 +2042,12 @@ void FtpSession::readCommand (int const events_)
 			return;
 		}
 
+		// a TLS handshake or partial record may yield no data yet
 		auto const rc = m_commandSocket->read (m_commandBuffer);
 		if (rc < 0)
 		{
-			closeCommand ();
+			if (errno != EWOULDBLOCK)
+				closeCommand ();
 			return;
 		}
 
@@ -1719,6 +2059,7 @@ void FtpSession::readCommand (int const events_)
 			return;
 		}
 
+		m_controlIn += rc;
 		m_timestamp = std::time (nullptr);
 
 		if (m_urgent)
@@ -1740,6 +2081,10 @@ void FtpSession::readCommand (int const events_)
 	// loop through commands
 	while (true)
 	{
+		// HASH replies before the next command runs
+		if (m_hashing)
+			return;
+
 		// must have at least enough data for the delimiter
 		auto const size = m_commandBuffer.usedSize ();
 		if (size < 1)
@@ -1750,12 +2095,13 @@ void FtpSession::readCommand (int const events_)
 		if (!next)
 			return;
 
-		*delim = '\0';
-		decodePath (buffer, delim - buffer);
 		if (::strncasecmp ("USER ", buffer, 5) == 0 || ::strncasecmp ("PASS ", buffer, 5) == 0)
 			command ("%.*s ******\n", 5, buffer);
 		else
-			command ("%s\n", buffer);
+			addLog (COMMAND, std::string_view (buffer, next - buffer));
+
+		*delim = '\0';
+		decodePath (buffer, delim - buffer);
 
 		char const *const command = buffer;
 
@@ -1770,9 +2116,46 @@ void FtpSession::readCommand (int const events_)
 		    command,
 		    [] (auto const &lhs_, auto const &rhs_) { return compare (lhs_.first, rhs_) < 0; });
 
+		// time the handler for per-verb statistics
+		auto const dispatch = [&] {
+			// handler names are literals, so they outlive the trace
+			TRACE_SCOPE_ARG (it->first.data (), m_id);
+			ALLOC_SCOPE (it->first.data ());
+
+			auto const start = platform::steady_clock::now ();
+			auto const index = std::distance (std::begin (handlers), it);
+
+			m_commandStart = start;
+			m_commandIndex = index;
+
+			// settings changes apply from the next command; transfers never wait on them
+			m_config = m_server.config ();
+
+			(this->*(it->second)) (args);
+
+			auto &stats         = m_commandStats[index];
+			auto const elapsed  = platform::steady_clock::now () - start;
+			auto const duration = static_cast<std::uint64_t> (
+			    std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ());
+
+			++stats.count;
+			stats.total += duration;
+			stats.max = std::max (stats.max, duration);
+
+			if (s_commandLatency.empty ())
+				s_commandLatency.resize (handlers.size ());
+
+			auto &histogram = s_commandLatency[index];
+			if (!histogram)
+				histogram = std::make_unique<LatencyHistogram> ();
+			histogram->record (duration);
+		};
+
 		m_timestamp = std::time (nullptr);
 		if (it == std::end (handlers) || compare (it->first, command) != 0)
 		{
+			++m_invalidCommands;
+
 			std::string response = "502 Invalid command \"";
 			response += encodePath (command);
 
@@ -1786,6 +2169,15 @@ void FtpSession::readCommand (int const events_)
 
 			sendResponse (response);
 		}
+#if FTPD_HAS_TLS
+		else if (m_config->tlsRequired () && m_commandSocket && !m_commandSocket->tls () &&
+		         compare (command, "AUTH") != 0 && compare (command, "FEAT") != 0 &&
+		         compare (command, "NOOP") != 0 && compare (command, "QUIT") != 0)
+		{
+			// credentials never cross the wire in the clear
+			sendResponse ("530 TLS required\r\n");
+		}
+#endif
 		else if (m_state != State::COMMAND)
 		{
 			// only some commands are available during data transfer
@@ -1795,13 +2187,11 @@ void FtpSession::readCommand (int const events_)
 			{
 				sendResponse ("503 Invalid command during transfer\r\n");
 				setState (State::COMMAND, true, true);
+				writeResponse ();
 				closeCommand ();
 			}
 			else
-			{
-				auto const handler = it->second;
-				(this->*handler) (args);
-			}
+				dispatch ();
 		}
 		else
 		{
@@ -1809,75 +2199,102 @@ void FtpSession::readCommand (int const events_)
 			if (compare (command, "RNTO") != 0)
 				m_rename.clear ();
 
-			auto const handler = it->second;
-			(this->*handler) (args);
+			dispatch ();
 		}
 
 		m_commandBuffer.markFree (next - buffer);
 		m_commandBuffer.coalesce ();
+
+		// anything pipelined after AUTH was sent in the clear; drop it
+		if (m_startTls)
+		{
+			m_commandBuffer.clear ();
+			return;
+		}
 	}
 }
 
 void FtpSession::writeResponse ()
 {
+	if (!m_commandSocket || m_responseBuffer.empty ())
+		return;
+
+	++m_responseWrites;
 	auto const rc = m_commandSocket->write (m_responseBuffer);
 	if (rc <= 0)
 	{
-		closeCommand ();
+		// the rest goes out when the socket polls writable
+		if (rc == 0 || errno != EWOULDBLOCK)
+			closeCommand ();
 		return;
 	}
 
+	m_controlOut += rc;
 	m_timestamp = std::time (nullptr);
 
 	m_responseBuffer.coalesce ();
+
+	// the final reply of a transfer has gone out
+	if (m_xferPhases.pending && m_responseBuffer.empty ())
+		xferPhasesDone (platform::steady_clock::now ());
+
+#if FTPD_HAS_TLS
+	// the AUTH reply was the last plaintext; the client starts the handshake next
+	if (m_startTls && m_responseBuffer.empty ())
+	{
+		m_startTls = false;
+		auto const context = tls::context ();
+		if (!context || !m_commandSocket->startTls (context))
+			closeCommand ();
+	}
+#endif
 }
 
 void FtpSession::sendResponse (char const *fmt_, ...)
 {
-	if (!m_commandSocket)
-		return;
+	// a batch of pipelined replies may fill the buffer; make room once before giving up
+	for (bool retry = true;; retry = false)
+	{
+		if (!m_commandSocket)
+			return;
 
-	auto const buffer = m_responseBuffer.freeArea ();
-	auto const size   = m_responseBuffer.freeSize ();
+		auto const buffer = m_responseBuffer.freeArea ();
+		auto const size   = m_responseBuffer.freeSize ();
 
-	va_list ap;
+		va_list ap;
 
-	va_start (ap, fmt_);
-	addLog (RESPONSE, fmt_, ap);
-	va_end (ap);
+		// format once, straight into the response buffer
+		va_start (ap, fmt_);
+		auto const rc = std::vsnprintf (buffer, size, fmt_, ap);
+		va_end (ap);
 
-	va_start (ap, fmt_);
-	auto const rc = std::vsnprintf (buffer, size, fmt_, ap);
-	va_end (ap);
+		if (rc < 0)
+		{
+			error ("vsnprintf: %s\n", std::strerror (errno));
+			closeCommand ();
+			return;
+		}
 
-	if (rc < 0)
-	{
-		error ("vsnprintf: %s\n", std::strerror (errno));
-		closeCommand ();
-		return;
-	}
+		// vsnprintf truncates to size - 1 characters
+		if (static_cast<std::size_t> (rc) >= size)
+		{
+			if (retry && !m_responseBuffer.empty ())
+			{
+				writeResponse ();
+				continue;
+			}
 
-	if (static_cast<std::size_t> (rc) > size)
-	{
-		error ("Not enough space for response\n");
-		closeCommand ();
-		return;
-	}
+			error ("Not enough space for response\n");
+			closeCommand ();
+			return;
+		}
 
-	m_responseBuffer.markUsed (rc);
+		// the log copies the same bytes
+		addLog (RESPONSE, std::string_view (buffer, rc));
 
-	// try to write data immediately
-	assert (m_commandSocket);
-	auto const bytes = m_commandSocket->write (m_responseBuffer);
-	if (bytes <= 0)
-	{
-		if (bytes == 0 || errno != EWOULDBLOCK)
-			closeCommand ();
-	}
-	else
-	{
-		m_timestamp = std::time (nullptr);
-		m_responseBuffer.coalesce ();
+		m_responseBuffer.markUsed (rc);
+		++m_responses;
+		return;
 	}
 }
 
@@ -1888,6 +2305,13 @@ void FtpSession::sendResponse (std::string_view const response_)
 
 	addLog (RESPONSE, response_);
 
+	// a batch of pipelined replies may fill the buffer; make room once before giving up
+	if (response_.size () > m_responseBuffer.freeSize ())
+		writeResponse ();
+
+	if (!m_commandSocket)
+		return;
+
 	auto const buffer = m_responseBuffer.freeArea ();
 	auto const size   = m_responseBuffer.freeSize ();
 
@@ -1900,10 +2324,13 @@ void FtpSession::sendResponse (std::string_view const response_)
 
 	std::memcpy (buffer, response_.data (), response_.size ());
 	m_responseBuffer.markUsed (response_.size ());
+	++m_responses;
 }
 
 bool FtpSession::deflateBuffer (bool const flush_)
 {
+	TRACE_SCOPE ("deflateBuffer");
+
 	auto const inSize  = m_zStreamBuffer.usedSize ();
 	auto const outSize = m_xferBuffer.freeSize ();
 
@@ -1958,6 +2385,8 @@ bool FtpSession::deflateBuffer (bool const flush_)
 
 bool FtpSession::inflateBuffer ()
 {
+	TRACE_SCOPE ("inflateBuffer");
+
 	auto const inSize  = m_zStreamBuffer.usedSize ();
 	auto const outSize = m_xferBuffer.freeSize ();
 
@@ -1994,383 +2423,547 @@ bool FtpSession::inflateBuffer ()
 	return true;
 }
 
-bool FtpSession::listTransfer ()
+std::make_signed_t<std::size_t> FtpSession::sendXfer ()
 {
-	// check if we sent all available data
-	while (m_xferBuffer.empty ())
+	auto const rc = m_dataSocket->write (m_xferBuffer);
+	if (rc <= 0)
 	{
-		m_xferBuffer.clear ();
+		// error sending data
+		if (rc < 0 && errno == EWOULDBLOCK)
+			return 0;
+
+		sendResponse ("426 Connection broken during transfer\r\n");
+		setState (State::COMMAND, true, true);
+		return -1;
+	}
+
+	m_dataOut += rc;
+	m_timestamp = std::time (nullptr);
+	xferFirstByte ();
 
-		if (!m_zStreamBuffer.empty ())
-			return deflateBuffer (false);
+	return rc;
+}
 
-		if (m_deflate && !m_zFlushed && m_eof)
-			return deflateBuffer (true);
+void FtpSession::startTransfer (co::Task<> transfer_, char const *const name_)
+{
+	m_transfer     = std::move (transfer_);
+	m_transferName = name_;
 
-		m_zStreamBuffer.clear ();
+	// runnable right away; the event loop starts it once the command's pass is done
+	m_wait.clear ();
+	m_wait.handle   = m_transfer.handle ();
+	m_wait.deadline = platform::steady_clock::now ();
+}
 
-		// check xfer dir type
-		int rc = 226;
-		if (m_xferDirMode == XferDirMode::MLST || m_xferDirMode == XferDirMode::STAT)
-			rc = 250;
+void FtpSession::resumeTransfer (int const revents_)
+{
+	if (revents_ & ~(POLLIN | POLLPRI | POLLOUT))
+		debug ("Data revents 0x%X\n", revents_);
 
-		if (m_eof && (m_deflate == m_zFlushed))
-		{
-			sendResponse ("%d OK\r\n", rc);
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+	if (revents_ & (POLLERR | POLLHUP))
+	{
+		sendResponse ("426 Data connection failed\r\n");
+		setState (State::COMMAND, true, true);
+		return;
+	}
 
-		// check if this was for a file/MLST
-		if (!m_dir)
+	m_wait.revents = revents_;
+	for (unsigned i = 0; i < TRANSFER_QUANTUM; ++i)
+	{
 		{
-			// we already sent the file's listing
-			m_eof = true;
-			return true;
+			// one transfer step; the scopes can't span a suspension, and accepting or connecting
+			// the data socket isn't part of the transfer
+			auto const name = m_state == State::DATA_CONNECT ? "dataOpened" : m_transferName;
+			TRACE_SCOPE_ARG (name, m_id);
+			ALLOC_SCOPE (name);
+			(void)name;
+
+			m_resuming = true;
+			std::exchange (m_wait.handle, nullptr).resume ();
+			m_resuming = false;
 		}
 
-		// get the next directory entry
-		auto const dent = m_dir.read ();
-		if (!dent)
+		if (m_transfer.done ())
 		{
-			// we have exhausted the directory listing
-			m_eof = true;
-			return true;
+			m_wait.clear ();
+			m_transfer = {};
+
+			// commands pipelined behind HASH
+			if (m_commandSocket && !m_commandBuffer.empty ())
+				readCommand (0);
+			return;
 		}
 
-		// I think we are supposed to return entries for . and ..
-		if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
-			continue; // just skip it
+		// waiting for the socket or a deadline
+		if (!m_wait.yielded)
+			return;
+
+		m_wait.revents = m_wait.events;
+	}
+}
+
+void FtpSession::cancelTransfer ()
+{
+	if (m_resuming)
+		return;
+
+	m_wait.clear ();
+	m_transfer = {};
+	m_hashing  = false;
+}
+
+co::Task<> FtpSession::listTransfer ()
+{
+	if (m_state != State::DATA_TRANSFER && !dataOpened (co_await dataReady ()))
+		co_return;
 
-		// check if this was NLST
-		if (m_xferDirMode == XferDirMode::NLST)
+	for (auto eof = false;;)
+	{
+		// check if we sent all available data
+		if (m_xferBuffer.empty ())
 		{
-			auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
-			// NLST gives the whole path name
-			auto const path = encodePath (buildPath (m_lwd, dent->d_name)) + "\r\n";
-			if (ioBuffer.freeSize () < path.size ())
+			m_xferBuffer.clear ();
+
+			// deflate the listing; flush once it is complete
+			if (!m_zStreamBuffer.empty () || (m_deflate && !m_zFlushed && eof))
 			{
-				sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
-				setState (State::COMMAND, true, true);
-				return false;
+				if (!deflateBuffer (m_zStreamBuffer.empty ()))
+					co_return;
+
+				co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
+				continue;
 			}
 
-			std::memcpy (ioBuffer.freeArea (), path.data (), path.size ());
-			ioBuffer.markUsed (path.size ());
-			LOCKED (m_filePosition += path.size ());
-		}
-		else
-		{
-			// build the path
-			auto const fullPath = buildPath (m_lwd, dent->d_name);
-			stat_t st;
+			m_zStreamBuffer.clear ();
 
-#ifdef __3DS__
-			// the sdmc directory entry already has the type and size, so no need to do a slow stat
-			auto const dp    = static_cast<DIR *> (m_dir);
-			auto const magic = *reinterpret_cast<u32 *> (dp->dirData->dirStruct);
+			if (eof)
+				break;
 
-			if (magic == ARCHIVE_DIRITER_MAGIC)
+			// check if this was for a file/MLST
+			if (!m_dir)
 			{
-				auto const dir   = reinterpret_cast<archive_dir_t const *> (dp->dirData->dirStruct);
-				auto const entry = &dir->entry_data[dir->index];
-
-				if (entry->attributes & FS_ATTRIBUTE_DIRECTORY)
-					st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
-				else
-					st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+				// we already sent the file's listing
+				eof = true;
+				continue;
+			}
 
-				if (!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
-					st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+			// get the next directory entry
+			auto const dent = m_dir.read ();
+			if (!dent)
+			{
+				// we have exhausted the directory listing
+				eof = true;
+				continue;
+			}
 
-				st.st_size  = entry->fileSize;
-				st.st_mtime = 0;
+			// I think we are supposed to return entries for . and ..
+			if (std::strcmp (dent->d_name, ".") == 0 || std::strcmp (dent->d_name, "..") == 0)
+				continue; // just skip it
 
-				bool getmtime = true;
-				if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
+			// check if this was NLST
+			if (m_xferDirMode == XferDirMode::NLST)
+			{
+				auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+				// NLST gives the whole path name
+				auto const path = encodePath (buildPath (m_lwd, dent->d_name)) + "\r\n";
+				if (ioBuffer.freeSize () < path.size ())
 				{
-					if (!m_mlstModify)
-						getmtime = false;
+					sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
+					setState (State::COMMAND, true, true);
+					co_return;
 				}
-				else if (m_xferDirMode == XferDirMode::NLST)
-					getmtime = false;
 
+				std::memcpy (ioBuffer.freeArea (), path.data (), path.size ());
+				ioBuffer.markUsed (path.size ());
+				m_filePosition += path.size ();
+			}
+			else
+			{
+				// build the path
+				auto const fullPath = buildPath (m_lwd, dent->d_name);
+				stat_t st;
+
+#ifdef __3DS__
+				// the sdmc directory entry already has the type and size, so skip the slow stat
+				auto const dp    = static_cast<DIR *> (m_dir);
+				auto const magic = *reinterpret_cast<u32 *> (dp->dirData->dirStruct);
+
+				if (magic == ARCHIVE_DIRITER_MAGIC)
 				{
-					auto const lock = m_config.lockGuard ();
-					if (!m_config.getMTime ())
+					auto const dir =
+					    reinterpret_cast<archive_dir_t const *> (dp->dirData->dirStruct);
+					auto const entry = &dir->entry_data[dir->index];
+
+					if (entry->attributes & FS_ATTRIBUTE_DIRECTORY)
+						st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
+					else
+						st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+
+					if (!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
+						st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+
+					st.st_size  = entry->fileSize;
+					st.st_mtime = 0;
+
+					bool getmtime = true;
+					if (m_xferDirMode == XferDirMode::MLSD || m_xferDirMode == XferDirMode::MLST)
+					{
+						if (!m_mlstModify)
+							getmtime = false;
+					}
+					else if (m_xferDirMode == XferDirMode::NLST)
 						getmtime = false;
-				}
 
-				if (getmtime)
+					if (!m_config->getMTime ())
+						getmtime = false;
+
+					if (getmtime)
+					{
+						std::uint64_t mtime = 0;
+						auto const rc       = archive_getmtime (fullPath.c_str (), &mtime);
+						if (rc != 0)
+							error ("sdmc_getmtime %s 0x%lx\n", fullPath.c_str (), rc);
+						else
+							st.st_mtime = mtime - FtpServer::tzOffset ();
+					}
+				}
+				else
 				{
-					std::uint64_t mtime = 0;
-					auto const rc       = archive_getmtime (fullPath.c_str (), &mtime);
-					if (rc != 0)
-						error ("sdmc_getmtime %s 0x%lx\n", fullPath.c_str (), rc);
-					else
-						st.st_mtime = mtime - FtpServer::tzOffset ();
+#endif
+					// lstat the entry
+					if (tzLStat (fullPath.c_str (), &st) != 0)
+					{
+						error ("Skipping %s: %s\n", fullPath.c_str (), std::strerror (errno));
+						continue; // just skip it
+					}
+#ifdef __3DS__
 				}
-			}
-			else
-			{
 #endif
-				// lstat the entry
-				if (tzLStat (fullPath.c_str (), &st) != 0)
+
+				auto const path = encodePath (dent->d_name);
+				auto const rc   = fillDirent (st, path);
+				if (rc != 0)
 				{
-					error ("Skipping %s: %s\n", fullPath.c_str (), std::strerror (errno));
-					continue; // just skip it
+					sendResponse ("425 %s\r\n", std::strerror (errno));
+					setState (State::COMMAND, true, true);
+					co_return;
 				}
-#ifdef __3DS__
 			}
-#endif
 
-			auto const path = encodePath (dent->d_name);
-			auto const rc   = fillDirent (st, path);
-			if (rc != 0)
+			if (m_deflate)
 			{
-				sendResponse ("425 %s\r\n", std::strerror (errno));
-				setState (State::COMMAND, true, true);
-				return false;
+				co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
+				continue;
 			}
 		}
 
-		if (m_deflate)
-			return true;
-	}
-
-	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
-	if (rc <= 0)
-	{
-		// error sending data
-		if (rc < 0 && errno == EWOULDBLOCK)
-			return false;
+		// send any pending data
+		auto const rc = sendXfer ();
+		if (rc < 0)
+			co_return;
 
-		sendResponse ("426 Connection broken during transfer\r\n");
-		setState (State::COMMAND, true, true);
-		return false;
+		if (rc == 0)
+			co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
+		else
+			co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
 	}
 
-	m_timestamp = std::time (nullptr);
+	m_xferPhases.ok = true;
+	while (!dataFinish ())
+		co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
 
-	// we can try to send more data
-	return true;
+	// check xfer dir type
+	if (m_xferDirMode == XferDirMode::MLST || m_xferDirMode == XferDirMode::STAT)
+		sendResponse ("250 OK\r\n");
+	else
+		sendResponse ("226 OK\r\n");
+	setState (State::COMMAND, true, true);
 }
 
-bool FtpSession::globTransfer ()
-{
 #if FTPD_HAS_GLOB
-	// check if we sent all available data
-	if (m_xferBuffer.empty ())
-	{
-		m_xferBuffer.clear ();
+co::Task<> FtpSession::globTransfer ()
+{
+	if (m_state != State::DATA_TRANSFER && !dataOpened (co_await dataReady ()))
+		co_return;
 
-		auto const entry = m_glob.next ();
-		if (!entry)
+	for (;;)
+	{
+		// check if we sent all available data
+		if (m_xferBuffer.empty ())
 		{
-			// we have exhausted the glob listing
-			sendResponse ("226 OK\r\n");
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+			m_xferBuffer.clear ();
 
-		// NLST gives the whole path name
-		auto const path = encodePath (entry) + "\r\n";
-		if (m_xferBuffer.freeSize () < path.size ())
-		{
-			sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
-			setState (State::COMMAND, true, true);
-			return false;
-		}
+			// check if we exhausted the glob listing
+			auto const entry = m_glob.next ();
+			if (!entry)
+				break;
 
-		std::memcpy (m_xferBuffer.freeArea (), path.data (), path.size ());
-		m_xferBuffer.markUsed (path.size ());
-		LOCKED (m_filePosition += path.size ());
-	}
+			// NLST gives the whole path name
+			auto const path = encodePath (entry) + "\r\n";
+			if (m_xferBuffer.freeSize () < path.size ())
+			{
+				sendResponse ("501 %s\r\n", std::strerror (ENOMEM));
+				setState (State::COMMAND, true, true);
+				co_return;
+			}
 
-	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
-	if (rc <= 0)
-	{
-		// error sending data
-		if (rc < 0 && errno == EWOULDBLOCK)
-			return false;
+			std::memcpy (m_xferBuffer.freeArea (), path.data (), path.size ());
+			m_xferBuffer.markUsed (path.size ());
+			m_filePosition += path.size ();
+		}
 
-		sendResponse ("426 Connection broken during transfer\r\n");
-		setState (State::COMMAND, true, true);
-		return false;
+		// send any pending data
+		auto const rc = sendXfer ();
+		if (rc < 0)
+			co_return;
+
+		if (rc == 0)
+			co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
+		else
+			co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
 	}
 
-	m_timestamp = std::time (nullptr);
+	m_xferPhases.ok = true;
+	while (!dataFinish ())
+		co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
 
-	// we can try to send more data
-	return true;
-#else
-	/// \todo error code?
-	sendResponse ("451 Glob unsupported\r\n");
+	sendResponse ("226 OK\r\n");
 	setState (State::COMMAND, true, true);
-	return false;
-#endif
 }
+#endif
 
-bool FtpSession::retrieveTransfer ()
+co::Task<> FtpSession::retrieveTransfer ()
 {
-	if (m_xferBuffer.empty ())
-	{
-		m_xferBuffer.clear ();
+	if (m_state != State::DATA_TRANSFER && !dataOpened (co_await dataReady ()))
+		co_return;
 
-		auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
-
-		if (!m_devZero)
+	auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+	for (auto eof = false;;)
+	{
+		if (m_xferBuffer.empty ())
 		{
-			if (!m_zStreamBuffer.empty ())
-				return deflateBuffer (false);
+			m_xferBuffer.clear ();
 
-			if (m_deflate && !m_zFlushed && m_eof)
-				return deflateBuffer (true);
+			// deflate what was read; flush once the file is exhausted
+			if (!m_zStreamBuffer.empty () || (m_deflate && !m_zFlushed && eof))
+			{
+				if (!deflateBuffer (m_zStreamBuffer.empty ()))
+					co_return;
+
+				co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
+				continue;
+			}
 
 			m_zStreamBuffer.clear ();
 
-			if (m_eof && (m_deflate == m_zFlushed))
-			{
-				sendResponse ("226 OK\r\n");
-				setState (State::COMMAND, true, true);
-				return false;
-			}
+			if (eof)
+				break;
 
 			// we have sent all the data, so read some more
-			auto const rc = m_file.read (ioBuffer);
+			auto const rc = m_devFile ? co_await co::read (m_devFile, ioBuffer)
+			                          : co_await co::read (m_file, ioBuffer);
 			if (rc < 0)
 			{
 				// failed to read data
 				sendResponse ("451 %s\r\n", std::strerror (errno));
 				setState (State::COMMAND, true, true);
-				return false;
+				co_return;
 			}
 
 			if (rc == 0)
 			{
 				// reached end of file
-				m_eof = true;
-				return true;
+				eof = true;
+				continue;
 			}
 
-			LOCKED (m_filePosition += rc);
+			m_filePosition += rc;
+
+			if (m_deflate)
+			{
+				co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
+				continue;
+			}
 		}
+
+		// send any pending data
+		auto const rc = sendXfer ();
+		if (rc < 0)
+			co_return;
+
+		if (rc == 0)
+			co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
 		else
-		{
-			if (!m_zStreamBuffer.empty ())
-				return deflateBuffer (false);
+			co_await co::yield (m_wait, *m_dataSocket, POLLOUT);
+	}
 
-			if (m_deflate && !m_zFlushed && m_eof)
-				return deflateBuffer (true);
+	m_xferPhases.ok = true;
+	while (!dataFinish ())
+		co_await co::ready (m_wait, *m_dataSocket, POLLOUT);
 
-			m_zStreamBuffer.clear ();
+	sendResponse ("226 OK\r\n");
+	setState (State::COMMAND, true, true);
+}
 
-			auto const buffer = ioBuffer.freeArea ();
-			auto const size   = ioBuffer.freeSize ();
+co::Task<> FtpSession::storeTransfer ()
+{
+	if (m_state != State::DATA_TRANSFER && !dataOpened (co_await dataReady ()))
+		co_return;
 
-			std::memset (buffer, 0, size);
-			ioBuffer.markUsed (size);
+	auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+	for (auto eof = false;;)
+	{
+		if (m_xferBuffer.empty ())
+		{
+			m_xferBuffer.clear ();
 
-			LOCKED (m_filePosition += size);
-		}
+			// inflate what was received, and whatever is left once the client is done
+			if (!m_zStreamBuffer.empty () || (m_deflate && !m_zFlushed && eof))
+			{
+				if (!inflateBuffer ())
+					co_return;
 
-		if (m_deflate)
-			return true;
-	}
+				co_await co::yield (m_wait, *m_dataSocket, POLLIN);
+				continue;
+			}
 
-	// send any pending data
-	auto const rc = m_dataSocket->write (m_xferBuffer);
-	if (rc <= 0)
-	{
-		// error sending data
-		if (rc < 0 && errno == EWOULDBLOCK)
-			return false;
+			if (eof)
+				break;
 
-		sendResponse ("426 Connection broken during transfer\r\n");
-		setState (State::COMMAND, true, true);
-		return false;
-	}
+			// we have written all the received data, so try to get some more
+			auto const rc = m_dataSocket->read (ioBuffer);
+			if (rc < 0)
+			{
+				if (errno == EWOULDBLOCK)
+				{
+					co_await co::ready (m_wait, *m_dataSocket, POLLIN);
+					continue;
+				}
 
-	m_timestamp = std::time (nullptr);
+				// the data connection failed, or a TLS peer closed without close_notify
+				sendResponse ("426 %s\r\n", std::strerror (errno));
+				setState (State::COMMAND, true, true);
+				co_return;
+			}
 
-	// we can try to read/send more data
-	return true;
-}
+			if (rc == 0)
+			{
+				// reached end of file
+				eof = true;
+				continue;
+			}
 
-bool FtpSession::storeTransfer ()
-{
-	if (m_xferBuffer.empty ())
-	{
-		m_xferBuffer.clear ();
+			m_dataIn += rc;
+			m_timestamp = std::time (nullptr);
+			xferFirstByte ();
 
-		auto &ioBuffer = m_deflate ? m_zStreamBuffer : m_xferBuffer;
+			if (m_deflate)
+			{
+				co_await co::yield (m_wait, *m_dataSocket, POLLIN);
+				continue;
+			}
+		}
 
-		if (!m_zStreamBuffer.empty ())
-			return inflateBuffer ();
+		if (!m_devFile)
+		{
+			// write any pending data
+			auto const data = m_xferBuffer.usedArea ();
+			auto const rc   = co_await co::write (m_file, m_xferBuffer);
+			if (rc <= 0)
+			{
+				// error writing data
+				sendResponse (
+				    "426 %s\r\n", rc < 0 ? std::strerror (errno) : "Failed to write data");
+				setState (State::COMMAND, true, true);
+				co_return;
+			}
 
-		if (m_deflate && !m_zFlushed && m_eof)
-			return inflateBuffer ();
+#if FTPD_HAS_DEDUP
+			if (m_dedup)
+				m_hash.update (data, rc);
+#else
+			(void)data;
+#endif
 
-		if (m_eof && (m_deflate == m_zFlushed))
+			m_filePosition += rc;
+			freespace::consume (m_freeSpaceMount, rc);
+		}
+		else
 		{
-			sendResponse ("226 OK\r\n");
-			setState (State::COMMAND, true, true);
-			return false;
+			// discard pending data
+			m_filePosition += co_await co::write (m_devFile, m_xferBuffer);
 		}
 
-		// we have written all the received data, so try to get some more
-		auto const rc = m_dataSocket->read (ioBuffer);
+		// we can try to recv/write more data
+		co_await co::yield (m_wait, *m_dataSocket, POLLIN);
+	}
+
+#if FTPD_HAS_DEDUP
+	if (m_dedup)
+		dedupUpload ();
+#endif
+
+	m_xferPhases.ok = true;
+	if (m_devFile)
+		sendResponse ("226 Discarded %" PRIu64 " bytes\r\n", m_devFile.position ());
+	else
+		sendResponse ("226 OK\r\n");
+	setState (State::COMMAND, true, true);
+}
+
+///////////////////////////////////////////////////////////////////////////
+#if FTPD_HAS_DEDUP
+co::Task<> FtpSession::hashTransfer ()
+{
+	auto failed = false;
+	while (true)
+	{
+		m_xferBuffer.clear ();
+		auto const rc = co_await co::read (m_file, m_xferBuffer);
 		if (rc < 0)
 		{
-			// failed to read data
-			if (errno == EWOULDBLOCK)
-				return false;
-
 			sendResponse ("451 %s\r\n", std::strerror (errno));
-			setState (State::COMMAND, true, true);
-			return false;
+			failed = true;
+			break;
 		}
 
 		if (rc == 0)
-		{
-			// reached end of file
-			m_eof = true;
-			return true;
-		}
+			break;
 
-		m_timestamp = std::time (nullptr);
+		m_hash.update (m_xferBuffer.usedArea (), m_xferBuffer.usedSize ());
+		m_filePosition += rc;
 
-		if (m_deflate)
-			return true;
+		co_await co::yield (m_wait);
 	}
 
-	if (!m_devZero)
+	if (!failed)
 	{
-		// write any pending data
-		auto const rc = m_file.write (m_xferBuffer);
-		if (rc <= 0)
+		auto const digest = m_hash.finish ();
+
+		stat_t st;
+		if (m_config->dedup () && m_filePosition != 0 &&
+		    ::stat (m_workItem.c_str (), &st) == 0 &&
+		    static_cast<std::uint64_t> (st.st_size) == m_filePosition)
 		{
-			// error writing data
-			sendResponse ("426 %s\r\n", rc < 0 ? std::strerror (errno) : "Failed to write data");
-			setState (State::COMMAND, true, true);
-			return false;
+			dedup::setIndexPath (m_config->dedupIndex ());
+			dedup::insert (digest, m_workItem, st);
 		}
 
-		// we can try to recv/write more data
-		LOCKED (m_filePosition += rc);
-	}
-	else
-	{
-		LOCKED (m_filePosition += m_xferBuffer.usedSize ());
-		m_xferBuffer.clear ();
+		sendResponse ("213 SHA-256 0-%" PRIu64 " %s %s\r\n",
+		    m_filePosition,
+		    Sha256::toHex (digest).c_str (),
+		    encodePath (m_workItem).c_str ());
 	}
 
-	return true;
+	// the session never left the command state; the owner runs the commands queued meanwhile
+	m_hashing = false;
+	m_file.close ();
+	m_workItem.clear ();
+	m_fileSize     = 0;
+	m_filePosition = 0;
 }
+#endif
 
-///////////////////////////////////////////////////////////////////////////
 void FtpSession::ABOR (char const *args_)
 {
 	(void)args_;
@@ -2389,10 +2982,37 @@ void FtpSession::ABOR (char const *args_)
 
 void FtpSession::ALLO (char const *args_)
 {
-	(void)args_;
+	setState (State::COMMAND, false, false);
+
+	if (!authorized ())
+	{
+		sendResponse ("530 Not logged in\r\n");
+		return;
+	}
+
+	// parse the size; a record size ("R <n>") doesn't matter in stream mode
+	std::string_view const args = args_;
+	std::uint64_t size          = 0;
+
+	auto const end       = args.data () + args.size ();
+	auto const [ptr, ec] = std::from_chars (args.data (), end, size);
+	if (ec != std::errc () || (ptr != end && *ptr != ' '))
+	{
+		sendResponse ("501 Syntax error in parameters\r\n");
+		return;
+	}
 
-	sendResponse ("202 Superfluous command\r\n");
-	setState (State::COMMAND, false, false);
+	// check against the cached free space of the working directory's mount point
+	auto const available = freespace::available (freespace::find (m_cwd));
+	if (available && size > *available)
+	{
+		sendResponse ("552 Insufficient storage space\r\n");
+		return;
+	}
+
+	// checked again once the next upload's path is known
+	m_allocHint = size;
+	sendResponse ("200 OK\r\n");
 }
 
 void FtpSession::APPE (char const *args_)
@@ -2408,6 +3028,36 @@ void FtpSession::APPE (char const *args_)
 	xferFile (args_, XferFileMode::APPE);
 }
 
+#if FTPD_HAS_TLS
+void FtpSession::AUTH (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	if (::strcasecmp (args_, "TLS") != 0 && ::strcasecmp (args_, "TLS-C") != 0 &&
+	    ::strcasecmp (args_, "SSL") != 0)
+	{
+		sendResponse ("504 Unsupported security mechanism\r\n");
+		return;
+	}
+
+	if (m_commandSocket->tls ())
+	{
+		sendResponse ("503 TLS already active\r\n");
+		return;
+	}
+
+	if (!tls::context ())
+	{
+		sendResponse ("431 TLS not configured\r\n");
+		return;
+	}
+
+	// the handshake starts once this reply has been written
+	sendResponse ("234 Ready for TLS\r\n");
+	m_startTls = true;
+}
+#endif
+
 void FtpSession::CDUP (char const *args_)
 {
 	(void)args_;
@@ -2466,6 +3116,11 @@ void FtpSession::DELE (char const *args_)
 		return;
 	}
 
+	// only the last link of a regular file frees its blocks
+	stat_t st;
+	auto const freed = ::lstat (path.c_str (), &st) == 0 && S_ISREG (st.st_mode) &&
+	                   st.st_nlink == 1;
+
 	// unlink the path
 	if (::unlink (path.c_str ()) != 0)
 	{
@@ -2473,30 +3128,110 @@ void FtpSession::DELE (char const *args_)
 		return;
 	}
 
-	FtpServer::updateFreeSpace ();
+	if (freed)
+		freespace::consume (freespace::find (path), -static_cast<std::int64_t> (st.st_size));
 	sendResponse ("250 OK\r\n");
 }
 void FtpSession::FEAT (char const *args_)
 {
 	(void)args_;
 
+#if FTPD_HAS_TLS
+	auto const secure = tls::context () != nullptr;
+#else
+	constexpr auto secure = false;
+#endif
+
 	setState (State::COMMAND, false, false);
 	sendResponse ("211-\r\n"
+	              "%s"
+#if FTPD_HAS_DEDUP
+	              " HASH SHA-256*\r\n"
+#endif
 	              " MDTM\r\n"
 	              " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
 	              " MODE Z\r\n"
 	              " PASV\r\n"
+	              "%s"
 	              " SIZE\r\n"
 	              " TVFS\r\n"
 	              " UTF8\r\n"
 	              "\r\n"
 	              "211 End\r\n",
+	    secure ? " AUTH TLS\r\n" : "",
 	    m_mlstType ? "*" : "",
 	    m_mlstSize ? "*" : "",
 	    m_mlstModify ? "*" : "",
 	    m_mlstPerm ? "*" : "",
-	    m_mlstUnixMode ? "*" : "");
+	    m_mlstUnixMode ? "*" : "",
+	    secure ? " PBSZ\r\n PROT\r\n" : "");
+}
+
+#if FTPD_HAS_DEDUP
+void FtpSession::HASH (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	if (!authorized ())
+	{
+		sendResponse ("530 Not logged in\r\n");
+		return;
+	}
+
+	// build the path to hash
+	auto const path = buildResolvedPath (m_cwd, args_);
+	if (path.empty ())
+	{
+		sendResponse ("553 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	stat_t st;
+	if (::stat (path.c_str (), &st) != 0)
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	if (!S_ISREG (st.st_mode))
+	{
+		sendResponse ("550 Not a file\r\n");
+		return;
+	}
+
+	// indexed content doesn't need to be read again
+	if (m_config->dedup ())
+	{
+		dedup::setIndexPath (m_config->dedupIndex ());
+		if (auto const digest = dedup::digest (st))
+		{
+			sendResponse ("213 SHA-256 0-%" PRIu64 " %s %s\r\n",
+			    static_cast<std::uint64_t> (st.st_size),
+			    Sha256::toHex (*digest).c_str (),
+			    encodePath (path).c_str ());
+			return;
+		}
+	}
+
+	if (!m_file.open (path.c_str (), "rb"))
+	{
+		sendResponse ("550 %s\r\n", std::strerror (errno));
+		return;
+	}
+
+	m_file.setBufferSize (m_config->fileBufferSize ());
+	resetXferBuffers ();
+	m_hash.reset ();
+
+	// read a block per step like RETR, so other sessions are served meanwhile; this session's
+	// next commands wait for the reply, as they would for a synchronous one
+	m_hashing      = true;
+	m_fileSize     = st.st_size;
+	m_filePosition = 0;
+	m_workItem     = path;
+	startTransfer (hashTransfer (), "hashTransfer");
 }
+#endif
 
 void FtpSession::HELP (char const *args_)
 {
@@ -2505,9 +3240,25 @@ void FtpSession::HELP (char const *args_)
 	setState (State::COMMAND, false, false);
 	sendResponse ("214-\r\n"
 	              "The following commands are recognized\r\n"
-	              " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-	              " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO SITE\r\n"
-	              " SIZE STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
+	              " ABOR ALLO APPE"
+#if FTPD_HAS_TLS
+	              " AUTH"
+#endif
+	              " CDUP CWD DELE FEAT"
+#if FTPD_HAS_DEDUP
+	              " HASH"
+#endif
+	              " HELP LIST MDTM MKD MLSD MLST\r\n"
+	              " MODE NLST NOOP OPTS PASS PASV"
+#if FTPD_HAS_TLS
+	              " PBSZ"
+#endif
+	              " PORT"
+#if FTPD_HAS_TLS
+	              " PROT"
+#endif
+	              " PWD QUIT REST RETR RMD RNFR RNTO\r\n"
+	              " SITE SIZE STAT STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
 	              "214 End\r\n");
 }
 
@@ -2564,7 +3315,6 @@ void FtpSession::MKD (char const *args_)
 		return;
 	}
 
-	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
 
@@ -2635,8 +3385,6 @@ void FtpSession::NLST (char const *args_)
 			return;
 		}
 
-		m_transfer = &FtpSession::globTransfer;
-
 		if (!m_port && !m_pasv)
 		{
 			// Prior PORT or PASV required
@@ -2646,6 +3394,8 @@ void FtpSession::NLST (char const *args_)
 		}
 
 		setState (State::DATA_CONNECT, false, true);
+		m_xferPhases.recv    = false;
+		m_xferPhases.listing = true;
 		m_send = true;
 
 		// setup connection
@@ -2653,8 +3403,10 @@ void FtpSession::NLST (char const *args_)
 		{
 			sendResponse ("425 Can't open data connection\r\n");
 			setState (State::COMMAND, true, true);
+			return;
 		}
 
+		startTransfer (globTransfer (), "globTransfer");
 		return;
 	}
 #endif
@@ -2759,7 +3511,8 @@ void FtpSession::OPTS (char const *args_)
 				}
 
 				level = val[0] - '0';
-				m_config.setDeflateLevel (level);
+				m_server.updateConfig (
+				    [level] (FtpConfig &config_) { return config_.setDeflateLevel (level); });
 			}
 			else
 			{
@@ -2787,16 +3540,8 @@ void FtpSession::PASS (char const *args_)
 
 	m_authorizedPass = false;
 
-	std::string user;
-	std::string pass;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
-#endif
-		user = m_config.user ();
-		pass = m_config.pass ();
-	}
+	auto const &user = m_config->user ();
+	auto const &pass = m_config->pass ();
 
 	if (!user.empty () && !m_authorizedUser)
 	{
@@ -2830,9 +3575,17 @@ void FtpSession::PASV (char const *args_)
 	m_pasv = false;
 	m_port = false;
 
+#if FTPD_HAS_TLS
+	if (m_config->tlsRequired () && !m_protPrivate)
+	{
+		sendResponse ("521 Data connections must be protected (PROT P)\r\n");
+		return;
+	}
+#endif
+
 	// create a socket to listen on
 	auto pasv = Socket::create (Socket::eStream);
-	LOCKED (m_pasvSocket = std::move (pasv));
+	m_pasvSocket = std::move (pasv);
 	if (!m_pasvSocket)
 	{
 		sendResponse ("451 Failed to create listening socket\r\n");
@@ -2840,8 +3593,7 @@ void FtpSession::PASV (char const *args_)
 	}
 
 	// set the socket options
-	m_pasvSocket->setRecvBufferSize (SOCK_BUFFERSIZE);
-	m_pasvSocket->setSendBufferSize (SOCK_BUFFERSIZE);
+	setSockBufferSize (*m_pasvSocket);
 
 	// create an address to bind
 	sockaddr_in addr = m_commandSocket->sockName ();
@@ -2888,6 +3640,24 @@ void FtpSession::PASV (char const *args_)
 	    "227 Entering Passive Mode (%s,%u,%u).\r\n", name.c_str (), port >> 8, port & 0xFF);
 }
 
+#if FTPD_HAS_TLS
+void FtpSession::PBSZ (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	if (!m_commandSocket->tls ())
+	{
+		sendResponse ("503 Security data exchange not complete\r\n");
+		return;
+	}
+
+	// TLS is a streaming protection mechanism
+	(void)args_;
+	m_pbsz = true;
+	sendResponse ("200 PBSZ=0\r\n");
+}
+#endif
+
 void FtpSession::PORT (char const *args_)
 {
 	if (!authorized ())
@@ -2902,6 +3672,14 @@ void FtpSession::PORT (char const *args_)
 	m_pasv = false;
 	m_port = false;
 
+#if FTPD_HAS_TLS
+	if (m_config->tlsRequired () && !m_protPrivate)
+	{
+		sendResponse ("521 Data connections must be protected (PROT P)\r\n");
+		return;
+	}
+#endif
+
 	std::string addrString = args_;
 
 	// convert a,b,c,d,e,f with a.b.c.d\0e.f
@@ -2979,6 +3757,34 @@ void FtpSession::PORT (char const *args_)
 	sendResponse ("200 OK\r\n");
 }
 
+#if FTPD_HAS_TLS
+void FtpSession::PROT (char const *args_)
+{
+	setState (State::COMMAND, false, false);
+
+	if (!m_pbsz)
+	{
+		sendResponse ("503 PBSZ required\r\n");
+		return;
+	}
+
+	if (::strcasecmp (args_, "C") == 0)
+	{
+		m_protPrivate = false;
+		sendResponse ("200 OK\r\n");
+	}
+	else if (::strcasecmp (args_, "P") == 0)
+	{
+		m_protPrivate = true;
+		sendResponse ("200 OK\r\n");
+	}
+	else if (::strcasecmp (args_, "S") == 0 || ::strcasecmp (args_, "E") == 0)
+		sendResponse ("536 Protection level not supported\r\n");
+	else
+		sendResponse ("504 Unknown protection level\r\n");
+}
+#endif
+
 void FtpSession::PWD (char const *args_)
 {
 	(void)args_;
@@ -2989,8 +3795,6 @@ void FtpSession::PWD (char const *args_)
 		return;
 	}
 
-	auto const path = encodePath (m_cwd);
-
 	std::string response = "257 \"";
 	response += encodePath (m_cwd, true);
 	response += "\"\r\n";
@@ -3003,6 +3807,7 @@ void FtpSession::QUIT (char const *args_)
 	(void)args_;
 
 	sendResponse ("221 Disconnecting\r\n");
+	writeResponse ();
 	closeCommand ();
 }
 
@@ -3080,7 +3885,6 @@ void FtpSession::RMD (char const *args_)
 		return;
 	}
 
-	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
 
@@ -3152,7 +3956,6 @@ void FtpSession::RNTO (char const *args_)
 	// clear the rename state
 	m_rename.clear ();
 
-	FtpServer::updateFreeSpace ();
 	sendResponse ("250 OK\r\n");
 }
 
@@ -3174,6 +3977,19 @@ void FtpSession::SITE (char const *args_)
 		              " Set password: SITE PASS <PASS>\r\n"
 		              " Set port: SITE PORT <PORT>\r\n"
 		              " Set deflate level: SITE DEFLATE <LEVEL>\r\n"
+		              " Set logging: SITE LOG <COMMANDS|RESPONSES> <0|1>\r\n"
+#if FTPD_ALLOC_TRACKING
+		              " Show statistics: SITE STATS [SELF|LATENCY|ALLOC]\r\n"
+#else
+		              " Show statistics: SITE STATS [SELF|LATENCY]\r\n"
+#endif
+#if FTPD_TRACE
+		              " Dump trace: SITE TRACE [PATH]\r\n"
+#endif
+#if FTPD_HAS_DEDUP
+		              " Set upload dedup: SITE DEDUP [0|1]\r\n"
+		              " Link known content: SITE LINK <SHA-256> <PATH>\r\n"
+#endif
 #ifndef __NDS__
 		              " Set hostname: SITE HOST <HOSTNAME>\r\n"
 #endif
@@ -3193,40 +4009,39 @@ void FtpSession::SITE (char const *args_)
 
 	if (compare (command, "USER") == 0)
 	{
-		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
-#endif
-			m_config.setUser (std::string (arg));
-		}
+		m_server.updateConfig ([arg] (FtpConfig &config_) {
+			config_.setUser (std::string (arg));
+			return true;
+		});
 
 		sendResponse ("200 OK\r\n");
 		return;
 	}
 	else if (compare (command, "PASS") == 0)
 	{
-		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
-#endif
-			m_config.setPass (std::string (arg));
-		}
+		m_server.updateConfig ([arg] (FtpConfig &config_) {
+			config_.setPass (std::string (arg));
+			return true;
+		});
 
 		sendResponse ("200 OK\r\n");
 		return;
 	}
 	else if (compare (command, "PORT") == 0)
 	{
-		bool error = false;
-
+		if (!m_server.updateConfig ([arg] (FtpConfig &config_) { return config_.setPort (arg); }))
 		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
-#endif
-			error = !m_config.setPort (arg);
+			sendResponse ("550 %s\r\n", std::strerror (errno));
+			return;
 		}
 
-		if (error)
+		sendResponse ("200 OK\r\n");
+		return;
+	}
+	else if (compare (command, "DEFLATE") == 0)
+	{
+		if (!m_server.updateConfig (
+		        [arg] (FtpConfig &config_) { return config_.setDeflateLevel (arg); }))
 		{
 			sendResponse ("550 %s\r\n", std::strerror (errno));
 			return;
@@ -3235,64 +4050,198 @@ void FtpSession::SITE (char const *args_)
 		sendResponse ("200 OK\r\n");
 		return;
 	}
-	else if (compare (command, "DEFLATE") == 0)
+	else if (compare (command, "LOG") == 0)
 	{
-		if (!m_config.setDeflateLevel (arg))
+		auto const sep      = arg.find_first_of (' ');
+		auto const which    = arg.substr (0, sep);
+		auto const value =
+		    sep == std::string_view::npos ? std::string_view () : arg.substr (sep + 1);
+		auto const commands = compare (which, "COMMANDS") == 0;
+		if ((!commands && compare (which, "RESPONSES") != 0) || (value != "0" && value != "1"))
 		{
-			sendResponse ("550 %s\r\n", std::strerror (errno));
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
 			return;
 		}
 
+		m_server.updateConfig ([commands, value] (FtpConfig &config_) {
+			if (commands)
+				config_.setLogCommands (value == "1");
+			else
+				config_.setLogResponses (value == "1");
+			return true;
+		});
+
+		setLogEnabled (commands ? COMMAND : RESPONSE, value == "1");
 		sendResponse ("200 OK\r\n");
 		return;
 	}
 #ifndef __NDS__
 	else if (compare (command, "HOST") == 0)
 	{
+		m_server.updateConfig ([arg] (FtpConfig &config_) {
+			config_.setHostname (std::string (arg));
+			return true;
+		});
+	}
+
+#endif
+#if FTPD_HAS_DEDUP
+	else if (compare (command, "DEDUP") == 0)
+	{
+		if (arg != "0" && arg != "1")
 		{
-			auto const lock = m_config.lockGuard ();
-			m_config.setHostname (std::string (arg));
-			mdns::setHostname (std::string (arg));
+			sendResponse ("550 %s\r\n", std::strerror (EINVAL));
+			return;
 		}
+
+		m_server.updateConfig ([arg] (FtpConfig &config_) {
+			config_.setDedup (arg == "1");
+			return true;
+		});
+
+		sendResponse ("200 OK\r\n");
+		return;
 	}
+	else if (compare (command, "LINK") == 0)
+	{
+		// pre-upload query: link content the server already has instead of uploading it
+		auto const sep = arg.find_first_of (' ');
+
+		Sha256::Digest digest;
+		if (sep == std::string_view::npos || !Sha256::fromHex (arg.substr (0, sep), digest))
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		if (!m_config->dedup ())
+		{
+			sendResponse ("550 Dedup disabled\r\n");
+			return;
+		}
+
+		dedup::setIndexPath (m_config->dedupIndex ());
+
+		auto const path = buildResolvedPath (m_cwd, std::string (arg.substr (sep + 1)).c_str ());
+		if (path.empty ())
+		{
+			sendResponse ("553 %s\r\n", std::strerror (errno));
+			return;
+		}
+
+		auto const existing = dedup::find (digest);
+		if (!existing)
+		{
+			sendResponse ("550 Unknown content\r\n");
+			return;
+		}
+
+		if (*existing != path)
+		{
+			// link only new files; clone would replace whatever is there
+			stat_t st;
+			if (::lstat (path.c_str (), &st) == 0)
+			{
+				sendResponse ("553 File exists\r\n");
+				return;
+			}
+
+			if (!dedup::clone (*existing, path))
+			{
+				sendResponse ("550 %s\r\n", std::strerror (errno));
+				return;
+			}
+		}
 
+		freespace::refresh ();
+		sendResponse ("250 OK\r\n");
+		return;
+	}
 #endif
 #ifdef __3DS__
 	else if (compare (command, "MTIME") == 0)
 	{
-		if (arg == "0")
+		if (arg != "0" && arg != "1")
 		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
+			sendResponse ("550 %s\r\n", std::strerror (EINVAL));
+			return;
+		}
+
+		m_server.updateConfig ([arg] (FtpConfig &config_) {
+			config_.setGetMTime (arg == "1");
+			return true;
+		});
+	}
 #endif
-			m_config.setGetMTime (false);
+	else if (compare (command, "STATS") == 0)
+	{
+		auto const all     = arg.empty ();
+		auto const latency = !all && compare (arg, "LATENCY") == 0;
+		auto const allocs  = FTPD_ALLOC_TRACKING && !all && compare (arg, "ALLOC") == 0;
+		if (!all && !latency && !allocs && compare (arg, "SELF") != 0)
+		{
+			sendResponse ("501 %s\r\n", std::strerror (EINVAL));
+			return;
 		}
-		else if (arg == "1")
+
+		// one JSON object per continuation line
+		constexpr std::string_view header = "211-Statistics\r\n";
+		constexpr std::string_view footer = "211 End\r\n";
+
+		// replies to earlier pipelined commands may still be queued; send them to make room
+		writeResponse ();
+
+		auto const free     = m_responseBuffer.freeSize ();
+		auto const overhead = header.size () + footer.size ();
+		auto const limit    = free > overhead ? free - overhead : 0;
+
+		std::string response (header);
+		if (latency || allocs)
 		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
+			// leave room for the omitted count
+			auto const budget = limit > 32 ? limit - 32 : 0;
+#if FTPD_ALLOC_TRACKING
+			auto const omitted =
+			    allocs ? alloc::report (response, budget) : writeLatency (response, budget);
+#else
+			auto const omitted = writeLatency (response, budget);
 #endif
-			m_config.setGetMTime (true);
+			if (omitted)
+				ftp::appendFormat (response, " {\"omitted\":%u}\r\n", omitted);
 		}
 		else
+			m_server.writeStats (response, *this, all, limit);
+		response += footer;
+
+		sendResponse (response);
+		return;
+	}
+#if FTPD_TRACE
+	else if (compare (command, "TRACE") == 0)
+	{
+		auto const path =
+		    arg.empty () ? std::string (trace::DEFAULT_PATH) : buildResolvedPath (m_cwd, arg);
+		if (path.empty ())
 		{
-			sendResponse ("550 %s\r\n", std::strerror (EINVAL));
+			sendResponse ("553 %s\r\n", std::strerror (errno));
 			return;
 		}
-	}
-#endif
-	else if (compare (command, "SAVE") == 0)
-	{
-		bool error;
 
+		auto const events = trace::dump (path.c_str ());
+		if (events < 0)
 		{
-#ifndef __NDS__
-			auto const lock = m_config.lockGuard ();
-#endif
-			error = !m_config.save (FTPDCONFIG);
+			sendResponse ("550 %s\r\n", std::strerror (errno));
+			return;
 		}
 
-		if (error)
+		sendResponse ("200 Wrote %ld events to %s\r\n", events, encodePath (path).c_str ());
+		return;
+	}
+#endif
+	else if (compare (command, "SAVE") == 0)
+	{
+		auto const config = m_server.config ();
+		if (!config->save (config->path ().c_str ()))
 		{
 			sendResponse ("550 %s\r\n", std::strerror (errno));
 			return;
@@ -3315,6 +4264,26 @@ void FtpSession::SIZE (char const *args_)
 		return;
 	}
 
+	// virtual devices shadow the filesystem
+	if (auto const path = buildPath (m_cwd, args_); fs::DevFile::match (path))
+	{
+		fs::DevFile devFile;
+		if (!devFile.open (path))
+		{
+			sendResponse ("553 %s\r\n", std::strerror (errno));
+			return;
+		}
+
+		if (devFile.size () < 0)
+		{
+			sendResponse ("550 Unbounded device\r\n");
+			return;
+		}
+
+		sendResponse ("213 %" PRIu64 "\r\n", static_cast<std::uint64_t> (devFile.size ()));
+		return;
+	}
+
 	// build the path to stat
 	auto const path = buildResolvedPath (m_cwd, args_);
 	if (path.empty ())
@@ -3447,20 +4416,14 @@ void FtpSession::USER (char const *args_)
 
 	m_authorizedUser = false;
 
-	std::string user;
-	std::string pass;
-
-	{
-#ifndef __NDS__
-		auto const lock = m_config.lockGuard ();
-#endif
-		user = m_config.user ();
-		pass = m_config.pass ();
-	}
+	auto const &user = m_config->user ();
+	auto const &pass = m_config->pass ();
 
 	if (user.empty () || user == args_)
 	{
 		m_authorizedUser = true;
+		m_anonymous      = user.empty ();
+		m_userName       = args_;
 		if (pass.empty ())
 		{
 			sendResponse ("230 OK\r\n");
@@ -3481,10 +4444,16 @@ std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> co
 	{"ABOR", &FtpSession::ABOR}, 
 	{"ALLO", &FtpSession::ALLO}, 
 	{"APPE", &FtpSession::APPE}, 
+#if FTPD_HAS_TLS
+	{"AUTH", &FtpSession::AUTH},
+#endif
 	{"CDUP", &FtpSession::CDUP}, 
 	{"CWD",  &FtpSession::CWD},
 	{"DELE", &FtpSession::DELE}, 
 	{"FEAT", &FtpSession::FEAT}, 
+#if FTPD_HAS_DEDUP
+	{"HASH", &FtpSession::HASH},
+#endif
 	{"HELP", &FtpSession::HELP}, 
 	{"LIST", &FtpSession::LIST}, 
 	{"MDTM", &FtpSession::MDTM}, 
@@ -3497,7 +4466,13 @@ std::vector<std::pair<std::string_view, void (FtpSession::*) (char const *)>> co
 	{"OPTS", &FtpSession::OPTS}, 
 	{"PASS", &FtpSession::PASS}, 
 	{"PASV", &FtpSession::PASV}, 
+#if FTPD_HAS_TLS
+	{"PBSZ", &FtpSession::PBSZ},
+#endif
 	{"PORT", &FtpSession::PORT}, 
+#if FTPD_HAS_TLS
+	{"PROT", &FtpSession::PROT},
+#endif
 	{"PWD",  &FtpSession::PWD},
 	{"QUIT", &FtpSession::QUIT}, 
 	{"REST", &FtpSession::REST}, 
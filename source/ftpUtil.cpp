@@ -0,0 +1,611 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ftpUtil.h"
+
+#include <gsl/gsl>
+
+#include <strings.h>
+#include <sys/stat.h>
+using stat_t = struct stat;
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+/// \brief Check if string view is a C string
+/// \param str_ String to check
+bool isCString (std::string_view const str_)
+{
+	return str_.find_first_of ('\0') != std::string_view::npos;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+int ftp::compare (std::string_view const lhs_, std::string_view const rhs_)
+{
+	if (isCString (lhs_) && isCString (rhs_))
+		return ::strcasecmp (lhs_.data (), rhs_.data ());
+
+	auto const maxLen = std::min (lhs_.size (), rhs_.size ());
+	for (unsigned i = 0; i < maxLen; ++i)
+	{
+		auto const l = std::tolower (lhs_[i]);
+		auto const r = std::tolower (rhs_[i]);
+		if (l != r)
+			return l - r;
+	}
+
+	return gsl::narrow_cast<int> (lhs_.size ()) - gsl::narrow_cast<int> (rhs_.size ());
+}
+
+std::pair<char *, char *> ftp::parseCommand (char *const buffer_, std::size_t const size_)
+{
+	// look for \r\n or \n delimiter
+	auto const end = &buffer_[size_];
+	for (auto p = buffer_; p < end; ++p)
+	{
+		if (p[0] == '\r' && p < end - 1 && p[1] == '\n')
+			return {p, &p[2]};
+
+		if (p[0] == '\n')
+			return {p, &p[1]};
+	}
+
+	return {nullptr, nullptr};
+}
+
+void ftp::decodePath (char *const buffer_, std::size_t const size_)
+{
+	auto const end = &buffer_[size_];
+	for (auto p = buffer_; p < end; ++p)
+	{
+		// this is an encoded \n
+		if (*p == '\0')
+			*p = '\n';
+	}
+}
+
+std::string ftp::encodePath (std::string_view const buffer_, bool const quotes_)
+{
+	// check if the buffer has \n
+	bool const lf = std::memchr (buffer_.data (), '\n', buffer_.size ());
+
+	auto end = std::end (buffer_);
+
+	std::size_t numQuotes = 0;
+	if (quotes_)
+	{
+		// check for \" that needs to be encoded
+		auto p = buffer_.data ();
+		do
+		{
+			p = static_cast<char const *> (std::memchr (p, '"', end - p));
+			if (p)
+			{
+				++p;
+				++numQuotes;
+			}
+		} while (p);
+	}
+
+	// if nothing needs escaping, return it as-is
+	if (!lf && !numQuotes)
+		return std::string (buffer_);
+
+	// reserve output buffer
+	std::string path (buffer_.size () + numQuotes, '\0');
+	auto in  = buffer_.data ();
+	auto out = path.data ();
+
+	// encode into the output buffer
+	while (in < end)
+	{
+		if (*in == '\n')
+		{
+			// encoded \n is \0
+			*out++ = '\0';
+		}
+		else if (quotes_ && *in == '"')
+		{
+			// encoded \" is \"\"
+			*out++ = '"';
+			*out++ = '"';
+		}
+		else
+			*out++ = *in;
+		++in;
+	}
+
+	return path;
+}
+
+std::string ftp::dirName (std::string_view const path_)
+{
+	// remove last path component
+	auto const dir = std::string (path_.substr (0, path_.rfind ('/')));
+	if (dir.empty ())
+		return "/";
+
+	return dir;
+}
+
+std::string ftp::resolvePath (std::string_view const path_)
+{
+	assert (!path_.empty ());
+	assert (path_[0] == '/');
+
+	// make sure parent is a directory
+	stat_t st;
+	if (::stat (dirName (path_).c_str (), &st) != 0)
+		return {};
+
+	if (!S_ISDIR (st.st_mode))
+	{
+		errno = ENOTDIR;
+		return {};
+	}
+
+	// split path components
+	std::vector<std::string_view> components;
+
+	std::size_t pos = 1;
+	auto next       = path_.find ('/', pos);
+	while (next != std::string::npos)
+	{
+		if (next != pos)
+			components.emplace_back (path_.substr (pos, next - pos));
+		pos  = next + 1;
+		next = path_.find ('/', pos);
+	}
+
+	if (pos != path_.size ())
+		components.emplace_back (path_.substr (pos));
+
+	// collapse . and ..
+	auto it = std::begin (components);
+	while (it != std::end (components))
+	{
+		if (*it == ".")
+		{
+			it = components.erase (it);
+			continue;
+		}
+
+		if (*it == "..")
+		{
+			if (it != std::begin (components))
+				it = components.erase (std::prev (it));
+			it = components.erase (it);
+			continue;
+		}
+
+		++it;
+	}
+
+	// join path components
+	std::string outPath = "/";
+	for (auto const &component : components)
+	{
+		outPath += component;
+		outPath.push_back ('/');
+	}
+
+	if (outPath.size () > 1)
+		outPath.pop_back ();
+
+	return outPath;
+}
+
+std::string ftp::buildPath (std::string_view const cwd_, std::string_view const args_)
+{
+	std::string path;
+
+	// absolute path
+	if (args_[0] == '/')
+		path = std::string (args_);
+	// relative path
+	else
+		path = std::string (cwd_) + '/' + std::string (args_);
+
+	// coalesce consecutive slashes
+	auto it = std::begin (path);
+	while (it != std::end (path))
+	{
+		if (it != std::begin (path) && *it == '/' && *std::prev (it) == '/')
+			it = path.erase (it);
+		else
+			++it;
+	}
+
+	return path;
+}
+
+std::string ftp::buildResolvedPath (std::string_view const cwd_, std::string_view const args_)
+{
+	return resolvePath (buildPath (cwd_, args_));
+}
+
+int ftp::fillDirent (IOBuffer &buffer_,
+    ListMode const mode_,
+    MlstFacts const facts_,
+    std::time_t const now_,
+    struct stat const &st_,
+    std::string_view const path_,
+    char const *type_)
+{
+	auto const buffer = buffer_.freeArea ();
+	auto const size   = buffer_.freeSize ();
+
+	std::size_t pos = 0;
+
+	if (mode_ == ListMode::MLSD || mode_ == ListMode::MLST)
+	{
+		if (mode_ == ListMode::MLST)
+		{
+			if (pos >= size)
+				return EAGAIN;
+			buffer[pos++] = ' ';
+		}
+
+		// type fact
+		if (facts_.type)
+		{
+			if (!type_)
+			{
+				type_ = "???";
+				if (S_ISREG (st_.st_mode))
+					type_ = "file";
+				else if (S_ISDIR (st_.st_mode))
+					type_ = "dir";
+#if !defined(__3DS__) && !defined(__SWITCH__)
+				else if (S_ISLNK (st_.st_mode))
+					type_ = "os.unix=symlink";
+				else if (S_ISCHR (st_.st_mode))
+					type_ = "os.unix=character";
+				else if (S_ISBLK (st_.st_mode))
+					type_ = "os.unix=block";
+				else if (S_ISFIFO (st_.st_mode))
+					type_ = "os.unix=fifo";
+				else if (S_ISSOCK (st_.st_mode))
+					type_ = "os.unix=socket";
+#endif
+			}
+
+			auto const rc = std::snprintf (&buffer[pos], size - pos, "Type=%s;", type_);
+			if (rc < 0)
+				return errno;
+			if (static_cast<std::size_t> (rc) > size - pos)
+				return EAGAIN;
+
+			pos += rc;
+		}
+
+		// size fact
+		if (facts_.size)
+		{
+			auto const rc = std::snprintf (&buffer[pos],
+			    size - pos,
+			    "Size=%llu;",
+			    static_cast<unsigned long long> (st_.st_size));
+			if (rc < 0)
+				return errno;
+			if (static_cast<std::size_t> (rc) > size - pos)
+				return EAGAIN;
+
+			pos += rc;
+		}
+
+		// mtime fact
+		if (facts_.modify)
+		{
+			auto const tm = std::gmtime (&st_.st_mtime);
+			if (!tm)
+				return errno;
+
+			auto const rc = std::strftime (&buffer[pos], size - pos, "Modify=%Y%m%d%H%M%S;", tm);
+			if (rc == 0)
+				return EAGAIN;
+
+			pos += rc;
+		}
+
+		// permission fact
+		if (facts_.perm)
+		{
+			auto const header = "Perm=";
+			if (size - pos < std::strlen (header))
+				return EAGAIN;
+
+			std::strcpy (&buffer[pos], header);
+			pos += std::strlen (header);
+
+			// append permission
+			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'a';
+			}
+
+			// create permission
+			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'c';
+			}
+
+			// delete permission
+			if (pos >= size)
+				return EAGAIN;
+			buffer[pos++] = 'd';
+
+			// chdir permission
+			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IXUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'e';
+			}
+
+			// rename permission
+			if (pos >= size)
+				return EAGAIN;
+			buffer[pos++] = 'f';
+
+			// list permission
+			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IRUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'l';
+			}
+
+			// mkdir permission
+			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'm';
+			}
+
+			// purge permission
+			if (S_ISDIR (st_.st_mode) && (st_.st_mode & S_IWUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'p';
+			}
+
+			// read permission
+			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IRUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'r';
+			}
+
+			// write permission
+			if (S_ISREG (st_.st_mode) && (st_.st_mode & S_IWUSR))
+			{
+				if (pos >= size)
+					return EAGAIN;
+				buffer[pos++] = 'w';
+			}
+
+			if (pos >= size)
+				return EAGAIN;
+			buffer[pos++] = ';';
+		}
+
+		// unix mode fact
+		if (facts_.unixMode)
+		{
+			auto const mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
+
+			auto const rc = std::snprintf (&buffer[pos],
+			    size - pos,
+			    "UNIX.mode=0%lo;",
+			    static_cast<unsigned long> (st_.st_mode & mask));
+			if (rc < 0)
+				return errno;
+			if (static_cast<std::size_t> (rc) > size - pos)
+				return EAGAIN;
+
+			pos += rc;
+		}
+
+		// make sure space precedes name
+		if (buffer[pos - 1] != ' ')
+		{
+			if (pos >= size)
+				return EAGAIN;
+
+			buffer[pos++] = ' ';
+		}
+	}
+	else if (mode_ != ListMode::NLST)
+	{
+		if (mode_ == ListMode::STAT)
+		{
+			if (pos >= size)
+				return EAGAIN;
+
+			buffer[pos++] = ' ';
+		}
+
+#ifdef __3DS__
+		auto const owner = "3DS";
+		auto const group = "3DS";
+#elif defined(__SWITCH__)
+		auto const owner = "Switch";
+		auto const group = "Switch";
+#else
+		char owner[32];
+		char group[32];
+		std::sprintf (owner, "%d", st_.st_uid);
+		std::sprintf (group, "%d", st_.st_gid);
+#endif
+		// perms nlinks owner group size
+		auto rc = std::snprintf (&buffer[pos],
+		    size - pos,
+		    "%c%c%c%c%c%c%c%c%c%c %lu %s %s %llu ",
+		    // clang-format off
+		    S_ISREG (st_.st_mode)  ? '-' :
+		    S_ISDIR (st_.st_mode)  ? 'd' :
+#if !defined(__3DS__) && !defined(__SWITCH__)
+		    S_ISLNK (st_.st_mode)  ? 'l' :
+		    S_ISCHR (st_.st_mode)  ? 'c' :
+		    S_ISBLK (st_.st_mode)  ? 'b' :
+		    S_ISFIFO (st_.st_mode) ? 'p' :
+		    S_ISSOCK (st_.st_mode) ? 's' :
+#endif
+		    '?',
+		    // clang-format on
+		    st_.st_mode & S_IRUSR ? 'r' : '-',
+		    st_.st_mode & S_IWUSR ? 'w' : '-',
+		    st_.st_mode & S_IXUSR ? 'x' : '-',
+		    st_.st_mode & S_IRGRP ? 'r' : '-',
+		    st_.st_mode & S_IWGRP ? 'w' : '-',
+		    st_.st_mode & S_IXGRP ? 'x' : '-',
+		    st_.st_mode & S_IROTH ? 'r' : '-',
+		    st_.st_mode & S_IWOTH ? 'w' : '-',
+		    st_.st_mode & S_IXOTH ? 'x' : '-',
+		    static_cast<unsigned long> (st_.st_nlink),
+		    owner,
+		    group,
+		    static_cast<unsigned long long> (st_.st_size));
+		if (rc < 0)
+			return errno;
+
+		if (static_cast<std::size_t> (rc) > size - pos)
+			return EAGAIN;
+
+		pos += rc;
+
+		// timestamp
+		auto const tm = std::gmtime (&st_.st_mtime);
+		if (!tm)
+			return errno;
+
+		auto fmt = "%b %e %Y ";
+		if (now_ > st_.st_mtime && now_ - st_.st_mtime < (60 * 60 * 24 * 365 / 2))
+			fmt = "%b %e %H:%M ";
+		rc = std::strftime (&buffer[pos], size - pos, fmt, tm);
+		if (rc < 0)
+			return errno;
+		if (static_cast<std::size_t> (rc) > size - pos)
+			return EAGAIN;
+
+		pos += rc;
+	}
+
+	if (size - pos < path_.size () + 2)
+		return EAGAIN;
+
+	// path
+	std::memcpy (&buffer[pos], path_.data (), path_.size ());
+	pos += path_.size ();
+	buffer[pos++] = '\r';
+	buffer[pos++] = '\n';
+
+	buffer_.markUsed (pos);
+
+	return 0;
+}
+
+void ftp::appendFormat (std::string &out_, char const *const fmt_, ...)
+{
+	char buffer[256];
+
+	va_list ap;
+	va_start (ap, fmt_);
+	auto const rc = std::vsnprintf (buffer, sizeof (buffer), fmt_, ap);
+	va_end (ap);
+
+	if (rc < 0)
+		return;
+
+	if (static_cast<std::size_t> (rc) < sizeof (buffer))
+	{
+		out_.append (buffer, rc);
+		return;
+	}
+
+	// too long for the stack buffer; format in place
+	auto const pos = out_.size ();
+	out_.resize (pos + rc + 1);
+
+	va_start (ap, fmt_);
+	std::vsnprintf (&out_[pos], rc + 1, fmt_, ap);
+	va_end (ap);
+
+	out_.resize (pos + rc);
+}
+
+void ftp::appendJsonString (std::string &out_, std::string_view const str_)
+{
+	out_.push_back ('"');
+
+	for (auto const c : str_)
+	{
+		switch (c)
+		{
+		case '"':
+			out_ += "\\\"";
+			break;
+
+		case '\\':
+			out_ += "\\\\";
+			break;
+
+		case '\n':
+			out_ += "\\n";
+			break;
+
+		case '\r':
+			out_ += "\\r";
+			break;
+
+		case '\t':
+			out_ += "\\t";
+			break;
+
+		default:
+			if (static_cast<unsigned char> (c) < 0x20)
+				appendFormat (out_, "\\u%04x", static_cast<unsigned char> (c));
+			else
+				out_.push_back (c);
+			break;
+		}
+	}
+
+	out_.push_back ('"');
+}
@@ -24,6 +24,7 @@
 
 #include <cassert>
 #include <cstring>
+#include <utility>
 
 ///////////////////////////////////////////////////////////////////////////
 IOBuffer::~IOBuffer () = default;
@@ -90,6 +91,26 @@ std::size_t IOBuffer::capacity () const
 	return m_size;
 }
 
+void IOBuffer::resize (std::size_t const size_)
+{
+	assert (size_ > 0);
+	assert (size_ >= usedSize ());
+
+	if (size_ == m_size)
+		return;
+
+	auto buffer = std::make_unique<char[]> (size_);
+
+	auto const size = m_end - m_start;
+	if (size != 0)
+		std::memcpy (&buffer[0], &m_buffer[m_start], size);
+
+	m_buffer = std::move (buffer);
+	m_size   = size_;
+	m_start  = 0;
+	m_end    = size;
+}
+
 void IOBuffer::clear ()
 {
 	m_start = 0;
@@ -0,0 +1,135 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "latencyHistogram.h"
+
+#include "ftpUtil.h"
+
+#include <algorithm>
+#include <bit>
+#include <cinttypes>
+#include <cmath>
+
+///////////////////////////////////////////////////////////////////////////
+void LatencyHistogram::record (std::uint64_t const value_)
+{
+	auto &bucket = m_buckets[LatencyHistogram::bucket (value_)];
+	if (bucket != UINT32_MAX)
+		++bucket;
+
+	++m_count;
+	m_total += value_;
+	m_max = std::max (m_max, value_);
+}
+
+std::uint64_t LatencyHistogram::count () const
+{
+	return m_count;
+}
+
+std::uint64_t LatencyHistogram::total () const
+{
+	return m_total;
+}
+
+std::uint64_t LatencyHistogram::max () const
+{
+	return m_max;
+}
+
+std::uint64_t LatencyHistogram::percentile (double const percentile_) const
+{
+	std::uint64_t total = 0;
+	for (auto const count : m_buckets)
+		total += count;
+
+	if (!total)
+		return 0;
+
+	auto const fraction = std::clamp (percentile_, 0.0, 100.0) / 100;
+	auto const target   = std::max<std::uint64_t> (1, std::ceil (total * fraction));
+
+	std::uint64_t seen = 0;
+	for (std::size_t i = 0; i < BUCKETS; ++i)
+	{
+		seen += m_buckets[i];
+		if (seen >= target)
+			return std::min (upperBound (i), m_max);
+	}
+
+	return m_max;
+}
+
+void LatencyHistogram::write (std::string &out_) const
+{
+	ftp::appendFormat (out_,
+	    "\"count\":%" PRIu64 ",\"mean_ns\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p90_ns\":%" PRIu64
+	    ",\"p99_ns\":%" PRIu64 ",\"p999_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 ",\"buckets\":[",
+	    m_count,
+	    m_count ? m_total / m_count : 0,
+	    percentile (50),
+	    percentile (90),
+	    percentile (99),
+	    percentile (99.9),
+	    m_max);
+
+	bool first = true;
+	for (std::size_t i = 0; i < BUCKETS; ++i)
+	{
+		if (!m_buckets[i])
+			continue;
+
+		ftp::appendFormat (
+		    out_, "%s[%" PRIu64 ",%" PRIu32 "]", first ? "" : ",", upperBound (i), m_buckets[i]);
+		first = false;
+	}
+
+	out_ += ']';
+}
+
+std::size_t LatencyHistogram::bucket (std::uint64_t const value_)
+{
+	constexpr auto limit = (std::uint64_t{1} << MAX_BITS) - 1;
+	auto const value     = std::min (value_, limit);
+
+	// values below 2^SUB_BITS get exact buckets
+	if (value < (1u << SUB_BITS))
+		return value;
+
+	// the bits after the leading one select the linear sub-bucket
+	unsigned const exponent = std::bit_width (value) - 1;
+	auto const sub          = (value >> (exponent - SUB_BITS)) & ((1u << SUB_BITS) - 1);
+
+	return ((exponent - SUB_BITS + 1) << SUB_BITS) + sub;
+}
+
+std::uint64_t LatencyHistogram::upperBound (std::size_t const bucket_)
+{
+	if (bucket_ < (1u << SUB_BITS))
+		return bucket_;
+
+	auto const group = bucket_ >> SUB_BITS;
+	auto const sub   = bucket_ & ((1u << SUB_BITS) - 1);
+	auto const width = std::uint64_t{1} << (group - 1);
+
+	return (static_cast<std::uint64_t> ((1u << SUB_BITS) + sub) << (group - 1)) + width - 1;
+}
@@ -0,0 +1,240 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "platform.h"
+
+#include "log.h"
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+using namespace std::chrono_literals;
+
+namespace
+{
+/// \brief How long the main thread sleeps between log flushes
+constexpr auto LOG_INTERVAL = 250ms;
+
+/// \brief Signals handled by the main thread
+sigset_t s_signals;
+
+/// \brief Whether SIGHUP was received since the last reloadRequested ()
+bool s_reload = false;
+}
+
+bool platform::init ()
+{
+	sigemptyset (&s_signals);
+	sigaddset (&s_signals, SIGINT);
+	sigaddset (&s_signals, SIGTERM);
+	sigaddset (&s_signals, SIGHUP);
+#if FTPD_TRACE
+	// dump the trace from outside, e.g. while a client is stalled
+	sigaddset (&s_signals, SIGUSR2);
+#endif
+
+	// block these before any thread is started so they are only consumed by loop ()
+	auto const rc = pthread_sigmask (SIG_BLOCK, &s_signals, nullptr);
+	if (rc != 0)
+	{
+		std::fprintf (stderr, "pthread_sigmask: %s\n", std::strerror (rc));
+		return false;
+	}
+
+	// peers closing mid-transfer must not kill the daemon
+	std::signal (SIGPIPE, SIG_IGN);
+
+	return true;
+}
+
+bool platform::networkVisible ()
+{
+	return true;
+}
+
+bool platform::networkAddress (SockAddr &addr_)
+{
+	sockaddr_in addr;
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl (INADDR_ANY);
+
+	addr_ = addr;
+	return true;
+}
+
+std::string const &platform::hostname ()
+{
+	static std::string hostname;
+	if (hostname.empty ())
+	{
+		std::string buffer (256, '\0');
+		gethostname (buffer.data (), buffer.size ());
+
+		if (buffer.back () == 0) // check for truncation
+		{
+			hostname = std::move (buffer);
+			hostname.resize (std::strlen (hostname.data ()));
+		}
+	}
+
+	return hostname;
+}
+
+bool platform::loop ()
+{
+	// sleep until a signal arrives or the log needs flushing; nothing is drawn
+	timespec timeout;
+	timeout.tv_sec  = 0;
+	timeout.tv_nsec = std::chrono::nanoseconds (LOG_INTERVAL).count ();
+
+	auto const signal = sigtimedwait (&s_signals, nullptr, &timeout);
+	switch (signal)
+	{
+	case SIGINT:
+	case SIGTERM:
+		info ("Received %s, shutting down\n", strsignal (signal));
+		return false;
+
+	case SIGHUP:
+		s_reload = true;
+		break;
+
+#if FTPD_TRACE
+	case SIGUSR2:
+		trace::requestDump ();
+		break;
+#endif
+
+	default:
+		if (signal < 0 && errno != EAGAIN && errno != EINTR)
+		{
+			std::fprintf (stderr, "sigtimedwait: %s\n", std::strerror (errno));
+			return false;
+		}
+		break;
+	}
+
+	return true;
+}
+
+bool platform::reloadRequested ()
+{
+	auto const reload = s_reload;
+	s_reload          = false;
+	return reload;
+}
+
+void platform::render ()
+{
+}
+
+void platform::exit ()
+{
+	// flush whatever was logged during shutdown
+	drawLog ();
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// \brief Platform thread pimpl
+class platform::Thread::privateData_t
+{
+public:
+	privateData_t () = default;
+
+	/// \brief Parameterized constructor
+	/// \param func_ Thread entry point
+	privateData_t (std::function<void ()> &&func_) : thread (std::move (func_))
+	{
+	}
+
+	/// \brief Underlying thread object
+	std::thread thread;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::Thread::~Thread () = default;
+
+platform::Thread::Thread () : m_d (new privateData_t ())
+{
+}
+
+platform::Thread::Thread (std::function<void ()> &&func_)
+    : m_d (new privateData_t (std::move (func_)))
+{
+}
+
+platform::Thread::Thread (Thread &&that_) : m_d (new privateData_t ())
+{
+	std::swap (m_d, that_.m_d);
+}
+
+platform::Thread &platform::Thread::operator= (Thread &&that_)
+{
+	std::swap (m_d, that_.m_d);
+	return *this;
+}
+
+void platform::Thread::join ()
+{
+	m_d->thread.join ();
+}
+
+void platform::Thread::sleep (std::chrono::milliseconds const timeout_)
+{
+	std::this_thread::sleep_for (timeout_);
+}
+
+///////////////////////////////////////////////////////////////////////////
+/// \brief Platform mutex pimpl
+class platform::Mutex::privateData_t
+{
+public:
+	/// \brief Underlying mutex
+	std::mutex mutex;
+};
+
+///////////////////////////////////////////////////////////////////////////
+platform::Mutex::~Mutex () = default;
+
+platform::Mutex::Mutex () : m_d (new privateData_t ())
+{
+}
+
+void platform::Mutex::lock ()
+{
+	m_d->mutex.lock ();
+}
+
+void platform::Mutex::unlock ()
+{
+	m_d->mutex.unlock ();
+}
@@ -23,6 +23,7 @@
 #include "platform.h"
 
 #include "ftpServer.h"
+#include "trace.h"
 
 #include <imgui.h>
 
@@ -33,6 +34,7 @@
 
 #include <unistd.h>
 
+#include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <memory>
@@ -89,6 +91,11 @@ void APIENTRY logCallback (GLenum const source_,
 
 bool platform::init ()
 {
+#if FTPD_TRACE
+	// dump the trace from outside, e.g. while a client is stalled
+	std::signal (SIGUSR2, [] (int) { trace::requestDump (); });
+#endif
+
 	// initialize GLFW
 	if (!glfwInit ())
 	{
@@ -28,23 +28,50 @@
 #include <imgui.h>
 #endif
 
-#include <mutex>
-#include <ranges>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <vector>
 
 namespace
 {
-#ifdef __3DS__
+#if defined(__NDS__)
+/// \brief Number of ring slots
+constexpr std::size_t LOG_SLOTS = 256;
+/// \brief Maximum number of log messages to keep
+constexpr auto MAX_LOGS = 250;
+#elif defined(__3DS__)
+/// \brief Number of ring slots
+constexpr std::size_t LOG_SLOTS = 1024;
 /// \brief Maximum number of log messages to keep
 constexpr auto MAX_LOGS = 250;
 #else
+/// \brief Number of ring slots
+constexpr std::size_t LOG_SLOTS = 16384;
 /// \brief Maximum number of log messages to keep
 constexpr auto MAX_LOGS = 10000;
 #endif
 
-#ifdef CLASSIC
-bool s_logUpdated = true;
-#endif
+/// \brief Ring slot size
+constexpr std::size_t SLOT_SIZE = 128;
+
+/// \brief Maximum message size; longer messages are truncated
+constexpr std::size_t MAX_MESSAGE = 1024;
+
+/// \brief Maximum getLog size
+constexpr std::size_t MAX_GET_LOG = 1024 * 1024;
+
+/// \brief Sequence bit set while a slot is being written
+constexpr std::uint64_t WRITING = UINT64_C (1) << 63;
+
+/// \brief Sequence bit set when the slot's ticket was dropped
+constexpr std::uint64_t DROPPED = UINT64_C (1) << 62;
+
+/// \brief Sequence bits holding the ticket
+constexpr std::uint64_t TICKET = ~(WRITING | DROPPED);
 
 /// \brief Message prefix
 static char const *const s_prefix[] = {
@@ -55,6 +82,28 @@ static char const *const s_prefix[] = {
     [RESPONSE] = "[RESPONSE]",
 };
 
+/// \brief Ring slot
+/// A message occupies one or more consecutive slots. Each slot is a seqlock: the writer sets the
+/// WRITING bit, fills the slot, then publishes its ticket + 1. A producer that finds the slot still
+/// being written by an older ticket marks its own ticket DROPPED instead, so readers skip it.
+struct Slot
+{
+	/// \brief Ticket + 1 once published, ticket | WRITING while being written, or ticket | DROPPED
+	/// (with WRITING until the older writer finishes) if the ticket's part was dropped
+	std::atomic<std::uint64_t> sequence = 0;
+	/// \brief Bytes of text in this slot
+	std::uint16_t size;
+	/// \brief Log level
+	std::uint8_t level;
+	/// \brief Number of slots in the message; 0 for a continuation slot
+	std::uint8_t parts;
+	/// \brief Message text
+	char text[SLOT_SIZE - sizeof (std::atomic<std::uint64_t>) - 4];
+};
+
+static_assert (sizeof (Slot) == SLOT_SIZE);
+static_assert ((MAX_MESSAGE + sizeof (Slot::text) - 1) / sizeof (Slot::text) < LOG_SLOTS / 4);
+
 /// \brief Log message
 struct Message
 {
@@ -72,28 +121,222 @@ struct Message
 	std::string message;
 };
 
-/// \brief Log messages
-std::vector<Message> s_messages;
+/// \brief Mask of recorded log levels
+std::atomic<unsigned> s_enabled = ~0u;
 
-#ifndef __NDS__
-/// \brief Log lock
-platform::Mutex s_lock;
-#endif
+/// \brief Log ring; producers never block and overwrite the oldest slots
+Slot s_slots[LOG_SLOTS];
+
+/// \brief Next ticket to hand out
+std::atomic<std::uint64_t> s_head = 0;
+
+/// \brief Number of messages dropped by lapped producers
+std::atomic<std::uint64_t> s_dropped = 0;
+
+/// \brief s_dropped as last reported by drawLog (UI thread only)
+std::uint64_t s_drawDropped = 0;
+
+/// \brief Messages read by drawLog (UI thread only)
+std::deque<Message> s_messages;
+
+/// \brief Next ticket for drawLog to read (UI thread only)
+std::uint64_t s_drawTail = 0;
+
+/// \brief Publish a message to the ring
+/// \param level_ Log level
+/// \param data_ Message text
+/// \param size_ Message size
+void publish (LogLevel const level_, char const *const data_, std::size_t size_)
+{
+	constexpr auto TEXT_SIZE = sizeof (Slot::text);
+
+	size_            = std::min (size_, MAX_MESSAGE);
+	auto const parts = std::max<std::size_t> ((size_ + TEXT_SIZE - 1) / TEXT_SIZE, 1);
+
+	auto const ticket = s_head.fetch_add (parts, std::memory_order_relaxed);
+	auto dropped      = false;
+	for (std::size_t i = 0; i < parts; ++i)
+	{
+		auto &slot     = s_slots[(ticket + i) % LOG_SLOTS];
+		auto sequence  = slot.sequence.load (std::memory_order_relaxed);
+		auto const own = (ticket + i) | WRITING;
+
+		auto claimed = false;
+		while (true)
+		{
+			auto const owner = (sequence & (WRITING | DROPPED)) ? sequence & TICKET : sequence - 1;
+
+			// we were lapped and a newer ticket owns the slot
+			if (sequence != 0 && owner >= ticket + i)
+				break;
+
+			// an older producer that was lapped is still writing the slot; rather than
+			// interleave with it, mark our part dropped so readers skip it
+			if (sequence & WRITING)
+			{
+				if (slot.sequence.compare_exchange_weak (
+				        sequence, (ticket + i) | WRITING | DROPPED, std::memory_order_relaxed))
+					break;
+				continue;
+			}
+
+			if (slot.sequence.compare_exchange_weak (
+			        sequence, own, std::memory_order_relaxed))
+			{
+				claimed = true;
+				break;
+			}
+		}
+
+		if (!claimed)
+		{
+			dropped = true;
+			continue;
+		}
+		std::atomic_thread_fence (std::memory_order_release);
+
+		auto const offset = i * TEXT_SIZE;
+		auto const size   = std::min (size_ - offset, TEXT_SIZE);
+
+		slot.size  = size;
+		slot.level = level_;
+		slot.parts = i == 0 ? parts : 0;
+		std::memcpy (slot.text, data_ + offset, size);
+
+		// replace nul-characters with ? to avoid truncation
+		std::replace (slot.text, slot.text + size, '\0', '?');
+
+		sequence = own;
+		if (slot.sequence.compare_exchange_strong (
+		        sequence, ticket + i + 1, std::memory_order_release, std::memory_order_relaxed))
+			continue;
+
+		// a newer ticket dropped its part while we wrote; hand the slot over to it
+		dropped = true;
+		while (!slot.sequence.compare_exchange_weak (
+		    sequence, sequence & ~WRITING, std::memory_order_release, std::memory_order_relaxed))
+			;
+	}
+
+	if (dropped)
+		s_dropped.fetch_add (1, std::memory_order_relaxed);
 }
 
-void drawLog ()
+/// \brief Classify a slot for a reader
+/// \param sequence_ Slot sequence
+/// \param ticket_ Ticket the reader expects
+/// \returns 1 if published for ticket_, -1 if taken by a newer ticket, or 0 if not published yet
+int classify (std::uint64_t const sequence_, std::uint64_t const ticket_)
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
+	if (sequence_ == ticket_ + 1)
+		return 1;
 
-#ifdef CLASSIC
-	if (!s_logUpdated)
-		return;
+	if (sequence_ == 0)
+		return 0;
 
-	s_logUpdated = false;
-#endif
+	// nothing will be published for a dropped ticket
+	if (sequence_ & DROPPED)
+		return (sequence_ & TICKET) >= ticket_ ? -1 : 0;
+
+	auto const owner = (sequence_ & WRITING) ? sequence_ & TICKET : sequence_ - 1;
+	return owner > ticket_ ? -1 : 0;
+}
+
+/// \brief Copy a message out of the ring
+/// \param ticket_ Ticket of the message's first slot
+/// \param level_ Output log level
+/// \param buffer_ Output buffer of at least MAX_MESSAGE bytes
+/// \param size_ Output message size
+/// \returns Number of slots read if the message was copied, the negated number of slots to skip
+/// if it was overwritten or is incomplete, or 0 if it isn't published yet
+long readMessage (std::uint64_t const ticket_,
+    LogLevel &level_,
+    char *const buffer_,
+    std::size_t &size_)
+{
+	auto const &first = s_slots[ticket_ % LOG_SLOTS];
+	auto const state  = classify (first.sequence.load (std::memory_order_acquire), ticket_);
+	if (state <= 0)
+		return state;
+
+	long const parts = first.parts;
+	level_           = static_cast<LogLevel> (first.level);
+	if (parts == 0)
+		return -1; // continuation of a message whose start was overwritten
+
+	size_ = 0;
+	for (long i = 0; i < parts; ++i)
+	{
+		auto const &slot = s_slots[(ticket_ + i) % LOG_SLOTS];
+
+		auto const sequence = slot.sequence.load (std::memory_order_acquire);
+		auto const state    = classify (sequence, ticket_ + i);
+		if (state <= 0)
+			return state < 0 ? -parts : 0;
+
+		auto const size = std::min<std::size_t> (slot.size, MAX_MESSAGE - size_);
+		std::memcpy (buffer_ + size_, slot.text, size);
+
+		// the slot may have been reused while it was copied
+		std::atomic_thread_fence (std::memory_order_acquire);
+		if (slot.sequence.load (std::memory_order_relaxed) != sequence)
+			return -parts;
+
+		size_ += size;
+	}
+
+	// the first slot's header was read before its parts were validated
+	if (first.sequence.load (std::memory_order_relaxed) != ticket_ + 1)
+		return -parts;
+
+	return parts;
+}
+
+/// \brief Read newly published messages into s_messages
+/// \param maxLogs_ Maximum number of messages to keep
+/// \returns Whether any messages were read
+bool readNew (std::size_t const maxLogs_)
+{
+	auto const head = s_head.load (std::memory_order_acquire);
+	if (head - s_drawTail > LOG_SLOTS)
+		s_drawTail = head - LOG_SLOTS;
+
+	char buffer[MAX_MESSAGE];
+	auto updated = false;
+	while (s_drawTail < head)
+	{
+		LogLevel level;
+		std::size_t size;
+		auto const rc = readMessage (s_drawTail, level, buffer, size);
+		if (rc == 0)
+			break; // wait for the producer; if it never finishes, it is lapped and skipped above
+
+		s_drawTail += rc < 0 ? -rc : rc;
+		if (rc < 0)
+			continue;
+
+		s_messages.emplace_back (level, std::string (buffer, size));
+		updated = true;
+	}
+
+	auto const dropped = s_dropped.load (std::memory_order_relaxed);
+	if (dropped != s_drawDropped)
+	{
+		s_messages.emplace_back (ERROR,
+		    "Dropped " + std::to_string (dropped - s_drawDropped) + " log messages\n");
+		s_drawDropped = dropped;
+		updated       = true;
+	}
+
+	while (s_messages.size () > maxLogs_)
+		s_messages.pop_front ();
 
+	return updated;
+}
+}
+
+void drawLog ()
+{
 	auto const maxLogs =
 #ifdef CLASSIC
 	    g_logConsole.windowHeight;
@@ -101,14 +344,10 @@ void drawLog ()
 	    MAX_LOGS;
 #endif
 
-	if (s_messages.size () > static_cast<unsigned> (maxLogs))
-	{
-		auto const begin = std::begin (s_messages);
-		auto const end   = std::next (begin, s_messages.size () - maxLogs);
-		s_messages.erase (begin, end);
-	}
-
 #ifdef CLASSIC
+	if (!readNew (maxLogs))
+		return;
+
 	char const *const s_colors[] = {
 	    [DEBUG]    = "\x1b[33;1m", // yellow
 	    [INFO]     = "\x1b[37;1m", // white
@@ -117,20 +356,38 @@ void drawLog ()
 	    [RESPONSE] = "\x1b[36;1m", // cyan
 	};
 
-	auto it = std::begin (s_messages);
-	if (s_messages.size () > static_cast<unsigned> (g_logConsole.windowHeight))
-		it = std::next (it, s_messages.size () - g_logConsole.windowHeight);
-
 	consoleSelect (&g_logConsole);
-	while (it != std::end (s_messages))
+	for (auto const &message : s_messages)
 	{
-		std::fputs (s_colors[it->level], stdout);
-		std::fputs (it->message.c_str (), stdout);
-		++it;
+		std::fputs (s_colors[message.level], stdout);
+		std::fputs (message.message.c_str (), stdout);
 	}
 	std::fflush (stdout);
 	s_messages.clear ();
+#elif FTPD_HEADLESS
+	if (!readNew (maxLogs))
+		return;
+
+	// one line per message, so the output suits journald and log files; stdout is left to
+	// tools that embed the server, like the benchmarks' reports
+	for (auto const &message : s_messages)
+	{
+		auto const &text = message.message;
+		auto size        = text.size ();
+		while (size > 0 && (text[size - 1] == '\n' || text[size - 1] == '\r'))
+			--size;
+
+		std::fprintf (stderr,
+		    "%s %.*s\n",
+		    s_prefix[message.level],
+		    static_cast<int> (size),
+		    text.data ());
+	}
+	std::fflush (stderr);
+	s_messages.clear ();
 #else
+	readNew (maxLogs);
+
 	ImVec4 const s_colors[] = {
 	    [DEBUG]    = ImVec4 (1.0f, 1.0f, 0.4f, 1.0f),          // yellow
 	    [INFO]     = ImGui::GetStyleColorVec4 (ImGuiCol_Text), // normal
@@ -157,36 +414,59 @@ void drawLog ()
 #ifndef CLASSIC
 std::string getLog ()
 {
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
-
-	if (s_messages.empty ())
-		return {};
+	auto const head = s_head.load (std::memory_order_acquire);
+	auto ticket     = head > LOG_SLOTS ? head - LOG_SLOTS : 0;
 
-	std::vector<Message const *> stack;
-	stack.reserve (s_messages.size ());
+	std::string log;
+	std::vector<std::size_t> starts;
 
-	std::size_t size = 0;
-	for (auto const &msg : s_messages | std::views::reverse)
+	char buffer[MAX_MESSAGE];
+	while (ticket < head)
 	{
-		if (size + msg.message.size () > 1024 * 1024)
-			break;
-
-		size += msg.message.size ();
-		stack.emplace_back (&msg);
+		LogLevel level;
+		std::size_t size;
+		auto const rc = readMessage (ticket, level, buffer, size);
+		if (rc <= 0)
+		{
+			ticket += rc < 0 ? -rc : 1;
+			continue;
+		}
+
+		ticket += rc;
+		starts.emplace_back (log.size ());
+		log.append (buffer, size);
 	}
 
-	std::string log;
-	log.reserve (size);
-
-	for (auto const &msg : stack | std::views::reverse)
-		log += msg->message;
+	if (log.size () > MAX_GET_LOG)
+	{
+		// keep the newest messages that fit
+		auto const it = std::lower_bound (
+		    std::begin (starts), std::end (starts), log.size () - MAX_GET_LOG);
+		log.erase (0, it == std::end (starts) ? log.size () : *it);
+	}
 
 	return log;
 }
 #endif
 
+void setLogEnabled (LogLevel const level_, bool const enable_)
+{
+	if (enable_)
+		s_enabled.fetch_or (1u << level_, std::memory_order_relaxed);
+	else
+		s_enabled.fetch_and (~(1u << level_), std::memory_order_relaxed);
+}
+
+bool logEnabled (LogLevel const level_)
+{
+#ifdef NDEBUG
+	if (level_ == DEBUG)
+		return false;
+#endif
+
+	return s_enabled.load (std::memory_order_relaxed) & (1u << level_);
+}
+
 void debug (char const *const fmt_, ...)
 {
 #ifndef NDEBUG
@@ -238,55 +518,33 @@ void response (char const *const fmt_, ...)
 
 void addLog (LogLevel const level_, char const *const fmt_, va_list ap_)
 {
-#ifdef NDEBUG
-	if (level_ == DEBUG)
+	if (!logEnabled (level_))
 		return;
-#endif
 
 #ifndef __NDS__
 	thread_local
 #endif
-	    static char buffer[1024];
+	    static char buffer[MAX_MESSAGE];
 
-	std::vsnprintf (buffer, sizeof (buffer), fmt_, ap_);
+	auto const rc = std::vsnprintf (buffer, sizeof (buffer), fmt_, ap_);
+	if (rc < 0)
+		return;
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
 #ifndef NDEBUG
 	// std::fprintf (stderr, "%s", s_prefix[level_]);
 	// std::fputs (buffer, stderr);
 #endif
-	s_messages.emplace_back (level_, buffer);
-#ifdef CLASSIC
-	s_logUpdated = true;
-#endif
+	publish (level_, buffer, std::min<std::size_t> (rc, sizeof (buffer) - 1));
 }
 
 void addLog (LogLevel const level_, std::string_view const message_)
 {
-#ifdef NDEBUG
-	if (level_ == DEBUG)
+	if (!logEnabled (level_))
 		return;
-#endif
-
-	auto msg = std::string (message_);
-	for (auto &c : msg)
-	{
-		// replace nul-characters with ? to avoid truncation
-		if (c == '\0')
-			c = '?';
-	}
 
-#ifndef __NDS__
-	auto const lock = std::scoped_lock (s_lock);
-#endif
 #ifndef NDEBUG
 	// std::fprintf (stderr, "%s", s_prefix[level_]);
-	// std::fwrite (msg.data (), 1, msg.size (), stderr);
-#endif
-	s_messages.emplace_back (level_, msg);
-#ifdef CLASSIC
-	s_logUpdated = true;
+	// std::fwrite (message_.data (), 1, message_.size (), stderr);
 #endif
+	publish (level_, message_.data (), message_.size ());
 }
@@ -24,7 +24,12 @@
 
 #include "ftpServer.h"
 
-#ifndef CLASSIC
+#if FTPD_HEADLESS
+#include "ftpConfig.h"
+#include "log.h"
+
+#include <getopt.h>
+#elif !defined(CLASSIC)
 #include <imgui.h>
 
 #include <curl/curl.h>
@@ -32,7 +37,180 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <optional>
+#include <string>
+
+#if FTPD_HEADLESS
+namespace
+{
+/// \brief Command-line settings
+/// \note These override the config file, on startup and on every reload
+struct Options
+{
+	/// \brief Config file path
+	std::string config = FTPDCONFIG;
+
+	/// \brief User
+	std::optional<std::string> user;
+
+	/// \brief Listen port
+	std::optional<std::string> port;
+
+	/// \brief Deflate level
+	std::optional<std::string> deflateLevel;
+
+	/// \brief Whether to stop logging commands and responses
+	bool quiet = false;
+};
+
+/// \brief Print usage
+/// \param fp_ Output stream
+/// \param argv0_ Program name
+void usage (std::FILE *const fp_, char const *const argv0_)
+{
+	std::fprintf (fp_,
+	    "Usage: %s [OPTIONS]\n"
+	    "\n"
+	    "Options:\n"
+	    "  -c, --config PATH       Config file (default " FTPDCONFIG ")\n"
+	    "  -p, --port PORT         Listen port\n"
+	    "  -u, --user NAME         Username\n"
+	    "  -z, --deflate LEVEL     Deflate level\n"
+	    "  -q, --quiet             Don't log commands and responses\n"
+	    "  -h, --help              Show this help\n"
+	    "  -V, --version           Show version\n"
+	    "\n"
+	    "SIGINT/SIGTERM shut down; SIGHUP reloads the config file.\n",
+	    argv0_);
+}
+
+/// \brief Parse command line
+/// \param[out] options_ Parsed options
+/// \param argc_ Argument count
+/// \param argv_ Arguments
+/// \returns Exit status if the program should exit
+std::optional<int> parseOptions (Options &options_, int const argc_, char *argv_[])
+{
+	static option const longOptions[] = {
+	    {"config", required_argument, nullptr, 'c'},
+	    {"port", required_argument, nullptr, 'p'},
+	    {"user", required_argument, nullptr, 'u'},
+	    {"deflate", required_argument, nullptr, 'z'},
+	    {"quiet", no_argument, nullptr, 'q'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {"version", no_argument, nullptr, 'V'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	// validate values up front rather than on every reload
+	auto const check = FtpConfig::create ();
+
+	int c;
+	while ((c = getopt_long (argc_, argv_, "c:p:u:z:qhV", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'c':
+			options_.config = optarg;
+			break;
+
+		case 'p':
+			if (!check->setPort (optarg))
+			{
+				std::fprintf (stderr, "%s: invalid port '%s'\n", argv_[0], optarg);
+				return EXIT_FAILURE;
+			}
+			options_.port = optarg;
+			break;
+
+		case 'u':
+			options_.user = optarg;
+			break;
+
+		case 'z':
+			if (!check->setDeflateLevel (optarg))
+			{
+				std::fprintf (stderr, "%s: invalid deflate level '%s'\n", argv_[0], optarg);
+				return EXIT_FAILURE;
+			}
+			options_.deflateLevel = optarg;
+			break;
+
+		case 'q':
+			options_.quiet = true;
+			break;
+
+		case 'h':
+			usage (stdout, argv_[0]);
+			return EXIT_SUCCESS;
+
+		case 'V':
+			std::printf ("%s\n", STATUS_STRING);
+			return EXIT_SUCCESS;
+
+		default:
+			usage (stderr, argv_[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc_)
+	{
+		usage (stderr, argv_[0]);
+		return EXIT_FAILURE;
+	}
+
+	return std::nullopt;
+}
+
+/// \brief Load config file and apply command-line settings
+/// \param options_ Command-line settings
+UniqueFtpConfig loadConfig (Options const &options_)
+{
+	auto config = FtpConfig::load (options_.config.c_str ());
+
+	if (options_.user)
+		config->setUser (*options_.user);
+	if (options_.port)
+		config->setPort (*options_.port);
+	if (options_.deflateLevel)
+		config->setDeflateLevel (*options_.deflateLevel);
+
+	if (options_.quiet)
+	{
+		config->setLogCommands (false);
+		config->setLogResponses (false);
+	}
+
+	return config;
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	Options options;
+	if (auto const rc = parseOptions (options, argc_, argv_))
+		return *rc;
 
+	if (!platform::init ())
+		return EXIT_FAILURE;
+
+	auto server = FtpServer::create (loadConfig (options));
+
+	// block on signals between log flushes instead of rendering frames
+	while (!server->quit () && platform::loop ())
+	{
+		if (platform::reloadRequested ())
+			server->reload (loadConfig (options));
+
+		drawLog ();
+	}
+
+	server.reset ();
+
+	platform::exit ();
+}
+#else
 int main ()
 {
 #ifndef CLASSIC
@@ -75,3 +253,4 @@ int main ()
 	curl_global_cleanup ();
 #endif
 }
+#endif
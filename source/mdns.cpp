@@ -6,6 +6,7 @@
 // ftpd implements mdns based on the following:
 // - RFC 1035 (https://datatracker.ietf.org/doc/html/rfc1035)
 // - RFC 6762 (https://datatracker.ietf.org/doc/html/rfc6762)
+// - RFC 6763 (https://datatracker.ietf.org/doc/html/rfc6763)
 //
 // Copyright (C) 2024 Michael Theall
 //
@@ -24,6 +25,7 @@
 
 #include "mdns.h"
 
+#include "allocTrack.h"
 #include "log.h"
 #include "platform.h"
 
@@ -36,6 +38,7 @@
 #include <concepts>
 #include <cstdlib>
 #include <cstring>
+#include <span>
 #include <string>
 #include <type_traits>
 #include <vector>
@@ -48,15 +51,55 @@ static_assert (sizeof (in_addr_t) == 4);
 
 namespace
 {
+/// \brief TTL of host records (A, SRV)
 constexpr auto MDNS_TTL = 120;
 
+/// \brief TTL of service records (PTR, TXT)
+constexpr auto SERVICE_TTL = 4500;
+
+/// \brief Largest mDNS datagram (RFC 6762 section 17)
+constexpr auto MAX_PACKET = 9000;
+
+/// \brief Datagrams drained per wakeup; the rest are read on the next, immediate, wakeup
+constexpr auto MAX_DRAIN = 256;
+
+/// \brief Compression pointers followed per name
+constexpr auto MAX_HOPS = 16;
+
+/// \brief Size of a DNS header
+constexpr auto HEADER_SIZE = 12;
+
+constexpr std::uint16_t TYPE_A   = 1;
+constexpr std::uint16_t TYPE_PTR = 12;
+constexpr std::uint16_t TYPE_TXT = 16;
+constexpr std::uint16_t TYPE_SRV = 33;
+constexpr std::uint16_t TYPE_ANY = 255;
+
+constexpr std::uint16_t CLASS_IN  = 1;
+constexpr std::uint16_t CLASS_ANY = 255;
+
+/// \brief Unicast-response bit of a question class, cache-flush bit of a record class
+constexpr std::uint16_t CLASS_TOP = 1 << 15;
+
 SockAddr const s_multicastAddress{inet_addr ("224.0.0.251"), 5353};
 
 platform::steady_clock::time_point s_lastAnnounce{};
 platform::steady_clock::time_point s_lastProbe{};
 
-std::string s_hostname      = platform::hostname ();
-std::string s_hostnameLocal = s_hostname + ".local";
+/// \brief Hostname setting, as passed to setService
+std::string s_setting;
+
+/// \brief Advertised hostname
+std::string s_hostname;
+
+/// \brief Advertised address
+SockAddr s_addr;
+
+/// \brief Whether setService has run
+bool s_set = false;
+
+/// \brief Whether the prebuilt records are valid
+bool s_ready = false;
 
 enum class State
 {
@@ -71,6 +114,51 @@ enum class State
 
 auto s_state = State::Probe1;
 
+/// \brief Prebuilt records
+enum Record : unsigned
+{
+	HOST_LOCAL, ///< <host>.local A
+	HOST,       ///< <host> A, for clients that leave off .local
+	SERVICES,   ///< _services._dns-sd._udp.local PTR _ftp._tcp.local
+	SERVICE,    ///< _ftp._tcp.local PTR <host>._ftp._tcp.local
+	SRV,        ///< <host>._ftp._tcp.local SRV <port> <host>.local
+	TXT,        ///< <host>._ftp._tcp.local TXT path=/
+	RECORD_COUNT,
+};
+
+/// \brief Prebuilt resource record
+struct ResourceRecord
+{
+	/// \brief Owner name in wire format; empty never matches
+	std::vector<std::uint8_t> name;
+
+	/// \brief Record type
+	std::uint16_t type;
+
+	/// \brief Whole record in wire format
+	std::vector<std::uint8_t> wire;
+};
+
+std::array<ResourceRecord, RECORD_COUNT> s_records;
+
+/// \brief Records announced unsolicited
+constexpr unsigned ANNOUNCED =
+    (1u << HOST_LOCAL) | (1u << SERVICES) | (1u << SERVICE) | (1u << SRV) | (1u << TXT);
+
+/// \brief Records multicast by the last announcement
+unsigned s_announced = 0;
+
+/// \brief Prebuilt probe
+std::vector<std::uint8_t> s_probe;
+
+/// \brief Receive buffer, reused for every datagram
+std::array<std::uint8_t, MAX_PACKET> s_buffer;
+
+/// \brief Response buffer, reused for every response
+std::array<std::uint8_t, MAX_PACKET> s_response;
+
+mdns::Stats s_stats{};
+
 #if __has_cpp_attribute(__cpp_lib_byteswap)
 template <std::integral T>
 using byteswap = std::byteswap<T>;
@@ -94,319 +182,368 @@ constexpr T hton (T const value_) noexcept
 		return byteswap (value_);
 }
 
+/// \brief Append integer in network byte order
+/// \param out_ Buffer to append to
+/// \param value_ Value to append
 template <std::integral T>
-constexpr T ntoh (T const value_) noexcept
+void encode (std::vector<std::uint8_t> &out_, T const value_)
 {
-	if constexpr (std::endian::native == std::endian::big)
-		return value_;
-	else
-		return byteswap (value_);
+	auto const value = hton (value_);
+	auto const p     = reinterpret_cast<std::uint8_t const *> (&value);
+	out_.insert (std::end (out_), p, p + sizeof (T));
 }
 
-template <std::integral T, std::integral U>
-void const *decode (void const *const buffer_, U &size_, T &out_, bool networkToHost_ = true)
+/// \brief Append label
+/// \param out_ Buffer to append to
+/// \param label_ Label to append; may contain dots
+bool encodeLabel (std::vector<std::uint8_t> &out_, std::string_view const label_)
 {
-	if (!buffer_)
-		return nullptr;
-
-	if (size_ < 0 || static_cast<std::make_unsigned_t<T>> (size_) < sizeof (T))
-		return nullptr;
-
-	std::memcpy (&out_, buffer_, sizeof (T));
+	// labels are limited to 63 bytes
+	if (label_.empty () || label_.size () > 0x3F)
+		return false;
 
-	if (networkToHost_)
-		out_ = ntoh (out_);
-
-	size_ -= sizeof (T);
-	return static_cast<std::uint8_t const *> (buffer_) + sizeof (T);
+	encode<std::uint8_t> (out_, label_.size ());
+	out_.insert (std::end (out_), std::begin (label_), std::end (label_));
+	return true;
 }
 
-template <std::integral T>
-void const *decode (void const *buffer_, T &size_, std::string &out_)
+/// \brief Append dotted name, terminated
+/// \param out_ Buffer to append to
+/// \param name_ Name to append
+bool encodeName (std::vector<std::uint8_t> &out_, std::string_view name_)
 {
-	auto p         = static_cast<char const *> (buffer_);
-	auto const end = p + size_;
-
-	std::string result;
-	result.reserve (size_);
-
-	while (p < end && *p)
+	while (!name_.empty ())
 	{
-		auto const len = *p++;
-
-		// punt on compressed labels
-		if (len & 0xC0)
-			return nullptr;
+		auto const pos = name_.find ('.');
+		if (!encodeLabel (out_, name_.substr (0, pos)))
+			return false;
 
-		if (p + len >= end)
-			return nullptr;
-
-		if (!result.empty ())
-			result.push_back ('.');
-
-		result.insert (std::end (result), p, p + len);
-		p += len;
+		name_ = pos == std::string_view::npos ? std::string_view () : name_.substr (pos + 1);
 	}
 
-	++p;
+	out_.emplace_back (0);
 
-	out_ = std::move (result);
+	// names are limited to 255 bytes
+	return out_.size () <= 0xFF;
+}
 
-	size_ = end - p;
-	return p;
+/// \brief Read integer in network byte order
+/// \param in_ Buffer to read from; must hold 2 bytes
+std::uint16_t decode16 (std::uint8_t const *const in_)
+{
+	return static_cast<std::uint16_t> ((in_[0] << 8) | in_[1]);
 }
 
-template <std::integral T, std::integral U>
-void *encode (void *const buffer_, U &size_, T in_, bool hostToNetwork_ = true)
+/// \brief Fold ASCII case
+/// \param c_ Character to fold
+constexpr std::uint8_t lower (std::uint8_t const c_)
 {
-	if (!buffer_)
-		return nullptr;
+	return c_ >= 'A' && c_ <= 'Z' ? c_ - 'A' + 'a' : c_;
+}
 
-	if (size_ < sizeof (T))
-		return nullptr;
+/// \brief Skip over a name
+/// \param packet_ Packet
+/// \param offset_ Offset of name
+/// \returns Offset past the name, or 0 if it is malformed
+std::size_t skipName (std::span<std::uint8_t const> const packet_, std::size_t offset_)
+{
+	while (offset_ < packet_.size ())
+	{
+		auto const len = packet_[offset_];
+		if ((len & 0xC0) == 0xC0)
+			return offset_ + 2 <= packet_.size () ? offset_ + 2 : 0;
 
-	if (hostToNetwork_)
-		in_ = hton (in_);
+		if (len & 0xC0)
+			return 0;
 
-	std::memcpy (buffer_, &in_, sizeof (T));
+		offset_ += 1 + len;
+		if (len == 0)
+			return offset_;
+	}
 
-	size_ -= sizeof (T);
-	return static_cast<std::uint8_t *> (buffer_) + sizeof (T);
+	return 0;
 }
 
-template <std::integral T>
-void *encode (void *const buffer_, T &size_, std::string const &in_)
+/// \brief Compare a name in a packet with a prebuilt name, ignoring ASCII case
+/// \param packet_ Packet
+/// \param offset_ Offset of name, which may be compressed
+/// \param name_ Name in wire format
+bool matchName (std::span<std::uint8_t const> const packet_,
+    std::size_t offset_,
+    std::span<std::uint8_t const> const name_)
 {
-	// names are limited to 255 bytes
-	if (in_.size () > 0xFF)
-		return nullptr;
-
-	auto p         = static_cast<char *> (buffer_);
-	auto const end = p + size_;
-
-	std::string::size_type prev = 0;
-	std::string::size_type pos  = 0;
-	while (p < end && pos != std::string::npos)
+	std::size_t pos = 0;
+	unsigned hops   = 0;
+	while (offset_ < packet_.size () && pos < name_.size ())
 	{
-		pos = in_.find ('.', prev);
+		auto const len = packet_[offset_];
+		if ((len & 0xC0) == 0xC0)
+		{
+			if (offset_ + 1 >= packet_.size () || ++hops > MAX_HOPS)
+				return false;
 
-		auto const label = std::string_view (in_).substr (prev, pos);
+			offset_ = ((len & 0x3F) << 8) | packet_[offset_ + 1];
+			continue;
+		}
 
-		// labels are limited to 63 bytes
-		if (label.size () >= size_ || label.size () > 0x3F)
-			return nullptr;
+		if ((len & 0xC0) || len != name_[pos])
+			return false;
 
-		p = static_cast<char *> (encode<std::uint8_t> (p, size_, label.size ()));
-		if (!p)
-			return nullptr;
+		if (len == 0)
+			return true;
 
-		std::memcpy (p, label.data (), label.size ());
+		if (offset_ + 1 + len > packet_.size () || pos + 1 + len > name_.size ())
+			return false;
 
-		p += label.size ();
+		for (unsigned i = 1; i <= len; ++i)
+		{
+			if (lower (packet_[offset_ + i]) != lower (name_[pos + i]))
+				return false;
+		}
 
-		if (pos != std::string::npos)
-			prev = pos + 1;
+		offset_ += 1 + len;
+		pos += 1 + len;
 	}
 
-	if (p == end)
-		return nullptr;
-
-	*p++ = 0;
+	return false;
+}
 
-	size_ = end - p;
-	return p;
+/// \brief Build record
+/// \param record_ Record to build
+/// \param name_ Owner name in wire format
+/// \param type_ Record type
+/// \param unique_ Whether to set the cache-flush bit
+/// \param ttl_ Record TTL
+/// \param rdata_ Record data
+void build (ResourceRecord &record_,
+    std::vector<std::uint8_t> name_,
+    std::uint16_t const type_,
+    bool const unique_,
+    std::uint32_t const ttl_,
+    std::span<std::uint8_t const> const rdata_)
+{
+	record_.wire = name_;
+	encode<std::uint16_t> (record_.wire, type_);
+	encode<std::uint16_t> (record_.wire, CLASS_IN | (unique_ ? CLASS_TOP : 0));
+	encode<std::uint32_t> (record_.wire, ttl_);
+	encode<std::uint16_t> (record_.wire, rdata_.size ());
+	record_.wire.insert (std::end (record_.wire), std::begin (rdata_), std::end (rdata_));
+
+	record_.name = std::move (name_);
+	record_.type = type_;
 }
 
-struct DNSHeader
+/// \brief Build every record and the probe
+/// \param hostname_ Hostname
+/// \param addr_ Listen address
+bool build (std::string_view const hostname_, SockAddr const &addr_)
 {
-	std::uint16_t id{};
-	std::uint16_t flags{};
-	std::uint16_t qdCount{};
-	std::uint16_t anCount{};
-	std::uint16_t nsCount{};
-	std::uint16_t arCount{};
-
-	template <std::integral T>
-	void const *decode (void const *const buffer_, T &size_)
+	// a hostname may already carry the domain
+	auto host = hostname_;
+	if (host.size () > 6 && host.ends_with (".local"))
+		host.remove_suffix (6);
+
+	std::vector<std::uint8_t> hostLocal;
+	std::vector<std::uint8_t> hostBare;
+	if (!encodeName (hostLocal, host) || hostLocal.size () + 6 > 0xFF)
+		return false;
+	hostLocal.pop_back ();
+	encodeName (hostLocal, "local");
+
+	if (host.size () != hostname_.size () || !encodeName (hostBare, hostname_))
+		hostBare.clear ();
+
+	std::vector<std::uint8_t> service;
+	encodeName (service, "_ftp._tcp.local");
+
+	// the instance name is a single label, dots included
+	std::vector<std::uint8_t> instance;
+	if (!encodeLabel (instance, host.substr (0, 0x3F)))
+		return false;
+	instance.insert (std::end (instance), std::begin (service), std::end (service));
+
+	std::vector<std::uint8_t> services;
+	encodeName (services, "_services._dns-sd._udp.local");
+
+	auto const &in = static_cast<sockaddr_in const &> (addr_).sin_addr.s_addr;
+	auto const a   = std::span (reinterpret_cast<std::uint8_t const *> (&in), sizeof (in));
+
+	std::vector<std::uint8_t> srv;
+	encode<std::uint16_t> (srv, 0); // priority
+	encode<std::uint16_t> (srv, 0); // weight
+	encode<std::uint16_t> (srv, addr_.port ());
+	srv.insert (std::end (srv), std::begin (hostLocal), std::end (hostLocal));
+
+	static std::uint8_t const txt[] = {6, 'p', 'a', 't', 'h', '=', '/'};
+
+	build (s_records[HOST_LOCAL], hostLocal, TYPE_A, true, MDNS_TTL, a);
+	build (s_records[HOST], hostBare, TYPE_A, true, MDNS_TTL, a);
+	build (s_records[SERVICES], services, TYPE_PTR, false, SERVICE_TTL, service);
+	build (s_records[SERVICE], service, TYPE_PTR, false, SERVICE_TTL, instance);
+	build (s_records[SRV], instance, TYPE_SRV, true, MDNS_TTL, srv);
+	build (s_records[TXT], instance, TYPE_TXT, true, SERVICE_TTL, txt);
+
+	// probe both unique names, asking for unicast responses
+	s_probe.clear ();
+	for (auto const value : {0, 0, 2, 0, 0, 0})
+		encode<std::uint16_t> (s_probe, value);
+	for (auto const &name : {hostLocal, instance})
 	{
-		auto in = ::decode (buffer_, size_, id);
-		in      = ::decode (buffer_, size_, flags);
-		in      = ::decode (buffer_, size_, qdCount);
-		in      = ::decode (buffer_, size_, anCount);
-		in      = ::decode (buffer_, size_, nsCount);
-		in      = ::decode (buffer_, size_, arCount);
-
-		return buffer_;
+		s_probe.insert (std::end (s_probe), std::begin (name), std::end (name));
+		encode<std::uint16_t> (s_probe, TYPE_ANY);
+		encode<std::uint16_t> (s_probe, CLASS_IN | CLASS_TOP);
 	}
 
-	template <std::integral T>
-	void *encode (void *buffer_, T &size_)
-	{
-		buffer_ = ::encode (buffer_, size_, id);
-		buffer_ = ::encode (buffer_, size_, flags);
-		buffer_ = ::encode (buffer_, size_, qdCount);
-		buffer_ = ::encode (buffer_, size_, anCount);
-		buffer_ = ::encode (buffer_, size_, nsCount);
-		buffer_ = ::encode (buffer_, size_, arCount);
-
-		return buffer_;
-	}
-};
+	return true;
+}
 
-struct QueryRecord
+/// \brief Build response in s_response
+/// \param id_ Query id
+/// \param answers_ Answer records
+/// \param additional_ Additional records
+/// \returns Response size, or 0 if it doesn't fit
+std::size_t respond (std::uint16_t const id_, unsigned const answers_, unsigned const additional_)
 {
-	std::string qname{};
-	std::uint16_t qtype{};
-	std::uint16_t qclass{};
-
-	template <std::integral T>
-	void const *decode (void const *buffer_, T &size_)
+	auto const header = std::array<std::uint16_t, 6>{id_,
+	    static_cast<std::uint16_t> ((1 << 15) | (1 << 10)), // response/AA
+	    0,
+	    static_cast<std::uint16_t> (std::popcount (answers_)),
+	    0,
+	    static_cast<std::uint16_t> (std::popcount (additional_))};
+
+	std::size_t size = 0;
+	for (auto const value : header)
 	{
-		buffer_ = ::decode (buffer_, size_, qname);
-		buffer_ = ::decode (buffer_, size_, qtype);
-		buffer_ = ::decode (buffer_, size_, qclass);
-
-		return buffer_;
+		s_response[size++] = value >> 8;
+		s_response[size++] = value & 0xFF;
 	}
 
-	template <std::integral T>
-	void *encode (void *buffer_, T &size_)
+	for (auto const mask : {answers_, additional_})
 	{
-		buffer_ = ::encode (buffer_, size_, qname);
-		buffer_ = ::encode (buffer_, size_, qtype);
-		buffer_ = ::encode (buffer_, size_, qclass);
+		for (unsigned i = 0; i < RECORD_COUNT; ++i)
+		{
+			if (!(mask & (1u << i)))
+				continue;
 
-		return buffer_;
+			auto const &wire = s_records[i].wire;
+			if (size + wire.size () > s_response.size ())
+				return 0;
+
+			std::memcpy (&s_response[size], wire.data (), wire.size ());
+			size += wire.size ();
+		}
 	}
-};
 
-struct ResourceRecord
+	return size;
+}
+
+/// \brief Answer one query
+/// \param socket_ mDNS socket
+/// \param packet_ Query
+/// \param srcAddr_ Query source
+void handlePacket (Socket *const socket_,
+    std::span<std::uint8_t const> const packet_,
+    SockAddr const &srcAddr_)
 {
-	std::string rname{};
-	std::uint16_t rtype{};
-	std::uint16_t rclass{};
-	std::uint32_t rttl{};
-	std::uint16_t rlen{};
-	std::vector<std::uint8_t> rdata{};
-
-	template <std::integral T>
-	void const *decode (void const *buffer_, T &size_)
+	// only support IPv4 for now; ignore loopback
+	if (packet_.size () < HEADER_SIZE || srcAddr_.domain () != SockAddr::Domain::IPv4 ||
+	    std::memcmp (&static_cast<sockaddr_in const &> (srcAddr_).sin_addr.s_addr,
+	        &static_cast<sockaddr_in const &> (s_addr).sin_addr.s_addr,
+	        sizeof (in_addr_t)) == 0)
 	{
-		buffer_ = ::decode (buffer_, size_, rname);
-		buffer_ = ::decode (buffer_, size_, rtype);
-		buffer_ = ::decode (buffer_, size_, rclass);
-		buffer_ = ::decode (buffer_, size_, rttl);
-		buffer_ = ::decode (buffer_, size_, rlen);
-
-		return buffer_;
+		++s_stats.ignored;
+		return;
 	}
 
-	template <std::integral T>
-	void *encode (void *buffer_, T &size_)
-	{
-		if (rttl > std::numeric_limits<std::int32_t>::max ())
-			return nullptr;
-
-		buffer_ = ::encode (buffer_, size_, rname);
-		buffer_ = ::encode (buffer_, size_, rtype);
-		buffer_ = ::encode (buffer_, size_, rclass);
-		buffer_ = ::encode (buffer_, size_, rttl);
-		buffer_ = ::encode (buffer_, size_, rlen);
-
-		if (rlen > size_)
-			return nullptr;
+	auto const id      = decode16 (&packet_[0]);
+	auto const flags   = decode16 (&packet_[2]);
+	auto const qdCount = decode16 (&packet_[4]);
 
-		rdata.resize (rlen);
-		std::memcpy (rdata.data (), buffer_, rlen);
-
-		size_ -= rlen;
-		return static_cast<std::uint8_t *> (buffer_) + rlen;
+	// only respond to queries; opcode, truncation, Z and rcode must be clear
+	if (flags & ((1 << 15) | (0xF << 11) | (1 << 10) | (1 << 9) | (1 << 7) | 0x7F))
+	{
+		++s_stats.ignored;
+		return;
 	}
-};
 
-void probe (Socket *const socket_, std::string const &qname_)
-{
-	std::vector<std::uint8_t> response (65536);
-	auto available = response.size ();
+	unsigned answers   = 0;
+	bool preferUnicast = srcAddr_.port () != s_multicastAddress.port ();
 
-	auto out = DNSHeader{.qdCount = 1}.encode (response.data (), available);
-	out      = QueryRecord{.qname = qname_, .qtype = 255, .qclass = 1}.encode (out, available);
+	std::size_t offset = HEADER_SIZE;
+	for (unsigned i = 0; i < qdCount; ++i)
+	{
+		auto const name = offset;
+		offset          = skipName (packet_, offset);
+		if (!offset || offset + 4 > packet_.size ())
+		{
+			++s_stats.ignored;
+			return;
+		}
 
-	if (!out)
-		return;
+		auto const qtype  = decode16 (&packet_[offset]);
+		auto const qclass = decode16 (&packet_[offset + 2]);
+		offset += 4;
 
-	info ("Probe mDNS %s\n", qname_.c_str ());
+		// only accept IN or ANY class
+		if ((qclass & ~CLASS_TOP) != CLASS_IN && (qclass & ~CLASS_TOP) != CLASS_ANY)
+			continue;
 
-	socket_->writeTo (response.data (), response.size () - available, s_multicastAddress);
-	s_lastProbe = platform::steady_clock::now ();
-}
+		for (unsigned r = 0; r < RECORD_COUNT; ++r)
+		{
+			auto const &record = s_records[r];
+			if ((qtype != record.type && qtype != TYPE_ANY) ||
+			    !matchName (packet_, name, record.name))
+				continue;
+
+			answers |= 1u << r;
+			if (qclass & CLASS_TOP)
+				preferUnicast = true;
+		}
+	}
 
-void announce (Socket *const socket_,
-    SockAddr const *srcAddr_,
-    std::uint16_t const id_,
-    std::uint16_t const flags_,
-    QueryRecord const &record_,
-    SockAddr const &addr_)
-{
-	std::vector<std::uint8_t> response (65536);
-	auto available = response.size ();
-
-	// header
-	auto out = encode<std::uint16_t> (response.data (), available, id_);
-	out =
-	    encode<std::uint16_t> (out, available, flags_ | (1 << 15) | (1 << 10)); // mark response/AA
-	out = encode<std::uint16_t> (out, available, 0);
-	out = encode<std::uint16_t> (out, available, 1);
-	out = encode<std::uint16_t> (out, available, 0);
-	out = encode<std::uint16_t> (out, available, 0);
-
-	// answer section
-	out = encode (out, available, record_.qname);
-	out = encode<std::uint16_t> (out, available, record_.qtype);
-	out = encode<std::uint16_t> (out, available, record_.qclass | (1 << 15)); // mark unique/flush
-	out = encode<std::uint32_t> (out, available, MDNS_TTL);
-	out = encode<std::uint16_t> (out, available, sizeof (in_addr_t));
-	out = encode<in_addr_t> (
-	    out, available, static_cast<sockaddr_in const &> (addr_).sin_addr.s_addr, false);
-
-	if (!out)
+	if (!answers)
 		return;
 
-	auto const preferUnicast = srcAddr_ && ((record_.qclass >> 15) & 0x1);
+	++s_stats.answered;
+
+	// save the client a second query for the records it is about to need
+	auto additional = 0u;
+	if (answers & (1u << SERVICE))
+		additional |= (1u << SRV) | (1u << TXT) | (1u << HOST_LOCAL);
+	if (answers & (1u << SRV))
+		additional |= 1u << HOST_LOCAL;
+	additional &= ~answers;
 
 	if (preferUnicast)
 	{
-		auto const name = std::string (addr_.name ());
-		info (
-		    "Respond mDNS %s %s to %s\n", record_.qname.c_str (), name.c_str (), srcAddr_->name ());
-		socket_->writeTo (response.data (), response.size () - available, *srcAddr_);
+		if (auto const size = respond (id, answers, additional))
+		{
+			debug ("Respond mDNS 0x%X to %s\n", answers, srcAddr_.name ());
+			socket_->writeTo (s_response.data (), size, srcAddr_);
+		}
 	}
 
 	auto const now = platform::steady_clock::now ();
-	if (!preferUnicast || now - s_lastAnnounce > std::chrono::seconds (MDNS_TTL / 4))
+	if (preferUnicast && now - s_lastAnnounce <= std::chrono::seconds (MDNS_TTL / 4))
+		return;
+
+	// multicast a record at most once per second (RFC 6762 section 6)
+	if (now - s_lastAnnounce < 1s && !(answers & ~s_announced))
+	{
+		++s_stats.suppressed;
+		return;
+	}
+
+	if (auto const size = respond (0, answers, additional))
 	{
-		info ("Announce mDNS %s %s\n", record_.qname.c_str (), addr_.name ());
-		socket_->writeTo (response.data (), response.size () - available, s_multicastAddress);
+		debug ("Announce mDNS 0x%X\n", answers);
+		socket_->writeTo (s_response.data (), size, s_multicastAddress);
 		s_lastAnnounce = now;
+		s_announced    = answers | additional;
 	}
 }
 }
 
-void mdns::setHostname (std::string hostname_)
-{
-	if (hostname_.empty ())
-		hostname_ = platform::hostname ();
-
-	if (s_hostname == hostname_)
-		return;
-
-	s_hostname      = std::move (hostname_);
-	s_hostnameLocal = s_hostname + ".local";
-
-	s_state     = State::Probe1;
-	s_lastProbe = platform::steady_clock::now ();
-}
-
 UniqueSocket mdns::createSocket ()
 {
 	auto socket = Socket::create (Socket::eDatagram);
@@ -416,6 +553,10 @@ UniqueSocket mdns::createSocket ()
 	if (!socket->setReuseAddress ())
 		return nullptr;
 
+	// handleSocket drains until the socket would block
+	if (!socket->setNonBlocking ())
+		return nullptr;
+
 	auto iface = SockAddr::AnyIPv4;
 	iface.setPort (s_multicastAddress.port ());
 	if (!socket->bind (iface))
@@ -430,15 +571,40 @@ UniqueSocket mdns::createSocket ()
 	return socket;
 }
 
-void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
+void mdns::setService (std::string_view const hostname_, SockAddr const &addr_)
 {
-	if (!socket_)
-		return;
-
 	// only support IPv4 for now
 	if (addr_.domain () != SockAddr::Domain::IPv4)
 		return;
 
+	if (s_set && hostname_ == s_setting && addr_ == s_addr)
+		return;
+
+	ALLOC_SCOPE ("mdns");
+
+	s_set     = true;
+	s_setting = hostname_;
+	s_addr    = addr_;
+
+	auto const &hostname = s_setting.empty () ? platform::hostname () : s_setting;
+	if (hostname != s_hostname)
+	{
+		s_hostname  = hostname;
+		s_state     = State::Probe1;
+		s_lastProbe = platform::steady_clock::now ();
+	}
+
+	s_announced = 0;
+	s_ready     = build (s_hostname, s_addr);
+	if (!s_ready)
+		error ("Invalid mDNS hostname %s\n", s_hostname.c_str ());
+}
+
+void mdns::update (Socket *const socket_)
+{
+	if (!socket_ || !s_ready)
+		return;
+
 	auto const now = platform::steady_clock::now ();
 
 	switch (s_state)
@@ -448,8 +614,10 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 	case State::Probe3:
 		if (now - s_lastProbe > 250ms)
 		{
-			probe (socket_, s_hostname);
-			s_state = static_cast<State> (static_cast<int> (s_state) + 1);
+			info ("Probe mDNS %s\n", s_hostname.c_str ());
+			socket_->writeTo (s_probe.data (), s_probe.size (), s_multicastAddress);
+			s_lastProbe = now;
+			s_state     = static_cast<State> (static_cast<int> (s_state) + 1);
 		}
 		break;
 
@@ -457,143 +625,52 @@ void mdns::handleSocket (Socket *socket_, SockAddr const &addr_)
 	case State::Announce2:
 		if (now - s_lastAnnounce > 1s)
 		{
-			announce (socket_,
-			    nullptr,
-			    0,
-			    0,
-			    QueryRecord{.qname = s_hostname, .qtype = 1, .qclass = 1},
-			    addr_);
+			if (auto const size = respond (0, ANNOUNCED, 0))
+			{
+				info ("Announce mDNS %s [%s]:%u\n",
+				    s_hostname.c_str (),
+				    s_addr.name (),
+				    s_addr.port ());
+				socket_->writeTo (s_response.data (), size, s_multicastAddress);
+				s_lastAnnounce = now;
+				s_announced    = ANNOUNCED;
+			}
 			s_state = static_cast<State> (static_cast<int> (s_state) + 1);
 		}
+		break;
 
 	default:
 		break;
 	}
+}
 
-	Socket::PollInfo pollInfo{*socket_, POLLIN, 0};
-	auto const rc = Socket::poll (&pollInfo, 1, 0ms);
-	if (rc <= 0 || !(pollInfo.revents & POLLIN))
-		return;
-
-	SockAddr srcAddr;
-	std::vector<std::uint8_t> buffer (65536);
-	auto bytes = socket_->readFrom (buffer.data (), buffer.size (), srcAddr);
-	if (bytes <= 0)
-		return;
-
-	// only support IPv4 for now
-	if (srcAddr.domain () != SockAddr::Domain::IPv4)
-		return;
-
-	// ignore loopback
-	if (std::memcmp (&reinterpret_cast<sockaddr_in const &> (srcAddr).sin_addr.s_addr,
-	        &reinterpret_cast<sockaddr_in const &> (addr_).sin_addr.s_addr,
-	        sizeof (in_addr_t)) == 0)
-		return;
-
-	std::uint16_t id;
-	std::uint16_t flags;
-	std::uint16_t qdCount;
-	std::uint16_t anCount;
-	std::uint16_t nsCount;
-	std::uint16_t arCount;
-
-	// parse header
-	auto in = decode (buffer.data (), bytes, id);
-	in      = decode (in, bytes, flags);
-	in      = decode (in, bytes, qdCount);
-	in      = decode (in, bytes, anCount);
-	in      = decode (in, bytes, nsCount);
-	in      = decode (in, bytes, arCount);
-
-	if (!in)
-		return;
-
-	auto const qr = (flags >> 15) & 0x1;
-
-	// ill-formed on queries and responses
-	auto const opcode = (flags >> 11) & 0xF;
-	if (opcode != 0)
-		return;
-
-	// ill-formed on queries
-	if (!qr && ((flags >> 10) & 0x1))
-		return;
-
-	// punt on truncated messages
-	if ((flags >> 9) & 0x1)
-		return;
-
-	// ill-formed on queries
-	if (!qr && ((flags >> 7) & 0x1))
-		return;
-
-	// must be zero
-	if ((flags >> 4) & 0x7)
-		return;
+void mdns::handleSocket (Socket *const socket_)
+{
+	ALLOC_SCOPE ("mdns");
 
-	// ill-formed on queries and responses
-	if ((flags >> 0) & 0xF)
+	if (!socket_)
 		return;
 
-	// std::vector<std::uint8_t> response (65536);
-	//	void *out      = response.data ();
-	//  auto available = response.size ();
-
-	std::vector<ResourceRecord> answers;
-
-	bool announced = false;
-	for (unsigned i = 0; i < qdCount; ++i)
+	SockAddr srcAddr;
+	for (unsigned i = 0; i < MAX_DRAIN; ++i)
 	{
-		QueryRecord record;
-		in = record.decode (in, bytes);
-
-		if (!in)
+		auto const bytes = socket_->readFrom (s_buffer.data (), s_buffer.size (), srcAddr);
+		if (bytes <= 0)
 			return;
 
-		// only respond to queries
-		if (qr)
-			continue;
-
-		// only accept A or ANY type
-		if (record.qtype != 1 && record.qtype != 255)
-			continue;
-
-		// only accept IN or ANY class
-		if ((record.qclass & 0x7FFF) != 1 && (record.qclass & 0x7FFF) != 255)
-			continue;
-
-		if (record.qname != s_hostname && record.qname != s_hostnameLocal)
-			continue;
-
-		if (!announced)
+		++s_stats.packets;
+		if (!s_ready)
 		{
-			std::vector<std::uint8_t> data (sizeof (in_addr_t));
-			auto n = data.size ();
-			encode (data.data (),
-			    n,
-			    static_cast<sockaddr_in const &> (addr_).sin_addr.s_addr,
-			    false);
-
-			answers.emplace_back (ResourceRecord{// answer
-			    .rname  = record.qname,
-			    .rtype  = 1,
-			    .rclass = static_cast<std::uint16_t> (1 | (1 << 15)),
-			    .rttl   = MDNS_TTL,
-			    .rlen   = sizeof (in_addr_t),
-			    .rdata  = std::move (data)});
-
-			announce (socket_, &srcAddr, id, flags, record, addr_);
-			announced = true;
+			++s_stats.ignored;
+			continue;
 		}
-	}
 
-	for (unsigned i = 0; i < anCount; ++i)
-	{
-		ResourceRecord record;
-		in = record.decode (in, bytes);
-
-		if (!in)
-			return;
+		auto const packet = std::span (s_buffer.data (), static_cast<std::size_t> (bytes));
+		handlePacket (socket_, packet, srcAddr);
 	}
 }
+
+mdns::Stats mdns::stats ()
+{
+	return s_stats;
+}
@@ -0,0 +1,228 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "sha256.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+/// \brief Round constants
+constexpr std::uint32_t K[] = {
+    // clang-format off
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    // clang-format on
+};
+
+constexpr std::uint32_t rotr (std::uint32_t const x_, unsigned const n_)
+{
+	return (x_ >> n_) | (x_ << (32 - n_));
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+Sha256::Sha256 ()
+{
+	reset ();
+}
+
+void Sha256::reset ()
+{
+	m_state = {
+	    0x6a09e667,
+	    0xbb67ae85,
+	    0x3c6ef372,
+	    0xa54ff53a,
+	    0x510e527f,
+	    0x9b05688c,
+	    0x1f83d9ab,
+	    0x5be0cd19,
+	};
+
+	m_blockSize = 0;
+	m_length    = 0;
+}
+
+void Sha256::update (void const *const data_, std::size_t size_)
+{
+	auto p = static_cast<std::uint8_t const *> (data_);
+
+	m_length += size_;
+
+	// fill pending block
+	if (m_blockSize != 0)
+	{
+		auto const size = std::min (size_, m_block.size () - m_blockSize);
+		std::memcpy (&m_block[m_blockSize], p, size);
+		m_blockSize += size;
+		p += size;
+		size_ -= size;
+
+		if (m_blockSize < m_block.size ())
+			return;
+
+		transform (m_block.data ());
+		m_blockSize = 0;
+	}
+
+	// process whole blocks directly from input
+	while (size_ >= m_block.size ())
+	{
+		transform (p);
+		p += m_block.size ();
+		size_ -= m_block.size ();
+	}
+
+	// save remainder
+	std::memcpy (m_block.data (), p, size_);
+	m_blockSize = size_;
+}
+
+Sha256::Digest Sha256::finish ()
+{
+	auto const bits = m_length * 8;
+
+	// append padding
+	std::uint8_t pad[72] = {0x80};
+	auto const padSize   = (m_blockSize < 56 ? 56 : 120) - m_blockSize;
+	for (unsigned i = 0; i < 8; ++i)
+		pad[padSize + i] = static_cast<std::uint8_t> (bits >> (56 - 8 * i));
+
+	update (pad, padSize + 8);
+
+	Digest digest;
+	for (unsigned i = 0; i < m_state.size (); ++i)
+	{
+		digest[4 * i + 0] = static_cast<std::uint8_t> (m_state[i] >> 24);
+		digest[4 * i + 1] = static_cast<std::uint8_t> (m_state[i] >> 16);
+		digest[4 * i + 2] = static_cast<std::uint8_t> (m_state[i] >> 8);
+		digest[4 * i + 3] = static_cast<std::uint8_t> (m_state[i] >> 0);
+	}
+
+	return digest;
+}
+
+std::string Sha256::toHex (Digest const &digest_)
+{
+	static char const hex[] = "0123456789abcdef";
+
+	std::string result (2 * digest_.size (), '\0');
+	for (unsigned i = 0; i < digest_.size (); ++i)
+	{
+		result[2 * i + 0] = hex[digest_[i] >> 4];
+		result[2 * i + 1] = hex[digest_[i] & 0xF];
+	}
+
+	return result;
+}
+
+bool Sha256::fromHex (std::string_view const hex_, Digest &digest_)
+{
+	if (hex_.size () != 2 * digest_.size ())
+		return false;
+
+	auto const nibble = [] (char const c_) -> int {
+		if (c_ >= '0' && c_ <= '9')
+			return c_ - '0';
+		if (c_ >= 'a' && c_ <= 'f')
+			return c_ - 'a' + 10;
+		if (c_ >= 'A' && c_ <= 'F')
+			return c_ - 'A' + 10;
+		return -1;
+	};
+
+	for (unsigned i = 0; i < digest_.size (); ++i)
+	{
+		auto const hi = nibble (hex_[2 * i + 0]);
+		auto const lo = nibble (hex_[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+
+		digest_[i] = static_cast<std::uint8_t> (hi << 4 | lo);
+	}
+
+	return true;
+}
+
+void Sha256::transform (std::uint8_t const *const block_)
+{
+	std::uint32_t w[64];
+	for (unsigned i = 0; i < 16; ++i)
+	{
+		w[i] = static_cast<std::uint32_t> (block_[4 * i + 0]) << 24 |
+		       static_cast<std::uint32_t> (block_[4 * i + 1]) << 16 |
+		       static_cast<std::uint32_t> (block_[4 * i + 2]) << 8 |
+		       static_cast<std::uint32_t> (block_[4 * i + 3]) << 0;
+	}
+
+	for (unsigned i = 16; i < 64; ++i)
+	{
+		auto const s0 = rotr (w[i - 15], 7) ^ rotr (w[i - 15], 18) ^ (w[i - 15] >> 3);
+		auto const s1 = rotr (w[i - 2], 17) ^ rotr (w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i]          = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	auto a = m_state[0];
+	auto b = m_state[1];
+	auto c = m_state[2];
+	auto d = m_state[3];
+	auto e = m_state[4];
+	auto f = m_state[5];
+	auto g = m_state[6];
+	auto h = m_state[7];
+
+	for (unsigned i = 0; i < 64; ++i)
+	{
+		auto const s1    = rotr (e, 6) ^ rotr (e, 11) ^ rotr (e, 25);
+		auto const ch    = (e & f) ^ (~e & g);
+		auto const temp1 = h + s1 + ch + K[i] + w[i];
+		auto const s0    = rotr (a, 2) ^ rotr (a, 13) ^ rotr (a, 22);
+		auto const maj   = (a & b) ^ (a & c) ^ (b & c);
+		auto const temp2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + temp1;
+		d = c;
+		c = b;
+		b = a;
+		a = temp1 + temp2;
+	}
+
+	m_state[0] += a;
+	m_state[1] += b;
+	m_state[2] += c;
+	m_state[3] += d;
+	m_state[4] += e;
+	m_state[5] += f;
+	m_state[6] += g;
+	m_state[7] += h;
+}
@@ -23,16 +23,43 @@
 #include "socket.h"
 
 #include "log.h"
+#include "trace.h"
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#if FTPD_HAS_TCP_INFO
+#include <linux/tcp.h>
+#elif __has_include(<netinet/tcp.h>)
+#include <netinet/tcp.h>
+#endif
+
+#if FTPD_HAS_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
 #include <cassert>
 #include <cerrno>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
+#include <vector>
+
+#if FTPD_HAS_TLS
+namespace
+{
+/// \brief Describe OpenSSL error
+/// \param error_ Error code
+char const *tlsReason (unsigned long const error_)
+{
+	auto const reason = ERR_reason_error_string (error_);
+	return reason ? reason : "unknown error";
+}
+}
+#endif
 
 ///////////////////////////////////////////////////////////////////////////
 Socket::~Socket ()
@@ -43,6 +70,10 @@ Socket::~Socket ()
 	if (m_connected)
 		info ("Closing connection to [%s]:%u\n", m_peerName.name (), m_peerName.port ());
 
+#if FTPD_HAS_TLS
+	SSL_free (m_ssl);
+#endif
+
 #ifdef __NDS__
 	if (::closesocket (m_fd) != 0)
 		error ("closesocket: %s\n", std::strerror (errno));
@@ -67,6 +98,8 @@ Socket::Socket (int const fd_, SockAddr const &sockName_, SockAddr const &peerNa
 
 UniqueSocket Socket::accept ()
 {
+	TRACE_SCOPE ("Socket::accept");
+
 	SockAddr addr;
 	socklen_t addrLen = sizeof (sockaddr_storage);
 
@@ -78,7 +111,18 @@ UniqueSocket Socket::accept ()
 	}
 
 	info ("Accepted connection from [%s]:%u\n", addr.name (), addr.port ());
-	return UniqueSocket (new Socket (fd, m_sockName, addr));
+
+	// a wildcard listener doesn't know which local address the peer reached, which PASV needs
+	auto sockName = m_sockName;
+	if (sockName.domain () == SockAddr::Domain::IPv4 &&
+	    static_cast<sockaddr_in const &> (sockName).sin_addr.s_addr == htonl (INADDR_ANY))
+	{
+		socklen_t addrLen = sizeof (sockaddr_storage);
+		if (::getsockname (fd, sockName, &addrLen) != 0)
+			error ("getsockname: %s\n", std::strerror (errno));
+	}
+
+	return UniqueSocket (new Socket (fd, sockName, addr));
 }
 
 int Socket::atMark ()
@@ -119,6 +163,8 @@ bool Socket::bind (SockAddr const &addr_)
 
 bool Socket::connect (SockAddr const &addr_)
 {
+	TRACE_SCOPE ("Socket::connect");
+
 	if (::connect (m_fd, addr_, addr_.size ()) != 0)
 	{
 		if (errno != EINPROGRESS)
@@ -152,6 +198,16 @@ bool Socket::listen (int const backlog_)
 
 bool Socket::shutdown (int const how_)
 {
+#if FTPD_HAS_TLS
+	// best effort; the peer may already be gone
+	if (m_ssl && how_ != SHUT_RD && SSL_is_init_finished (m_ssl) &&
+	    !(SSL_get_shutdown (m_ssl) & SSL_SENT_SHUTDOWN))
+	{
+		SSL_shutdown (m_ssl);
+		ERR_clear_error ();
+	}
+#endif
+
 	if (::shutdown (m_fd, how_) != 0)
 	{
 		error ("shutdown: %s\n", std::strerror (errno));
@@ -257,6 +313,116 @@ bool Socket::setSendBufferSize (std::size_t const size_)
 	return true;
 }
 
+bool Socket::setNoDelay (bool const noDelay_)
+{
+#ifdef TCP_NODELAY
+	int const value = noDelay_;
+	if (::setsockopt (m_fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof (value)) != 0)
+	{
+		error ("setsockopt(TCP_NODELAY, %s): %s\n", noDelay_ ? "on" : "off", std::strerror (errno));
+		return false;
+	}
+
+	m_tuning.noDelay = noDelay_;
+	return true;
+#else
+	(void)noDelay_;
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+bool Socket::setNotSentLowat (std::size_t const bytes_)
+{
+#ifdef TCP_NOTSENT_LOWAT
+	int const value = bytes_;
+	if (::setsockopt (m_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof (value)) != 0)
+	{
+		error ("setsockopt(TCP_NOTSENT_LOWAT, %zu): %s\n", bytes_, std::strerror (errno));
+		return false;
+	}
+
+	m_tuning.notSentLowat = bytes_;
+	return true;
+#else
+	(void)bytes_;
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+bool Socket::setBusyPoll (std::chrono::microseconds const time_)
+{
+#ifdef SO_BUSY_POLL
+	int const value = time_.count ();
+	if (::setsockopt (m_fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof (value)) != 0)
+	{
+		error ("setsockopt(SO_BUSY_POLL, %d): %s\n", value, std::strerror (errno));
+		return false;
+	}
+
+	m_tuning.busyPoll = time_;
+	return true;
+#else
+	(void)time_;
+	errno = ENOSYS;
+	return false;
+#endif
+}
+
+Socket::Tuning const &Socket::tuning () const
+{
+	return m_tuning;
+}
+
+std::size_t Socket::recvBufferSize () const
+{
+	int size         = 0;
+	socklen_t length = sizeof (size);
+	if (::getsockopt (m_fd, SOL_SOCKET, SO_RCVBUF, &size, &length) != 0 || size < 0)
+		return 0;
+
+	return size;
+}
+
+std::size_t Socket::sendBufferSize () const
+{
+	int size         = 0;
+	socklen_t length = sizeof (size);
+	if (::getsockopt (m_fd, SOL_SOCKET, SO_SNDBUF, &size, &length) != 0 || size < 0)
+		return 0;
+
+	return size;
+}
+
+#if FTPD_HAS_TCP_INFO
+bool Socket::tcpInfo (TcpInfo &info_) const
+{
+	tcp_info info{};
+	socklen_t size = sizeof (info);
+	if (::getsockopt (m_fd, IPPROTO_TCP, TCP_INFO, &info, &size) != 0)
+		return false;
+
+	info_.rtt    = std::chrono::microseconds (info.tcpi_rtt);
+	info_.rcvRtt = std::chrono::microseconds (info.tcpi_rcv_rtt);
+
+	// older kernels don't report these
+	info_.minRtt = info_.rtt;
+	if (size >= offsetof (tcp_info, tcpi_min_rtt) + sizeof (info.tcpi_min_rtt))
+		info_.minRtt = std::chrono::microseconds (info.tcpi_min_rtt);
+
+	info_.deliveryRate = 0;
+	if (size >= offsetof (tcp_info, tcpi_delivery_rate) + sizeof (info.tcpi_delivery_rate))
+		info_.deliveryRate = info.tcpi_delivery_rate;
+
+	info_.segsOut = 0;
+	if (size >= offsetof (tcp_info, tcpi_segs_out) + sizeof (info.tcpi_segs_out))
+		info_.segsOut = info.tcpi_segs_out;
+
+	return true;
+}
+#endif
+
 #ifndef __NDS__
 bool Socket::joinMulticastGroup (SockAddr const &addr_, SockAddr const &iface_)
 {
@@ -292,9 +458,51 @@ bool Socket::dropMulticastGroup (SockAddr const &addr_, SockAddr const &iface_)
 std::make_signed_t<std::size_t>
     Socket::read (void *const buffer_, std::size_t const size_, bool const oob_)
 {
+	TRACE_SCOPE_ARG ("Socket::read", size_);
+
 	assert (buffer_);
 	assert (size_);
 
+#if FTPD_HAS_TLS
+	// out-of-band data bypasses TLS
+	if (m_ssl && !oob_)
+	{
+		if (m_tlsReadError)
+		{
+			errno = m_tlsReadError;
+			return -1;
+		}
+
+		// drain whole records while they fit, rather than one per call
+		std::size_t total = 0;
+		while (total < size_)
+		{
+			std::size_t bytes = 0;
+			auto const rc     = SSL_read_ex (m_ssl,
+			    static_cast<std::uint8_t *> (buffer_) + total,
+			    size_ - total,
+			    &bytes);
+			if (rc <= 0)
+			{
+				auto const result = tlsError (rc, m_tlsReadWant, "SSL_read");
+				if (!total)
+					return result;
+
+				// return the data first; the failure can't be asked for again
+				if (result < 0 && errno != EWOULDBLOCK)
+					m_tlsReadError = errno;
+
+				return total;
+			}
+
+			m_tlsReadWant = POLLIN;
+			total += bytes;
+		}
+
+		return total;
+	}
+#endif
+
 	auto const rc = ::recv (m_fd, buffer_, size_, oob_ ? MSG_OOB : 0);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("recv: %s\n", std::strerror (errno));
@@ -316,6 +524,8 @@ std::make_signed_t<std::size_t> Socket::read (IOBuffer &buffer_, bool const oob_
 std::make_signed_t<std::size_t>
     Socket::readFrom (void *const buffer_, std::size_t const size_, SockAddr &addr_)
 {
+	TRACE_SCOPE_ARG ("Socket::readFrom", size_);
+
 	assert (buffer_);
 	assert (size_);
 
@@ -330,9 +540,37 @@ std::make_signed_t<std::size_t>
 
 std::make_signed_t<std::size_t> Socket::write (void const *const buffer_, std::size_t const size_)
 {
+	TRACE_SCOPE_ARG ("Socket::write", size_);
+
 	assert (buffer_);
 	assert (size_ > 0);
 
+#if FTPD_HAS_TLS
+	if (m_ssl)
+	{
+		// partial writes return per record; keep going until the socket is full
+		std::size_t total = 0;
+		while (total < size_)
+		{
+			std::size_t bytes = 0;
+			auto const rc     = SSL_write_ex (m_ssl,
+			    static_cast<std::uint8_t const *> (buffer_) + total,
+			    size_ - total,
+			    &bytes);
+			if (rc <= 0)
+			{
+				auto const result = tlsError (rc, m_tlsWriteWant, "SSL_write");
+				return total ? static_cast<std::make_signed_t<std::size_t>> (total) : result;
+			}
+
+			m_tlsWriteWant = POLLOUT;
+			total += bytes;
+		}
+
+		return total;
+	}
+#endif
+
 	auto const rc = ::send (m_fd, buffer_, size_, 0);
 	if (rc < 0 && errno != EWOULDBLOCK)
 		error ("send: %s\n", std::strerror (errno));
@@ -354,6 +592,8 @@ std::make_signed_t<std::size_t> Socket::write (IOBuffer &buffer_)
 std::make_signed_t<std::size_t>
     Socket::writeTo (void const *buffer_, std::size_t size_, SockAddr const &addr_)
 {
+	TRACE_SCOPE_ARG ("Socket::writeTo", size_);
+
 	assert (buffer_);
 	assert (size_ > 0);
 
@@ -374,6 +614,115 @@ SockAddr const &Socket::peerName () const
 	return m_peerName;
 }
 
+#if FTPD_HAS_TLS
+bool Socket::startTls (ssl_ctx_st *const context_)
+{
+	assert (context_);
+	assert (!m_ssl);
+
+	m_ssl = SSL_new (context_);
+	if (!m_ssl)
+	{
+		error ("SSL_new: %s\n", tlsReason (ERR_get_error ()));
+		return false;
+	}
+
+	if (!SSL_set_fd (m_ssl, m_fd))
+	{
+		error ("SSL_set_fd: %s\n", tlsReason (ERR_get_error ()));
+		SSL_free (m_ssl);
+		m_ssl = nullptr;
+		return false;
+	}
+
+	SSL_set_accept_state (m_ssl);
+	return true;
+}
+
+bool Socket::closeNotify ()
+{
+	if (!m_ssl || !SSL_is_init_finished (m_ssl))
+		return true;
+
+	auto const rc = SSL_shutdown (m_ssl);
+	if (rc >= 0)
+		return true;
+
+	return tlsError (rc, m_tlsWriteWant, "SSL_shutdown") == 0 || errno != EWOULDBLOCK;
+}
+
+bool Socket::tls () const
+{
+	return m_ssl;
+}
+
+bool Socket::tlsInfo (TlsInfo &info_) const
+{
+	if (!m_ssl)
+		return false;
+
+	info_.established = SSL_is_init_finished (m_ssl);
+	info_.resumed     = SSL_session_reused (m_ssl);
+#ifndef OPENSSL_NO_KTLS
+	info_.ktlsSend = BIO_get_ktls_send (SSL_get_wbio (m_ssl));
+	info_.ktlsRecv = BIO_get_ktls_recv (SSL_get_rbio (m_ssl));
+#else
+	info_.ktlsSend = false;
+	info_.ktlsRecv = false;
+#endif
+	info_.version = SSL_get_version (m_ssl);
+	info_.cipher  = SSL_get_cipher_name (m_ssl);
+	return true;
+}
+
+std::make_signed_t<std::size_t>
+    Socket::tlsError (int const rc_, int &want_, char const *const op_)
+{
+	switch (SSL_get_error (m_ssl, rc_))
+	{
+	case SSL_ERROR_WANT_READ:
+		want_ = POLLIN;
+		errno = EWOULDBLOCK;
+		return -1;
+
+	case SSL_ERROR_WANT_WRITE:
+		want_ = POLLOUT;
+		errno = EWOULDBLOCK;
+		return -1;
+
+	case SSL_ERROR_ZERO_RETURN:
+		// peer sent close_notify
+		return 0;
+
+	case SSL_ERROR_SYSCALL:
+		if (errno != 0)
+		{
+			error ("%s: %s\n", op_, std::strerror (errno));
+			break;
+		}
+		[[fallthrough]];
+
+	case SSL_ERROR_SSL:
+		// peer closed without close_notify, so the data may have been cut short
+		if (ERR_GET_REASON (ERR_peek_last_error ()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)
+		{
+			ERR_clear_error ();
+			errno = ECONNRESET;
+			return -1;
+		}
+		[[fallthrough]];
+
+	default:
+		error ("%s: %s\n", op_, tlsReason (ERR_peek_last_error ()));
+		break;
+	}
+
+	ERR_clear_error ();
+	errno = ECONNABORTED;
+	return -1;
+}
+#endif
+
 UniqueSocket Socket::create (Type const type_)
 {
 	auto const fd = ::socket (AF_INET, static_cast<int> (type_), 0);
@@ -390,18 +739,46 @@ int Socket::poll (PollInfo *const info_,
     std::size_t const count_,
     std::chrono::milliseconds const timeout_)
 {
+	TRACE_SCOPE_ARG ("Socket::poll", count_);
+
 	if (count_ == 0)
 		return 0;
 
-	auto const pfd = std::make_unique<pollfd[]> (count_);
+	// reuse the array between calls so polling doesn't allocate in steady state
+	thread_local std::vector<pollfd> pfd;
+	pfd.resize (count_);
+#if FTPD_HAS_TLS
+	auto pending = false;
+#endif
 	for (std::size_t i = 0; i < count_; ++i)
 	{
 		pfd[i].fd      = info_[i].socket.get ().m_fd;
 		pfd[i].events  = info_[i].events;
 		pfd[i].revents = 0;
+
+#if FTPD_HAS_TLS
+		auto const &socket = info_[i].socket.get ();
+		if (!socket.m_ssl)
+			continue;
+
+		// decrypted data already buffered won't make the socket readable
+		if ((info_[i].events & POLLIN) && SSL_has_pending (socket.m_ssl))
+			pending = true;
+
+		// wait for the direction TLS needs, not the one the caller asked for
+		pfd[i].events &= ~(POLLIN | POLLOUT);
+		if (info_[i].events & POLLIN)
+			pfd[i].events |= socket.m_tlsReadWant;
+		if (info_[i].events & POLLOUT)
+			pfd[i].events |= socket.m_tlsWriteWant;
+#endif
 	}
 
-	auto const rc = ::poll (pfd.get (), count_, timeout_.count ());
+#if FTPD_HAS_TLS
+	auto rc = ::poll (pfd.data (), count_, pending ? 0 : timeout_.count ());
+#else
+	auto const rc = ::poll (pfd.data (), count_, timeout_.count ());
+#endif
 	if (rc < 0)
 	{
 		error ("poll: %s\n", std::strerror (errno));
@@ -411,6 +788,31 @@ int Socket::poll (PollInfo *const info_,
 	for (std::size_t i = 0; i < count_; ++i)
 		info_[i].revents = pfd[i].revents;
 
+#if FTPD_HAS_TLS
+	// report readiness in terms of what the caller asked for
+	rc = 0;
+	for (std::size_t i = 0; i < count_; ++i)
+	{
+		auto const &socket = info_[i].socket.get ();
+		if (socket.m_ssl)
+		{
+			auto const events = info_[i].events;
+			auto &revents     = info_[i].revents;
+			auto const ready  = revents;
+
+			revents &= ~(POLLIN | POLLOUT);
+			if ((events & POLLIN) &&
+			    ((ready & socket.m_tlsReadWant) || SSL_has_pending (socket.m_ssl)))
+				revents |= POLLIN;
+			if ((events & POLLOUT) && (ready & socket.m_tlsWriteWant))
+				revents |= POLLOUT;
+		}
+
+		if (info_[i].revents)
+			++rc;
+	}
+#endif
+
 	return rc;
 }
 
@@ -0,0 +1,154 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "statsSegment.h"
+
+#if FTPD_HAS_STATS_SEGMENT
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+///////////////////////////////////////////////////////////////////////////
+stats::SegmentMap::~SegmentMap ()
+{
+	close ();
+}
+
+stats::SegmentMap::SegmentMap () = default;
+
+bool stats::SegmentMap::create (std::string name_)
+{
+	close ();
+
+	auto const fd = ::shm_open (name_.c_str (), O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		return false;
+
+	if (::ftruncate (fd, sizeof (Segment)) != 0)
+	{
+		auto const err = errno;
+		::close (fd);
+		::shm_unlink (name_.c_str ());
+		errno = err;
+		return false;
+	}
+
+	auto const p = ::mmap (nullptr, sizeof (Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close (fd);
+
+	if (p == MAP_FAILED)
+	{
+		auto const err = errno;
+		::shm_unlink (name_.c_str ());
+		errno = err;
+		return false;
+	}
+
+	// a segment left behind by a previous run is simply reset
+	m_segment           = new (p) Segment{};
+	m_segment->slots    = SEGMENT_SLOTS;
+	m_segment->slotSize = sizeof (Seqlocked<SessionRecord>);
+	m_segment->version  = SEGMENT_VERSION;
+
+	// readers check the magic last
+	std::atomic_thread_fence (std::memory_order_release);
+	m_segment->magic = SEGMENT_MAGIC;
+
+	m_name  = std::move (name_);
+	m_owner = true;
+	return true;
+}
+
+bool stats::SegmentMap::open (std::string name_)
+{
+	close ();
+
+	auto const fd = ::shm_open (name_.c_str (), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (::fstat (fd, &st) != 0)
+	{
+		auto const err = errno;
+		::close (fd);
+		errno = err;
+		return false;
+	}
+
+	if (static_cast<std::size_t> (st.st_size) < sizeof (Segment))
+	{
+		::close (fd);
+		errno = EPROTO;
+		return false;
+	}
+
+	auto const p = ::mmap (nullptr, sizeof (Segment), PROT_READ, MAP_SHARED, fd, 0);
+	::close (fd);
+
+	if (p == MAP_FAILED)
+		return false;
+
+	auto const segment = static_cast<Segment *> (p);
+	if (segment->magic != SEGMENT_MAGIC || segment->version != SEGMENT_VERSION ||
+	    segment->slots != SEGMENT_SLOTS || segment->slotSize != sizeof (Seqlocked<SessionRecord>))
+	{
+		::munmap (p, sizeof (Segment));
+		errno = EPROTO;
+		return false;
+	}
+
+	m_segment = segment;
+	m_name    = std::move (name_);
+	m_owner   = false;
+	return true;
+}
+
+void stats::SegmentMap::close ()
+{
+	if (!m_segment)
+		return;
+
+	::munmap (m_segment, sizeof (Segment));
+	if (m_owner)
+		::shm_unlink (m_name.c_str ());
+
+	m_segment = nullptr;
+	m_name.clear ();
+	m_owner = false;
+}
+
+stats::Segment *stats::SegmentMap::get () const
+{
+	return m_segment;
+}
+
+std::string const &stats::SegmentMap::name () const
+{
+	return m_name;
+}
+#endif
@@ -0,0 +1,107 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "task.h"
+
+#include <cassert>
+#include <new>
+
+///////////////////////////////////////////////////////////////////////////
+co::Arena::~Arena ()
+{
+	assert (m_used == 0);
+
+	while (m_free)
+		::operator delete (std::exchange (m_free, m_free->next));
+}
+
+co::Arena::Arena () = default;
+
+void *co::Arena::allocate (Arena *const arena_, std::size_t size_)
+{
+	// keep the frame that follows the header aligned
+	size_ = (size_ + alignof (Block) - 1) / alignof (Block) * alignof (Block);
+
+	Block *block = nullptr;
+	if (arena_)
+	{
+		// first fit; a session only ever has a handful of frames
+		for (auto link = &arena_->m_free; *link; link = &(*link)->next)
+		{
+			if ((*link)->size < size_)
+				continue;
+
+			block = *link;
+			*link = block->next;
+			break;
+		}
+	}
+
+	if (!block)
+	{
+		block        = static_cast<Block *> (::operator new (sizeof (Block) + size_));
+		block->arena = arena_;
+		block->size  = size_;
+
+		if (arena_)
+		{
+			arena_->m_capacity += size_;
+			++arena_->m_misses;
+		}
+	}
+
+	block->next = nullptr;
+	if (arena_)
+		++arena_->m_used;
+
+	return block + 1;
+}
+
+void co::Arena::deallocate (void *const frame_) noexcept
+{
+	if (!frame_)
+		return;
+
+	auto const block = static_cast<Block *> (frame_) - 1;
+	auto const arena = block->arena;
+	if (!arena)
+	{
+		::operator delete (block);
+		return;
+	}
+
+	assert (arena->m_used > 0);
+	--arena->m_used;
+
+	block->next   = arena->m_free;
+	arena->m_free = block;
+}
+
+std::size_t co::Arena::capacity () const
+{
+	return m_capacity;
+}
+
+std::uint64_t co::Arena::misses () const
+{
+	return m_misses;
+}
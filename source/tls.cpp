@@ -0,0 +1,160 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// ftpd implements FTPS based on the following:
+// - RFC 4217 (https://datatracker.ietf.org/doc/html/rfc4217)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "tls.h"
+
+#if FTPD_HAS_TLS
+#include "log.h"
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <string>
+
+namespace
+{
+/// \brief Certificate path of the current context
+std::string s_cert;
+
+/// \brief Key path of the current context
+std::string s_key;
+
+/// \brief Whether the current context enables kTLS
+bool s_ktls = false;
+
+/// \brief Whether configure has run
+bool s_set = false;
+
+/// \brief Server context
+SSL_CTX *s_context = nullptr;
+
+tls::Stats s_stats{};
+
+/// \brief Describe and clear the last OpenSSL error
+char const *lastError ()
+{
+	auto const reason = ERR_reason_error_string (ERR_peek_last_error ());
+	ERR_clear_error ();
+	return reason ? reason : "unknown error";
+}
+
+/// \brief Count handshakes and alerts
+/// \param ssl_ Connection
+/// \param where_ Callback context
+/// \param ret_ Alert level and description
+void infoCallback (SSL const *const ssl_, int const where_, int const ret_)
+{
+	if (where_ & SSL_CB_HANDSHAKE_DONE)
+	{
+		++s_stats.handshakes;
+		if (SSL_session_reused (ssl_))
+			++s_stats.resumed;
+
+#ifndef OPENSSL_NO_KTLS
+		if (BIO_get_ktls_send (SSL_get_wbio (ssl_)))
+			++s_stats.ktlsSend;
+		if (BIO_get_ktls_recv (SSL_get_rbio (ssl_)))
+			++s_stats.ktlsRecv;
+#endif
+	}
+	else if ((where_ & SSL_CB_WRITE_ALERT) == SSL_CB_WRITE_ALERT && (ret_ >> 8) == SSL3_AL_FATAL)
+	{
+		++s_stats.alerts;
+		info ("TLS alert: %s\n", SSL_alert_desc_string_long (ret_));
+	}
+}
+
+/// \brief Create server context
+/// \returns Context, or nullptr on error
+SSL_CTX *createContext ()
+{
+	auto const context = SSL_CTX_new (TLS_server_method ());
+	if (!context)
+	{
+		error ("SSL_CTX_new: %s\n", lastError ());
+		return nullptr;
+	}
+
+	SSL_CTX_set_min_proto_version (context, TLS1_2_VERSION);
+
+	// a write returns once a record is out, and IOBuffer may move the data before a retry
+	SSL_CTX_set_mode (context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if (s_ktls)
+		SSL_CTX_set_options (context, SSL_OP_ENABLE_KTLS);
+
+	// data connections resume the control connection's session instead of a full handshake
+	static unsigned char const sessionId[] = {'f', 't', 'p', 'd'};
+	SSL_CTX_set_session_cache_mode (context, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context (context, sessionId, sizeof (sessionId));
+
+	SSL_CTX_set_info_callback (context, &infoCallback);
+
+	auto const &key = s_key.empty () ? s_cert : s_key;
+	if (SSL_CTX_use_certificate_chain_file (context, s_cert.c_str ()) != 1 ||
+	    SSL_CTX_use_PrivateKey_file (context, key.c_str (), SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key (context) != 1)
+	{
+		error ("Failed to load TLS certificate %s: %s\n", s_cert.c_str (), lastError ());
+		SSL_CTX_free (context);
+		return nullptr;
+	}
+
+	return context;
+}
+}
+
+void tls::configure (std::string_view const cert_, std::string_view const key_, bool const ktls_)
+{
+	if (s_set && cert_ == s_cert && key_ == s_key && ktls_ == s_ktls)
+		return;
+
+	s_set  = true;
+	s_cert = cert_;
+	s_key  = key_;
+	s_ktls = ktls_;
+
+	// connections hold their own reference
+	SSL_CTX_free (s_context);
+	s_context = nullptr;
+
+	if (s_cert.empty ())
+		return;
+
+	s_context = createContext ();
+	if (s_context)
+		info ("TLS enabled with %s%s\n", s_cert.c_str (), s_ktls ? " (kTLS where supported)" : "");
+}
+
+ssl_ctx_st *tls::context ()
+{
+	return s_context;
+}
+
+tls::Stats tls::stats ()
+{
+	return s_stats;
+}
+#endif
@@ -0,0 +1,224 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "trace.h"
+
+#if FTPD_TRACE
+#include "platform.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <vector>
+
+namespace
+{
+/// \brief Trace event
+struct Event
+{
+	/// \brief Event name
+	std::atomic<char const *> name;
+	/// \brief Start time
+	std::atomic<std::uint64_t> start;
+	/// \brief Duration
+	std::atomic<std::uint64_t> duration;
+	/// \brief Event argument
+	std::atomic<std::int64_t> arg;
+};
+
+/// \brief Per-thread event ring
+/// The owning thread is the only writer. Readers copy events without blocking it, then discard
+/// any slot the writer may have started overwriting in the meantime.
+struct Ring
+{
+	/// \brief Number of events started
+	std::atomic<std::uint64_t> started = 0;
+	/// \brief Number of events completed
+	std::atomic<std::uint64_t> completed = 0;
+
+	/// \brief Events
+	Event events[trace::RING_SIZE];
+};
+
+/// \brief Copy of an event
+struct Snapshot
+{
+	/// \brief Event name
+	char const *name;
+	/// \brief Start time
+	std::uint64_t start;
+	/// \brief Duration
+	std::uint64_t duration;
+	/// \brief Event argument
+	std::int64_t arg;
+};
+
+/// \brief Trace clock epoch
+auto const s_epoch = platform::steady_clock::now ();
+
+/// \brief Registered rings
+std::atomic<Ring *> s_rings[trace::MAX_THREADS];
+/// \brief Number of claimed ring slots
+std::atomic<std::size_t> s_ringCount = 0;
+
+/// \brief Whether a dump was requested
+std::atomic<bool> s_dumpRequested = false;
+
+/// \brief Calling thread's ring
+thread_local Ring *t_ring = nullptr;
+/// \brief Whether the calling thread ran out of rings
+thread_local bool t_untraced = false;
+
+/// \brief Get calling thread's ring
+/// \note Rings are never freed, so a dump can read them after their thread exits
+Ring *ring ()
+{
+	if (t_ring || t_untraced)
+		return t_ring;
+
+	auto const index = s_ringCount.fetch_add (1, std::memory_order_relaxed);
+	if (index >= trace::MAX_THREADS)
+	{
+		t_untraced = true;
+		return nullptr;
+	}
+
+	t_ring = new Ring ();
+	s_rings[index].store (t_ring, std::memory_order_release);
+	return t_ring;
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+std::uint64_t trace::now ()
+{
+	auto const elapsed = platform::steady_clock::now () - s_epoch;
+	return std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ();
+}
+
+void trace::record (char const *const name_, std::uint64_t const start_, std::int64_t const arg_)
+{
+	auto const ring = ::ring ();
+	if (!ring)
+		return;
+
+	auto const end   = now ();
+	auto const index = ring->started.load (std::memory_order_relaxed);
+
+	// announce the overwrite before touching the slot
+	ring->started.store (index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence (std::memory_order_release);
+
+	auto &event = ring->events[index % RING_SIZE];
+	event.name.store (name_, std::memory_order_relaxed);
+	event.start.store (start_, std::memory_order_relaxed);
+	event.duration.store (end - start_, std::memory_order_relaxed);
+	event.arg.store (arg_, std::memory_order_relaxed);
+
+	ring->completed.store (index + 1, std::memory_order_release);
+}
+
+long trace::dump (char const *const path_)
+{
+	auto const fp = std::fopen (path_, "w");
+	if (!fp)
+		return -1;
+
+	std::fputs ("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", fp);
+
+	long count = 0;
+	std::vector<Snapshot> events;
+	auto const rings = std::min (s_ringCount.load (std::memory_order_acquire), MAX_THREADS);
+	for (std::size_t i = 0; i < rings; ++i)
+	{
+		auto const ring = s_rings[i].load (std::memory_order_acquire);
+		if (!ring)
+			continue;
+
+		auto const end   = ring->completed.load (std::memory_order_acquire);
+		auto const begin = end > RING_SIZE ? end - RING_SIZE : 0;
+
+		events.clear ();
+		for (auto j = begin; j < end; ++j)
+		{
+			auto const &event = ring->events[j % RING_SIZE];
+			events.emplace_back (Snapshot{
+			    .name     = event.name.load (std::memory_order_relaxed),
+			    .start    = event.start.load (std::memory_order_relaxed),
+			    .duration = event.duration.load (std::memory_order_relaxed),
+			    .arg      = event.arg.load (std::memory_order_relaxed),
+			});
+		}
+
+		// drop slots the writer started overwriting while they were copied
+		std::atomic_thread_fence (std::memory_order_acquire);
+		auto const started = ring->started.load (std::memory_order_relaxed);
+		auto const valid   = std::max (begin, started > RING_SIZE ? started - RING_SIZE : 0);
+		auto const skip    = std::min<std::uint64_t> (valid - begin, events.size ());
+
+		for (auto it = std::next (std::begin (events), skip); it != std::end (events); ++it)
+		{
+			std::fprintf (fp,
+			    "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+			    "\"args\":{\"arg\":%" PRId64 "}}",
+			    count ? "," : "",
+			    it->name,
+			    i + 1,
+			    it->start / 1e3,
+			    it->duration / 1e3,
+			    it->arg);
+			++count;
+		}
+	}
+
+	std::fputs ("\n]}\n", fp);
+
+	auto const error = std::ferror (fp);
+	if (std::fclose (fp) != 0 || error)
+		return -1;
+
+	return count;
+}
+
+void trace::requestDump ()
+{
+	s_dumpRequested.store (true, std::memory_order_relaxed);
+}
+
+bool trace::dumpRequested ()
+{
+	return s_dumpRequested.exchange (false, std::memory_order_relaxed);
+}
+
+///////////////////////////////////////////////////////////////////////////
+trace::Scope::~Scope ()
+{
+	record (m_name, m_start, m_arg);
+}
+
+trace::Scope::Scope (char const *const name_, std::int64_t const arg_)
+    : m_name (name_), m_arg (arg_), m_start (now ())
+{
+}
+#endif
@@ -0,0 +1,276 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "xferJournal.h"
+
+#if FTPD_HAS_XFER_JOURNAL
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string_view>
+
+namespace
+{
+/// \brief Current time in nanoseconds since epoch
+std::int64_t now ()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds> (
+	    std::chrono::system_clock::now ().time_since_epoch ())
+	    .count ();
+}
+
+/// \brief Size of a journal file
+/// \param records_ Number of record slots
+std::size_t fileSize (std::size_t const records_)
+{
+	return sizeof (journal::Header) + records_ * sizeof (journal::Record);
+}
+
+/// \brief View a nul-terminated field, tolerating a missing terminator
+/// \param field_ Field to view
+template <std::size_t N>
+std::string_view field (char const (&field_)[N])
+{
+	return std::string_view (field_, strnlen (field_, N));
+}
+}
+
+///////////////////////////////////////////////////////////////////////////
+std::string journal::toXferlog (Record const &record_)
+{
+	auto const seconds = static_cast<std::time_t> (record_.time / 1000000000);
+
+	struct tm tm;
+	char time[32];
+	if (!::localtime_r (&seconds, &tm) ||
+	    std::strftime (time, sizeof (time), "%a %b %e %H:%M:%S %Y", &tm) == 0)
+		std::strcpy (time, "-");
+
+	// whitespace would split the path across fields
+	auto path = std::string (field (record_.path));
+	for (auto &c : path)
+	{
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+			c = '_';
+	}
+
+	auto const user = record_.user[0] ? field (record_.user) : std::string_view ("-");
+	auto const peer = record_.peer[0] ? field (record_.peer) : std::string_view ("-");
+
+	char line[1024];
+	auto const rc = std::snprintf (line,
+	    sizeof (line),
+	    "%s %llu %.*s %llu %s b %c %c %c %.*s ftp 0 * %c\n",
+	    time,
+	    static_cast<unsigned long long> ((record_.duration + 500000000) / 1000000000),
+	    static_cast<int> (peer.size ()),
+	    peer.data (),
+	    static_cast<unsigned long long> (record_.bytes),
+	    path.empty () ? "-" : path.c_str (),
+	    record_.deflate ? 'C' : '_',
+	    record_.direction,
+	    record_.access,
+	    static_cast<int> (user.size ()),
+	    user.data (),
+	    record_.complete ? 'c' : 'i');
+	if (rc < 0)
+		return {};
+
+	return std::string (line, std::min<std::size_t> (rc, sizeof (line) - 1));
+}
+
+///////////////////////////////////////////////////////////////////////////
+journal::Journal::~Journal ()
+{
+	close ();
+}
+
+journal::Journal::Journal () = default;
+
+bool journal::Journal::open (std::string path_,
+    std::size_t const records_,
+    std::chrono::seconds const rotate_)
+{
+	close ();
+
+	m_path     = std::move (path_);
+	m_capacity = records_;
+	m_rotate   = rotate_;
+
+	if (map ())
+		return true;
+
+	// an unusable file is moved aside rather than overwritten
+	if (errno == EPROTO)
+		return rotate ();
+
+	return false;
+}
+
+void journal::Journal::close ()
+{
+	if (!m_header)
+		return;
+
+	auto const size = fileSize (m_header->capacity);
+	::msync (m_header, size, MS_ASYNC);
+	::munmap (m_header, size);
+
+	m_header  = nullptr;
+	m_records = nullptr;
+}
+
+bool journal::Journal::append (Record const &record_)
+{
+	if (!m_header)
+		return false;
+
+	auto records = m_header->records.load (std::memory_order_relaxed);
+	if (records >= m_header->capacity || record_.time >= m_rotateAt)
+	{
+		if (!rotate ())
+			return false;
+
+		records = 0;
+	}
+
+	std::memcpy (&m_records[records], &record_, sizeof (record_));
+
+	// readers trust the count, so it goes last
+	m_header->records.store (records + 1, std::memory_order_release);
+	return true;
+}
+
+std::string const &journal::Journal::path () const
+{
+	return m_path;
+}
+
+bool journal::Journal::map ()
+{
+	auto const fd = ::open (m_path.c_str (), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (::fstat (fd, &st) != 0)
+	{
+		auto const err = errno;
+		::close (fd);
+		errno = err;
+		return false;
+	}
+
+	// an existing journal keeps its own capacity; one too short to hold a header is no journal
+	auto const fresh    = st.st_size == 0;
+	auto const capacity = [&] () -> std::size_t {
+		if (fresh)
+			return m_capacity;
+
+		if (static_cast<std::size_t> (st.st_size) < sizeof (Header))
+			return 0;
+
+		Header header;
+		if (::pread (fd, &header, sizeof (header), 0) != sizeof (header) ||
+		    header.magic != FILE_MAGIC || header.version != FILE_VERSION ||
+		    header.recordSize != sizeof (Record) ||
+		    static_cast<std::size_t> (st.st_size) != fileSize (header.capacity))
+			return 0;
+
+		return header.capacity;
+	}();
+
+	if (capacity == 0)
+	{
+		::close (fd);
+		errno = EPROTO;
+		return false;
+	}
+
+	auto const size = fileSize (capacity);
+	if (fresh && ::ftruncate (fd, size) != 0)
+	{
+		auto const err = errno;
+		::close (fd);
+		errno = err;
+		return false;
+	}
+
+	auto const p = ::mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close (fd);
+
+	if (p == MAP_FAILED)
+		return false;
+
+	if (fresh)
+	{
+		auto const header  = new (p) Header{};
+		header->version    = FILE_VERSION;
+		header->recordSize = sizeof (Record);
+		header->capacity   = capacity;
+		header->created    = now ();
+
+		// readers check the magic last
+		std::atomic_thread_fence (std::memory_order_release);
+		header->magic = FILE_MAGIC;
+	}
+
+	m_header   = static_cast<Header *> (p);
+	m_records  = reinterpret_cast<Record *> (m_header + 1);
+	m_rotateAt = m_header->created +
+	             std::chrono::duration_cast<std::chrono::nanoseconds> (m_rotate).count ();
+
+	return true;
+}
+
+bool journal::Journal::rotate ()
+{
+	auto const created = m_header ? m_header->created : now ();
+	close ();
+
+	auto const seconds = static_cast<std::time_t> (created / 1000000000);
+
+	struct tm tm;
+	char stamp[32];
+	if (!::localtime_r (&seconds, &tm) ||
+	    std::strftime (stamp, sizeof (stamp), "%Y%m%d%H%M%S", &tm) == 0)
+		std::strcpy (stamp, "0");
+
+	// never clobber an earlier rotation
+	auto rotated = m_path + '.' + stamp;
+	for (unsigned i = 1; ::access (rotated.c_str (), F_OK) == 0; ++i)
+		rotated = m_path + '.' + stamp + '-' + std::to_string (i);
+
+	if (::rename (m_path.c_str (), rotated.c_str ()) != 0 && errno != ENOENT)
+		return false;
+
+	return map ();
+}
+#endif
@@ -0,0 +1,321 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// ftpd-top: live view of a running server's shared-memory statistics segment
+//
+// Maps the segment read-only and samples it, so monitoring adds no work to the server beyond its
+// periodic publish.
+
+#include "statsSegment.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+/// \brief Previous sample of a session
+struct Sample
+{
+	/// \brief Total data bytes
+	std::uint64_t bytes;
+
+	/// \brief Publish time in nanoseconds
+	std::uint64_t updated;
+};
+
+/// \brief Session row
+struct Row
+{
+	/// \brief Session record
+	stats::SessionRecord record;
+
+	/// \brief Sampled data rate in bytes/s
+	double rate;
+};
+
+/// \brief Format size in human-readable units
+/// \param size_ Size to format
+std::string printSize (double size_)
+{
+	static char const *const units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+
+	unsigned unit = 0;
+	while (size_ >= 1024.0 && unit + 1 < std::size (units))
+	{
+		size_ /= 1024.0;
+		++unit;
+	}
+
+	char buffer[32];
+	if (unit == 0)
+		std::snprintf (buffer, sizeof (buffer), "%.0f%s", size_, units[unit]);
+	else
+		std::snprintf (buffer, sizeof (buffer), "%.1f%s", size_, units[unit]);
+
+	return buffer;
+}
+
+/// \brief Format duration
+/// \param seconds_ Duration in seconds
+std::string printUptime (std::int64_t const seconds_)
+{
+	char buffer[32];
+	std::snprintf (buffer,
+	    sizeof (buffer),
+	    "%" PRId64 ":%02d:%02d",
+	    seconds_ / 3600,
+	    static_cast<int> (seconds_ / 60 % 60),
+	    static_cast<int> (seconds_ % 60));
+	return buffer;
+}
+
+/// \brief Get terminal width
+int terminalWidth ()
+{
+	winsize ws;
+	if (::ioctl (STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+		return ws.ws_col;
+
+	return 160;
+}
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options]\n"
+	    "  -n, --name NAME        stats segment name (default /ftpd-stats)\n"
+	    "  -d, --delay SEC        refresh interval (default 1)\n"
+	    "  -i, --iterations N     exit after N refreshes\n"
+	    "  -b, --batch            append refreshes instead of redrawing the screen\n",
+	    prog_);
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	std::string name = "/ftpd-stats";
+	double delay     = 1.0;
+	long iterations  = -1;
+	bool batch       = !::isatty (STDOUT_FILENO);
+
+	static option const longOptions[] = {
+	    {"name", required_argument, nullptr, 'n'},
+	    {"delay", required_argument, nullptr, 'd'},
+	    {"iterations", required_argument, nullptr, 'i'},
+	    {"batch", no_argument, nullptr, 'b'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "n:d:i:bh", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'n':
+			name = optarg;
+			break;
+
+		case 'd':
+			delay = std::max (0.01, std::strtod (optarg, nullptr));
+			break;
+
+		case 'i':
+			iterations = std::strtol (optarg, nullptr, 0);
+			break;
+
+		case 'b':
+			batch = true;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	stats::SegmentMap map;
+	std::unordered_map<std::uint64_t, Sample> samples;
+	std::vector<Row> rows;
+	std::string screen;
+
+	auto const interval = std::chrono::duration<double> (delay);
+	for (long i = 0; iterations < 0 || i < iterations; ++i)
+	{
+		if (i != 0)
+			std::this_thread::sleep_for (interval);
+
+		screen.clear ();
+		if (!batch)
+			screen += "\x1b[H\x1b[2J";
+
+		if (!map.get () && !map.open (name))
+		{
+			screen += "Waiting for " + name + ": " + std::strerror (errno) + "\n";
+			std::fputs (screen.c_str (), stdout);
+			std::fflush (stdout);
+			continue;
+		}
+
+		auto const segment = map.get ();
+
+		stats::ServerRecord server;
+		if (!stats::load (segment->server, server))
+			continue;
+
+		// the server removes the segment on exit; drop our mapping if it went away
+		if (::kill (server.pid, 0) != 0 && errno == ESRCH)
+		{
+			map.close ();
+			samples.clear ();
+			continue;
+		}
+
+		char line[512];
+		std::snprintf (line,
+		    sizeof (line),
+		    "ftpd pid %" PRIu64 "  up %s  sessions %u (%u unpublished)  accepts %" PRIu64
+		    "  loop mean %.2fms max %.2fms  control p99 %.2fms max %.2fms  buffers %s/%s\n\n",
+		    server.pid,
+		    printUptime (std::time (nullptr) - server.startTime).c_str (),
+		    server.sessions,
+		    server.unpublished,
+		    server.accepts,
+		    server.loopIterations ? server.loopTotal / 1e6 / server.loopIterations : 0.0,
+		    server.loopMax / 1e6,
+		    server.controlP99 / 1e6,
+		    server.controlMax / 1e6,
+		    printSize (server.bufferUsed).c_str (),
+		    printSize (server.bufferCapacity).c_str ());
+		screen += line;
+
+		rows.clear ();
+		std::unordered_map<std::uint64_t, Sample> nextSamples;
+		for (auto const &slot : segment->sessions)
+		{
+			Row row;
+			if (!stats::load (slot, row.record) || row.record.id == 0)
+				continue;
+
+			row.record.peer[sizeof (row.record.peer) - 1]         = '\0';
+			row.record.workItem[sizeof (row.record.workItem) - 1] = '\0';
+
+			// rate from the byte counters between our own samples; fall back to the server EWMA
+			auto const bytes = row.record.dataIn + row.record.dataOut;
+			auto const it    = samples.find (row.record.id);
+			if (it != std::end (samples) && server.updated > it->second.updated)
+				row.rate =
+				    (bytes - it->second.bytes) * 1e9 / (server.updated - it->second.updated);
+			else
+				row.rate = row.record.rate;
+
+			nextSamples[row.record.id] = {bytes, server.updated};
+			rows.emplace_back (row);
+		}
+		samples = std::move (nextSamples);
+
+		std::sort (std::begin (rows), std::end (rows), [] (auto const &lhs_, auto const &rhs_) {
+			if (lhs_.rate != rhs_.rate)
+				return lhs_.rate > rhs_.rate;
+			return lhs_.record.id < rhs_.record.id;
+		});
+
+		std::snprintf (line,
+		    sizeof (line),
+		    "%6s %-24s %-8s %10s %9s %9s %15s %7s %8s  %s\n",
+		    "ID",
+		    "PEER",
+		    "STATE",
+		    "RATE",
+		    "IN",
+		    "OUT",
+		    "PROGRESS",
+		    "CMDS",
+		    "AVG",
+		    "WORK ITEM");
+		screen += line;
+
+		static char const *const states[] = {"command", "connect", "send", "recv"};
+
+		auto const width = batch ? sizeof (line) : static_cast<std::size_t> (terminalWidth ());
+		for (auto const &row : rows)
+		{
+			auto const &record = row.record;
+
+			char peer[64];
+			std::snprintf (peer, sizeof (peer), "%s:%u", record.peer, record.port);
+
+			char progress[32] = "-";
+			if (record.size)
+				std::snprintf (progress,
+				    sizeof (progress),
+				    "%.1f%% %s",
+				    100.0 * record.position / record.size,
+				    printSize (record.size).c_str ());
+			else if (record.position)
+				std::snprintf (
+				    progress, sizeof (progress), "%s", printSize (record.position).c_str ());
+
+			auto const state = record.state < 2 ? record.state : 2 + record.recv;
+
+			auto const len = std::snprintf (line,
+			    sizeof (line),
+			    "%6" PRIu64 " %-24s %-8s %8s/s %9s %9s %15s %7" PRIu64 " %6.2fms  %s",
+			    record.id,
+			    peer,
+			    states[state],
+			    printSize (row.rate).c_str (),
+			    printSize (record.controlIn + record.dataIn).c_str (),
+			    printSize (record.controlOut + record.dataOut).c_str (),
+			    progress,
+			    record.commands,
+			    record.commands ? record.commandTime / 1e6 / record.commands : 0.0,
+			    record.workItem);
+
+			screen.append (line, std::min<std::size_t> (std::max (len, 0), width));
+			screen += '\n';
+		}
+
+		if (batch)
+			screen += '\n';
+
+		std::fputs (screen.c_str (), stdout);
+		std::fflush (stdout);
+	}
+}
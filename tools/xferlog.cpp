@@ -0,0 +1,197 @@
+// ftpd is a server implementation based on the following:
+// - RFC  959 (https://tools.ietf.org/html/rfc959)
+// - RFC 3659 (https://tools.ietf.org/html/rfc3659)
+// - suggested implementation details from https://cr.yp.to/ftp/filesystem.html
+// - Deflate transmission mode for FTP
+//   (https://tools.ietf.org/html/draft-preston-ftpext-deflate-04)
+//
+// Copyright (C) 2025 Michael Theall
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// ftpd-xferlog: convert binary transfer journals to wu-ftpd xferlog text
+//
+// Reads journal files written by the server (including the live one; only published records are
+// converted) and prints one xferlog line per file transfer, or one JSON object per transfer with
+// the phase breakdown.
+
+#include "xferJournal.h"
+
+#include <getopt.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace
+{
+/// \brief Phase names, in Record::phases order
+char const *const phaseNames[] = {"open", "connect", "first_byte", "transfer", "reply"};
+
+static_assert (std::size (phaseNames) == std::size (journal::Record{}.phases));
+
+/// \brief Print usage
+/// \param prog_ Program name
+void usage (char const *const prog_)
+{
+	std::fprintf (stderr,
+	    "Usage: %s [options] JOURNAL...\n"
+	    "  -a, --all              include directory listings\n"
+	    "  -j, --json             print JSON lines with the phase breakdown\n",
+	    prog_);
+}
+
+/// \brief View a nul-terminated field, tolerating a missing terminator
+/// \param field_ Field to view
+template <std::size_t N>
+std::string_view field (char const (&field_)[N])
+{
+	return std::string_view (field_, strnlen (field_, N));
+}
+
+/// \brief Print a record as a JSON object
+/// \param record_ Record to print
+void printJson (journal::Record const &record_)
+{
+	auto const string = [] (std::string_view const value_) {
+		std::putchar ('"');
+		for (auto const c : value_)
+		{
+			if (c == '"' || c == '\\')
+				std::printf ("\\%c", c);
+			else if (static_cast<unsigned char> (c) < 0x20)
+				std::printf ("\\u%04x", static_cast<unsigned char> (c));
+			else
+				std::putchar (c);
+		}
+		std::putchar ('"');
+	};
+
+	std::printf ("{\"time\":%" PRId64 ",\"session\":%" PRIu64 ",\"verb\":",
+	    record_.time,
+	    record_.session);
+	string (field (record_.verb));
+	std::printf (",\"peer\":");
+	string (field (record_.peer));
+	std::printf (",\"port\":%u,\"user\":", record_.port);
+	string (field (record_.user));
+	std::printf (",\"path\":");
+	string (field (record_.path));
+	std::printf (",\"direction\":\"%c\",\"complete\":%s,\"deflate\":%s,\"bytes\":%" PRIu64
+	             ",\"duration_ns\":%" PRIu64,
+	    record_.direction,
+	    record_.complete ? "true" : "false",
+	    record_.deflate ? "true" : "false",
+	    record_.bytes,
+	    record_.duration);
+	for (std::size_t i = 0; i < std::size (phaseNames); ++i)
+		std::printf (",\"%s_ns\":%" PRIu64, phaseNames[i], record_.phases[i]);
+	std::printf ("}\n");
+}
+
+/// \brief Convert a journal file
+/// \param path_ Journal path
+/// \param all_ Whether to include directory listings
+/// \param json_ Whether to print JSON lines
+bool convert (char const *const path_, bool const all_, bool const json_)
+{
+	auto const fp = std::unique_ptr<std::FILE, int (*) (std::FILE *)> (
+	    std::fopen (path_, "rb"), &std::fclose);
+	if (!fp)
+	{
+		std::fprintf (stderr, "%s: %s\n", path_, std::strerror (errno));
+		return false;
+	}
+
+	journal::Header header;
+	if (std::fread (&header, sizeof (header), 1, fp.get ()) != 1 ||
+	    header.magic != journal::FILE_MAGIC || header.version != journal::FILE_VERSION ||
+	    header.recordSize != sizeof (journal::Record))
+	{
+		std::fprintf (
+		    stderr, "%s: not a version %u transfer journal\n", path_, journal::FILE_VERSION);
+		return false;
+	}
+
+	auto const records = header.records.load (std::memory_order_acquire);
+	for (std::uint64_t i = 0; i < records && i < header.capacity; ++i)
+	{
+		journal::Record record;
+		if (std::fread (&record, sizeof (record), 1, fp.get ()) != 1)
+		{
+			std::fprintf (stderr, "%s: truncated at record %" PRIu64 "\n", path_, i);
+			return false;
+		}
+
+		if (record.listing && !all_)
+			continue;
+
+		if (json_)
+			printJson (record);
+		else
+			std::fputs (journal::toXferlog (record).c_str (), stdout);
+	}
+
+	return true;
+}
+}
+
+int main (int argc_, char *argv_[])
+{
+	bool all  = false;
+	bool json = false;
+
+	static option const longOptions[] = {
+	    {"all", no_argument, nullptr, 'a'},
+	    {"json", no_argument, nullptr, 'j'},
+	    {"help", no_argument, nullptr, 'h'},
+	    {nullptr, 0, nullptr, 0},
+	};
+
+	int c;
+	while ((c = ::getopt_long (argc_, argv_, "ajh", longOptions, nullptr)) != -1)
+	{
+		switch (c)
+		{
+		case 'a':
+			all = true;
+			break;
+
+		case 'j':
+			json = true;
+			break;
+
+		default:
+			usage (argv_[0]);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc_)
+	{
+		usage (argv_[0]);
+		return EXIT_FAILURE;
+	}
+
+	auto ok = true;
+	for (int i = optind; i < argc_; ++i)
+		ok = convert (argv_[i], all, json) && ok;
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}